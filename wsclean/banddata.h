@@ -1,6 +1,7 @@
 #ifndef BANDDATA_H
 #define BANDDATA_H
 
+#include <cstring>
 #include <stdexcept>
 
 #include <casacore/ms/MeasurementSets/MeasurementSet.h>
@@ -100,7 +101,6 @@ class BandData
 		 * @param channelCount Number of channels in the new instance.
 		 * @param frequencies Array of @p channelCount doubles containing the channel frequencies.
 		 */
-		/*
 		BandData(size_t channelCount, const double* frequencies) :
 			_channelCount(channelCount)
 		{
@@ -110,7 +110,7 @@ class BandData
 				_frequencyStep = _channelFrequencies[1] - _channelFrequencies[0];
 			else
 				_frequencyStep = 0.0;
-		}*/
+		}
 		
 		/** Destructor. */
 		~BandData()
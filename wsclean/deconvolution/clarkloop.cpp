@@ -1,4 +1,5 @@
 #include "clarkloop.h"
+#include "simpleclean.h"
 
 #include "../deconvolution/spectralfitter.h"
 #include "../deconvolution/componentlist.h"
@@ -8,34 +9,165 @@
 
 #include "../wsclean/logger.h"
 
+#include <boost/thread/thread.hpp>
+
+#include <algorithm>
+#include <limits>
+
+#ifdef USE_INTRINSICS
+#include <immintrin.h>
+#endif
+
 template<bool AllowNegatives>
 size_t ClarkModel::GetMaxComponent(double* scratch, double& maxValue) const
 {
-	_residual->GetLinearIntegrated(scratch);
-	if(!_rmsFactorImage.empty())
+	if(size() == 0)
 	{
-		for(size_t i=0; i!=size(); ++i)
-			scratch[i] *= _rmsFactorImage[i];
+		maxValue = 0.0;
+		return 0;
 	}
-	size_t maxComponent = 0;
-	maxValue = scratch[0];
-	for(size_t i=0; i!=size(); ++i)
+	GetIntegrated(scratch, 0, size());
+	size_t maxComponent = FindMaxComponent<AllowNegatives>(scratch, 0, size(), maxValue);
+	if(maxComponent == size())
+		maxComponent = 0;
+	maxValue = scratch[maxComponent]; // If it was negative, make sure a negative value is returned
+	return maxComponent;
+}
+
+template<bool AllowNegatives>
+size_t ClarkModel::FindMaxComponent(const double* values, size_t start, size_t end, double& maxValue)
+{
+	size_t maxComponent = end;
+	maxValue = -std::numeric_limits<double>::infinity();
+	size_t i = start;
+#if defined __AVX__ && defined USE_INTRINSICS && !defined FORCE_NON_AVX
+	// Only look at the individual values when one of the four is larger than the current maximum
+	__m256d mMaxValue = _mm256_set1_pd(maxValue);
+	const __m256d mSignBit = _mm256_set1_pd(-0.0);
+	for(; i+4 <= end; i+=4)
 	{
-		double value;
+		__m256d val = _mm256_loadu_pd(values + i);
 		if(AllowNegatives)
-			value = std::fabs(scratch[i]);
-		else
-			value = scratch[i];
+			val = _mm256_andnot_pd(mSignBit, val);
+		if(_mm256_movemask_pd(_mm256_cmp_pd(val, mMaxValue, _CMP_GT_OQ)) != 0)
+		{
+			for(size_t j=i; j!=i+4; ++j)
+			{
+				const double value = AllowNegatives ? std::fabs(values[j]) : values[j];
+				if(value > maxValue)
+				{
+					maxComponent = j;
+					maxValue = value;
+				}
+			}
+			mMaxValue = _mm256_set1_pd(maxValue);
+		}
+	}
+#endif
+	for(; i!=end; ++i)
+	{
+		const double value = AllowNegatives ? std::fabs(values[i]) : values[i];
 		if(value > maxValue)
 		{
 			maxComponent = i;
 			maxValue = value;
 		}
 	}
-	maxValue = scratch[maxComponent]; // If it was negative, make sure a negative value is returned
 	return maxComponent;
 }
 
+void ClarkModel::GetIntegrated(double* dest, size_t start, size_t end) const
+{
+	const size_t n = end - start;
+	double* out = dest + start;
+	const double* first = (*_residual)[_integrationImages[0]] + start;
+	if(_isIntegrationSquared)
+	{
+		for(size_t i=0; i!=n; ++i)
+			out[i] = first[i] * first[i];
+		for(size_t term=1; term!=_integrationImages.size(); ++term)
+		{
+			const double* image = (*_residual)[_integrationImages[term]] + start;
+			for(size_t i=0; i!=n; ++i)
+				out[i] += image[i] * image[i];
+		}
+	}
+	else {
+		const double firstWeight = _integrationWeights[0];
+		for(size_t i=0; i!=n; ++i)
+			out[i] = first[i] * firstWeight;
+		for(size_t term=1; term!=_integrationImages.size(); ++term)
+		{
+			const double* image = (*_residual)[_integrationImages[term]] + start;
+			const double weight = _integrationWeights[term];
+			for(size_t i=0; i!=n; ++i)
+				out[i] += image[i] * weight;
+		}
+	}
+	if(_integrationNormalization != 1.0)
+	{
+		for(size_t i=0; i!=n; ++i)
+			out[i] *= _integrationNormalization;
+	}
+	if(_isIntegrationSquared)
+	{
+		for(size_t i=0; i!=n; ++i)
+			out[i] = std::sqrt(out[i]);
+	}
+	if(!_rmsFactorImage.empty())
+	{
+		const double* rmsFactors = _rmsFactorImage.data() + start;
+		for(size_t i=0; i!=n; ++i)
+			out[i] *= rmsFactors[i];
+	}
+}
+
+static void subtractRow(double* image, const double* psf, double factor, size_t n)
+{
+	// Simple enough for the compiler to vectorize
+	for(size_t i=0; i!=n; ++i)
+		image[i] -= psf[i] * factor;
+}
+
+void ClarkModel::SubtractPSF(double* image, const double* psf, double factor, size_t peakIndex, size_t start, size_t end) const
+{
+	if(start >= end)
+		return;
+	// The psf covers x in [xMin, xMax) and y in [yMin, yMax)
+	const int
+		xMin = int(X(peakIndex)) - int(_width/2), xMax = xMin + int(_width),
+		yMin = int(Y(peakIndex)) - int(_height/2), yMax = yMin + int(_height);
+	std::vector<RowRun>::const_iterator run = std::upper_bound(_rowRuns.begin(), _rowRuns.end(), start,
+		[](size_t index, const RowRun& r) { return index < r.index; });
+	--run;
+	for(; run!=_rowRuns.end() && run->index < end; ++run)
+	{
+		const int y = run->y;
+		if(y >= yMin && y < yMax)
+		{
+			const int
+				runStart = int(run->x + (std::max(start, run->index) - run->index)),
+				runEnd = int(run->x + (std::min(end, run->index + run->length) - run->index)),
+				x1 = std::max(runStart, xMin),
+				x2 = std::min(runEnd, xMax);
+			if(x1 < x2)
+				subtractRow(image + run->index + (x1 - int(run->x)), psf + (y - yMin) * _width + (x1 - xMin), factor, x2 - x1);
+		}
+	}
+}
+
+void ClarkModel::makeRowRuns()
+{
+	_rowRuns.clear();
+	for(size_t i=0; i!=size(); ++i)
+	{
+		if(!_rowRuns.empty() && _rowRuns.back().y == Y(i) && _rowRuns.back().x + _rowRuns.back().length == X(i))
+			++_rowRuns.back().length;
+		else
+			_rowRuns.push_back(RowRun{X(i), Y(i), i, 1});
+	}
+}
+
 double ClarkLoop::Run(ImageSet& convolvedResidual, const ao::uvector<const double*>& doubleConvolvedPsfs)
 {
 	_clarkModel = ClarkModel(_width, _height);
@@ -47,57 +179,134 @@ double ClarkLoop::Run(ImageSet& convolvedResidual, const ao::uvector<const doubl
 		_clarkModel.MakeRMSFactorImage(_rmsFactorImage);
 	Logger::Debug << "Number of components selected > " << _threshold << ": " << _clarkModel.size() << '\n';
 	
-	ao::uvector<double> scratch(_clarkModel.size());
+	_integrated.resize(_clarkModel.size());
 	double maxValue;
-	size_t maxComponent = _clarkModel.GetMaxComponent(scratch.data(), maxValue, _allowNegativeComponents);
-		
+	size_t maxComponent = _clarkModel.GetMaxComponent(_integrated.data(), maxValue, _allowNegativeComponents);
+	
+	// Every iteration synchronizes the threads, so only use threads when there's enough work
+	const size_t minPixelsPerThread = 16384;
+	_chunkCount = std::max<size_t>(1, std::min(_threadCount, _clarkModel.size() * _clarkModel.Residual().size() / minPixelsPerThread));
+	_doubleConvolvedPsfs = &doubleConvolvedPsfs;
+	_componentValues.resize(_clarkModel.Residual().size());
+	boost::thread_group threadGroup;
+	_taskLanes.clear();
+	_resultLanes.clear();
+	for(size_t chunk=1; chunk<_chunkCount; ++chunk)
+	{
+		_taskLanes.emplace_back(new ao::lane<size_t>(1));
+		_resultLanes.emplace_back(new ao::lane<ChunkPeak>(1));
+	}
+	for(size_t chunk=1; chunk<_chunkCount; ++chunk)
+		threadGroup.add_thread(new boost::thread(&ClarkLoop::workThread, this, chunk));
+	
 	while(std::fabs(maxValue) > _threshold && _currentIteration < _maxIterations && (!_stopOnNegativeComponent || maxValue>=0.0))
 	{
-		ao::uvector<double> componentValues(_clarkModel.Residual().size());
 		for(size_t imgIndex=0; imgIndex!=_clarkModel.Residual().size(); ++imgIndex)
-			componentValues[imgIndex] = _clarkModel.Residual()[imgIndex][maxComponent] * _gain;
+			_componentValues[imgIndex] = _clarkModel.Residual()[imgIndex][maxComponent] * _gain;
 		_fluxCleaned += maxValue * _gain;
 		
 		if(_fitter)
-			_fitter->FitAndEvaluate(componentValues.data());
-			
+			_fitter->FitAndEvaluate(_componentValues.data());
+		
 		for(size_t imgIndex=0; imgIndex!=_clarkModel.Model().size(); ++imgIndex)
-			_clarkModel.Model()[imgIndex][maxComponent] += componentValues[imgIndex];
+			_clarkModel.Model()[imgIndex][maxComponent] += _componentValues[imgIndex];
 		
-		size_t
-			x = _clarkModel.X(maxComponent),
-			y = _clarkModel.Y(maxComponent);
 		/*
 		  Commented out because even in verbose mode this is a bit too verbose, but useful in case divergence occurs:
-		Logger::Debug << x << ", " << y << " " << maxValue << " -> ";
+		Logger::Debug << _clarkModel.X(maxComponent) << ", " << _clarkModel.Y(maxComponent) << " " << maxValue << " -> ";
 		for(size_t imgIndex=0; imgIndex!=_clarkModel.Model().size(); ++imgIndex)
-		  Logger::Debug << componentValues[imgIndex] << ' ';
+		  Logger::Debug << _componentValues[imgIndex] << ' ';
 		Logger::Debug << '\n';
 		*/
-		for(size_t imgIndex=0; imgIndex!=_clarkModel.Residual().size(); ++imgIndex)
-		{
-			double* image = _clarkModel.Residual()[imgIndex];
-			const double* psf = doubleConvolvedPsfs[_clarkModel.Residual().PSFIndex(imgIndex)];
-			double psfFactor = componentValues[imgIndex];
-			for(size_t px=0; px!=_clarkModel.size(); ++px)
-			{
-				int psfX = _clarkModel.X(px) - x + _width/2;
-				int psfY = _clarkModel.Y(px) - y + _height/2;
-				if(psfX >= 0 && psfX < int(_width) && psfY >= 0 && psfY < int(_height))
-					image[px] -= psf[psfX + psfY*_width] * psfFactor;
-			}
-		}
-		
-		maxComponent = _clarkModel.GetMaxComponent(scratch.data(), maxValue, _allowNegativeComponents);
+		maxComponent = subtractAndFindPeak(maxComponent, maxValue);
 		++_currentIteration;
 	}
+	
+	for(std::unique_ptr<ao::lane<size_t>>& lane : _taskLanes)
+		lane->write_end();
+	threadGroup.join_all();
+	_taskLanes.clear();
+	_resultLanes.clear();
 	return maxValue;
 }
 
+size_t ClarkLoop::subtractAndFindPeak(size_t peakIndex, double& maxValue)
+{
+	for(std::unique_ptr<ao::lane<size_t>>& lane : _taskLanes)
+		lane->write(peakIndex);
+	
+	ChunkPeak peak;
+	if(_allowNegativeComponents)
+		peak = processChunk<true>(peakIndex, 0, chunkStart(1));
+	else
+		peak = processChunk<false>(peakIndex, 0, chunkStart(1));
+	
+	// Combine in order of the chunks, such that the first pixel with the
+	// maximum value is selected, as in a serial search
+	for(std::unique_ptr<ao::lane<ChunkPeak>>& lane : _resultLanes)
+	{
+		ChunkPeak chunkPeak;
+		lane->read(chunkPeak);
+		if(chunkPeak.value > peak.value)
+			peak = chunkPeak;
+	}
+	if(peak.index >= _clarkModel.size())
+		peak.index = 0;
+	maxValue = _integrated[peak.index]; // If it was negative, make sure a negative value is returned
+	return peak.index;
+}
+
+template<bool AllowNegatives>
+ClarkLoop::ChunkPeak ClarkLoop::processChunk(size_t peakIndex, size_t start, size_t end)
+{
+	// Pixels are processed in blocks, such that the integration and peak search
+	// use values that were just subtracted and are still in the cache
+	const size_t blockSize = 4096;
+	ImageSet& residual = _clarkModel.Residual();
+	ChunkPeak peak;
+	peak.index = end;
+	peak.value = -std::numeric_limits<double>::infinity();
+	for(size_t blockStart=start; blockStart<end; blockStart+=blockSize)
+	{
+		const size_t blockEnd = std::min(blockStart + blockSize, end);
+		for(size_t imgIndex=0; imgIndex!=residual.size(); ++imgIndex)
+		{
+			const double* psf = (*_doubleConvolvedPsfs)[residual.PSFIndex(imgIndex)];
+			_clarkModel.SubtractPSF(residual[imgIndex], psf, _componentValues[imgIndex], peakIndex, blockStart, blockEnd);
+		}
+		_clarkModel.GetIntegrated(_integrated.data(), blockStart, blockEnd);
+		double blockMaxValue;
+		size_t blockPeak = ClarkModel::FindMaxComponent<AllowNegatives>(_integrated.data(), blockStart, blockEnd, blockMaxValue);
+		if(blockMaxValue > peak.value)
+		{
+			peak.index = blockPeak;
+			peak.value = blockMaxValue;
+		}
+	}
+	return peak;
+}
+
+void ClarkLoop::workThread(size_t chunkIndex)
+{
+	ao::lane<size_t>& taskLane = *_taskLanes[chunkIndex-1];
+	ao::lane<ChunkPeak>& resultLane = *_resultLanes[chunkIndex-1];
+	const size_t start = chunkStart(chunkIndex), end = chunkStart(chunkIndex+1);
+	size_t peakIndex;
+	while(taskLane.read(peakIndex))
+	{
+		if(_allowNegativeComponents)
+			resultLane.write(processChunk<true>(peakIndex, start, end));
+		else
+			resultLane.write(processChunk<false>(peakIndex, start, end));
+	}
+}
+
 void ClarkModel::MakeSets(const ImageSet& residualSet)
 {
 	_residual.reset(new ImageSet(&residualSet.Table(), residualSet.Allocator(), residualSet.ChannelsInDeconvolution(), residualSet.SquareJoinedChannels(), size(), 1));
 	_model.reset(new ImageSet(&residualSet.Table(), residualSet.Allocator(), residualSet.ChannelsInDeconvolution(), residualSet.SquareJoinedChannels(), size(), 1));
+	makeRowRuns();
+	residualSet.GetLinearIntegrationTerms(_integrationImages, _integrationWeights, _integrationNormalization, _isIntegrationSquared);
 	for(size_t imgIndex=0; imgIndex!=_model->size(); ++imgIndex)
 	{
 		std::fill((*_model)[imgIndex], (*_model)[imgIndex]+size(), 0.0);
@@ -184,16 +393,25 @@ void ClarkLoop::GetFullIndividualModel(size_t imageIndex, double* individualMode
 
 void ClarkLoop::CorrectResidualDirty(double* scratchA, double* scratchB, double* scratchC, size_t imageIndex, double* residual, const double* singleConvolvedPsf) const
 {
-	// Get padded kernel in scratchB
-	Image::Untrim(scratchA, _untrimmedWidth, _untrimmedHeight, singleConvolvedPsf, _width, _height);
-	FFTConvolver::PrepareKernel(scratchB, scratchA, _untrimmedWidth, _untrimmedHeight);
+	// Images with the same psf are corrected after each other, so the transformed
+	// psf is kept and only recalculated when a different psf is given
+	if(_residualConvolver == nullptr || _residualConvolverPsf != singleConvolvedPsf)
+	{
+		// Get padded kernel in scratchB
+		Image::Untrim(scratchA, _untrimmedWidth, _untrimmedHeight, singleConvolvedPsf, _width, _height);
+		FFTConvolver::PrepareKernel(scratchB, scratchA, _untrimmedWidth, _untrimmedHeight);
+		if(_residualConvolver == nullptr)
+			_residualConvolver.reset(new FFTConvolver(_untrimmedWidth, _untrimmedHeight));
+		_residualConvolver->SetKernel(scratchB);
+		_residualConvolverPsf = singleConvolvedPsf;
+	}
 	
 	// Get padded model image in scratchA
 	GetFullIndividualModel(imageIndex, scratchC);
 	Image::Untrim(scratchA, _untrimmedWidth, _untrimmedHeight, scratchC, _width, _height);
 	
 	// Convolve and store in scratchA
-	FFTConvolver::ConvolveSameSize(scratchA, scratchB, _untrimmedWidth, _untrimmedHeight);
+	_residualConvolver->ConvolveImage(scratchA);
 	
 	//Trim the result into scratchC
 	Image::Trim(scratchC, _width, _height, scratchA, _untrimmedWidth, _untrimmedHeight);
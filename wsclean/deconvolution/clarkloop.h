@@ -2,9 +2,13 @@
 #define CLARK_LOOP_H
 
 #include <cstring>
+#include <memory>
 #include <vector>
 
+#include "../fftconvolver.h"
 #include "../image.h"
+#include "../lane.h"
+#include "../uvector.h"
 #include "../deconvolution/imageset.h"
 
 /**
@@ -37,7 +41,9 @@ class ClarkModel
 {
 public:
 	ClarkModel(size_t width, size_t height) :
-		_width(width), _height(height)
+		_width(width), _height(height),
+		_integrationNormalization(1.0),
+		_isIntegrationSquared(false)
 	{ }
 	
 	void AddPosition(size_t x, size_t y)
@@ -69,11 +75,49 @@ public:
 		else
 			return GetMaxComponent<false>(scratch, maxValue);
 	}
+	
+	/**
+	 * Calculate the integrated values of the selected pixels [start, end) in the same
+	 * way as ImageSet::GetLinearIntegrated(), multiplied by the RMS factor image if
+	 * one was set. Disjoint ranges can be calculated concurrently.
+	 */
+	void GetIntegrated(double* dest, size_t start, size_t end) const;
+	
+	/**
+	 * Find the first selected pixel in [start, end) with the largest (absolute) value.
+	 * @param maxValue Set to the largest (absolute) value, or -infinity when the range is empty.
+	 * @returns Index of the pixel, or @p end when the range is empty.
+	 */
+	template<bool AllowNegatives>
+	static size_t FindMaxComponent(const double* values, size_t start, size_t end, double& maxValue);
+	
+	/**
+	 * Subtract the psf multiplied by @p factor, centred on selected pixel @p peakIndex,
+	 * from the selected pixels [start, end) of the given image. The selected
+	 * pixels of a row are contiguous, which makes it possible to subtract whole
+	 * rows of the psf at once.
+	 */
+	void SubtractPSF(double* image, const double* psf, double factor, size_t peakIndex, size_t start, size_t end) const;
 private:
+	/**
+	 * A sequence of selected pixels that are next to each other on the same row.
+	 */
+	struct RowRun
+	{
+		size_t x, y, index, length;
+	};
+	
+	void makeRowRuns();
+	
 	std::vector<std::pair<size_t,size_t>> _positions;
+	std::vector<RowRun> _rowRuns;
 	std::unique_ptr<ImageSet> _residual, _model;
 	Image _rmsFactorImage;
 	size_t _width, _height;
+	ao::uvector<size_t> _integrationImages;
+	ao::uvector<double> _integrationWeights;
+	double _integrationNormalization;
+	bool _isIntegrationSquared;
 };
 
 class ClarkLoop
@@ -89,7 +133,9 @@ public:
 		_stopOnNegativeComponent(false),
 		_mask(0), _fitter(0),
 		_clarkModel(width, height),
-		_fluxCleaned(0.0)
+		_fluxCleaned(0.0),
+		_threadCount(1),
+		_residualConvolverPsf(nullptr)
 	{ }
 	
 	/**
@@ -126,6 +172,13 @@ public:
 	void SetRMSFactorImage(const Image& image)
 	{ _rmsFactorImage = image; }
 	
+	/**
+	 * Set the number of threads that perform the subtraction and peak finding in
+	 * @ref Run(). Fewer threads are used when there are not many selected pixels.
+	 */
+	void SetThreadCount(size_t threadCount)
+	{ _threadCount = threadCount; }
+	
 	size_t CurrentIteration() const { return _currentIteration; }
 	
 	double FluxCleaned() const { return _fluxCleaned; }
@@ -138,6 +191,8 @@ public:
 	 * After this method, the residual will hold the result of the Clark loop run.
 	 * scratchA and scratchB need to be able to store the full padded image (_untrimmedWidth x _untrimmedHeight).
 	 * scratchC only needs to store the trimmed size (_width x _height).
+	 * The transformed psf is kept for the next call: when called again with the same psf
+	 * pointer, the psf is assumed to be unchanged and scratchB is not used.
 	 */
 	void CorrectResidualDirty(double* scratchA, double* scratchB, double* scratchC, size_t imageIndex, double* residual, const double* singleConvolvedPsf) const;
 	
@@ -148,8 +203,28 @@ public:
 	void UpdateComponentList(class ComponentList& list, size_t scaleIndex) const;
 	
 private:
+	struct ChunkPeak
+	{
+		size_t index;
+		double value;
+	};
+	
 	void findPeakPositions(ImageSet& convolvedResidual);
 	
+	/**
+	 * Subtracts the current component from all residual images and finds the
+	 * next peak, using the worker threads for all but the first chunk of pixels.
+	 */
+	size_t subtractAndFindPeak(size_t peakIndex, double& maxValue);
+	
+	template<bool AllowNegatives>
+	ChunkPeak processChunk(size_t peakIndex, size_t start, size_t end);
+	
+	void workThread(size_t chunkIndex);
+	
+	size_t chunkStart(size_t chunkIndex) const
+	{ return _clarkModel.size() * chunkIndex / _chunkCount; }
+	
 	size_t _width, _height, _untrimmedWidth, _untrimmedHeight;
 	double _threshold, _consideredPixelThreshold, _gain;
 	size_t _horizontalBorder, _verticalBorder;
@@ -160,6 +235,19 @@ private:
 	ClarkModel _clarkModel;
 	double _fluxCleaned;
 	Image _rmsFactorImage;
+	size_t _threadCount;
+	
+	// State shared with the worker threads during Run()
+	size_t _chunkCount;
+	const ao::uvector<const double*>* _doubleConvolvedPsfs;
+	ao::uvector<double> _componentValues;
+	ao::uvector<double> _integrated;
+	std::vector<std::unique_ptr<ao::lane<size_t>>> _taskLanes;
+	std::vector<std::unique_ptr<ao::lane<ChunkPeak>>> _resultLanes;
+	
+	// Convolver with the psf of the last call to CorrectResidualDirty()
+	mutable std::unique_ptr<FFTConvolver> _residualConvolver;
+	mutable const double* _residualConvolverPsf;
 };
 
 #endif
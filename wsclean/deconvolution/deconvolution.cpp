@@ -75,10 +75,10 @@ void Deconvolution::Perform(const class ImagingTable& groupTable, bool& reachedM
 			switch(_settings.rmsBackgroundMethod)
 			{
 				case WSCleanSettings::RMSWindow:
-					RMSImage::Make(rmsImage, integrated, _settings.rmsBackgroundWindow, _beamSize, _beamSize, 0.0, _pixelScaleX, _pixelScaleY);
+					RMSImage::Make(rmsImage, integrated, _settings.rmsBackgroundWindow, _beamSize, _beamSize, 0.0, _pixelScaleX, _pixelScaleY, _settings.threadCount);
 					break;
 				case WSCleanSettings::RMSAndMinimumWindow:
-					RMSImage::MakeWithNegativityLimit(rmsImage, integrated, _settings.rmsBackgroundWindow, _beamSize, _beamSize, 0.0, _pixelScaleX, _pixelScaleY);
+					RMSImage::MakeWithNegativityLimit(rmsImage, integrated, _settings.rmsBackgroundWindow, _beamSize, _beamSize, 0.0, _pixelScaleX, _pixelScaleY, _settings.threadCount);
 					break;
 			}
 			// Normalize the RMS image relative to the threshold so that Jy remains Jy.
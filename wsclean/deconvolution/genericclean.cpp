@@ -1,6 +1,7 @@
 #include "genericclean.h"
 
 #include "clarkloop.h"
+#include "peaktracker.h"
 
 #include "../lane.h"
 
@@ -60,6 +61,7 @@ void GenericClean::ExecuteMajorIteration(ImageSet& dirtySet, ImageSet& modelSet,
 		clarkLoop.SetAllowNegativeComponents(AllowNegativeComponents());
 		clarkLoop.SetStopOnNegativeComponent(StopOnNegativeComponents());
 		clarkLoop.SetSpectralFitter(&Fitter());
+		clarkLoop.SetThreadCount(_threadCount);
 		if(!_rmsFactorImage.empty())
 			clarkLoop.SetRMSFactorImage(_rmsFactorImage);
 		if(_cleanMask)
@@ -93,6 +95,18 @@ void GenericClean::ExecuteMajorIteration(ImageSet& dirtySet, ImageSet& modelSet,
 
 		ao::uvector<double> peakValues(dirtySet.size());
 		
+		// A subtraction only changes the area covered by the psf, hence the peak is
+		// tracked by updating that area instead of searching the full image again.
+		const double* peakImage = integrated.data();
+		if(!_rmsFactorImage.empty())
+		{
+			for(size_t i=0; i!=_width*_height; ++i)
+				scratchB.data()[i] = integrated.data()[i] * _rmsFactorImage[i];
+			peakImage = scratchB.data();
+		}
+		PeakTracker peakTracker(_width, _height, _allowNegativeComponents, _cleanMask, round(_width*_cleanBorderRatio), round(_height*_cleanBorderRatio));
+		peakTracker.Reset(peakImage);
+		
 		while(fabs(maxValue) > firstThreshold && this->_iterationNumber < this->_maxIter && !(maxValue<0.0 && this->_stopOnNegativeComponent))
 		{
 			if(this->_iterationNumber <= 10 ||
@@ -116,8 +130,19 @@ void GenericClean::ExecuteMajorIteration(ImageSet& dirtySet, ImageSet& modelSet,
 				tools.SubtractImage(dirtySet[i], psfs[psfIndex], width, height, componentX, componentY, peakValues[i]);
 			}
 			
-			dirtySet.GetSquareIntegrated(integrated.data(), scratchA.data());
-			maxValue = findPeak(integrated.data(), scratchA.data(), componentX, componentY);
+			const size_t
+				x1 = componentX > width/2 ? componentX - width/2 : 0,
+				x2 = std::min(componentX + width/2, width),
+				y1 = componentY > height/2 ? componentY - height/2 : 0,
+				y2 = std::min(componentY + height/2, height);
+			dirtySet.GetSquareIntegrated(integrated.data(), scratchA.data(), y1*width, y2*width);
+			if(!_rmsFactorImage.empty())
+			{
+				for(size_t i=y1*width; i!=y2*width; ++i)
+					scratchB.data()[i] = integrated.data()[i] * _rmsFactorImage[i];
+			}
+			peakTracker.Update(peakImage, x1, y1, x2, y2);
+			maxValue = peakTracker.Peak(componentX, componentY);
 			
 			peakIndex = componentX + componentY*_width;
 			
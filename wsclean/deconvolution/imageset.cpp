@@ -210,8 +210,11 @@ void ImageSet::directStore(CachedImageSet& imageSet)
 	}
 }
 
-void ImageSet::getSquareIntegratedWithNormalChannels(double* dest, double* scratch) const
+void ImageSet::getSquareIntegratedWithNormalChannels(double* dest, double* scratch, size_t start, size_t end) const
 {
+	const size_t n = end - start;
+	dest += start;
+	scratch += start;
 	if(_channelsInDeconvolution == 1)
 	{
 		// In case only one frequency channel is used, we do not have to use 'scratch',
@@ -221,7 +224,7 @@ void ImageSet::getSquareIntegratedWithNormalChannels(double* dest, double* scrat
 		{
 			const ImagingTableEntry& entry = subTable[0];
 			size_t imageIndex = _tableIndexToImageIndex.find(entry.index)->second;
-			assign(dest, _images[imageIndex]);
+			assign(dest, _images[imageIndex] + start, n);
 		}
 		else {
 			for(size_t eIndex = 0; eIndex!=subTable.EntryCount(); ++eIndex)
@@ -230,14 +233,14 @@ void ImageSet::getSquareIntegratedWithNormalChannels(double* dest, double* scrat
 				size_t imageIndex = _tableIndexToImageIndex.find(entry.index)->second;
 				if(eIndex == 0)
 				{
-					assign(dest, _images[0]);
-					square(dest);
+					assign(dest, _images[0] + start, n);
+					square(dest, n);
 				}
 				else {
-					addSquared(dest, _images[imageIndex]);
+					addSquared(dest, _images[imageIndex] + start, n);
 				}
 			}
-			squareRoot(dest);
+			squareRoot(dest, n);
 		}
 	}
 	else {
@@ -251,7 +254,7 @@ void ImageSet::getSquareIntegratedWithNormalChannels(double* dest, double* scrat
 			{
 				const ImagingTableEntry& entry = subTable[0];
 				size_t imageIndex = _tableIndexToImageIndex.find(entry.index)->second;
-				assign(scratch, _images[imageIndex]);
+				assign(scratch, _images[imageIndex] + start, n);
 			}
 			else {
 				for(size_t eIndex = 0; eIndex!=subTable.EntryCount(); ++eIndex)
@@ -260,30 +263,32 @@ void ImageSet::getSquareIntegratedWithNormalChannels(double* dest, double* scrat
 					size_t imageIndex = _tableIndexToImageIndex.find(entry.index)->second;
 					if(eIndex == 0)
 					{
-						assign(scratch, _images[0]);
-						square(scratch);
+						assign(scratch, _images[0] + start, n);
+						square(scratch, n);
 					}
 					else {
-						addSquared(scratch, _images[imageIndex]);
+						addSquared(scratch, _images[imageIndex] + start, n);
 					}
 				}
-				squareRoot(scratch);
+				squareRoot(scratch, n);
 			}
 			
 			if(chIndex == 0)
-				assignMultiply(dest, scratch, groupWeight);
+				assignMultiply(dest, scratch, groupWeight, n);
 			else
-				addFactor(dest, scratch, groupWeight);
+				addFactor(dest, scratch, groupWeight, n);
 		}
 		if(_channelsInDeconvolution > 0)
-			multiply(dest, 1.0/weightSum);
+			multiply(dest, 1.0/weightSum, n);
 		else
-			assign(dest, 0.0);
+			assign(dest, 0.0, n);
 	}
 }
 
-void ImageSet::getSquareIntegratedWithSquaredChannels(double* dest) const
+void ImageSet::getSquareIntegratedWithSquaredChannels(double* dest, size_t start, size_t end) const
 {
+	const size_t n = end - start;
+	dest += start;
 	size_t addIndex = 0;
 	for(size_t sqIndex = 0; sqIndex!=_channelsInDeconvolution; ++sqIndex)
 	{
@@ -294,18 +299,18 @@ void ImageSet::getSquareIntegratedWithSquaredChannels(double* dest) const
 			size_t imageIndex = _tableIndexToImageIndex.find(entry.index)->second;
 			if(addIndex == 0)
 			{
-				assign(dest, _images[imageIndex]);
-				square(dest);
+				assign(dest, _images[imageIndex] + start, n);
+				square(dest, n);
 			} else
-				addSquared(dest, _images[imageIndex]);
+				addSquared(dest, _images[imageIndex] + start, n);
 			++addIndex;
 		}
 	}
 	if(_channelsInDeconvolution > 0)
-		multiply(dest, 1.0/double(_channelsInDeconvolution));
+		multiply(dest, 1.0/double(_channelsInDeconvolution), n);
 	else
-		assign(dest, 0.0);
-	squareRoot(dest);
+		assign(dest, 0.0, n);
+	squareRoot(dest, n);
 }
 
 void ImageSet::getLinearIntegratedWithNormalChannels(double* dest) const
@@ -342,3 +347,35 @@ void ImageSet::getLinearIntegratedWithNormalChannels(double* dest) const
 			assign(dest, 0.0);
 	}
 }
+
+void ImageSet::GetLinearIntegrationTerms(ao::uvector<size_t>& imageIndices, ao::uvector<double>& weights, double& normalization, bool& isSquared) const
+{
+	imageIndices.clear();
+	weights.clear();
+	isSquared = _squareJoinedChannels;
+	if(!_squareJoinedChannels && _channelsInDeconvolution == 1 && _imagingTable.GetSquaredGroup(0).EntryCount() == 1)
+	{
+		ImagingTable subTable = _imagingTable.GetSquaredGroup(0);
+		imageIndices.push_back(_tableIndexToImageIndex.find(subTable[0].index)->second);
+		weights.push_back(1.0);
+		normalization = 1.0;
+	}
+	else {
+		double weightSum = 0.0;
+		for(size_t sqIndex = 0; sqIndex!=_channelsInDeconvolution; ++sqIndex)
+		{
+			ImagingTable subTable = _imagingTable.GetSquaredGroup(sqIndex);
+			const double groupWeight = _squareJoinedChannels ? 1.0 : subTable.Front().imageWeight;
+			weightSum += groupWeight;
+			for(size_t eIndex = 0; eIndex!=subTable.EntryCount(); ++eIndex)
+			{
+				imageIndices.push_back(_tableIndexToImageIndex.find(subTable[eIndex].index)->second);
+				weights.push_back(groupWeight);
+			}
+		}
+		if(_channelsInDeconvolution > 0)
+			normalization = 1.0 / weightSum;
+		else
+			normalization = 0.0;
+	}
+}
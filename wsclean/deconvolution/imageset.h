@@ -132,11 +132,21 @@ public:
 	 * @param scratch Pre-allocated scratch space, same size as image.
 	 */
 	void GetSquareIntegrated(double* dest, double* scratch) const
+	{
+		GetSquareIntegrated(dest, scratch, 0, _imageSize);
+	}
+	
+	/**
+	 * Like @ref GetSquareIntegrated(double*, double*), but only calculates the
+	 * pixels with indices [start, end). This is useful when only part of the
+	 * images has changed. Other values of @p dest and @p scratch are not changed.
+	 */
+	void GetSquareIntegrated(double* dest, double* scratch, size_t start, size_t end) const
 	{
 		if(_squareJoinedChannels)
-			getSquareIntegratedWithSquaredChannels(dest);
+			getSquareIntegratedWithSquaredChannels(dest, start, end);
 		else
-			getSquareIntegratedWithNormalChannels(dest, scratch);
+			getSquareIntegratedWithNormalChannels(dest, scratch, start, end);
 	}
 	
 	/**
@@ -151,11 +161,20 @@ public:
 	void GetLinearIntegrated(double* dest) const
 	{
 		if(_squareJoinedChannels)
-			getSquareIntegratedWithSquaredChannels(dest);
+			getSquareIntegratedWithSquaredChannels(dest, 0, _imageSize);
 		else
 			getLinearIntegratedWithNormalChannels(dest);
 	}
-
+	
+	/**
+	 * Describes the combination that @ref GetLinearIntegrated() calculates, such
+	 * that it can be calculated for only part of the pixels. The integrated
+	 * value is normalization * sum_i (weights[i] * image[imageIndices[i]]).
+	 * When @p isSquared is returned as true, the squared images are summed
+	 * instead and the square root of the result should be taken.
+	 */
+	void GetLinearIntegrationTerms(ao::uvector<size_t>& imageIndices, ao::uvector<double>& weights, double& normalization, bool& isSquared) const;
+	
 	void GetIntegratedPSF(double* dest, const ao::uvector<const double*>& psfs)
 	{
 		memcpy(dest, psfs[0], sizeof(double) * _imageSize);
@@ -232,9 +251,14 @@ public:
 		return _squareJoinedChannels; 
 	}
 private:
+	void assign(double* lhs, const double* rhs, size_t n) const
+	{
+		memcpy(lhs, rhs, sizeof(double) * n);
+	}
+	
 	void assign(double* lhs, const double* rhs) const
 	{
-		memcpy(lhs, rhs, sizeof(double) * _imageSize);
+		assign(lhs, rhs, _imageSize);
 	}
 	
 	void assign(double* lhs, const ImageBufferAllocator::Ptr& rhs) const
@@ -242,57 +266,77 @@ private:
 		memcpy(lhs, rhs.data(), sizeof(double) * _imageSize);
 	}
 	
-	void assignMultiply(double* lhs, const double* rhs, double factor) const
+	void assignMultiply(double* lhs, const double* rhs, double factor, size_t n) const
 	{
-		for(size_t i=0; i!=_imageSize; ++i)
+		for(size_t i=0; i!=n; ++i)
 			lhs[i] = rhs[i] * factor;
 	}
 	
-	void assign(double* image, double value) const
+	void assignMultiply(double* lhs, const double* rhs, double factor) const
 	{
-		for(size_t i=0; i!=_imageSize; ++i)
+		assignMultiply(lhs, rhs, factor, _imageSize);
+	}
+	
+	void assign(double* image, double value, size_t n) const
+	{
+		for(size_t i=0; i!=n; ++i)
 			image[i] = value;
 	}
 	
+	void assign(double* image, double value) const
+	{
+		assign(image, value, _imageSize);
+	}
+	
 	void add(double* lhs, const double* rhs) const
 	{
 		for(size_t i=0; i!=_imageSize; ++i)
 			lhs[i] += rhs[i];
 	}
 	
-	void square(double* image) const
+	void square(double* image, size_t n) const
 	{
-		for(size_t i=0; i!=_imageSize; ++i)
+		for(size_t i=0; i!=n; ++i)
 			image[i] *= image[i];
 	}
 	
-	void squareRoot(double* image) const
+	void squareRoot(double* image, size_t n) const
 	{
-		for(size_t i=0; i!=_imageSize; ++i)
+		for(size_t i=0; i!=n; ++i)
 			image[i] = sqrt(image[i]);
 	}
 	
-	void addSquared(double* lhs, const double* rhs) const
+	void addSquared(double* lhs, const double* rhs, size_t n) const
 	{
-		for(size_t i=0; i!=_imageSize; ++i)
+		for(size_t i=0; i!=n; ++i)
 			lhs[i] += rhs[i]*rhs[i];
 	}
 	
-	void addFactor(double* lhs, const double* rhs, double factor) const
+	void addFactor(double* lhs, const double* rhs, double factor, size_t n) const
 	{
-		for(size_t i=0; i!=_imageSize; ++i)
+		for(size_t i=0; i!=n; ++i)
 			lhs[i] += rhs[i] * factor;
 	}
 	
-	void multiply(double* image, double fact) const
+	void addFactor(double* lhs, const double* rhs, double factor) const
+	{
+		addFactor(lhs, rhs, factor, _imageSize);
+	}
+	
+	void multiply(double* image, double fact, size_t n) const
 	{
 		if(fact != 1.0)
 		{
-			for(size_t i=0; i!=_imageSize; ++i)
+			for(size_t i=0; i!=n; ++i)
 				image[i] *= fact;
 		}
 	}
 	
+	void multiply(double* image, double fact) const
+	{
+		multiply(image, fact, _imageSize);
+	}
+	
 	void initializeIndices()
 	{
 		for(size_t i=0; i!=_imagingTable.EntryCount(); ++i)
@@ -328,9 +372,9 @@ private:
 	
 	void directStore(class CachedImageSet& imageSet);
 	
-	void getSquareIntegratedWithNormalChannels(double* dest, double* scratch) const;
+	void getSquareIntegratedWithNormalChannels(double* dest, double* scratch, size_t start, size_t end) const;
 	
-	void getSquareIntegratedWithSquaredChannels(double* dest) const;
+	void getSquareIntegratedWithSquaredChannels(double* dest, size_t start, size_t end) const;
 	
 	void getLinearIntegratedWithNormalChannels(double* dest) const;
 	
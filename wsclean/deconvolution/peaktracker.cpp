@@ -0,0 +1,122 @@
+#include "peaktracker.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+PeakTracker::PeakTracker(size_t width, size_t height, bool allowNegativeComponents, const bool* mask, size_t horizontalBorder, size_t verticalBorder, size_t tileSize) :
+	_width(width), _height(height), _tileSize(tileSize),
+	_tilesX((width + tileSize - 1) / tileSize),
+	_tilesY((height + tileSize - 1) / tileSize),
+	_allowNegativeComponents(allowNegativeComponents),
+	_mask(mask),
+	_xStart(horizontalBorder), _xEnd(std::max(horizontalBorder, width - std::min(width, horizontalBorder))),
+	_yStart(verticalBorder), _yEnd(std::max(verticalBorder, height - std::min(height, verticalBorder)))
+{
+	const size_t tileCount = _tilesX * _tilesY;
+	// The extra tile peak stays empty, and is used for unused leaves
+	TilePeak empty;
+	empty.compareValue = std::numeric_limits<double>::min();
+	empty.value = std::numeric_limits<double>::quiet_NaN();
+	empty.index = _width * _height;
+	_tilePeaks.assign(tileCount + 1, empty);
+	_leafCount = 1;
+	while(_leafCount < tileCount)
+		_leafCount *= 2;
+	_tree.assign(_leafCount * 2, tileCount);
+}
+
+void PeakTracker::Reset(const double* image)
+{
+	for(size_t tileY=0; tileY!=_tilesY; ++tileY)
+	{
+		for(size_t tileX=0; tileX!=_tilesX; ++tileX)
+			scanTile(image, tileX, tileY);
+	}
+	for(size_t tile=0; tile!=_tilesX*_tilesY; ++tile)
+		_tree[_leafCount + tile] = tile;
+	for(size_t node=_leafCount-1; node!=0; --node)
+	{
+		const size_t a = _tree[node*2], b = _tree[node*2 + 1];
+		_tree[node] = isBetter(_tilePeaks[b], _tilePeaks[a]) ? b : a;
+	}
+}
+
+void PeakTracker::Update(const double* image, size_t x1, size_t y1, size_t x2, size_t y2)
+{
+	x2 = std::min(x2, _width);
+	y2 = std::min(y2, _height);
+	if(x1 >= x2 || y1 >= y2)
+		return;
+	const size_t
+		tileXEnd = (x2 - 1) / _tileSize + 1,
+		tileYEnd = (y2 - 1) / _tileSize + 1;
+	for(size_t tileY=y1/_tileSize; tileY!=tileYEnd; ++tileY)
+	{
+		for(size_t tileX=x1/_tileSize; tileX!=tileXEnd; ++tileX)
+		{
+			scanTile(image, tileX, tileY);
+			updateTree(tileX + tileY*_tilesX);
+		}
+	}
+}
+
+double PeakTracker::Peak(size_t& x, size_t& y) const
+{
+	const TilePeak& peak = _tilePeaks[_tree[1]];
+	if(peak.index == _width * _height)
+	{
+		x = _width;
+		y = _height;
+	}
+	else {
+		x = peak.index % _width;
+		y = peak.index / _width;
+	}
+	return peak.value;
+}
+
+void PeakTracker::scanTile(const double* image, size_t tileX, size_t tileY)
+{
+	TilePeak& peak = _tilePeaks[tileX + tileY*_tilesX];
+	peak.compareValue = std::numeric_limits<double>::min();
+	peak.value = std::numeric_limits<double>::quiet_NaN();
+	peak.index = _width * _height;
+	const size_t
+		xStart = std::max(tileX*_tileSize, _xStart),
+		xEnd = std::min((tileX+1)*_tileSize, _xEnd),
+		yStart = std::max(tileY*_tileSize, _yStart),
+		yEnd = std::min((tileY+1)*_tileSize, _yEnd);
+	for(size_t y=yStart; y<yEnd; ++y)
+	{
+		const double* row = image + y*_width;
+		const bool* maskRow = _mask ? _mask + y*_width : nullptr;
+		for(size_t x=xStart; x<xEnd; ++x)
+		{
+			double value = row[x];
+			if(std::isfinite(value) && (maskRow == nullptr || maskRow[x]))
+			{
+				if(_allowNegativeComponents)
+					value = std::fabs(value);
+				// Rows are scanned in order, so the first pixel with the maximum value is kept
+				if(value > peak.compareValue)
+				{
+					peak.compareValue = value;
+					peak.value = row[x];
+					peak.index = x + y*_width;
+				}
+			}
+		}
+	}
+}
+
+void PeakTracker::updateTree(size_t tileIndex)
+{
+	size_t node = _leafCount + tileIndex;
+	while(node != 1)
+	{
+		node /= 2;
+		const size_t a = _tree[node*2], b = _tree[node*2 + 1];
+		_tree[node] = isBetter(_tilePeaks[b], _tilePeaks[a]) ? b : a;
+	}
+}
@@ -0,0 +1,75 @@
+#ifndef PEAK_TRACKER_H
+#define PEAK_TRACKER_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * Keeps track of the peak of an image that changes only locally, as happens
+ * in a Högbom minor loop. The image is divided in tiles of which the maxima
+ * are stored. The tile maxima form the leaves of a tournament tree, whose root
+ * holds the peak of the image. After part of the image was changed, only the
+ * tiles in that part are rescanned and only their paths in the tree are
+ * updated.
+ *
+ * The selected peak is the same as with SimpleClean::FindPeak() and
+ * SimpleClean::FindPeakWithMask(): non-finite values, masked values and the
+ * border are skipped, and of equal values the first in the image is taken.
+ */
+class PeakTracker
+{
+public:
+	/**
+	 * @param mask Clean mask, or nullptr when all pixels may be selected. It should stay
+	 * valid during the lifetime of the tracker.
+	 */
+	PeakTracker(size_t width, size_t height, bool allowNegativeComponents, const bool* mask, size_t horizontalBorder, size_t verticalBorder, size_t tileSize = 64);
+	
+	/**
+	 * Scan the full image.
+	 */
+	void Reset(const double* image);
+	
+	/**
+	 * Rescan the pixels with x1 <= x < x2 and y1 <= y < y2, after they were changed.
+	 * The image should be the same image as given to @ref Reset(), with the
+	 * same values outside the area.
+	 */
+	void Update(const double* image, size_t x1, size_t y1, size_t x2, size_t y2);
+	
+	/**
+	 * Returns the peak value, or NaN if no pixel can be selected. In that
+	 * case, x and y are set to the width and height.
+	 */
+	double Peak(size_t& x, size_t& y) const;
+
+private:
+	struct TilePeak
+	{
+		// Value used for comparing, i.e., the absolute value when negative components are allowed
+		double compareValue;
+		double value;
+		size_t index;
+	};
+	
+	bool isBetter(const TilePeak& a, const TilePeak& b) const
+	{
+		return a.compareValue > b.compareValue || (a.compareValue == b.compareValue && a.index < b.index);
+	}
+	
+	void scanTile(const double* image, size_t tileX, size_t tileY);
+	
+	void updateTree(size_t tileIndex);
+	
+	size_t _width, _height, _tileSize, _tilesX, _tilesY;
+	bool _allowNegativeComponents;
+	const bool* _mask;
+	size_t _xStart, _xEnd, _yStart, _yEnd;
+	std::vector<TilePeak> _tilePeaks;
+	// Binary tree with the index of the winning tile in each node. The leaves
+	// start at index _leafCount. Unused leaves refer to the last tile peak, which is empty.
+	std::vector<size_t> _tree;
+	size_t _leafCount;
+};
+
+#endif
@@ -3,6 +3,12 @@
 #include "matrix2x2.h"
 #include "model/model.h"
 #include "progressbar.h"
+#include "wsclean/logger.h"
+#include "buffered_lane.h"
+
+#include "msproviders/msprovider.h"
+
+#include <boost/thread/thread.hpp>
 
 #include <casacore/measures/TableMeasures/ArrayMeasColumn.h>
 
@@ -331,3 +337,126 @@ void DFTPredictionAlgorithm::UpdateBeam(LBeamEvaluator& beamEvaluator)
 		}
 	}
 }
+
+void DFTPredictionAlgorithm::InitializeKernel(DFTPredictionKernel& kernel, PolarizationEnum polarization) const
+{
+	const size_t
+		channelCount = kernel.ChannelCount(),
+		polarizationCount = kernel.PolarizationCount();
+	ao::uvector<std::complex<double>> flux(channelCount * polarizationCount);
+	for(DFTPredictionInput::const_iterator c=_input.begin(); c!=_input.end(); ++c)
+	{
+		for(size_t ch=0; ch!=channelCount; ++ch)
+			linearToPolarization(c->LinearFlux(ch), polarization, &flux[ch * polarizationCount]);
+		if(c->IsGaussian())
+			kernel.AddGaussianComponent(c->L(), c->M(), c->GausTransformationMatrix(), flux.data());
+		else
+			kernel.AddPointComponent(c->L(), c->M(), flux.data());
+	}
+}
+
+void DFTPredictionAlgorithm::linearToPolarization(const MC2x2& linear, PolarizationEnum polarization, std::complex<double>* dest)
+{
+	const std::complex<double> i(0.0, 1.0);
+	switch(polarization)
+	{
+		case Polarization::Instrumental:
+			for(size_t p=0; p!=4; ++p)
+				dest[p] = linear[p];
+			break;
+		case Polarization::XX: *dest = linear[0]; break;
+		case Polarization::XY: *dest = linear[1]; break;
+		case Polarization::YX: *dest = linear[2]; break;
+		case Polarization::YY: *dest = linear[3]; break;
+		case Polarization::StokesI: *dest = 0.5 * (linear[0] + linear[3]); break;
+		case Polarization::StokesQ: *dest = 0.5 * (linear[0] - linear[3]); break;
+		case Polarization::StokesU: *dest = 0.5 * (linear[1] + linear[2]); break;
+		case Polarization::StokesV: *dest = -0.5 * i * (linear[1] - linear[2]); break;
+		// RR = I + V, RL = Q + iU, LR = Q - iU, LL = I - V
+		case Polarization::RR: *dest = 0.5 * (linear[0] + linear[3]) - 0.5 * i * (linear[1] - linear[2]); break;
+		case Polarization::RL: *dest = 0.5 * (linear[0] - linear[3]) + 0.5 * i * (linear[1] + linear[2]); break;
+		case Polarization::LR: *dest = 0.5 * (linear[0] - linear[3]) - 0.5 * i * (linear[1] + linear[2]); break;
+		case Polarization::LL: *dest = 0.5 * (linear[0] + linear[3]) + 0.5 * i * (linear[1] - linear[2]); break;
+	}
+}
+
+void DFTPredictionAlgorithm::PredictMeasurementSet(MSProvider& msProvider, size_t threadCount)
+{
+	if(_hasBeam)
+		throw std::runtime_error("DFTPredictionAlgorithm::PredictMeasurementSet() does not support beams");
+	
+	const PolarizationEnum polarization = msProvider.Polarization();
+	const size_t polarizationCount = (polarization == Polarization::Instrumental) ? 4 : 1;
+	ao::uvector<double> frequencies(_band.ChannelCount());
+	for(size_t ch=0; ch!=_band.ChannelCount(); ++ch)
+		frequencies[ch] = _band.ChannelFrequency(ch);
+	DFTPredictionKernel kernel(frequencies, polarizationCount);
+	kernel.SetPhaseRecurrenceInterval(_phaseRecurrenceInterval);
+	InitializeKernel(kernel, polarization);
+	if(_phaseRecurrenceInterval > 1 && !kernel.UsesPhaseRecurrence())
+		Logger::Warn << "Channels are not regularly spaced: DFT phases are calculated without recurrence.\n";
+	
+	msProvider.ReopenRW();
+	
+	// The metadata is read first, so that the provider is only accessed from the write thread
+	// during prediction
+	std::vector<RowWorkItem> rows;
+	msProvider.Reset();
+	while(msProvider.CurrentRowAvailable())
+	{
+		RowWorkItem item;
+		size_t dataDescId;
+		msProvider.ReadMeta(item.u, item.v, item.w, dataDescId);
+		item.rowId = msProvider.RowId();
+		item.data = 0;
+		rows.push_back(item);
+		msProvider.NextRow();
+	}
+	
+	const size_t laneBufferSize = 16;
+	ao::lane<RowWorkItem>
+		calcLane(laneBufferSize * threadCount),
+		writeLane(laneBufferSize * threadCount);
+	set_lane_debug_name(calcLane, "DFT prediction calculation lane");
+	set_lane_debug_name(writeLane, "DFT prediction write lane");
+	lane_write_buffer<RowWorkItem> bufferedCalcLane(&calcLane, laneBufferSize);
+	boost::thread writeThread(&DFTPredictionAlgorithm::predictWriteThread, &writeLane, &msProvider);
+	boost::thread_group calcThreads;
+	for(size_t i=0; i!=threadCount; ++i)
+		calcThreads.add_thread(new boost::thread(&DFTPredictionAlgorithm::predictCalcThread, &calcLane, &writeLane, &kernel));
+	
+	const size_t valueCount = _band.ChannelCount() * polarizationCount;
+	for(RowWorkItem& item : rows)
+	{
+		item.data = new std::complex<float>[valueCount];
+		bufferedCalcLane.write(item);
+	}
+	
+	bufferedCalcLane.write_end();
+	calcThreads.join_all();
+	writeLane.write_end();
+	writeThread.join();
+}
+
+void DFTPredictionAlgorithm::predictCalcThread(ao::lane<RowWorkItem>* inputLane, ao::lane<RowWorkItem>* outputLane, const DFTPredictionKernel* kernel)
+{
+	lane_write_buffer<RowWorkItem> writeBuffer(outputLane, 16);
+	DFTPredictionKernel::Buffer buffer;
+	RowWorkItem item;
+	while(inputLane->read(item))
+	{
+		kernel->Predict(item.data, item.u, item.v, item.w, buffer);
+		writeBuffer.write(item);
+	}
+}
+
+void DFTPredictionAlgorithm::predictWriteThread(ao::lane<RowWorkItem>* inputLane, MSProvider* msProvider)
+{
+	lane_read_buffer<RowWorkItem> buffer(inputLane, std::min<size_t>(16, inputLane->capacity()));
+	RowWorkItem item;
+	while(buffer.read(item))
+	{
+		msProvider->WriteModel(item.rowId, item.data);
+		delete[] item.data;
+	}
+}
@@ -1,6 +1,8 @@
 #ifndef DFT_PREDICTION_ALGORITHM_H
 #define DFT_PREDICTION_ALGORITHM_H
 #include "banddata.h"
+#include "dftpredictionkernel.h"
+#include "lane.h"
 #include "matrix2x2.h"
 #include "polarization.h"
 #include "uvector.h"
@@ -176,19 +178,53 @@ private:
 class DFTPredictionAlgorithm
 {
 public:
-	DFTPredictionAlgorithm(DFTPredictionInput& input, const BandData& band) : _input(input), _band(band), _hasBeam(false)
+	DFTPredictionAlgorithm(DFTPredictionInput& input, const BandData& band) : _input(input), _band(band), _hasBeam(false), _phaseRecurrenceInterval(0)
 	{ }
 	
 	void Predict(MC2x2& dest, double u, double v, double w, size_t channelIndex, size_t a1, size_t a2);
 
 	void UpdateBeam(LBeamEvaluator& beamEvaluator);
 	
+	/**
+	 * Predict the visibilities of all rows of the MSProvider and write them as its model data.
+	 * The polarization of the MSProvider is predicted, and its selected channels
+	 * should correspond with the band of this algorithm. The components are converted
+	 * into a @ref DFTPredictionKernel, and the rows are divided over the given number
+	 * of threads. Beams are not supported.
+	 */
+	void PredictMeasurementSet(class MSProvider& msProvider, size_t threadCount);
+	
+	/**
+	 * Set the interval of direct phase calculations in @ref PredictMeasurementSet().
+	 * See DFTPredictionKernel::SetPhaseRecurrenceInterval().
+	 */
+	void SetPhaseRecurrenceInterval(size_t interval) { _phaseRecurrenceInterval = interval; }
+	
+	/**
+	 * Make a kernel that predicts the given polarization of the components.
+	 */
+	void InitializeKernel(DFTPredictionKernel& kernel, PolarizationEnum polarization) const;
+	
 private:
+	struct RowWorkItem
+	{
+		double u, v, w;
+		size_t rowId;
+		std::complex<float>* data;
+	};
+	
 	void predict(MC2x2& dest, double u, double v, double w, size_t channelIndex, size_t a1, size_t a2, const DFTPredictionComponent& component);
 	
+	static void predictCalcThread(ao::lane<RowWorkItem>* inputLane, ao::lane<RowWorkItem>* outputLane, const DFTPredictionKernel* kernel);
+	
+	static void predictWriteThread(ao::lane<RowWorkItem>* inputLane, class MSProvider* msProvider);
+	
+	static void linearToPolarization(const MC2x2& linear, PolarizationEnum polarization, std::complex<double>* dest);
+	
 	DFTPredictionInput& _input;
 	BandData _band;
 	bool _hasBeam;
+	size_t _phaseRecurrenceInterval;
 };
 
 #endif
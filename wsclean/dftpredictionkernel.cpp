@@ -0,0 +1,225 @@
+#include "dftpredictionkernel.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+DFTPredictionKernel::DFTPredictionKernel(const ao::uvector<double>& frequencies, size_t polarizationCount) :
+	_channelCount(frequencies.size()),
+	_polarizationCount(polarizationCount),
+	_recurrenceInterval(0),
+	_isRegularlySpaced(false),
+	_channelSpacing(0.0),
+	_frequencies(frequencies)
+{
+	if(_channelCount > 1)
+	{
+		// The recurrence gives the phases at f0 + ch x spacing. A deviation of the
+		// actual frequency results in a phase error of the deviation times the
+		// phase change per Hz, which is at most 2e-3 rad/Hz for a 100 km baseline.
+		_channelSpacing = (frequencies[_channelCount-1] - frequencies[0]) / (_channelCount-1);
+		_isRegularlySpaced = true;
+		for(size_t ch=0; ch!=_channelCount; ++ch)
+		{
+			const double expected = frequencies[0] + ch * _channelSpacing;
+			if(std::fabs(frequencies[ch] - expected) > 1e-12 * std::fabs(frequencies[ch]))
+				_isRegularlySpaced = false;
+		}
+	}
+	_points.fluxReal.resize(_channelCount * _polarizationCount);
+	_points.fluxImag.resize(_channelCount * _polarizationCount);
+	_gaussians.fluxReal.resize(_channelCount * _polarizationCount);
+	_gaussians.fluxImag.resize(_channelCount * _polarizationCount);
+}
+
+void DFTPredictionKernel::ComponentArrays::Add(double l, double m, const std::complex<double>* flux, size_t fluxCount)
+{
+	ls.push_back(l);
+	ms.push_back(m);
+	// n-1 written such that it is accurate for small l and m
+	const double lmSq = l*l + m*m;
+	nMinusOnes.push_back(-lmSq / (1.0 + sqrt(1.0 - lmSq)));
+	for(size_t i=0; i!=fluxCount; ++i)
+	{
+		fluxReal[i].push_back(flux[i].real());
+		fluxImag[i].push_back(flux[i].imag());
+	}
+}
+
+void DFTPredictionKernel::AddGaussianComponent(double l, double m, const double* gausTransformation, const std::complex<double>* flux)
+{
+	_gaussians.Add(l, m, flux, _channelCount * _polarizationCount);
+	for(size_t i=0; i!=4; ++i)
+		_gaussians.gausTransf[i].push_back(gausTransformation[i]);
+}
+
+void DFTPredictionKernel::Predict(std::complex<float>* dest, double uInM, double vInM, double wInM, Buffer& buffer) const
+{
+	const size_t valueCount = _channelCount * _polarizationCount;
+	buffer.values.assign(valueCount, 0.0);
+	addComponents(_points, false, uInM, vInM, wInM, buffer);
+	addComponents(_gaussians, true, uInM, vInM, wInM, buffer);
+	for(size_t i=0; i!=valueCount; ++i)
+		dest[i] = buffer.values[i];
+}
+
+void DFTPredictionKernel::addComponents(const ComponentArrays& components, bool isGaussian, double uInM, double vInM, double wInM, Buffer& buffer) const
+{
+	const size_t n = components.Size();
+	if(n == 0)
+		return;
+	buffer.baseAngles.resize(n);
+	buffer.angles.resize(n);
+	buffer.sines.resize(n);
+	buffer.cosines.resize(n);
+	
+	// The phase and the Gaussian exponent scale with the frequency (squared), so
+	// the parts that are independent of the channel are calculated once per row.
+	const double speedOfLight = 299792458.0;
+	const double angleFactor = 2.0 * M_PI / speedOfLight;
+	const double *ls = components.ls.data(), *ms = components.ms.data(), *nMinusOnes = components.nMinusOnes.data();
+	double* baseAngles = buffer.baseAngles.data();
+	for(size_t k=0; k!=n; ++k)
+		baseAngles[k] = angleFactor * (uInM*ls[k] + vInM*ms[k] + wInM*nMinusOnes[k]);
+	if(isGaussian)
+	{
+		buffer.gaussianExponents.resize(n);
+		double* exponents = buffer.gaussianExponents.data();
+		const double
+			*t0 = components.gausTransf[0].data(), *t1 = components.gausTransf[1].data(),
+			*t2 = components.gausTransf[2].data(), *t3 = components.gausTransf[3].data();
+		const double scale = 1.0 / (speedOfLight * speedOfLight);
+		for(size_t k=0; k!=n; ++k)
+		{
+			const double
+				uTransf = uInM*t0[k] + vInM*t1[k],
+				vTransf = uInM*t2[k] + vInM*t3[k];
+			exponents[k] = (uTransf*uTransf + vTransf*vTransf) * scale;
+		}
+	}
+	
+	const bool useRecurrence = UsesPhaseRecurrence();
+	if(useRecurrence)
+	{
+		// The phasors that rotate the phase from one channel to the next
+		buffer.stepSines.resize(n);
+		buffer.stepCosines.resize(n);
+		for(size_t k=0; k!=n; ++k)
+			buffer.angles[k] = baseAngles[k] * _channelSpacing;
+		SinCos(buffer.angles.data(), buffer.stepSines.data(), buffer.stepCosines.data(), n);
+	}
+	if(isGaussian)
+	{
+		buffer.weightedSines.resize(n);
+		buffer.weightedCosines.resize(n);
+	}
+	
+	double *angles = buffer.angles.data(), *sines = buffer.sines.data(), *cosines = buffer.cosines.data();
+	const double *stepSines = buffer.stepSines.data(), *stepCosines = buffer.stepCosines.data();
+	for(size_t ch=0; ch!=_channelCount; ++ch)
+	{
+		const double frequency = _frequencies[ch];
+		if(useRecurrence && ch % _recurrenceInterval != 0)
+		{
+			for(size_t k=0; k!=n; ++k)
+			{
+				const double
+					s = sines[k] * stepCosines[k] + cosines[k] * stepSines[k],
+					c = cosines[k] * stepCosines[k] - sines[k] * stepSines[k];
+				sines[k] = s;
+				cosines[k] = c;
+			}
+		}
+		else {
+			for(size_t k=0; k!=n; ++k)
+				angles[k] = baseAngles[k] * frequency;
+			SinCos(angles, sines, cosines, n);
+		}
+		const double *weightedSines = sines, *weightedCosines = cosines;
+		if(isGaussian)
+		{
+			const double* exponents = buffer.gaussianExponents.data();
+			double
+				*envelopedSines = buffer.weightedSines.data(),
+				*envelopedCosines = buffer.weightedCosines.data();
+			const double frequencySq = frequency * frequency;
+			for(size_t k=0; k!=n; ++k)
+			{
+				const double envelope = exp(-exponents[k] * frequencySq);
+				envelopedSines[k] = sines[k] * envelope;
+				envelopedCosines[k] = cosines[k] * envelope;
+			}
+			weightedSines = envelopedSines;
+			weightedCosines = envelopedCosines;
+		}
+		for(size_t p=0; p!=_polarizationCount; ++p)
+		{
+			const double
+				*fluxReal = components.fluxReal[ch*_polarizationCount + p].data(),
+				*fluxImag = components.fluxImag[ch*_polarizationCount + p].data();
+			// Four independent partial sums, such that the sum can be vectorized
+			// without reordering the floating point additions
+			double real[4] = { 0.0, 0.0, 0.0, 0.0 }, imag[4] = { 0.0, 0.0, 0.0, 0.0 };
+			size_t k = 0;
+			for(; k+4<=n; k+=4)
+			{
+				for(size_t j=0; j!=4; ++j)
+				{
+					real[j] += fluxReal[k+j] * weightedCosines[k+j] - fluxImag[k+j] * weightedSines[k+j];
+					imag[j] += fluxReal[k+j] * weightedSines[k+j] + fluxImag[k+j] * weightedCosines[k+j];
+				}
+			}
+			for(; k!=n; ++k)
+			{
+				real[0] += fluxReal[k] * weightedCosines[k] - fluxImag[k] * weightedSines[k];
+				imag[0] += fluxReal[k] * weightedSines[k] + fluxImag[k] * weightedCosines[k];
+			}
+			buffer.values[ch*_polarizationCount + p] += std::complex<double>(
+				(real[0] + real[1]) + (real[2] + real[3]),
+				(imag[0] + imag[1]) + (imag[2] + imag[3]));
+		}
+	}
+}
+
+void DFTPredictionKernel::SinCos(const double* angles, double* sines, double* cosines, size_t n)
+{
+	const double
+		twoOverPi = 6.36619772367581382433e-01,
+		roundingShift = 6755399441055744.0,
+		// pi/2 split in three parts of 33 bits, so that q*pio2_1 and q*pio2_2 are exact
+		pio2_1 = 1.57079632673412561417e+00,
+		pio2_2 = 6.07710050630396597660e-11,
+		pio2_3 = 2.02226624871116645580e-21,
+		s1 = -1.66666666666666324348e-01,
+		s2 = 8.33333333332248946124e-03,
+		s3 = -1.98412698298579493134e-04,
+		s4 = 2.75573137070700676789e-06,
+		s5 = -2.50507602534068634195e-08,
+		s6 = 1.58969099521155010221e-10,
+		c1 = 4.16666666666666019037e-02,
+		c2 = -1.38888888888741095749e-03,
+		c3 = 2.48015872894767294178e-05,
+		c4 = -2.75573143513906633035e-07,
+		c5 = 2.08757232129817482790e-09,
+		c6 = -1.13596475577881948265e-11;
+	for(size_t i=0; i!=n; ++i)
+	{
+		const double x = angles[i];
+		// Adding 1.5 x 2^52 rounds to the nearest integer, which is then also
+		// found in the lowest bits of the mantissa. Unlike floor(), this vectorizes.
+		const double shifted = x * twoOverPi + roundingShift;
+		const double q = shifted - roundingShift;
+		int64_t qBits;
+		memcpy(&qBits, &shifted, sizeof(double));
+		const double r = ((x - q*pio2_1) - q*pio2_2) - q*pio2_3;
+		const double z = r*r;
+		const double s = r + r*z*(s1 + z*(s2 + z*(s3 + z*(s4 + z*(s5 + z*s6)))));
+		const double c = 1.0 - 0.5*z + z*z*(c1 + z*(c2 + z*(c3 + z*(c4 + z*(c5 + z*c6)))));
+		// The quadrant (0-3) selects which of s and c is used, and with what sign
+		const int64_t quadrant = qBits & 3;
+		const double sinValue = (quadrant & 1) ? c : s;
+		const double cosValue = (quadrant & 1) ? s : c;
+		sines[i] = (quadrant & 2) ? -sinValue : sinValue;
+		cosines[i] = ((quadrant + 1) & 2) ? -cosValue : cosValue;
+	}
+}
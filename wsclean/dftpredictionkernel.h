@@ -0,0 +1,113 @@
+#ifndef DFT_PREDICTION_KERNEL_H
+#define DFT_PREDICTION_KERNEL_H
+
+#include "uvector.h"
+
+#include <complex>
+#include <vector>
+
+/**
+ * Calculates visibilities of a list of point and Gaussian components with a direct
+ * Fourier transform. The components are stored as a structure of arrays, with
+ * the point and Gaussian components in separate lists, such that the loops over the
+ * components vectorize. The flux of a component is stored per channel
+ * for each output polarization, which is already converted to the polarization
+ * that is predicted, so that predicting is a complex sum per channel and polarization.
+ *
+ * The phase convention is the same as that of @ref DFTPredictionAlgorithm.
+ */
+class DFTPredictionKernel
+{
+public:
+	/**
+	 * Scratch space for @ref Predict(). Each thread should have its own buffer.
+	 */
+	struct Buffer
+	{
+		ao::uvector<double> baseAngles, gaussianExponents, angles, sines, cosines;
+		ao::uvector<double> stepSines, stepCosines, weightedSines, weightedCosines;
+		ao::uvector<std::complex<double>> values;
+	};
+	
+	/**
+	 * @param frequencies Frequency of each channel in Hz.
+	 * @param polarizationCount Number of values per channel that is predicted.
+	 */
+	DFTPredictionKernel(const ao::uvector<double>& frequencies, size_t polarizationCount);
+	
+	/**
+	 * Add a point component.
+	 * @param flux The flux per channel and polarization, i.e. flux[channel * PolarizationCount() + polarization].
+	 */
+	void AddPointComponent(double l, double m, const std::complex<double>* flux)
+	{
+		_points.Add(l, m, flux, _channelCount * _polarizationCount);
+	}
+	
+	/**
+	 * Add a Gaussian component.
+	 * @param gausTransformation The transformation of uv coordinates (in wavelengths) to
+	 * the normalized Gaussian in the uv plane, as given by
+	 * DFTPredictionComponent::GausTransformationMatrix().
+	 */
+	void AddGaussianComponent(double l, double m, const double* gausTransformation, const std::complex<double>* flux);
+	
+	/**
+	 * Enable the phase recurrence. For regularly spaced channels, the phasor of a component
+	 * changes by a constant factor from one channel to the next. With the recurrence,
+	 * the phasors are calculated exactly only every @p interval channels, and by a complex
+	 * multiplication in between. The error of the recurrence grows linearly with the number
+	 * of steps, and is about interval x 1e-16 relative to the flux.
+	 * The recurrence is not used when the channels are not regularly spaced.
+	 * @param interval Number of channels between exact calculations; 0 or 1 disables the recurrence.
+	 */
+	void SetPhaseRecurrenceInterval(size_t interval) { _recurrenceInterval = interval; }
+	
+	/**
+	 * Whether phases are calculated by recurrence, i.e. whether it is enabled and the
+	 * channels are regularly spaced.
+	 */
+	bool UsesPhaseRecurrence() const { return _recurrenceInterval > 1 && _isRegularlySpaced; }
+	
+	size_t PointCount() const { return _points.Size(); }
+	size_t GaussianCount() const { return _gaussians.Size(); }
+	size_t ChannelCount() const { return _channelCount; }
+	size_t PolarizationCount() const { return _polarizationCount; }
+	
+	/**
+	 * Calculate the visibilities of one row.
+	 * @param dest Output visibilities, ChannelCount() x PolarizationCount().
+	 */
+	void Predict(std::complex<float>* dest, double uInM, double vInM, double wInM, Buffer& buffer) const;
+	
+	/**
+	 * Calculates sin and cos of all angles. The loop has no branches, which allows the
+	 * compiler to vectorize it. The arguments are reduced to [-pi/4, pi/4] with a three-part
+	 * (Cody-Waite) representation of pi/2, after which fdlibm's minimax polynomials are used.
+	 * For angles smaller than about 1e6 the accuracy is close to that of sincos().
+	 */
+	static void SinCos(const double* angles, double* sines, double* cosines, size_t n);
+
+private:
+	struct ComponentArrays
+	{
+		void Add(double l, double m, const std::complex<double>* flux, size_t fluxCount);
+		size_t Size() const { return ls.size(); }
+		
+		ao::uvector<double> ls, ms, nMinusOnes;
+		// Per channel and polarization, the flux of all components
+		std::vector<ao::uvector<double>> fluxReal, fluxImag;
+		// Only used for Gaussians
+		ao::uvector<double> gausTransf[4];
+	};
+	
+	void addComponents(const ComponentArrays& components, bool isGaussian, double uInM, double vInM, double wInM, Buffer& buffer) const;
+	
+	size_t _channelCount, _polarizationCount, _recurrenceInterval;
+	bool _isRegularlySpaced;
+	double _channelSpacing;
+	ao::uvector<double> _frequencies;
+	ComponentArrays _points, _gaussians;
+};
+
+#endif
@@ -4,6 +4,7 @@
 
 #include <fftw3.h>
 
+#include <algorithm>
 #include <complex>
 #include <stdexcept>
 
@@ -112,38 +113,106 @@ void FFTConvolver::PrepareKernel(double* dest, const double* source, size_t imgW
 
 void FFTConvolver::ConvolveSameSize(double* image, const double* kernel, size_t imgWidth, size_t imgHeight)
 {
-	const size_t imgSize = imgWidth * imgHeight;
-	const size_t complexSize = (imgWidth/2+1) * imgHeight;
-	double* tempData = reinterpret_cast<double*>(fftw_malloc(imgSize * sizeof(double)));
-	fftw_complex* fftImageData = reinterpret_cast<fftw_complex*>(fftw_malloc(complexSize * sizeof(fftw_complex)));
-	fftw_complex* fftKernelData = reinterpret_cast<fftw_complex*>(fftw_malloc(complexSize * sizeof(fftw_complex)));
-	
+	FFTConvolver convolver(imgWidth, imgHeight);
+	convolver.SetKernel(kernel);
+	convolver.ConvolveImage(image);
+}
+
+FFTConvolver::Buffers::Buffers(size_t imgSize, size_t complexSize) :
+	real(reinterpret_cast<double*>(fftw_malloc(imgSize * sizeof(double)))),
+	complex(reinterpret_cast<fftw_complex*>(fftw_malloc(complexSize * sizeof(fftw_complex))))
+{
+}
+
+FFTConvolver::Buffers::~Buffers()
+{
+	fftw_free(real);
+	fftw_free(complex);
+}
+
+FFTConvolver::FFTConvolver(size_t imgWidth, size_t imgHeight) :
+	_width(imgWidth), _height(imgHeight),
+	_complexSize((imgWidth/2+1) * imgHeight),
+	_buffers(imgWidth * imgHeight, _complexSize),
+	_kernelSpectrum(reinterpret_cast<fftw_complex*>(fftw_malloc(_complexSize * sizeof(fftw_complex))))
+{
 	boost::mutex::scoped_lock lock(_mutex);
-	fftw_plan inToFPlan = fftw_plan_dft_r2c_2d(imgHeight, imgWidth, tempData, fftImageData, FFTW_ESTIMATE);
-	fftw_plan fToOutPlan = fftw_plan_dft_c2r_2d(imgHeight, imgWidth, fftImageData, tempData, FFTW_ESTIMATE);
-	lock.unlock();
-	
-	memcpy(tempData, image, imgSize * sizeof(double));
-	fftw_execute_dft_r2c(inToFPlan, tempData, fftImageData);
+	_inToFPlan = fftw_plan_dft_r2c_2d(_height, _width, _buffers.real, _buffers.complex, FFTW_ESTIMATE);
+	_fToOutPlan = fftw_plan_dft_c2r_2d(_height, _width, _buffers.complex, _buffers.real, FFTW_ESTIMATE);
+}
+
+FFTConvolver::~FFTConvolver()
+{
+	fftw_free(_kernelSpectrum);
+	boost::mutex::scoped_lock lock(_mutex);
+	fftw_destroy_plan(_inToFPlan);
+	fftw_destroy_plan(_fToOutPlan);
+}
+
+void FFTConvolver::SetKernel(const double* preparedKernel)
+{
+	const size_t imgSize = _width * _height;
+	memcpy(_buffers.real, preparedKernel, imgSize * sizeof(double));
+	fftw_execute_dft_r2c(_inToFPlan, _buffers.real, _kernelSpectrum);
 	
-	memcpy(tempData, kernel, imgSize * sizeof(double));
-	fftw_execute_dft_r2c(inToFPlan, tempData, fftKernelData);
+	// The normalization of the backward transform is included in the kernel
+	std::complex<double>* kernelSpectrum = reinterpret_cast<std::complex<double>*>(_kernelSpectrum);
+	const double fact = 1.0/imgSize;
+	for(size_t i=0; i!=_complexSize; ++i)
+		kernelSpectrum[i] *= fact;
+}
+
+void FFTConvolver::ConvolveImage(double* image)
+{
+	convolve(image, _buffers);
+}
+
+void FFTConvolver::ConvolveImages(const ao::uvector<double*>& images, size_t threadCount)
+{
+	threadCount = std::min(threadCount, images.size());
+	if(threadCount <= 1)
+	{
+		for(double* image : images)
+			convolve(image, _buffers);
+	}
+	else {
+		boost::thread_group threads;
+		for(size_t i=0; i!=threadCount; ++i)
+			threads.add_thread(new boost::thread(&FFTConvolver::convolveThread, this, &images, i, threadCount));
+		threads.join_all();
+	}
+}
+
+void FFTConvolver::convolveThread(const ao::uvector<double*>* images, size_t threadIndex, size_t threadCount) const
+{
+	Buffers buffers(_width * _height, _complexSize);
+	for(size_t i=threadIndex; i<images->size(); i+=threadCount)
+		convolve((*images)[i], buffers);
+}
+
+void FFTConvolver::convolve(double* image, Buffers& buffers) const
+{
+	const size_t imgSize = _width * _height;
+	// The plans may be executed directly on the image when its alignment is equal to
+	// the alignment of the buffers that were used for planning. A real-to-complex
+	// transform does not overwrite its input.
+	const bool isAligned = fftw_alignment_of(image) == fftw_alignment_of(buffers.real);
+	double* realData = image;
+	if(!isAligned)
+	{
+		memcpy(buffers.real, image, imgSize * sizeof(double));
+		realData = buffers.real;
+	}
+	fftw_execute_dft_r2c(_inToFPlan, realData, buffers.complex);
 	
-	double fact = 1.0/imgSize;
-	for(size_t i=0; i!=complexSize; ++i)
-		reinterpret_cast<std::complex<double>*>(fftImageData)[i] *= fact * reinterpret_cast<std::complex<double>*>(fftKernelData)[i];
-		
-	fftw_execute_dft_c2r(fToOutPlan, reinterpret_cast<fftw_complex*>(fftImageData), tempData);
-	memcpy(image, tempData, imgSize * sizeof(double));
-		
-	fftw_free(fftImageData);
-	fftw_free(fftKernelData);
-	fftw_free(tempData);
+	std::complex<double>* fftImageData = reinterpret_cast<std::complex<double>*>(buffers.complex);
+	const std::complex<double>* kernelSpectrum = reinterpret_cast<const std::complex<double>*>(_kernelSpectrum);
+	for(size_t i=0; i!=_complexSize; ++i)
+		fftImageData[i] *= kernelSpectrum[i];
 	
-	lock.lock();
-	fftw_destroy_plan(inToFPlan);
-	fftw_destroy_plan(fToOutPlan);
-	lock.unlock();
+	fftw_execute_dft_c2r(_fToOutPlan, buffers.complex, realData);
+	if(!isAligned)
+		memcpy(image, buffers.real, imgSize * sizeof(double));
 }
 
 void FFTConvolver::Reverse(double* image, size_t imgWidth, size_t imgHeight)
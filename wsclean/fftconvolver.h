@@ -1,13 +1,53 @@
 #ifndef FFT_CONVOLVER_H
 #define FFT_CONVOLVER_H
 
+#include "uvector.h"
+
 #include <cstring>
 
+#include <fftw3.h>
 #include <boost/thread/thread.hpp>
 
+/**
+ * Convolution of images through FFTs. The static functions perform a single convolution.
+ * An FFTConvolver object keeps the FFT plans, the scratch buffers and the Fourier
+ * transform of a kernel, so that it can be used to convolve many images of a fixed size
+ * with the same kernel, without recreating plans and without transforming the kernel
+ * again for each image.
+ */
 class FFTConvolver {
 	
 public:
+	/**
+	 * Create plans and buffers for convolving images of the given size.
+	 */
+	FFTConvolver(size_t imgWidth, size_t imgHeight);
+	
+	~FFTConvolver();
+	
+	FFTConvolver(const FFTConvolver&) = delete;
+	FFTConvolver& operator=(const FFTConvolver&) = delete;
+	
+	/**
+	 * Transform a kernel and store its spectrum. The kernel should be prepared with
+	 * PrepareKernel() or PrepareSmallKernel().
+	 */
+	void SetKernel(const double* preparedKernel);
+	
+	/**
+	 * Convolve an image with the kernel set by SetKernel(). This uses the scratch buffers
+	 * of the object, so should not be called from multiple threads simultaneously.
+	 */
+	void ConvolveImage(double* image);
+	
+	/**
+	 * Convolve several images with the kernel set by SetKernel(), using the given number of threads.
+	 */
+	void ConvolveImages(const ao::uvector<double*>& images, size_t threadCount);
+	
+	size_t Width() const { return _width; }
+	size_t Height() const { return _height; }
+	
 	/**
 	 * Convolve an image with a smaller kernel. No preparation of either image is needed.
 	 * 
@@ -43,6 +83,25 @@ public:
 	
 	static void Reverse(double* image, size_t imgWidth, size_t imgHeight);
 private:
+	struct Buffers
+	{
+		Buffers(size_t imgSize, size_t complexSize);
+		~Buffers();
+		Buffers(const Buffers&) = delete;
+		Buffers& operator=(const Buffers&) = delete;
+		
+		double* real;
+		fftw_complex* complex;
+	};
+	
+	void convolve(double* image, Buffers& buffers) const;
+	void convolveThread(const ao::uvector<double*>* images, size_t threadIndex, size_t threadCount) const;
+	
+	size_t _width, _height, _complexSize;
+	Buffers _buffers;
+	fftw_complex* _kernelSpectrum;
+	fftw_plan _inToFPlan, _fToOutPlan;
+	
 	static boost::mutex _mutex;
 };
 
@@ -0,0 +1,49 @@
+#ifndef FNV_HASH_H
+#define FNV_HASH_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/**
+ * 64-bit FNV-1a hash, used to recognize cached data. Strings are hashed per byte,
+ * doubles per 64-bit pattern, so that e.g. -0.0 and 0.0 give different hashes.
+ */
+class FNVHash
+{
+public:
+	FNVHash() : _hash(14695981039346656037ull) { }
+	
+	/**
+	 * Continue from the value of an earlier hash.
+	 */
+	explicit FNVHash(uint64_t hash) : _hash(hash) { }
+	
+	void Add(const std::string& str)
+	{
+		for(char c : str)
+			add(uint64_t((unsigned char) c));
+	}
+	
+	void Add(double value)
+	{
+		uint64_t bits;
+		memcpy(&bits, &value, sizeof(double));
+		add(bits);
+	}
+	
+	void Add(const double* values, size_t n)
+	{
+		for(size_t i=0; i!=n; ++i)
+			Add(values[i]);
+	}
+	
+	uint64_t Value() const { return _hash; }
+
+private:
+	void add(uint64_t value) { _hash = (_hash ^ value) * 1099511628211ull; }
+	
+	uint64_t _hash;
+};
+
+#endif
@@ -4,27 +4,111 @@
 
 #include "msproviders/msprovider.h"
 #include "fitswriter.h"
+#include "fnvhash.h"
+#include "system.h"
 #include "units/angle.h"
 #include "wsclean/logger.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <cstring>
 
-ImageWeights::ImageWeights(const WeightMode& weightMode, size_t imageWidth, size_t imageHeight, double pixelScaleX, double pixelScaleY, double superWeight) :
+#include <boost/thread/thread.hpp>
+
+ImageWeights::ImageWeights(const WeightMode& weightMode, size_t imageWidth, size_t imageHeight, double pixelScaleX, double pixelScaleY, double superWeight, size_t threadCount) :
 	_weightMode(weightMode),
 	_imageWidth(round(double(imageWidth) / superWeight)),
 	_imageHeight(round(double(imageHeight) / superWeight)),
 	_pixelScaleX(pixelScaleX),
 	_pixelScaleY(pixelScaleY),
 	_totalSum(0.0),
-	_isGriddingFinished(false)
+	_isGriddingFinished(false),
+	_threadCount(threadCount)
 {
 	if(_imageWidth%2 != 0) ++_imageWidth;
 	if(_imageHeight%2 != 0) ++_imageHeight;
 	_grid.assign(_imageWidth*_imageHeight/2, 0.0);
 }
 
+template<typename RowReader>
+void ImageWeights::gridInParallel(size_t maxRowSize, size_t polarizationCount, size_t channelStart, RowReader readRow)
+{
+	// Every gridding thread except the first needs a private grid. The number of
+	// threads is limited such that these take at most an eighth of the memory.
+	const double gridSize = double(_grid.size() * sizeof(double));
+	const size_t threadCount = std::max<size_t>(1, std::min<size_t>(_threadCount, size_t(double(System::TotalMemory()) / (8.0 * gridSize))));
+	const size_t chunkRowCount = 256, chunkCount = threadCount * 2;
+	
+	std::vector<GriddingChunk> chunks(chunkCount);
+	ao::lane<GriddingChunk*> freeChunks(chunkCount), filledChunks(chunkCount);
+	for(GriddingChunk& chunk : chunks)
+	{
+		chunk.rowCount = 0;
+		chunk.us.resize(chunkRowCount);
+		chunk.vs.resize(chunkRowCount);
+		chunk.bands.resize(chunkRowCount);
+		chunk.channelCounts.resize(chunkRowCount);
+		chunk.weights.resize(chunkRowCount * maxRowSize);
+		freeChunks.write(&chunk);
+	}
+	
+	std::vector<ao::uvector<double>> privateGrids(threadCount-1);
+	std::vector<double> sums(threadCount, 0.0);
+	boost::thread_group threadGroup;
+	for(size_t i=0; i!=threadCount; ++i)
+	{
+		double* grid;
+		if(i == 0)
+			grid = _grid.data();
+		else {
+			privateGrids[i-1].assign(_grid.size(), 0.0);
+			grid = privateGrids[i-1].data();
+		}
+		threadGroup.add_thread(new boost::thread(&ImageWeights::gridChunks, this, &filledChunks, &freeChunks, grid, &sums[i], maxRowSize, polarizationCount, channelStart));
+	}
+	
+	try {
+		bool isFinished = false;
+		GriddingChunk* chunk;
+		while(!isFinished && freeChunks.read(chunk))
+		{
+			size_t rowIndex = 0;
+			while(rowIndex != chunkRowCount && readRow(*chunk, rowIndex))
+				++rowIndex;
+			isFinished = (rowIndex != chunkRowCount);
+			chunk->rowCount = rowIndex;
+			filledChunks.write(chunk);
+		}
+	} catch(...) {
+		// The gridding threads use the lanes and grids on this stack, so they have
+		// to be finished before these go out of scope
+		filledChunks.write_end();
+		threadGroup.join_all();
+		throw;
+	}
+	filledChunks.write_end();
+	threadGroup.join_all();
+	
+	if(!privateGrids.empty())
+	{
+		// Reduce the private grids in parallel, each thread adding a slice of the grids
+		boost::thread_group reduceGroup;
+		for(size_t i=0; i!=threadCount; ++i)
+		{
+			size_t
+				start = (_grid.size() * i) / threadCount,
+				end = (_grid.size() * (i+1)) / threadCount;
+			reduceGroup.add_thread(new boost::thread(&ImageWeights::addGrids, this, boost::cref(privateGrids), start, end));
+		}
+		reduceGroup.join_all();
+	}
+	for(double sum : sums)
+		_totalSum += sum;
+}
+
 void ImageWeights::Grid(casacore::MeasurementSet& ms, const MSSelection& selection)
 {
 	if(_isGriddingFinished)
@@ -51,7 +135,6 @@ void ImageWeights::Grid(casacore::MeasurementSet& ms, const MSSelection& selecti
 	
 	const size_t polarizationCount = shape[0];
 	
-	casacore::Array<casacore::Complex> dataArr(shape);
 	casacore::Array<bool> flagArr(shape);
 	casacore::Array<float> weightArr(shape);
 	size_t timestep = 0;
@@ -60,74 +143,57 @@ void ImageWeights::Grid(casacore::MeasurementSet& ms, const MSSelection& selecti
 	if(!hasWeights)
 		weightArr.set(1.0);
 	
-	for(size_t row=0; row!=ms.nrow(); ++row)
+	const size_t channelStart = selection.HasChannelRange() ? selection.ChannelRangeStart() : 0;
+	const size_t maxRowSize = bandData.MaxChannels() * polarizationCount;
+	
+	// Reading is done by this thread, while the rows are gridded by the gridding threads.
+	size_t row = 0;
+	gridInParallel(maxRowSize, polarizationCount, channelStart, [&](GriddingChunk& chunk, size_t rowIndex) -> bool
 	{
-		const int a1 = antenna1Column(row), a2 = antenna2Column(row), fieldId = fieldIdColumn(row);
-		if(time != timeColumn(row))
+		while(row != ms.nrow())
 		{
-			++timestep;
-			time = timeColumn(row);
-		}
-		const casacore::Vector<double> uvw = uvwColumn(row);
-		if(selection.IsSelected(fieldId, timestep, a1, a2, uvw))
-		{
-			flagColumn.get(row, flagArr);
-			if(hasWeights)
-				weightColumn.get(row, weightArr);
-			const BandData& curBand = bandData[dataDescIdColumn(row)];
-			
-			bool* flagIter = flagArr.cbegin();
-			float* weightIter = weightArr.cbegin();
-			
-			double uInM = uvw(0), vInM = uvw(1);
-			if(vInM < 0.0)
-			{
-				uInM = -uInM;
-				vInM = -vInM;
-			}
-			
-			size_t startChannel, endChannel;
-			if(selection.HasChannelRange())
+			const int a1 = antenna1Column(row), a2 = antenna2Column(row), fieldId = fieldIdColumn(row);
+			if(time != timeColumn(row))
 			{
-				startChannel = selection.ChannelRangeStart();
-				endChannel = selection.ChannelRangeEnd();
-			}
-			else {
-				startChannel = 0;
-				endChannel = curBand.ChannelCount();
+				++timestep;
+				time = timeColumn(row);
 			}
-	
-			for(size_t ch=startChannel; ch!=endChannel; ++ch)
+			const casacore::Vector<double> uvw = uvwColumn(row);
+			if(selection.IsSelected(fieldId, timestep, a1, a2, uvw))
 			{
-				double
-					u = uInM / curBand.ChannelWavelength(ch),
-					v = vInM / curBand.ChannelWavelength(ch);
-				int x, y;
-				uvToXY(u, v, x, y);
-				if(isWithinLimits(x, y))
+				flagColumn.get(row, flagArr);
+				if(hasWeights)
+					weightColumn.get(row, weightArr);
+				const BandData& curBand = bandData[dataDescIdColumn(row)];
+				
+				size_t endChannel;
+				if(selection.HasChannelRange())
+					endChannel = selection.ChannelRangeEnd();
+				else
+					endChannel = curBand.ChannelCount();
+				
+				chunk.us[rowIndex] = uvw(0);
+				chunk.vs[rowIndex] = uvw(1);
+				chunk.bands[rowIndex] = &curBand;
+				chunk.channelCounts[rowIndex] = endChannel - channelStart;
+				
+				const bool* flagIter = flagArr.cbegin() + channelStart * polarizationCount;
+				const float* weightIter = weightArr.cbegin() + channelStart * polarizationCount;
+				float* destIter = &chunk.weights[rowIndex * maxRowSize];
+				for(size_t i=0; i!=(endChannel - channelStart) * polarizationCount; ++i)
 				{
-					for(size_t p=0; p!=polarizationCount; ++p)
-					{
-						if(!*flagIter)
-						{
-							size_t index = (size_t) x + (size_t) y*_imageWidth;
-							_grid[index] += *weightIter;
-							_totalSum += *weightIter;
-						}
-						++flagIter;
-						++weightIter;
-					}
-				}
-				else {
-					for(size_t p=0; p!=polarizationCount; ++p)
-					{
-						++flagIter;
-						++weightIter;
-					}
+					*destIter = *flagIter ? 0.0 : *weightIter;
+					++flagIter;
+					++weightIter;
+					++destIter;
 				}
+				++row;
+				return true;
 			}
+			++row;
 		}
-	}
+		return false;
+	});
 }
 
 void ImageWeights::Grid(MSProvider& msProvider, const MSSelection& selection)
@@ -143,37 +209,89 @@ void ImageWeights::Grid(MSProvider& msProvider, const MSSelection& selection)
 			selectedBand = MultiBandData(bandData, selection.ChannelRangeStart(), selection.ChannelRangeEnd());
 		else
 			selectedBand = bandData;
-		std::vector<float> weightBuffer(selectedBand.MaxChannels()*polarizationCount);
+		const size_t maxRowSize = selectedBand.MaxChannels()*polarizationCount;
 		
 		msProvider.Reset();
-		while(msProvider.CurrentRowAvailable())
+		gridInParallel(maxRowSize, polarizationCount, 0, [&](GriddingChunk& chunk, size_t rowIndex) -> bool
 		{
+			if(!msProvider.CurrentRowAvailable())
+				return false;
 			double uInM, vInM, wInM;
 			size_t dataDescId;
 			msProvider.ReadMeta(uInM, vInM, wInM, dataDescId);
-			msProvider.ReadWeights(weightBuffer.data());
+			msProvider.ReadWeights(&chunk.weights[rowIndex * maxRowSize]);
 			const BandData& curBand = selectedBand[dataDescId];
-			if(vInM < 0.0)
-			{
-				uInM = -uInM;
-				vInM = -vInM;
-			}
-			
-			const float* weightIter = weightBuffer.data();
-			for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
+			chunk.us[rowIndex] = uInM;
+			chunk.vs[rowIndex] = vInM;
+			chunk.bands[rowIndex] = &curBand;
+			chunk.channelCounts[rowIndex] = curBand.ChannelCount();
+			msProvider.NextRow();
+			return true;
+		});
+	}
+}
+
+void ImageWeights::Grid(const double* us, const double* vs, const float* weights, size_t rowCount, const BandData& band, size_t polarizationCount)
+{
+	if(_isGriddingFinished)
+		throw std::runtime_error("Grid() called after a call to FinishGridding()");
+	const size_t rowSize = band.ChannelCount() * polarizationCount;
+	size_t row = 0;
+	gridInParallel(rowSize, polarizationCount, 0, [&](GriddingChunk& chunk, size_t rowIndex) -> bool
+	{
+		if(row == rowCount)
+			return false;
+		chunk.us[rowIndex] = us[row];
+		chunk.vs[rowIndex] = vs[row];
+		chunk.bands[rowIndex] = &band;
+		chunk.channelCounts[rowIndex] = band.ChannelCount();
+		std::copy(&weights[row * rowSize], &weights[(row+1) * rowSize], &chunk.weights[rowIndex * rowSize]);
+		++row;
+		return true;
+	});
+}
+
+void ImageWeights::gridChunks(ao::lane<GriddingChunk*>* filledChunks, ao::lane<GriddingChunk*>* freeChunks, double* grid, double* totalSum, size_t maxRowSize, size_t polarizationCount, size_t channelStart) const
+{
+	double sum = 0.0;
+	GriddingChunk* chunk;
+	while(filledChunks->read(chunk))
+	{
+		for(size_t row=0; row!=chunk->rowCount; ++row)
+		{
+			const BandData& curBand = *chunk->bands[row];
+			const float* weightIter = &chunk->weights[row * maxRowSize];
+			for(size_t ch=0; ch!=chunk->channelCounts[row]; ++ch)
 			{
-				double
-					u = uInM / curBand.ChannelWavelength(ch),
-					v = vInM / curBand.ChannelWavelength(ch);
-				for(size_t p=0; p!=polarizationCount; ++p)
+				const double wavelength = curBand.ChannelWavelength(ch + channelStart);
+				int x, y;
+				uvToXY(chunk->us[row] / wavelength, chunk->vs[row] / wavelength, x, y);
+				if(isWithinLimits(x, y))
 				{
-					Grid(u, v, *weightIter);
-					++weightIter;
+					double& gridValue = grid[(size_t) x + (size_t) y*_imageWidth];
+					for(size_t p=0; p!=polarizationCount; ++p)
+					{
+						gridValue += *weightIter;
+						sum += *weightIter;
+						++weightIter;
+					}
+				}
+				else {
+					weightIter += polarizationCount;
 				}
 			}
-			
-			msProvider.NextRow();
 		}
+		freeChunks->write(chunk);
+	}
+	*totalSum = sum;
+}
+
+void ImageWeights::addGrids(const std::vector<ao::uvector<double>>& grids, size_t start, size_t end)
+{
+	for(const ao::uvector<double>& grid : grids)
+	{
+		for(size_t i=start; i!=end; ++i)
+			_grid[i] += grid[i];
 	}
 }
 
@@ -371,6 +489,13 @@ void ImageWeights::GetGrid(double* image) const
 	}
 }
 
+uint64_t ImageWeights::Checksum() const
+{
+	FNVHash checksum;
+	checksum.Add(_grid.data(), _grid.size());
+	return checksum.Value();
+}
+
 void ImageWeights::Save(const string& filename) const
 {
 	ao::uvector<double> image(_imageWidth*_imageHeight);
@@ -380,6 +505,52 @@ void ImageWeights::Save(const string& filename) const
 	writer.Write(filename, image.data());
 }
 
+void ImageWeights::Store(const std::string& filename, const std::string& key) const
+{
+	// The grid is written to a temporary name first, so that a partially written file is never read
+	const std::string partFilename = filename + ".part";
+	{
+		std::ofstream file(partFilename, std::ios::out | std::ios::binary | std::ios::trunc);
+		const uint64_t header[3] = { key.size(), _imageWidth, _imageHeight };
+		file.write("WSCW", 4);
+		file.write(reinterpret_cast<const char*>(header), sizeof(header));
+		file.write(key.data(), key.size());
+		file.write(reinterpret_cast<const char*>(&_totalSum), sizeof(double));
+		file.write(reinterpret_cast<const char*>(_grid.data()), _grid.size()*sizeof(double));
+		if(!file.good())
+			throw std::runtime_error("Error writing imaging weights to " + partFilename);
+	}
+	if(std::rename(partFilename.c_str(), filename.c_str()) != 0)
+		throw std::runtime_error("Could not rename " + partFilename + " to " + filename);
+}
+
+bool ImageWeights::Load(const std::string& filename, const std::string& key)
+{
+	std::ifstream file(filename, std::ios::in | std::ios::binary);
+	if(!file.good())
+		return false;
+	char magic[4];
+	uint64_t header[3];
+	file.read(magic, 4);
+	file.read(reinterpret_cast<char*>(header), sizeof(header));
+	if(!file.good() || std::string(magic, 4) != "WSCW" || header[0] != key.size() || header[1] != _imageWidth || header[2] != _imageHeight)
+		return false;
+	std::string storedKey(key.size(), ' ');
+	file.read(&storedKey[0], key.size());
+	if(!file.good() || storedKey != key)
+		return false;
+	double totalSum;
+	ao::uvector<double> grid(_grid.size());
+	file.read(reinterpret_cast<char*>(&totalSum), sizeof(double));
+	file.read(reinterpret_cast<char*>(grid.data()), grid.size()*sizeof(double));
+	if(!file.good())
+		return false;
+	_grid = std::move(grid);
+	_totalSum = totalSum;
+	_isGriddingFinished = true;
+	return true;
+}
+
 void ImageWeights::RankFilter(double rankLimit, size_t windowSize)
 {
 	ao::uvector<double> newGrid(_grid);
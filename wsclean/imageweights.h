@@ -3,18 +3,27 @@
 
 #include <cstddef>
 #include <complex>
+#include <cstdint>
+#include <vector>
 
 #include <casacore/ms/MeasurementSets/MeasurementSet.h>
 
+#include "lane.h"
 #include "uvector.h"
 //#include "wsclean/inversionalgorithm.h"
 #include "weightmode.h"
 #include "msselection.h"
 
+class BandData;
+
 class ImageWeights
 {
 	public:
-		ImageWeights(const WeightMode& weightMode, size_t imageWidth, size_t imageHeight, double pixelScaleX, double pixelScaleY, double superWeight=1.0);
+		/**
+		 * @param threadCount Number of threads used by the Grid() methods that read measurement sets.
+		 * Each thread accumulates into a private grid, which costs one additional grid of memory per thread.
+		 */
+		ImageWeights(const WeightMode& weightMode, size_t imageWidth, size_t imageHeight, double pixelScaleX, double pixelScaleY, double superWeight=1.0, size_t threadCount=1);
 		
 		double GetWeight(double u, double v) const
 		{
@@ -23,6 +32,14 @@ class ImageWeights
 
 		void Grid(casacore::MeasurementSet& ms, const MSSelection& selection);
 		void Grid(class MSProvider& ms, const MSSelection& selection);
+		/**
+		 * Grid the weights of rows that all have the same band, using the threads
+		 * given to the constructor like the other Grid() methods.
+		 * @param us u-coordinate of each row in meters.
+		 * @param vs v-coordinate of each row in meters.
+		 * @param weights Channels x polarizations weights per row, zero for flagged samples.
+		 */
+		void Grid(const double* us, const double* vs, const float* weights, size_t rowCount, const BandData& band, size_t polarizationCount);
 		void Grid(double u, double v, double weight)
 		{
 			int x,y;
@@ -47,8 +64,29 @@ class ImageWeights
 		void SetEdgeTukeyTaper(double transitionSizeInLambda, double edgeSizeInLambda);
 		
 		void GetGrid(double* image) const;
+		
+		/**
+		 * Calculate a checksum over the weight grid. This can be used to verify
+		 * whether imaging weights that were calculated earlier are still valid.
+		 */
+		uint64_t Checksum() const;
+
 		void Save(const std::string& filename) const;
 		
+		/**
+		 * Write the weight grid to a binary file, such that it can be read back
+		 * with @ref Load(). The @p key describes the settings and data with which the
+		 * grid was calculated.
+		 */
+		void Store(const std::string& filename, const std::string& key) const;
+		
+		/**
+		 * Replace the weight grid by a grid that was written with @ref Store(). The
+		 * grid is only read when the file exists and its key and dimensions match.
+		 * @returns true when the grid was read.
+		 */
+		bool Load(const std::string& filename, const std::string& key);
+		
 		void RankFilter(double rankLimit, size_t windowSize);
 		
 		size_t Width() const { return _imageWidth; }
@@ -97,6 +135,27 @@ class ImageWeights
 		
 		double windowMean(size_t x, size_t y, size_t windowSize);
 		
+		/**
+		 * A block of rows that is read by a single reading thread, and gridded
+		 * by one of the gridding threads. Each row has room for maxRowSize weights,
+		 * which are zero for flagged samples.
+		 */
+		struct GriddingChunk
+		{
+			size_t rowCount;
+			ao::uvector<double> us, vs;
+			ao::uvector<const BandData*> bands;
+			ao::uvector<size_t> channelCounts;
+			ao::uvector<float> weights;
+		};
+		
+		template<typename RowReader>
+		void gridInParallel(size_t maxRowSize, size_t polarizationCount, size_t channelStart, RowReader readRow);
+		
+		void gridChunks(ao::lane<GriddingChunk*>* filledChunks, ao::lane<GriddingChunk*>* freeChunks, double* grid, double* totalSum, size_t maxRowSize, size_t polarizationCount, size_t channelStart) const;
+		
+		void addGrids(const std::vector<ao::uvector<double>>& grids, size_t start, size_t end);
+		
 		/**
 		 * Returns Tukey tapering function. This function is
 		 * 0 when x=0 and 1 when x=n.
@@ -122,6 +181,7 @@ class ImageWeights
 		ao::uvector<double> _grid;
 		double _totalSum;
 		bool _isGriddingFinished;
+		size_t _threadCount;
 };
 
 #endif
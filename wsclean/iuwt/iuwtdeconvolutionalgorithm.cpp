@@ -375,11 +375,15 @@ bool IUWTDeconvolutionAlgorithm::runConjugateGradient(IUWTDecomposition& iuwt, c
 	
 	IUWTDecomposition initialDirtyIUWT(iuwt);
 	
+	// The psf is transformed once for all convolutions in this loop
+	FFTConvolver psfConvolver(width, height);
+	psfConvolver.SetKernel(psfKernel.data());
+	
 	for(size_t minorIter=0; minorIter!=20; ++minorIter)
 	{
 		// scratch = gradient (x) psf
 		scratch = gradient;
-		FFTConvolver::ConvolveSameSize(scratch.data(), psfKernel.data(), width, height);
+		psfConvolver.ConvolveImage(scratch.data());
 		
 		// calc: IUWT gradient (x) psf
 		iuwt.Decompose(*_threadPool, scratch.data(), scratch.data(), false);
@@ -425,7 +429,7 @@ bool IUWTDeconvolutionAlgorithm::runConjugateGradient(IUWTDecomposition& iuwt, c
 		
 		// scratch = mask IUWT PSF (x) model
 		scratch = structureModel;
-		FFTConvolver::ConvolveSameSize(scratch.data(), psfKernel.data(), width, height);
+		psfConvolver.ConvolveImage(scratch.data());
 		iuwt.Decompose(*_threadPool, scratch.data(), scratch.data(), false);
 		iuwt.ApplyMask(mask);
 		
@@ -975,12 +979,20 @@ void IUWTDeconvolutionAlgorithm::PerformMajorIteration(size_t& iterCounter, size
 			modelSet += structureModel;
 		
 			// Calculate: dirty = dirty - structureModel (x) psf
+			// The psf is only transformed again when it differs from the one of the previous image
+			FFTConvolver psfConvolver(_width, _height);
+			size_t convolverPsfIndex = dirtySet.PSFCount();
 			for(size_t i=0; i!=dirtySet.size(); ++i)
 			{
 				scratch.assign(structureModel[i], structureModel[i] + _width*_height);
 				size_t psfIndex = dirtySet.PSFIndex(i);
-				FFTConvolver::PrepareKernel(psfKernel.data(), psfs[psfIndex], _width, _height);
-				FFTConvolver::ConvolveSameSize(scratch.data(), psfKernel.data(), _width, _height);
+				if(psfIndex != convolverPsfIndex)
+				{
+					FFTConvolver::PrepareKernel(psfKernel.data(), psfs[psfIndex], _width, _height);
+					psfConvolver.SetKernel(psfKernel.data());
+					convolverPsfIndex = psfIndex;
+				}
+				psfConvolver.ConvolveImage(scratch.data());
 				Subtract(dirtySet[i], scratch);
 			}
 			dirtySet.GetLinearIntegrated(dirty.data());
@@ -25,6 +25,7 @@ ContiguousMS::ContiguousMS(const string& msPath, const std::string& dataColumnNa
 	Logger::Info << "Opening " << msPath << ", spw " << _dataDescId << " with contiguous MS reader.\n";
 	
 	_inputPolarizations = GetMSPolarizations(_ms);
+	_polarizationConverter.reset(new PolarizationConverter(_inputPolarizations, _polOut));
  
 	const casacore::IPosition shape(_dataColumn.shape(0));
 	_dataArray = casacore::Array<std::complex<float>>(shape);
@@ -164,7 +165,7 @@ void ContiguousMS::ReadData(std::complex<float>* buffer)
 		startChannel = 0;
 		endChannel = _bandData[_dataDescId].ChannelCount();
 	}
-	copyWeightedData(buffer,  startChannel, endChannel, _inputPolarizations, _dataArray, _weightSpectrumArray, _flagArray, _polOut);
+	copyWeightedData(buffer,  startChannel, endChannel, *_polarizationConverter, _dataArray, _weightSpectrumArray, _flagArray);
 }
 
 void ContiguousMS::prepareModelColumn()
@@ -195,7 +196,7 @@ void ContiguousMS::ReadModel(std::complex<float>* buffer)
 		startChannel = 0;
 		endChannel = _bandData[_dataDescId].ChannelCount();
 	}
-	copyWeightedData(buffer,  startChannel, endChannel, _inputPolarizations, _modelArray, _weightSpectrumArray, _flagArray, _polOut);
+	copyWeightedData(buffer,  startChannel, endChannel, *_polarizationConverter, _modelArray, _weightSpectrumArray, _flagArray);
 }
 
 void ContiguousMS::WriteModel(size_t rowId, std::complex<float>* buffer)
@@ -236,7 +237,7 @@ void ContiguousMS::ReadWeights(std::complex<float>* buffer)
 		startChannel = 0;
 		endChannel = _bandData[_dataDescId].ChannelCount();
 	}
-	copyWeights(buffer,  startChannel, endChannel, _inputPolarizations, _dataArray, _weightSpectrumArray, _flagArray, _polOut);
+	copyWeights(buffer,  startChannel, endChannel, *_polarizationConverter, _dataArray, _weightSpectrumArray, _flagArray);
 }
 
 void ContiguousMS::ReadWeights(float* buffer)
@@ -254,7 +255,7 @@ void ContiguousMS::ReadWeights(float* buffer)
 		startChannel = 0;
 		endChannel = _bandData[_dataDescId].ChannelCount();
 	}
-	copyWeights(buffer,  startChannel, endChannel, _inputPolarizations, _dataArray, _weightSpectrumArray, _flagArray, _polOut);
+	copyWeights(buffer,  startChannel, endChannel, *_polarizationConverter, _dataArray, _weightSpectrumArray, _flagArray);
 }
 
 void ContiguousMS::MakeIdToMSRowMapping(vector<size_t>& idToMSRow)
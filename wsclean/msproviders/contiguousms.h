@@ -11,6 +11,7 @@
 #include <casacore/tables/Tables/ScalarColumn.h>
 
 #include <memory>
+#include <stdexcept>
 
 class ContiguousMS : public MSProvider
 {
@@ -55,6 +56,25 @@ public:
 	virtual void MakeIdToMSRowMapping(std::vector<size_t>& idToMSRow) final override;
 	
 	virtual PolarizationEnum Polarization() final override { return _polOut; }
+
+	virtual bool SupportsImagingWeights() const final override { return false; }
+
+	virtual bool OpenImagingWeights(uint64_t, ImagingWeightSums&) final override { return false; }
+
+	virtual void ReadImagingWeights(float*) final override
+	{
+		throw std::runtime_error("ContiguousMS does not support storing imaging weights");
+	}
+
+	virtual void WriteImagingWeights(const float*) final override
+	{
+		throw std::runtime_error("ContiguousMS does not support storing imaging weights");
+	}
+
+	virtual void FinishImagingWeights(uint64_t, const ImagingWeightSums&) final override
+	{
+		throw std::runtime_error("ContiguousMS does not support storing imaging weights");
+	}
 private:
 	size_t _row, _rowId;
 	size_t _timestep;
@@ -65,6 +85,7 @@ private:
 	size_t _startRow, _endRow;
 	vector<size_t> _idToMSRow;
 	std::vector<PolarizationEnum> _inputPolarizations;
+	std::unique_ptr<PolarizationConverter> _polarizationConverter;
 	MSSelection _selection;
 	PolarizationEnum _polOut;
 	std::string _msPath;
@@ -9,412 +9,6 @@
 
 #include "../msselection.h"
 
-void MSProvider::copyWeightedData(std::complex<float>* dest, size_t startChannel, size_t endChannel, const std::vector<PolarizationEnum>& polsIn, const casacore::Array<std::complex<float>>& data, const casacore::Array<float>& weights, const casacore::Array<bool>& flags, PolarizationEnum polOut)
-{
-	const size_t polCount = polsIn.size();
-	casacore::Array<std::complex<float> >::const_contiter inPtr = data.cbegin() + startChannel * polCount;
-	casacore::Array<float>::const_contiter weightPtr = weights.cbegin() + startChannel * polCount;
-	casacore::Array<bool>::const_contiter flagPtr = flags.cbegin() + startChannel * polCount;
-	const size_t selectedChannelCount = endChannel - startChannel;
-		
-	size_t polIndex;
-	if(polOut == Polarization::Instrumental)
-	{
-		for(size_t ch=0; ch!=selectedChannelCount*polsIn.size(); ++ch)
-		{
-			if(!*flagPtr && std::isfinite(inPtr->real()) && std::isfinite(inPtr->imag()))
-			{
-				dest[ch] = *inPtr * (*weightPtr);
-			}
-			else {
-				dest[ch] = 0;
-			}
-			weightPtr++;
-			inPtr++;
-			flagPtr++;
-		}
-	}
-	else if(Polarization::TypeToIndex(polOut, polsIn, polIndex)) {
-		inPtr += polIndex;
-		weightPtr += polIndex;
-		flagPtr += polIndex;
-		for(size_t ch=0; ch!=selectedChannelCount; ++ch)
-		{
-			if(!*flagPtr && std::isfinite(inPtr->real()) && std::isfinite(inPtr->imag()))
-			{
-				dest[ch] = *inPtr * (*weightPtr);
-			}
-			else {
-				dest[ch] = 0;
-			}
-			weightPtr += polCount;
-			inPtr += polCount;
-			flagPtr += polCount;
-		}
-	}
-	else {
-		// Copy the right visibilities with conversion if necessary.
-		// Note that many conversions require dividing by two, e.g.
-		// I = (XX + YY)/2. This division is done with weighting, so
-		// weighted I = (w1 XX + w2 YY),
-		// which is given a weight (w1 + w2),
-		// and hence unweighted I = (w1 XX + w2 YY) / (w1 + w2), which if
-		// w1 = w2 results in I = (XX + YY) / 2.
-		switch(polOut)
-		{
-		case Polarization::StokesI: {
-			size_t polIndexA=0, polIndexB=0;
-			bool hasXX = Polarization::TypeToIndex(Polarization::XX, polsIn, polIndexA);
-			bool hasYY = Polarization::TypeToIndex(Polarization::YY, polsIn, polIndexB);
-			if(!hasXX || !hasYY)
-			{
-				bool hasRR = Polarization::TypeToIndex(Polarization::RR, polsIn, polIndexA);
-				bool hasLL = Polarization::TypeToIndex(Polarization::LL, polsIn, polIndexB);
-				if(!hasRR || !hasLL)
-					throw std::runtime_error("Can not form requested polarization (Stokes I) from available polarizations");
-			}
-			
-			for(size_t ch=0; ch!=selectedChannelCount; ++ch)
-			{
-				weightPtr += polIndexA;
-				inPtr += polIndexA;
-				flagPtr += polIndexA;
-				
-				bool flagA = *flagPtr || !std::isfinite(inPtr->real())|| !std::isfinite(inPtr->imag());
-				casacore::Complex valA = *inPtr * (*weightPtr);
-				
-				weightPtr += polIndexB - polIndexA;
-				inPtr += polIndexB - polIndexA;
-				flagPtr += polIndexB - polIndexA;
-				
-				bool flagB = *flagPtr || !std::isfinite(inPtr->real())|| !std::isfinite(inPtr->imag());
-				if(flagA || flagB)
-					dest[ch] = 0.0;
-				else {
-					// I = XX + YY
-					dest[ch] = (*inPtr * (*weightPtr)) + valA;
-				}
-				
-				weightPtr += polCount - polIndexB;
-				inPtr += polCount - polIndexB;
-				flagPtr += polCount - polIndexB;
-			}
-		} break;
-		case Polarization::StokesQ: {
-			size_t polIndexA=0, polIndexB=0;
-			bool hasXX = Polarization::TypeToIndex(Polarization::XX, polsIn, polIndexA);
-			bool hasYY = Polarization::TypeToIndex(Polarization::YY, polsIn, polIndexB);
-			if(hasXX && hasYY)
-			{
-				// Convert to StokesQ from XX and YY
-				for(size_t ch=0; ch!=selectedChannelCount; ++ch)
-				{
-					weightPtr += polIndexA;
-					inPtr += polIndexA;
-					flagPtr += polIndexA;
-					
-					bool flagA = *flagPtr || !std::isfinite(inPtr->real())|| !std::isfinite(inPtr->imag());
-					casacore::Complex valA = *inPtr * (*weightPtr);
-					
-					weightPtr += polIndexB - polIndexA;
-					inPtr += polIndexB - polIndexA;
-					flagPtr += polIndexB - polIndexA;
-					
-					bool flagB = *flagPtr || !std::isfinite(inPtr->real())|| !std::isfinite(inPtr->imag());
-					if(flagA || flagB)
-						dest[ch] = 0.0;
-					else {
-						// Q = (XX - YY)/2
-						dest[ch] = valA - (*inPtr * (*weightPtr));
-					}
-					
-					weightPtr += polCount - polIndexB;
-					inPtr += polCount - polIndexB;
-					flagPtr += polCount - polIndexB;
-				}
-			}
-			else {
-				// Convert to StokesQ from RR and LL
-				bool hasRL = Polarization::TypeToIndex(Polarization::RL, polsIn, polIndexA);
-				bool hasLR = Polarization::TypeToIndex(Polarization::LR, polsIn, polIndexB);
-				if(!hasRL || !hasLR)
-					throw std::runtime_error("Can not form requested polarization (Stokes Q) from available polarizations");
-				for(size_t ch=0; ch!=selectedChannelCount; ++ch)
-				{
-					weightPtr += polIndexA;
-					inPtr += polIndexA;
-					flagPtr += polIndexA;
-					
-					bool flagA = *flagPtr || !std::isfinite(inPtr->real())|| !std::isfinite(inPtr->imag());
-					casacore::Complex valA = *inPtr * (*weightPtr);
-					
-					weightPtr += polIndexB - polIndexA;
-					inPtr += polIndexB - polIndexA;
-					flagPtr += polIndexB - polIndexA;
-					
-					bool flagB = *flagPtr || !std::isfinite(inPtr->real()) || !std::isfinite(inPtr->imag());
-					if(flagA || flagB)
-						dest[ch] = 0.0;
-					else {
-						// Q = (RL + LR)/2
-						dest[ch] = (*inPtr * (*weightPtr)) + valA;
-					}
-					
-					weightPtr += polCount - polIndexB;
-					inPtr += polCount - polIndexB;
-					flagPtr += polCount - polIndexB;
-				}
-			}
-		} break;
-		case Polarization::StokesU: {
-			size_t polIndexA=0, polIndexB=0;
-			bool hasXY = Polarization::TypeToIndex(Polarization::XY, polsIn, polIndexA);
-			bool hasYX = Polarization::TypeToIndex(Polarization::YX, polsIn, polIndexB);
-			if(hasXY && hasYX)
-			{
-				// Convert to StokesU from XY and YX
-				for(size_t ch=0; ch!=selectedChannelCount; ++ch)
-				{
-					weightPtr += polIndexA;
-					inPtr += polIndexA;
-					flagPtr += polIndexA;
-					
-					bool flagA = *flagPtr || !std::isfinite(inPtr->real())|| !std::isfinite(inPtr->imag());
-					casacore::Complex valA = *inPtr * (*weightPtr);
-					
-					weightPtr += polIndexB - polIndexA;
-					inPtr += polIndexB - polIndexA;
-					flagPtr += polIndexB - polIndexA;
-					
-					bool flagB = *flagPtr || !std::isfinite(inPtr->real())|| !std::isfinite(inPtr->imag());
-					if(flagA || flagB)
-						dest[ch] = 0.0;
-					else
-						dest[ch] = valA + (*inPtr * (*weightPtr)); // U = (XY + YX)/2
-					
-					weightPtr += polCount - polIndexB;
-					inPtr += polCount - polIndexB;
-					flagPtr += polCount - polIndexB;
-				}
-			}
-			else {
-				// Convert to StokesU from RR and LL
-				bool hasRL = Polarization::TypeToIndex(Polarization::RL, polsIn, polIndexA);
-				bool hasLR = Polarization::TypeToIndex(Polarization::LR, polsIn, polIndexB);
-				if(!hasRL || !hasLR)
-					throw std::runtime_error("Can not form requested polarization (Stokes U) from available polarizations");
-				for(size_t ch=0; ch!=selectedChannelCount; ++ch)
-				{
-					weightPtr += polIndexA;
-					inPtr += polIndexA;
-					flagPtr += polIndexA;
-					
-					bool flagA = *flagPtr || !std::isfinite(inPtr->real())|| !std::isfinite(inPtr->imag());
-					casacore::Complex valA = *inPtr * (*weightPtr);
-					
-					weightPtr += polIndexB - polIndexA;
-					inPtr += polIndexB - polIndexA;
-					flagPtr += polIndexB - polIndexA;
-					
-					bool flagB = *flagPtr || !std::isfinite(inPtr->real())|| !std::isfinite(inPtr->imag());
-					if(flagA || flagB)
-						dest[ch] = 0.0;
-					else {
-						casacore::Complex diff = (valA - *inPtr * (*weightPtr));
-						// U = -i (RL - LR)/2
-						dest[ch] = casacore::Complex(diff.imag(), -diff.real());
-					}
-					
-					weightPtr += polCount - polIndexB;
-					inPtr += polCount - polIndexB;
-					flagPtr += polCount - polIndexB;
-				}
-			}
-		} break;
-		case Polarization::StokesV: {
-			size_t polIndexA=0, polIndexB=0;
-			bool hasXY = Polarization::TypeToIndex(Polarization::XY, polsIn, polIndexA);
-			bool hasYX = Polarization::TypeToIndex(Polarization::YX, polsIn, polIndexB);
-			if(hasXY && hasYX)
-			{
-				// Convert to StokesV from XX and YY
-				for(size_t ch=0; ch!=selectedChannelCount; ++ch)
-				{
-					weightPtr += polIndexA;
-					inPtr += polIndexA;
-					flagPtr += polIndexA;
-					
-					bool flagA = *flagPtr || !std::isfinite(inPtr->real())|| !std::isfinite(inPtr->imag());
-					casacore::Complex valA = *inPtr * (*weightPtr);
-					
-					weightPtr += polIndexB - polIndexA;
-					inPtr += polIndexB - polIndexA;
-					flagPtr += polIndexB - polIndexA;
-					
-					bool flagB = *flagPtr || !std::isfinite(inPtr->real())|| !std::isfinite(inPtr->imag());
-					if(flagA || flagB)
-						dest[ch] = 0.0;
-					else {
-						casacore::Complex diff = valA - (*inPtr * (*weightPtr));
-						// V = -i(XY - YX)/2
-						dest[ch] = casacore::Complex(diff.imag(), -diff.real());
-					}
-					
-					weightPtr += polCount - polIndexB;
-					inPtr += polCount - polIndexB;
-					flagPtr += polCount - polIndexB;
-				}
-			}
-			else {
-				// Convert to StokesV from RR and LL
-				bool hasRL = Polarization::TypeToIndex(Polarization::RR, polsIn, polIndexA);
-				bool hasLR = Polarization::TypeToIndex(Polarization::LL, polsIn, polIndexB);
-				if(!hasRL || !hasLR)
-					throw std::runtime_error("Can not form requested polarization (Stokes V) from available polarizations");
-				for(size_t ch=0; ch!=selectedChannelCount; ++ch)
-				{
-					weightPtr += polIndexA;
-					inPtr += polIndexA;
-					flagPtr += polIndexA;
-					
-					bool flagA = *flagPtr || !std::isfinite(inPtr->real())|| !std::isfinite(inPtr->imag());
-					casacore::Complex valA = *inPtr * (*weightPtr);
-					
-					weightPtr += polIndexB - polIndexA;
-					inPtr += polIndexB - polIndexA;
-					flagPtr += polIndexB - polIndexA;
-					
-					bool flagB = *flagPtr || !std::isfinite(inPtr->real())|| !std::isfinite(inPtr->imag());
-					if(flagA || flagB)
-						dest[ch] = 0.0;
-					else {
-						// V = (RR - LL)/2
-						dest[ch] = valA - *inPtr * (*weightPtr);
-					}
-					
-					weightPtr += polCount - polIndexB;
-					inPtr += polCount - polIndexB;
-					flagPtr += polCount - polIndexB;
-				}
-			}
-		} break;
-		default:
-			throw std::runtime_error("Could not convert ms polarizations to requested polarization");
-		}
-	}
-}
-
-template<typename NumType>
-void MSProvider::copyWeights(NumType* dest, size_t startChannel, size_t endChannel, const std::vector<PolarizationEnum>& polsIn, const casacore::Array<std::complex<float>>& data, const casacore::Array<float>& weights, const casacore::Array<bool>& flags, PolarizationEnum polOut)
-{
-	const size_t polCount = polsIn.size();
-	casacore::Array<std::complex<float> >::const_contiter inPtr = data.cbegin() + startChannel * polCount;
-	casacore::Array<float>::const_contiter weightPtr = weights.cbegin() + startChannel * polCount;
-	casacore::Array<bool>::const_contiter flagPtr = flags.cbegin() + startChannel * polCount;
-	const size_t selectedChannelCount = endChannel - startChannel;
-		
-	size_t polIndex;
-	if(polOut == Polarization::Instrumental)
-	{
-		for(size_t ch=0; ch!=selectedChannelCount * polsIn.size(); ++ch)
-		{
-			if(!*flagPtr && std::isfinite(inPtr->real()) && std::isfinite(inPtr->imag()))
-				dest[ch] = *weightPtr;
-			else
-				dest[ch] = 0;
-			inPtr++;
-			weightPtr++;
-			flagPtr++;
-		}
-	}
-	else if(Polarization::TypeToIndex(polOut, polsIn, polIndex)) {
-		inPtr += polIndex;
-		weightPtr += polIndex;
-		flagPtr += polIndex;
-		for(size_t ch=0; ch!=selectedChannelCount; ++ch)
-		{
-			if(!*flagPtr && std::isfinite(inPtr->real()) && std::isfinite(inPtr->imag()))
-				dest[ch] = *weightPtr;
-			else
-				dest[ch] = 0;
-			inPtr += polCount;
-			weightPtr += polCount;
-			flagPtr += polCount;
-		}
-	}
-	else {
-		size_t polIndexA=0, polIndexB=0;
-		switch(polOut) {
-			case Polarization::StokesI: {
-				bool hasXY = Polarization::TypeToIndex(Polarization::XX, polsIn, polIndexA);
-				bool hasYX = Polarization::TypeToIndex(Polarization::YY, polsIn, polIndexB);
-				if(!hasXY || !hasYX) {
-					Polarization::TypeToIndex(Polarization::RR, polsIn, polIndexA);
-					Polarization::TypeToIndex(Polarization::LL, polsIn, polIndexB);
-				}
-			}
-			break;
-			case Polarization::StokesQ: {
-				bool hasXX = Polarization::TypeToIndex(Polarization::XX, polsIn, polIndexA);
-				bool hasYY = Polarization::TypeToIndex(Polarization::YY, polsIn, polIndexB);
-				if(!hasXX || !hasYY) {
-					Polarization::TypeToIndex(Polarization::RL, polsIn, polIndexA);
-					Polarization::TypeToIndex(Polarization::LR, polsIn, polIndexB);
-				}
-			}
-			break;
-			case Polarization::StokesU: {
-				bool hasXY = Polarization::TypeToIndex(Polarization::XY, polsIn, polIndexA);
-				bool hasYX = Polarization::TypeToIndex(Polarization::YX, polsIn, polIndexB);
-				if(!hasXY || !hasYX) {
-					Polarization::TypeToIndex(Polarization::RL, polsIn, polIndexA);
-					Polarization::TypeToIndex(Polarization::LR, polsIn, polIndexB);
-				}
-			}
-			break;
-			case Polarization::StokesV: {
-				bool hasXY = Polarization::TypeToIndex(Polarization::XY, polsIn, polIndexA);
-				bool hasYX = Polarization::TypeToIndex(Polarization::YX, polsIn, polIndexB);
-				if(!hasXY || !hasYX) {
-					Polarization::TypeToIndex(Polarization::RR, polsIn, polIndexA);
-					Polarization::TypeToIndex(Polarization::LL, polsIn, polIndexB);
-				}
-			}
-			break;
-			default:
-				throw std::runtime_error("Could not convert ms polarizations to requested polarization");
-			break;
-		}
-		
-		weightPtr += polIndexA;
-		inPtr += polIndexA;
-		flagPtr += polIndexA;
-		for(size_t ch=0; ch!=selectedChannelCount; ++ch)
-		{
-			if(!*flagPtr && std::isfinite(inPtr->real()) && std::isfinite(inPtr->imag()))
-				dest[ch] = *weightPtr;
-			else
-				dest[ch] = 0;
-			inPtr += polIndexB-polIndexA;
-			weightPtr += polIndexB-polIndexA;
-			flagPtr += polIndexB-polIndexA;
-			if(!*flagPtr && std::isfinite(inPtr->real()) && std::isfinite(inPtr->imag()))
-				dest[ch] += *weightPtr;
-			else
-				dest[ch] = 0.0;
-			weightPtr += polCount - polIndexB + polIndexA;
-			inPtr += polCount - polIndexB + polIndexA;
-			flagPtr += polCount - polIndexB + polIndexA;
-		}
-	}
-}
-
-template
-void MSProvider::copyWeights<float>(float* dest, size_t startChannel, size_t endChannel, const std::vector<PolarizationEnum>& polsIn, const casacore::Array<std::complex<float>>& data, const casacore::Array<float>& weights, const casacore::Array<bool>& flags, PolarizationEnum polOut);
-
-template
-void MSProvider::copyWeights<std::complex<float>>(std::complex<float>* dest, size_t startChannel, size_t endChannel, const std::vector<PolarizationEnum>& polsIn, const casacore::Array<std::complex<float>>& data, const casacore::Array<float>& weights, const casacore::Array<bool>& flags, PolarizationEnum polOut);
-
 void MSProvider::reverseCopyData(casacore::Array<std::complex<float>>& dest, size_t startChannel, size_t endChannel, const std::vector<PolarizationEnum> &polsDest, const std::complex<float>* source, PolarizationEnum polSource)
 {
 	size_t polCount = polsDest.size();
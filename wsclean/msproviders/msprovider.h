@@ -1,6 +1,8 @@
 #ifndef MSPROVIDER_H
 #define MSPROVIDER_H
 
+#include "polarizationconverter.h"
+
 #include "../polarization.h"
 
 #include <casacore/casa/Arrays/Array.h>
@@ -8,6 +10,7 @@
 #include <casacore/tables/Tables/ArrayColumn.h>
 
 #include <complex>
+#include <cstdint>
 #include <set>
 
 namespace casacore {
@@ -62,12 +65,57 @@ public:
 	
 	virtual PolarizationEnum Polarization() = 0;
 	
+	/**
+	 * Sums over a stream of imaging weights, stored together with the weights
+	 * so that a gridder does not have to accumulate them again.
+	 */
+	struct ImagingWeightSums
+	{
+		double totalWeight, visibilityWeightSum, maxGriddedWeight;
+		uint64_t griddedVisibilityCount;
+	};
+	
+	/**
+	 * Imaging weights are the final factors with which the gridder multiplies the
+	 * visibilities, i.e. the combination of the visibility weighting mode and the
+	 * image weighting scheme. Providers that return true here can store these,
+	 * such that they only need to be calculated once.
+	 */
+	virtual bool SupportsImagingWeights() const = 0;
+	
+	/**
+	 * Open the imaging weights that were stored earlier with the same key. After
+	 * this call, @ref ReadImagingWeights() can be used to read the weights of the
+	 * current row.
+	 * @returns false if no imaging weights are stored for this key.
+	 */
+	virtual bool OpenImagingWeights(uint64_t key, ImagingWeightSums& sums) = 0;
+	
+	virtual void ReadImagingWeights(float* buffer) = 0;
+	
+	/**
+	 * Append the imaging weights of the current row. All rows should be written in
+	 * order after a call to @ref Reset(), followed by a call to
+	 * @ref FinishImagingWeights().
+	 */
+	virtual void WriteImagingWeights(const float* buffer) = 0;
+	
+	virtual void FinishImagingWeights(uint64_t key, const ImagingWeightSums& sums) = 0;
+	
 	static std::vector<PolarizationEnum> GetMSPolarizations(casacore::MeasurementSet& ms);
 protected:
-	static void copyWeightedData(std::complex<float>* dest, size_t startChannel, size_t endChannel, const std::vector<PolarizationEnum>& polsIn, const casacore::Array<std::complex<float>>& data, const casacore::Array<float>& weights, const casacore::Array<bool>& flags, PolarizationEnum polOut);
+	static void copyWeightedData(std::complex<float>* dest, size_t startChannel, size_t endChannel, const PolarizationConverter& converter, const casacore::Array<std::complex<float>>& data, const casacore::Array<float>& weights, const casacore::Array<bool>& flags)
+	{
+		const size_t offset = startChannel * converter.InputPolarizationCount();
+		converter.ConvertWeightedData(dest, data.data() + offset, weights.data() + offset, flags.data() + offset, endChannel - startChannel);
+	}
 	
 	template<typename NumType>
-	static void copyWeights(NumType* dest, size_t startChannel, size_t endChannel, const std::vector<PolarizationEnum>& polsIn, const casacore::Array<std::complex<float>>& data, const casacore::Array<float>& weights, const casacore::Array<bool>& flags, PolarizationEnum polOut);
+	static void copyWeights(NumType* dest, size_t startChannel, size_t endChannel, const PolarizationConverter& converter, const casacore::Array<std::complex<float>>& data, const casacore::Array<float>& weights, const casacore::Array<bool>& flags)
+	{
+		const size_t offset = startChannel * converter.InputPolarizationCount();
+		converter.ConvertWeights(dest, data.data() + offset, weights.data() + offset, flags.data() + offset, endChannel - startChannel);
+	}
 	
 	static void reverseCopyData(casacore::Array<std::complex<float>>& dest, size_t startChannel, size_t endChannel, const std::vector<PolarizationEnum>& polsDest, const std::complex<float>* source, PolarizationEnum polSource);
 	
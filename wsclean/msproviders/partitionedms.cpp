@@ -40,6 +40,7 @@ PartitionedMS::PartitionedMS(const Handle& handle, size_t partIndex, Polarizatio
 	_readPtrIsOk(true),
 	_metaPtrIsOk(true),
 	_weightPtrIsOk(true),
+	_imagingWeightPtrIsOk(true),
 	_polarization(polarization)
 {
 	_metaFile.read(reinterpret_cast<char*>(&_metaHeader), sizeof(MetaHeader));
@@ -47,7 +48,8 @@ PartitionedMS::PartitionedMS(const Handle& handle, size_t partIndex, Polarizatio
 	_metaFile.read(msPath.data(), _metaHeader.filenameLength);
 	Logger::Info << "Opening reordered part " << partIndex << " spw " << dataDescId << " for " << msPath.data() << '\n';
 	_msPath = msPath.data();
-	std::string partPrefix = getPartPrefix(msPath.data(), partIndex, polarization, dataDescId, handle._data->_temporaryDirectory);
+	_partPrefix = getPartPrefix(msPath.data(), partIndex, polarization, dataDescId, handle._data->_temporaryDirectory);
+	const std::string& partPrefix = _partPrefix;
 	
 	_dataFile.open(partPrefix+".tmp", std::ios::in);
 	if(!_dataFile.good())
@@ -103,9 +105,12 @@ void PartitionedMS::Reset()
 	_metaFile.seekg(sizeof(MetaHeader) + _metaHeader.filenameLength, std::ios::beg);
 	_dataFile.seekg(sizeof(PartHeader), std::ios::beg);
 	_weightFile.seekg(0, std::ios::beg);
+	if(_imagingWeightFile.is_open())
+		_imagingWeightFile.seekg(sizeof(ImagingWeightHeader), std::ios::beg);
 	_readPtrIsOk = true;
 	_metaPtrIsOk = true;
 	_weightPtrIsOk = true;
+	_imagingWeightPtrIsOk = true;
 }
 
 bool PartitionedMS::CurrentRowAvailable()
@@ -131,6 +136,10 @@ void PartitionedMS::NextRow()
 		if(_weightPtrIsOk && _partHeader.hasWeights)
 			_weightFile.seekg(_partHeader.channelCount * sizeof(float), std::ios::cur);
 		_weightPtrIsOk = true;
+		
+		if(_imagingWeightPtrIsOk && _imagingWeightFile.is_open())
+			_imagingWeightFile.seekg(_partHeader.channelCount * sizeof(float), std::ios::cur);
+		_imagingWeightPtrIsOk = true;
 	}
 }
 
@@ -236,6 +245,73 @@ void PartitionedMS::ReadWeights(float* buffer)
 	_weightPtrIsOk = false;
 }
 
+bool PartitionedMS::OpenImagingWeights(uint64_t key, ImagingWeightSums& sums)
+{
+	if(_imagingWeightFile.is_open())
+		_imagingWeightFile.close();
+	_imagingWeightFile.clear();
+	_imagingWeightFile.open(_partPrefix+"-iw.tmp", std::ios::in);
+	if(!_imagingWeightFile.good())
+	{
+		_imagingWeightFile.close();
+		return false;
+	}
+	ImagingWeightHeader header;
+	_imagingWeightFile.read(reinterpret_cast<char*>(&header), sizeof(ImagingWeightHeader));
+	if(!_imagingWeightFile.good() || header.key != key)
+	{
+		_imagingWeightFile.close();
+		return false;
+	}
+	sums = header.sums;
+	// Position the stream on the current row, so that reading can continue where the
+	// other streams are.
+	_imagingWeightFile.seekg(sizeof(ImagingWeightHeader) + _currentRow * _partHeader.channelCount * sizeof(float), std::ios::beg);
+	_imagingWeightPtrIsOk = true;
+	return true;
+}
+
+void PartitionedMS::ReadImagingWeights(float* buffer)
+{
+	if(!_imagingWeightPtrIsOk)
+		_imagingWeightFile.seekg(-_partHeader.channelCount * sizeof(float), std::ios::cur);
+	_imagingWeightFile.read(reinterpret_cast<char*>(buffer), _partHeader.channelCount * sizeof(float));
+	_imagingWeightPtrIsOk = false;
+}
+
+void PartitionedMS::WriteImagingWeights(const float* buffer)
+{
+	if(_imagingWeightWriteFile == nullptr)
+	{
+		// Any earlier opened weights are about to be overwritten
+		if(_imagingWeightFile.is_open())
+			_imagingWeightFile.close();
+		_imagingWeightWriteFile.reset(new std::ofstream(_partPrefix+"-iw.tmp"));
+		// Write an invalid header first, so that a partially written file is never used.
+		ImagingWeightHeader header;
+		memset(&header, 0, sizeof(ImagingWeightHeader));
+		_imagingWeightWriteFile->write(reinterpret_cast<char*>(&header), sizeof(ImagingWeightHeader));
+	}
+	_imagingWeightWriteFile->write(reinterpret_cast<const char*>(buffer), _partHeader.channelCount * sizeof(float));
+	if(!_imagingWeightWriteFile->good())
+		throw std::runtime_error("Error writing to temporary imaging weights file");
+}
+
+void PartitionedMS::FinishImagingWeights(uint64_t key, const ImagingWeightSums& sums)
+{
+	if(_imagingWeightWriteFile == nullptr)
+		throw std::runtime_error("FinishImagingWeights() called without writing imaging weights");
+	ImagingWeightHeader header;
+	memset(&header, 0, sizeof(ImagingWeightHeader));
+	header.key = key;
+	header.sums = sums;
+	_imagingWeightWriteFile->seekp(0, std::ios::beg);
+	_imagingWeightWriteFile->write(reinterpret_cast<char*>(&header), sizeof(ImagingWeightHeader));
+	if(!_imagingWeightWriteFile->good())
+		throw std::runtime_error("Error writing to temporary imaging weights file");
+	_imagingWeightWriteFile.reset();
+}
+
 std::string PartitionedMS::getPartPrefix(const std::string& msPathStr, size_t partIndex, PolarizationEnum pol, size_t dataDescId, const std::string& tempDir)
 {
 	boost::filesystem::path
@@ -361,6 +437,10 @@ PartitionedMS::Handle PartitionedMS::Partition(const string& msPath, const std::
 		rowProvider.reset(new AveragingMSRowProvider(settings.baselineDependentAveragingInWavelengths, msPath, selection, selectedDataDescIds, dataColumnName, initialModelRequired));
 	
 	std::vector<PolarizationEnum> msPolarizations = GetMSPolarizations(rowProvider->MS());
+	// The conversion for each output polarization, in the order of polsOut
+	std::vector<PolarizationConverter> polarizationConverters;
+	for(std::set<PolarizationEnum>::const_iterator p=polsOut.begin(); p!=polsOut.end(); ++p)
+		polarizationConverters.emplace_back(msPolarizations, *p);
 	
 	const casacore::IPosition shape(rowProvider->DataShape());
 	const size_t polarizationCount = shape[0];
@@ -431,23 +511,23 @@ PartitionedMS::Handle PartitionedMS::Partition(const string& msPath, const std::
 					partStartCh = channels[part].start,
 					partEndCh = channels[part].end;
 				
-				for(std::set<PolarizationEnum>::const_iterator p=polsOut.begin(); p!=polsOut.end(); ++p)
+				for(const PolarizationConverter& converter : polarizationConverters)
 				{
 					PartitionFiles& f = files[fileIndex];
-					copyWeightedData(dataBuffer.data(), partStartCh, partEndCh, msPolarizations, dataArray, weightSpectrumArray, flagArray, *p);
+					copyWeightedData(dataBuffer.data(), partStartCh, partEndCh, converter, dataArray, weightSpectrumArray, flagArray);
 					f.data->write(reinterpret_cast<char*>(dataBuffer.data()), (partEndCh - partStartCh) * sizeof(std::complex<float>) * polarizationsPerFile);
 					if(!f.data->good())
 						throw std::runtime_error("Error writing to temporary data file");
 					
 					if(initialModelRequired)
 					{
-						copyWeightedData(dataBuffer.data(), partStartCh, partEndCh, msPolarizations, modelArray, weightSpectrumArray, flagArray, *p);
+						copyWeightedData(dataBuffer.data(), partStartCh, partEndCh, converter, modelArray, weightSpectrumArray, flagArray);
 						f.model->write(reinterpret_cast<char*>(dataBuffer.data()), (partEndCh - partStartCh) * sizeof(std::complex<float>) * polarizationsPerFile);
 						if(!f.model->good())
 							throw std::runtime_error("Error writing to temporary data file");
 					}
 					
-					copyWeights(weightBuffer.data(), partStartCh, partEndCh, msPolarizations, dataArray, weightSpectrumArray, flagArray, *p);
+					copyWeights(weightBuffer.data(), partStartCh, partEndCh, converter, dataArray, weightSpectrumArray, flagArray);
 					f.weight->write(reinterpret_cast<char*>(weightBuffer.data()), (partEndCh - partStartCh) * sizeof(float) * polarizationsPerFile);
 					if(!f.weight->good())
 						throw std::runtime_error("Error writing to temporary weights file");
@@ -690,6 +770,7 @@ void PartitionedMS::Handle::decrease()
 				std::remove((prefix + ".tmp").c_str());
 				std::remove((prefix + "-w.tmp").c_str());
 				std::remove((prefix + "-m.tmp").c_str());
+				std::remove((prefix + "-iw.tmp").c_str());
 			}
 			size_t dataDescId = _data->_channels[part].dataDescId;
 			if(removedMetaFiles.count(dataDescId) == 0)
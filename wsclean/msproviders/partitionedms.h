@@ -72,7 +72,17 @@ public:
 	virtual void MakeIdToMSRowMapping(std::vector<size_t>& idToMSRow) final override;
 	
 	virtual PolarizationEnum Polarization() final override { return _polarization; }
-	
+
+	virtual bool SupportsImagingWeights() const final override { return true; }
+
+	virtual bool OpenImagingWeights(uint64_t key, ImagingWeightSums& sums) final override;
+
+	virtual void ReadImagingWeights(float* buffer) final override;
+
+	virtual void WriteImagingWeights(const float* buffer) final override;
+
+	virtual void FinishImagingWeights(uint64_t key, const ImagingWeightSums& sums) final override;
+
 	static Handle Partition(const string& msPath, const std::vector<ChannelRange>& channels, class MSSelection& selection, const string& dataColumnName, bool includeModel, bool initialModelRequired, const class WSCleanSettings& settings);
 	
 	class Handle {
@@ -125,10 +135,12 @@ private:
 	Handle _handle;
 	std::string _msPath;
 	std::unique_ptr<casacore::MeasurementSet> _ms;
-	std::ifstream _metaFile, _weightFile, _dataFile;
+	std::string _partPrefix;
+	std::ifstream _metaFile, _weightFile, _dataFile, _imagingWeightFile;
+	std::unique_ptr<std::ofstream> _imagingWeightWriteFile;
 	char *_modelFileMap;
 	size_t _currentRow;
-	bool _readPtrIsOk, _metaPtrIsOk, _weightPtrIsOk;
+	bool _readPtrIsOk, _metaPtrIsOk, _weightPtrIsOk, _imagingWeightPtrIsOk;
 	ao::uvector<float> _weightBuffer;
 	ao::uvector<std::complex<float>> _modelBuffer;
 	int _fd;
@@ -152,6 +164,11 @@ private:
 		uint32_t dataDescId;
 		bool hasModel, hasWeights;
 	} _partHeader;
+	struct ImagingWeightHeader
+	{
+		uint64_t key;
+		ImagingWeightSums sums;
+	};
 	
 	static std::string getPartPrefix(const std::string& msPath, size_t partIndex, PolarizationEnum pol, size_t dataDescId, const std::string& tempDir);
 	static std::string getMetaFilename(const std::string& msPath, const std::string& tempDir, size_t dataDescId);
@@ -0,0 +1,252 @@
+#include "polarizationconverter.h"
+
+#include <stdexcept>
+
+PolarizationConverter::PolarizationConverter(const std::vector<PolarizationEnum>& polsIn, PolarizationEnum polOut) :
+	_operation(Unsupported),
+	_polCount(polsIn.size()),
+	_indexA(0), _indexB(0),
+	_errorMessage("Could not convert ms polarizations to requested polarization")
+{
+	if(polOut == Polarization::Instrumental)
+		_operation = Copy;
+	else if(Polarization::TypeToIndex(polOut, polsIn, _indexA))
+		_operation = Select;
+	else {
+		switch(polOut)
+		{
+		case Polarization::StokesI:
+			// I = (XX + YY)/2 or (RR + LL)/2
+			if(findPair(polsIn, Polarization::XX, Polarization::YY) || findPair(polsIn, Polarization::RR, Polarization::LL))
+				_operation = Sum;
+			else
+				_errorMessage = "Can not form requested polarization (Stokes I) from available polarizations";
+			break;
+		case Polarization::StokesQ:
+			// Q = (XX - YY)/2 or (RL + LR)/2
+			if(findPair(polsIn, Polarization::XX, Polarization::YY))
+				_operation = Difference;
+			else if(findPair(polsIn, Polarization::RL, Polarization::LR))
+				_operation = Sum;
+			else
+				_errorMessage = "Can not form requested polarization (Stokes Q) from available polarizations";
+			break;
+		case Polarization::StokesU:
+			// U = (XY + YX)/2 or -i (RL - LR)/2
+			if(findPair(polsIn, Polarization::XY, Polarization::YX))
+				_operation = Sum;
+			else if(findPair(polsIn, Polarization::RL, Polarization::LR))
+				_operation = RotatedDifference;
+			else
+				_errorMessage = "Can not form requested polarization (Stokes U) from available polarizations";
+			break;
+		case Polarization::StokesV:
+			// V = -i (XY - YX)/2 or (RR - LL)/2
+			if(findPair(polsIn, Polarization::XY, Polarization::YX))
+				_operation = RotatedDifference;
+			else if(findPair(polsIn, Polarization::RR, Polarization::LL))
+				_operation = Difference;
+			else
+				_errorMessage = "Can not form requested polarization (Stokes V) from available polarizations";
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+bool PolarizationConverter::findPair(const std::vector<PolarizationEnum>& polsIn, PolarizationEnum polA, PolarizationEnum polB)
+{
+	size_t indexA, indexB;
+	if(Polarization::TypeToIndex(polA, polsIn, indexA) && Polarization::TypeToIndex(polB, polsIn, indexB))
+	{
+		_indexA = indexA;
+		_indexB = indexB;
+		return true;
+	}
+	else {
+		return false;
+	}
+}
+
+void PolarizationConverter::ConvertWeightedData(std::complex<float>* dest, const std::complex<float>* data, const float* weights, const bool* flags, size_t channelCount) const
+{
+	switch(_operation)
+	{
+	case Copy:
+		// All values are treated as if they were single-polarization channels
+		convertWeightedData<Select, 1, 0, 0>(dest, data, weights, flags, channelCount * _polCount, 0, 0, 0);
+		break;
+	case Select:
+		dispatchWeightedData<Select>(dest, data, weights, flags, channelCount);
+		break;
+	case Sum:
+		dispatchWeightedData<Sum>(dest, data, weights, flags, channelCount);
+		break;
+	case Difference:
+		dispatchWeightedData<Difference>(dest, data, weights, flags, channelCount);
+		break;
+	case RotatedDifference:
+		dispatchWeightedData<RotatedDifference>(dest, data, weights, flags, channelCount);
+		break;
+	case Unsupported:
+		throw std::runtime_error(_errorMessage);
+	}
+}
+
+template<typename NumType>
+void PolarizationConverter::ConvertWeights(NumType* dest, const std::complex<float>* data, const float* weights, const bool* flags, size_t channelCount) const
+{
+	switch(_operation)
+	{
+	case Copy:
+		convertWeights<Select, 1, 0, 0>(dest, data, weights, flags, channelCount * _polCount, 0, 0, 0);
+		break;
+	case Select:
+		dispatchWeights<Select>(dest, data, weights, flags, channelCount);
+		break;
+	case Sum:
+	case Difference:
+	case RotatedDifference:
+		// The weights of all combinations are the same
+		dispatchWeights<Sum>(dest, data, weights, flags, channelCount);
+		break;
+	case Unsupported:
+		throw std::runtime_error(_errorMessage);
+	}
+}
+
+/**
+ * The common layouts are specialized with compile-time indices, which the compiler
+ * needs to vectorize the strided access: one polarization selected from four, or
+ * combined from the outer (XX/YY, RR/LL) or inner (XY/YX, RL/LR) pair of four, or
+ * from two polarizations.
+ */
+template<PolarizationConverter::Operation Op>
+void PolarizationConverter::dispatchWeightedData(std::complex<float>* dest, const std::complex<float>* data, const float* weights, const bool* flags, size_t channelCount) const
+{
+	if(Op == Select && _polCount == 4)
+	{
+		switch(_indexA)
+		{
+		case 0: convertWeightedData<Op, 4, 0, 0>(dest, data, weights, flags, channelCount, 0, 0, 0); return;
+		case 1: convertWeightedData<Op, 4, 1, 0>(dest, data, weights, flags, channelCount, 0, 0, 0); return;
+		case 2: convertWeightedData<Op, 4, 2, 0>(dest, data, weights, flags, channelCount, 0, 0, 0); return;
+		case 3: convertWeightedData<Op, 4, 3, 0>(dest, data, weights, flags, channelCount, 0, 0, 0); return;
+		}
+	}
+	else if(Op != Select && _polCount == 4 && _indexA == 0 && _indexB == 3)
+		convertWeightedData<Op, 4, 0, 3>(dest, data, weights, flags, channelCount, 0, 0, 0);
+	else if(Op != Select && _polCount == 4 && _indexA == 1 && _indexB == 2)
+		convertWeightedData<Op, 4, 1, 2>(dest, data, weights, flags, channelCount, 0, 0, 0);
+	else if(Op != Select && _polCount == 2 && _indexA == 0 && _indexB == 1)
+		convertWeightedData<Op, 2, 0, 1>(dest, data, weights, flags, channelCount, 0, 0, 0);
+	else
+		convertWeightedData<Op, 0, 0, 0>(dest, data, weights, flags, channelCount, _polCount, _indexA, _indexB);
+}
+
+template<PolarizationConverter::Operation Op, typename NumType>
+void PolarizationConverter::dispatchWeights(NumType* dest, const std::complex<float>* data, const float* weights, const bool* flags, size_t channelCount) const
+{
+	if(Op == Select && _polCount == 4)
+	{
+		switch(_indexA)
+		{
+		case 0: convertWeights<Op, 4, 0, 0>(dest, data, weights, flags, channelCount, 0, 0, 0); return;
+		case 1: convertWeights<Op, 4, 1, 0>(dest, data, weights, flags, channelCount, 0, 0, 0); return;
+		case 2: convertWeights<Op, 4, 2, 0>(dest, data, weights, flags, channelCount, 0, 0, 0); return;
+		case 3: convertWeights<Op, 4, 3, 0>(dest, data, weights, flags, channelCount, 0, 0, 0); return;
+		}
+	}
+	else if(Op != Select && _polCount == 4 && _indexA == 0 && _indexB == 3)
+		convertWeights<Op, 4, 0, 3>(dest, data, weights, flags, channelCount, 0, 0, 0);
+	else if(Op != Select && _polCount == 4 && _indexA == 1 && _indexB == 2)
+		convertWeights<Op, 4, 1, 2>(dest, data, weights, flags, channelCount, 0, 0, 0);
+	else if(Op != Select && _polCount == 2 && _indexA == 0 && _indexB == 1)
+		convertWeights<Op, 2, 0, 1>(dest, data, weights, flags, channelCount, 0, 0, 0);
+	else
+		convertWeights<Op, 0, 0, 0>(dest, data, weights, flags, channelCount, _polCount, _indexA, _indexB);
+}
+
+/**
+ * PolCount is the number of input polarizations, or 0 when the layout is only known at
+ * run time, in which case polCount, indexA and indexB are used instead of the template
+ * parameters. The complex values are accessed as pairs of floats and the flags as bytes,
+ * and invalid values are zeroed with a bit mask instead of a branch. This allows the
+ * compiler to vectorize the loops.
+ */
+template<PolarizationConverter::Operation Op, size_t PolCount, size_t IndexA, size_t IndexB>
+void PolarizationConverter::convertWeightedData(std::complex<float>* dest, const std::complex<float>* data, const float* weights, const bool* flags, size_t channelCount, size_t polCount, size_t indexA, size_t indexB)
+{
+	const size_t
+		stride = (PolCount == 0) ? polCount : PolCount,
+		offsetA = (PolCount == 0) ? indexA : IndexA,
+		offsetB = (PolCount == 0) ? indexB : IndexB;
+	const float* values = reinterpret_cast<const float*>(data);
+	const unsigned char* flagBytes = reinterpret_cast<const unsigned char*>(flags);
+	float* output = reinterpret_cast<float*>(dest);
+	for(size_t ch=0; ch!=channelCount; ++ch)
+	{
+		const size_t a = ch*stride + offsetA;
+		const float realA = values[a*2] * weights[a], imagA = values[a*2+1] * weights[a];
+		uint32_t mask = validityMask(flagBytes[a], values[a*2], values[a*2+1]);
+		float real, imag;
+		if(Op == Select)
+		{
+			real = realA;
+			imag = imagA;
+		}
+		else {
+			const size_t b = ch*stride + offsetB;
+			const float realB = values[b*2] * weights[b], imagB = values[b*2+1] * weights[b];
+			mask &= validityMask(flagBytes[b], values[b*2], values[b*2+1]);
+			if(Op == Sum)
+			{
+				real = realA + realB;
+				imag = imagA + imagB;
+			}
+			else if(Op == Difference)
+			{
+				real = realA - realB;
+				imag = imagA - imagB;
+			}
+			else {
+				real = imagA - imagB;
+				imag = realB - realA;
+			}
+		}
+		output[ch*2] = applyMask(real, mask);
+		output[ch*2+1] = applyMask(imag, mask);
+	}
+}
+
+template<PolarizationConverter::Operation Op, size_t PolCount, size_t IndexA, size_t IndexB, typename NumType>
+void PolarizationConverter::convertWeights(NumType* dest, const std::complex<float>* data, const float* weights, const bool* flags, size_t channelCount, size_t polCount, size_t indexA, size_t indexB)
+{
+	const size_t
+		stride = (PolCount == 0) ? polCount : PolCount,
+		offsetA = (PolCount == 0) ? indexA : IndexA,
+		offsetB = (PolCount == 0) ? indexB : IndexB;
+	const float* values = reinterpret_cast<const float*>(data);
+	const unsigned char* flagBytes = reinterpret_cast<const unsigned char*>(flags);
+	for(size_t ch=0; ch!=channelCount; ++ch)
+	{
+		const size_t a = ch*stride + offsetA;
+		const float weightA = applyMask(weights[a], validityMask(flagBytes[a], values[a*2], values[a*2+1]));
+		if(Op == Select)
+		{
+			dest[ch] = weightA;
+		}
+		else {
+			// When only A is invalid, the weight of B is kept
+			const size_t b = ch*stride + offsetB;
+			dest[ch] = applyMask(weightA + weights[b], validityMask(flagBytes[b], values[b*2], values[b*2+1]));
+		}
+	}
+}
+
+template
+void PolarizationConverter::ConvertWeights<float>(float* dest, const std::complex<float>* data, const float* weights, const bool* flags, size_t channelCount) const;
+
+template
+void PolarizationConverter::ConvertWeights<std::complex<float>>(std::complex<float>* dest, const std::complex<float>* data, const float* weights, const bool* flags, size_t channelCount) const;
@@ -0,0 +1,124 @@
+#ifndef POLARIZATION_CONVERTER_H
+#define POLARIZATION_CONVERTER_H
+
+#include "../polarization.h"
+
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+/**
+ * Converts the visibilities and weights of a row from the polarizations of a
+ * measurement set to a requested output polarization. Which input polarizations
+ * are combined, and how, is decided once in the constructor. The conversion itself
+ * is a loop without branches over the channels, specialized for the common
+ * layouts of two and four input polarizations, such that the compiler can vectorize it.
+ *
+ * Visibilities are multiplied by their weight. Note that many conversions require
+ * dividing by two, e.g. I = (XX + YY)/2. This division is done with weighting, so
+ * weighted I = (w1 XX + w2 YY), which is given a weight (w1 + w2),
+ * and hence unweighted I = (w1 XX + w2 YY) / (w1 + w2), which if
+ * w1 = w2 results in I = (XX + YY) / 2.
+ * A visibility is set to zero when one of its input values is flagged or not finite.
+ */
+class PolarizationConverter
+{
+public:
+	/**
+	 * @param polsIn The polarizations of the measurement set, in the order in which they are stored.
+	 * @param polOut The requested polarization. When it is Polarization::Instrumental, all
+	 * input polarizations are copied.
+	 */
+	PolarizationConverter(const std::vector<PolarizationEnum>& polsIn, PolarizationEnum polOut);
+	
+	/**
+	 * Number of output values per channel: the number of input polarizations when
+	 * all polarizations are copied, and one otherwise.
+	 */
+	size_t OutputPolarizationCount() const { return _operation == Copy ? _polCount : 1; }
+	
+	size_t InputPolarizationCount() const { return _polCount; }
+	
+	/**
+	 * Convert the weighted visibilities of @p channelCount channels.
+	 * @param data Input visibilities, channelCount x number of input polarizations.
+	 * @param weights Weights, with the same layout as @p data.
+	 * @param flags Flags, with the same layout as @p data.
+	 * @param dest Output, channelCount x OutputPolarizationCount().
+	 * @throws std::runtime_error when the output polarization can not be formed from the input.
+	 */
+	void ConvertWeightedData(std::complex<float>* dest, const std::complex<float>* data, const float* weights, const bool* flags, size_t channelCount) const;
+	
+	/**
+	 * Convert the weights of @p channelCount channels. The weight of a combined
+	 * polarization is the sum of the weights of the valid inputs, or zero when the
+	 * second input is invalid.
+	 * @param data Input visibilities, which are only used to check whether they are finite.
+	 */
+	template<typename NumType>
+	void ConvertWeights(NumType* dest, const std::complex<float>* data, const float* weights, const bool* flags, size_t channelCount) const;
+
+private:
+	enum Operation {
+		// Copy all input polarizations
+		Copy,
+		// Select one of the input polarizations
+		Select,
+		// A + B
+		Sum,
+		// A - B
+		Difference,
+		// -i (A - B)
+		RotatedDifference,
+		// The requested polarization can not be formed
+		Unsupported
+	};
+	
+	template<Operation Op, size_t PolCount, size_t IndexA, size_t IndexB>
+	static void convertWeightedData(std::complex<float>* dest, const std::complex<float>* data, const float* weights, const bool* flags, size_t channelCount, size_t polCount, size_t indexA, size_t indexB);
+	
+	template<Operation Op, size_t PolCount, size_t IndexA, size_t IndexB, typename NumType>
+	static void convertWeights(NumType* dest, const std::complex<float>* data, const float* weights, const bool* flags, size_t channelCount, size_t polCount, size_t indexA, size_t indexB);
+	
+	template<Operation Op>
+	void dispatchWeightedData(std::complex<float>* dest, const std::complex<float>* data, const float* weights, const bool* flags, size_t channelCount) const;
+	
+	template<Operation Op, typename NumType>
+	void dispatchWeights(NumType* dest, const std::complex<float>* data, const float* weights, const bool* flags, size_t channelCount) const;
+	
+	bool findPair(const std::vector<PolarizationEnum>& polsIn, PolarizationEnum polA, PolarizationEnum polB);
+	
+	/**
+	 * Returns an all-ones mask when the value is valid, and zero otherwise. Unlike
+	 * std::isfinite(), the comparisons vectorize: they are false for NaN and infinity.
+	 */
+	static uint32_t validityMask(unsigned char flag, float real, float imag)
+	{
+		return -uint32_t((flag == 0) &
+			(std::abs(real) <= std::numeric_limits<float>::max()) &
+			(std::abs(imag) <= std::numeric_limits<float>::max()));
+	}
+	
+	/**
+	 * Zero the value unless the mask is all ones. Selecting with a condition would
+	 * make the compiler skip loading the value when it is not used, which prevents
+	 * vectorization of the strided loads.
+	 */
+	static float applyMask(float value, uint32_t mask)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(float));
+		bits &= mask;
+		memcpy(&value, &bits, sizeof(float));
+		return value;
+	}
+	
+	Operation _operation;
+	size_t _polCount, _indexA, _indexB;
+	const char* _errorMessage;
+};
+
+#endif
@@ -30,6 +30,8 @@ public:
 	
 	size_t FieldId() const { return _fieldId; }
 	
+	size_t BandId() const { return _bandId; }
+	
 	double MinUVWInM() const { return _minUVWInM; }
 	double MaxUVWInM() const { return _maxUVWInM; }
 	
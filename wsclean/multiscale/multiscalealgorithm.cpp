@@ -7,6 +7,7 @@
 #include "../deconvolution/simpleclean.h"
 
 #include "../fftwmultithreadenabler.h"
+#include "../fnvhash.h"
 
 #include "../wsclean/logger.h"
 
@@ -26,7 +27,9 @@ MultiScaleAlgorithm::MultiScaleAlgorithm(ImageBufferAllocator& allocator, double
 	_multiscaleNormalizeResponse(false),
 	_scaleShape(MultiScaleTransforms::TaperedQuadraticShape),
 	_trackPerScaleMasks(false), _usePerScaleMasks(false),
-	_fastSubMinorLoop(true), _trackComponents(false)
+	_fastSubMinorLoop(true), _trackComponents(false),
+	_psfCacheWidth(0), _psfCacheHeight(0),
+	_psfCacheShape(MultiScaleTransforms::TaperedQuadraticShape)
 {
 }
 
@@ -97,18 +100,33 @@ void MultiScaleAlgorithm::ExecuteMajorIteration(ImageSet& dirtySet, ImageSet& mo
 	_allocator.Allocate(_convolutionWidth*_convolutionHeight, scratch);
 	_allocator.Allocate(_convolutionWidth*_convolutionHeight, scratchB);
 	_allocator.Allocate(_width*_height, integratedScratch);
-	std::unique_ptr<std::unique_ptr<ImageBufferAllocator::Ptr[]>[]> convolvedPSFs(
-		new std::unique_ptr<ImageBufferAllocator::Ptr[]>[dirtySet.PSFCount()]);
-	dirtySet.GetIntegratedPSF(integratedScratch.data(), psfs);
-	convolvePSFs(convolvedPSFs[0], integratedScratch.data(), scratch.data(), true);
-
-	// If there's only one, the integrated equals the first, so we can skip this
-	if(dirtySet.PSFCount() > 1)
+	// The psfs are normally the same in every major iteration, so the convolved
+	// psfs of the previous iteration can be reused when they have not changed.
+	if(isPSFCacheValid(psfs))
 	{
-		for(size_t i=0; i!=dirtySet.PSFCount(); ++i)
+		Logger::Debug << "Reusing scale-convolved psfs of previous major iteration.\n";
+		for(ScaleInfo& scaleEntry : _scaleInfos)
+			scaleEntry.isActive = true;
+	}
+	else {
+		_convolvedPSFs.reset(new std::unique_ptr<ImageBufferAllocator::Ptr[]>[dirtySet.PSFCount()]);
+		dirtySet.GetIntegratedPSF(integratedScratch.data(), psfs);
+		convolvePSFs(_convolvedPSFs[0], integratedScratch.data(), scratch.data(), true);
+		
+		// If there's only one, the integrated equals the first, so we can skip this
+		if(dirtySet.PSFCount() > 1)
 		{
-			convolvePSFs(convolvedPSFs[i], psfs[i], scratch.data(), false);
+			for(size_t i=0; i!=dirtySet.PSFCount(); ++i)
+			{
+				convolvePSFs(_convolvedPSFs[i], psfs[i], scratch.data(), false);
+			}
 		}
+		
+		// The double-convolved psfs are calculated when a scale is first cleaned
+		_doubleConvolvedPSFs.reset(new std::unique_ptr<ImageBufferAllocator::Ptr[]>[dirtySet.PSFCount()]);
+		for(size_t i=0; i!=dirtySet.PSFCount(); ++i)
+			_doubleConvolvedPSFs[i].reset(new ImageBufferAllocator::Ptr[_scaleInfos.size()]);
+		storePSFCacheKey(psfs);
 	}
 	
 	MultiScaleTransforms msTransforms(_width, _height, _scaleShape);
@@ -124,13 +142,6 @@ void MultiScaleAlgorithm::ExecuteMajorIteration(ImageSet& dirtySet, ImageSet& mo
 		<< FluxDensity::ToNiceString(_scaleInfos[scaleWithPeak].maxUnnormalizedImageValue * _scaleInfos[scaleWithPeak].biasFactor)
 		<< ", major iteration threshold=" << FluxDensity::ToNiceString(firstThreshold) << "\n";
 	
-	std::unique_ptr<ImageBufferAllocator::Ptr[]> doubleConvolvedPSFs(
-		new ImageBufferAllocator::Ptr[dirtySet.PSFCount()]);
-	for(size_t i=0; i!=dirtySet.PSFCount(); ++i)
-	{
-		_allocator.Allocate(_width*_height, doubleConvolvedPSFs[i]);
-	}
-	
 	ImageSet individualConvolvedImages(&dirtySet.Table(), dirtySet.Allocator(), dirtySet.ChannelsInDeconvolution(), dirtySet.SquareJoinedChannels(), _width, _height);
 	
 	//
@@ -142,12 +153,18 @@ void MultiScaleAlgorithm::ExecuteMajorIteration(ImageSet& dirtySet, ImageSet& mo
 		(!StopOnNegativeComponents() || _scaleInfos[scaleWithPeak].maxUnnormalizedImageValue>=0.0) )
 	{
 		// Create double-convolved PSFs & individually convolved images for this scale
+		// (double-convolved PSFs of earlier sub-minor loops and major iterations are reused)
 		ao::uvector<double*> transformList;
 		for(size_t i=0; i!=dirtySet.PSFCount(); ++i)
 		{
-			double* psf = getConvolvedPSF(i, scaleWithPeak, psfs, scratch.data(), convolvedPSFs);
-			memcpy(doubleConvolvedPSFs[i].data(), psf, _width*_height*sizeof(double));
-			transformList.push_back(doubleConvolvedPSFs[i].data());
+			ImageBufferAllocator::Ptr& doubleConvolvedPSF = _doubleConvolvedPSFs[i][scaleWithPeak];
+			if(!doubleConvolvedPSF)
+			{
+				double* psf = getConvolvedPSF(i, scaleWithPeak, psfs, scratch.data(), _convolvedPSFs);
+				_allocator.Allocate(_width*_height, doubleConvolvedPSF);
+				memcpy(doubleConvolvedPSF.data(), psf, _width*_height*sizeof(double));
+				transformList.push_back(doubleConvolvedPSF.data());
+			}
 		}
 		for(size_t i=0; i!=dirtySet.size(); ++i)
 		{
@@ -179,6 +196,7 @@ void MultiScaleAlgorithm::ExecuteMajorIteration(ImageSet& dirtySet, ImageSet& mo
 			clarkLoop.SetGain(_scaleInfos[scaleWithPeak].gain);
 			clarkLoop.SetAllowNegativeComponents(AllowNegativeComponents());
 			clarkLoop.SetStopOnNegativeComponent(StopOnNegativeComponents());
+			clarkLoop.SetThreadCount(_threadCount);
 			const size_t
 				scaleBorder = size_t(ceil(_scaleInfos[scaleWithPeak].scale*0.5)),
 				horBorderSize = std::max<size_t>(round(width * _cleanBorderRatio), scaleBorder),
@@ -194,7 +212,7 @@ void MultiScaleAlgorithm::ExecuteMajorIteration(ImageSet& dirtySet, ImageSet& mo
 			
 			ao::uvector<const double*> clarkPSFs(dirtySet.PSFCount());
 			for(size_t psfIndex=0; psfIndex!=clarkPSFs.size(); ++psfIndex)
-				clarkPSFs[psfIndex] = doubleConvolvedPSFs[psfIndex].data();
+				clarkPSFs[psfIndex] = _doubleConvolvedPSFs[psfIndex][scaleWithPeak].data();
 			
 			clarkLoop.Run(individualConvolvedImages, clarkPSFs);
 			
@@ -205,7 +223,7 @@ void MultiScaleAlgorithm::ExecuteMajorIteration(ImageSet& dirtySet, ImageSet& mo
 			for(size_t imageIndex=0; imageIndex!=dirtySet.size(); ++imageIndex)
 			{
 				// TODO this can be multi-threaded if each thread has its own temporaries
-				double *psf = getConvolvedPSF(dirtySet.PSFIndex(imageIndex), scaleWithPeak, psfs, scratch.data(), convolvedPSFs);
+				double *psf = getConvolvedPSF(dirtySet.PSFIndex(imageIndex), scaleWithPeak, psfs, scratch.data(), _convolvedPSFs);
 				clarkLoop.CorrectResidualDirty(scratch.data(), scratchB.data(), integratedScratch.data(), imageIndex, dirtySet[imageIndex],  psf);
 				
 				clarkLoop.GetFullIndividualModel(imageIndex, scratch.data());
@@ -240,11 +258,11 @@ void MultiScaleAlgorithm::ExecuteMajorIteration(ImageSet& dirtySet, ImageSet& mo
 					// Subtract component from individual, non-deconvolved images
 					componentValues[imgIndex] = componentValues[imgIndex] * maxScaleInfo.gain;
 					
-					double* psf = getConvolvedPSF(dirtySet.PSFIndex(imgIndex), scaleWithPeak, psfs, scratch.data(), convolvedPSFs);
+					double* psf = getConvolvedPSF(dirtySet.PSFIndex(imgIndex), scaleWithPeak, psfs, scratch.data(), _convolvedPSFs);
 					tools->SubtractImage(dirtySet[imgIndex], psf, _width, _height, maxScaleInfo.maxImageValueX, maxScaleInfo.maxImageValueY, componentValues[imgIndex]);
 					
 					// Subtract double convolved PSFs from convolved images
-					tools->SubtractImage(individualConvolvedImages[imgIndex], doubleConvolvedPSFs[dirtySet.PSFIndex(imgIndex)].data(), _width, _height, maxScaleInfo.maxImageValueX, maxScaleInfo.maxImageValueY, componentValues[imgIndex]);
+					tools->SubtractImage(individualConvolvedImages[imgIndex], _doubleConvolvedPSFs[dirtySet.PSFIndex(imgIndex)][scaleWithPeak].data(), _width, _height, maxScaleInfo.maxImageValueX, maxScaleInfo.maxImageValueY, componentValues[imgIndex]);
 					// TODO this is incorrect, but why is the residual without Cotton-Schwab still OK ?
 					// Should test
 					//tools->SubtractImage(individualConvolvedImages[imgIndex], psf, _width, _height, maxScaleInfo.maxImageValueX, maxScaleInfo.maxImageValueY, componentValues[imgIndex]);
@@ -520,6 +538,45 @@ void MultiScaleAlgorithm::addComponentToModel(double* model, size_t scaleWithPea
 	}
 }
 
+uint64_t MultiScaleAlgorithm::psfChecksum(const double* psf) const
+{
+	FNVHash checksum;
+	checksum.Add(psf, _width*_height);
+	return checksum.Value();
+}
+
+bool MultiScaleAlgorithm::isPSFCacheValid(const ao::uvector<const double*>& psfs) const
+{
+	if(_convolvedPSFs == nullptr || _psfCacheWidth != _width || _psfCacheHeight != _height ||
+		_psfCacheShape != _scaleShape || _psfCacheChecksums.size() != psfs.size() ||
+		_psfCacheScales.size() != _scaleInfos.size())
+		return false;
+	for(size_t i=0; i!=_scaleInfos.size(); ++i)
+	{
+		if(_psfCacheScales[i] != _scaleInfos[i].scale)
+			return false;
+	}
+	for(size_t i=0; i!=psfs.size(); ++i)
+	{
+		if(_psfCacheChecksums[i] != psfChecksum(psfs[i]))
+			return false;
+	}
+	return true;
+}
+
+void MultiScaleAlgorithm::storePSFCacheKey(const ao::uvector<const double*>& psfs)
+{
+	_psfCacheWidth = _width;
+	_psfCacheHeight = _height;
+	_psfCacheShape = _scaleShape;
+	_psfCacheScales.resize(_scaleInfos.size());
+	for(size_t i=0; i!=_scaleInfos.size(); ++i)
+		_psfCacheScales[i] = _scaleInfos[i].scale;
+	_psfCacheChecksums.resize(psfs.size());
+	for(size_t i=0; i!=psfs.size(); ++i)
+		_psfCacheChecksums[i] = psfChecksum(psfs[i]);
+}
+
 double* MultiScaleAlgorithm::getConvolvedPSF(size_t psfIndex, size_t scaleIndex, const ao::uvector<const double*>& psfs, double* scratch,const std::unique_ptr<std::unique_ptr<ImageBufferAllocator::Ptr[]>[]>& convolvedPSFs)
 {
 	return convolvedPSFs[psfIndex][scaleIndex].data();
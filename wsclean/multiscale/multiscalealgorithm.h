@@ -1,6 +1,7 @@
 #ifndef MULTISCALE_ALGORITHM_H
 #define MULTISCALE_ALGORITHM_H
 
+#include <cstdint>
 #include <cstring>
 #include <vector>
 
@@ -111,7 +112,19 @@ private:
 	bool _trackPerScaleMasks, _usePerScaleMasks, _fastSubMinorLoop, _trackComponents;
 	std::vector<ao::uvector<bool>> _scaleMasks;
 	std::unique_ptr<ComponentList> _componentList;
-
+	
+	/**
+	 * The scale-convolved psfs [psf][scale] and double-convolved psfs [psf][scale] only depend
+	 * on the psfs and the scales, and are kept between major iterations. Double-convolved
+	 * psfs are only calculated for scales that are cleaned; an empty Ptr means it is not calculated yet.
+	 * The cache is invalidated when the checksums of the psfs, the image size or the scales change.
+	 */
+	std::unique_ptr<std::unique_ptr<ImageBufferAllocator::Ptr[]>[]> _convolvedPSFs, _doubleConvolvedPSFs;
+	size_t _psfCacheWidth, _psfCacheHeight;
+	MultiScaleTransforms::Shape _psfCacheShape;
+	ao::uvector<double> _psfCacheScales;
+	ao::uvector<uint64_t> _psfCacheChecksums;
+	
 	void initializeScaleInfo();
 	void convolvePSFs(std::unique_ptr<ImageBufferAllocator::Ptr[]>& convolvedPSFs, const double* psf, double* tmp, bool isIntegrated);
 	void findActiveScaleConvolvedMaxima(const ImageSet& imageSet, double* integratedScratch, double* scratch, bool reportRMS);
@@ -120,6 +133,10 @@ private:
 	void measureComponentValues(ao::uvector<double>& componentValues, size_t scaleIndex, ImageSet& imageSet);
 	void addComponentToModel(double* model, size_t scaleWithPeak, double componentValue);
 	
+	uint64_t psfChecksum(const double* psf) const;
+	bool isPSFCacheValid(const ao::uvector<const double*>& psfs) const;
+	void storePSFCacheKey(const ao::uvector<const double*>& psfs);
+	
 	void findPeakDirect(const double *image, double* scratch, size_t scaleIndex);
 	
 	double* getConvolvedPSF(size_t psfIndex, size_t scaleIndex, const ao::uvector<const double*>& psfs, double* scratch, const std::unique_ptr<std::unique_ptr<ImageBufferAllocator::Ptr[]>[]>& convolvedPSFs);
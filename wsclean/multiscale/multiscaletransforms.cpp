@@ -11,8 +11,9 @@ void MultiScaleTransforms::Transform(const ao::uvector<double*>& images, double*
 	memset(scratch, 0, sizeof(double) * _width * _height);
 	
 	FFTConvolver::PrepareSmallKernel(scratch, _width, _height, shape.data(), kernelSize);
-	for(double*const* imageIter = images.begin(); imageIter!=images.end(); ++imageIter)
-		FFTConvolver::ConvolveSameSize(*imageIter, scratch, _width, _height);
+	FFTConvolver convolver(_width, _height);
+	convolver.SetKernel(scratch);
+	convolver.ConvolveImages(images, 1);
 }
 
 void MultiScaleTransforms::PrepareTransform(double* kernel, double scale)
@@ -25,8 +26,3 @@ void MultiScaleTransforms::PrepareTransform(double* kernel, double scale)
 	
 	FFTConvolver::PrepareSmallKernel(kernel, _width, _height, shape.data(), kernelSize);
 }
-
-void MultiScaleTransforms::FinishTransform(double* image, const double* kernel)
-{
-	FFTConvolver::ConvolveSameSize(image, kernel, _width, _height);
-}
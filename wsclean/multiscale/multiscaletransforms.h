@@ -16,7 +16,6 @@ public:
 	{ }
 	
 	void PrepareTransform(double* kernel, double scale);
-	void FinishTransform(double* image, const double* kernel);
 	
 	void Transform(double* image, double* scratch, double scale)
 	{
@@ -3,6 +3,8 @@
 
 #include "../deconvolution/simpleclean.h"
 
+#include "../fftconvolver.h"
+
 #include "../wsclean/imagebufferallocator.h"
 
 ThreadedDeconvolutionTools::ThreadedDeconvolutionTools(size_t threadCount) :
@@ -73,42 +75,11 @@ ThreadedDeconvolutionTools::ThreadResult* ThreadedDeconvolutionTools::Subtractio
 
 void ThreadedDeconvolutionTools::MultiScaleTransform(MultiScaleTransforms* msTransforms, const ao::uvector<double*>& images, double* scratch, double scale)
 {
-	size_t imageIndex = 0;
-	size_t nextThread = 0;
+	// The kernel is transformed once, after which the images are convolved in parallel
 	msTransforms->PrepareTransform(scratch, scale);
-	while(imageIndex < images.size())
-	{
-		FinishMultiScaleTransformTask* task = new FinishMultiScaleTransformTask();
-		task->msTransforms = msTransforms;
-		task->image = images[imageIndex];
-		task->kernel = scratch;
-		_taskLanes[nextThread]->write(task);
-		
-		++nextThread;
-		if(nextThread == _threadCount)
-		{
-			for(size_t thr=0; thr!=nextThread; ++thr)
-			{
-				ThreadResult* result = 0;
-				_resultLanes[thr]->read(result);
-				delete result;
-			}
-			nextThread = 0;
-		}
-		++imageIndex;
-	}
-	for(size_t thr=0; thr!=nextThread; ++thr)
-	{
-		ThreadResult* result = 0;
-		_resultLanes[thr]->read(result);
-		delete result;
-	}
-}
-
-ThreadedDeconvolutionTools::ThreadResult* ThreadedDeconvolutionTools::FinishMultiScaleTransformTask::operator()()
-{
-	msTransforms->FinishTransform(image, kernel);
-	return 0;
+	FFTConvolver convolver(msTransforms->Width(), msTransforms->Height());
+	convolver.SetKernel(scratch);
+	convolver.ConvolveImages(images, _threadCount);
 }
 
 void ThreadedDeconvolutionTools::MultiScaleTransform(MultiScaleTransforms* msTransforms, ImageBufferAllocator* allocator, const ao::uvector<double*>& images, ao::uvector<double> scales)
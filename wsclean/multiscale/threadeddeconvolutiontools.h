@@ -59,13 +59,6 @@ private:
 		double factor;
 		size_t startY, endY;
 	};
-	struct FinishMultiScaleTransformTask : public ThreadTask {
-		virtual ThreadResult* operator()();
-		
-		class MultiScaleTransforms* msTransforms;
-		double* image;
-		double* kernel;
-	};
 	struct MultiScaleTransformTask : public ThreadTask {
 		virtual ThreadResult* operator()();
 		
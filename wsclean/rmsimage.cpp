@@ -1,7 +1,34 @@
 #include "rmsimage.h"
 #include "modelrenderer.h"
 
-void RMSImage::Make(Image& rmsOutput, const Image& inputImage, double windowSize, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM)
+#include <boost/thread/thread.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+void RMSImage::Make(Image& rmsOutput, const Image& inputImage, double windowSize, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM, size_t threadCount)
+{
+	if(beamMaj != beamMin)
+	{
+		makeWithFFT(rmsOutput, inputImage, windowSize, beamMaj, beamMin, beamPA, pixelScaleL, pixelScaleM);
+		return;
+	}
+	
+	rmsOutput = inputImage;
+	for(double& val : rmsOutput)
+		val *= val;
+	
+	// The beam is circular, so the Gaussian is separable in x and y
+	const long double sigma = beamMaj * windowSize / (2.0L * sqrtl(2.0L * logl(2.0L)));
+	filter(rmsOutput, BoxGaussianFilter(sigma / pixelScaleL), true, threadCount);
+	filter(rmsOutput, BoxGaussianFilter(sigma / pixelScaleM), false, threadCount);
+	
+	for(double& val : rmsOutput)
+		val = sqrt(std::max(val, 0.0));
+}
+
+void RMSImage::makeWithFFT(Image& rmsOutput, const Image& inputImage, double windowSize, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM)
 {
 	Image image(inputImage);
 	rmsOutput = Image(image.Width(), image.Height(), 0.0, image.Allocator());
@@ -19,45 +46,191 @@ void RMSImage::Make(Image& rmsOutput, const Image& inputImage, double windowSize
 		val = sqrt(val * norm);
 }
 
-void RMSImage::SlidingMinimum(Image& output, const Image& input, size_t windowSize)
+void RMSImage::SlidingMinimum(Image& output, const Image& input, size_t windowSize, size_t threadCount)
+{
+	output = input;
+	MinimumFilter minimumFilter(windowSize);
+	filter(output, minimumFilter, true, threadCount);
+	filter(output, minimumFilter, false, threadCount);
+}
+
+void RMSImage::MakeWithNegativityLimit(Image& rmsOutput, const Image& inputImage, double windowSize, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM, size_t threadCount)
+{
+	Make(rmsOutput, inputImage, windowSize, beamMaj, beamMin, beamPA, pixelScaleL, pixelScaleM, threadCount);
+	Image slidingMinimum(inputImage.Width(), inputImage.Height(), inputImage.Allocator());
+	double beamInPixels = std::max(beamMaj / pixelScaleL, 1.0L);
+	SlidingMinimum(slidingMinimum, inputImage, windowSize * beamInPixels, threadCount);
+	for(size_t i=0; i!=rmsOutput.size(); ++i)
+	{
+		rmsOutput[i] = std::max(rmsOutput[i], std::abs(slidingMinimum[i]) * (1.5/5.0) );
+	}
+}
+
+template<typename Filter>
+void RMSImage::filter(Image& image, const Filter& filter, bool horizontal, size_t threadCount)
+{
+	if(threadCount <= 1)
+		filterThread(&image, &filter, horizontal, 0, 1);
+	else {
+		boost::thread_group threads;
+		for(size_t i=0; i!=threadCount; ++i)
+			threads.add_thread(new boost::thread(&RMSImage::filterThread<Filter>, &image, &filter, horizontal, i, threadCount));
+		threads.join_all();
+	}
+}
+
+template<typename Filter>
+void RMSImage::filterThread(Image* image, const Filter* filter, bool horizontal, size_t threadIndex, size_t threadCount)
 {
-	const size_t width = input.Width();
-	output = Image(width, input.Height(), input.Allocator());
-	Image temp(output);
-	for(size_t y=0; y!=input.Height(); ++y)
+	const size_t width = image->Width(), height = image->Height();
+	ao::uvector<double> scratch;
+	if(horizontal)
 	{
-		double *outRowptr = &temp[y*width];
-		const double* inRowptr = &input[y*width];
-		for(size_t x=0; x!=width; ++x)
+		ao::uvector<double> line(width);
+		const size_t
+			yStart = height * threadIndex / threadCount,
+			yEnd = height * (threadIndex+1) / threadCount;
+		for(size_t y=yStart; y!=yEnd; ++y)
 		{
-			size_t left = std::max(x, windowSize/2) - windowSize/2;
-			size_t right = std::min(x, width-windowSize/2) + windowSize/2;
-			outRowptr[x] = *std::min_element(inRowptr + left, inRowptr + right);
+			double* row = image->data() + y*width;
+			std::copy(row, row + width, line.data());
+			(*filter)(line.data(), width, scratch);
+			std::copy(line.data(), line.data() + width, row);
 		}
 	}
-	for(size_t x=0; x!=width; ++x)
-	{
-		ao::uvector<double> vals;
-		for(size_t y=0; y!=input.Height(); ++y)
+	else {
+		// Blocks of columns are divided over the threads. Each block is stored
+		// transposed, so that each column is a contiguous line.
+		const size_t blockSize = 32, blockCount = (width + blockSize - 1) / blockSize;
+		ao::uvector<double> lines(blockSize * height);
+		for(size_t block=threadIndex; block<blockCount; block+=threadCount)
 		{
-			size_t top = std::max(y, windowSize/2) - windowSize/2;
-			size_t bottom = std::min(y, input.Height()-windowSize/2) + windowSize/2;
-			vals.clear();
-			for(size_t winY=top; winY!=bottom; ++winY)
-				vals.push_back(temp[winY*width + x]);
-			output[y*width + x] = *std::min_element(vals.begin(), vals.end());
+			const size_t
+				xStart = block * blockSize,
+				columnCount = std::min(blockSize, width - xStart);
+			for(size_t y=0; y!=height; ++y)
+			{
+				const double* row = image->data() + y*width + xStart;
+				for(size_t i=0; i!=columnCount; ++i)
+					lines[i*height + y] = row[i];
+			}
+			for(size_t i=0; i!=columnCount; ++i)
+				(*filter)(&lines[i*height], height, scratch);
+			for(size_t y=0; y!=height; ++y)
+			{
+				double* row = image->data() + y*width + xStart;
+				for(size_t i=0; i!=columnCount; ++i)
+					row[i] = lines[i*height + y];
+			}
 		}
 	}
 }
 
-void RMSImage::MakeWithNegativityLimit(Image& rmsOutput, const Image& inputImage, double windowSize, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM)
+RMSImage::BoxGaussianFilter::BoxGaussianFilter(double sigma)
 {
-	Make(rmsOutput, inputImage, windowSize, beamMaj, beamMin, beamPA, pixelScaleL, pixelScaleM);
-	Image slidingMinimum(inputImage.Width(), inputImage.Height(), inputImage.Allocator());
-	double beamInPixels = std::max(beamMaj / pixelScaleL, 1.0L);
-	SlidingMinimum(slidingMinimum, inputImage, windowSize * beamInPixels);
-	for(size_t i=0; i!=rmsOutput.size(); ++i)
+	// Three box filters of (odd) widths wl or wu = wl+2 are used, with a
+	// total variance that is as close as possible to sigma^2.
+	const size_t passes = 3;
+	const double variance = sigma * sigma;
+	int wl = std::floor(std::sqrt(12.0 * variance / passes + 1.0));
+	if(wl % 2 == 0)
+		--wl;
+	wl = std::max(wl, 1);
+	const int wu = wl + 2;
+	const double m = std::round((12.0 * variance - passes*wl*wl - 4.0*passes*wl - 3.0*passes) / (-4.0*wl - 4.0));
+	for(size_t i=0; i!=passes; ++i)
 	{
-		rmsOutput[i] = std::max(rmsOutput[i], std::abs(slidingMinimum[i]) * (1.5/5.0) );
+		const int width = (double(i) < m) ? wl : wu;
+		// Passes of width 1 do not change the image
+		if(width > 1)
+			_radii.push_back(width / 2);
+	}
+}
+
+void RMSImage::BoxGaussianFilter::operator()(double* line, size_t n, ao::uvector<double>& scratch) const
+{
+	scratch.resize(n);
+	double* input = line;
+	double* output = scratch.data();
+	for(size_t radius : _radii)
+	{
+		boxPass(input, output, n, radius);
+		std::swap(input, output);
+	}
+	if(input != line)
+		std::copy(input, input + n, line);
+}
+
+void RMSImage::BoxGaussianFilter::boxPass(const double* input, double* output, size_t n, size_t radius)
+{
+	// The running sum is compensated (Neumaier), so that the result does not depend on
+	// bright values that have left the window.
+	double sum = 0.0, compensation = 0.0;
+	auto add = [&sum, &compensation](double value)
+	{
+		const double t = sum + value;
+		if(std::fabs(sum) >= std::fabs(value))
+			compensation += (sum - t) + value;
+		else
+			compensation += (value - t) + sum;
+		sum = t;
+	};
+	// Periodic boundaries: the window may be larger than the line
+	const size_t radiusMod = radius % n;
+	size_t leaving = (n - radiusMod) % n;
+	for(size_t i=0; i!=2*radius+1; ++i)
+		add(input[(leaving + i) % n]);
+	size_t entering = (radiusMod + 1) % n;
+	const double norm = 1.0 / (2*radius+1);
+	for(size_t x=0; x!=n; ++x)
+	{
+		output[x] = (sum + compensation) * norm;
+		add(input[entering]);
+		add(-input[leaving]);
+		++entering;
+		if(entering == n) entering = 0;
+		++leaving;
+		if(leaving == n) leaving = 0;
+	}
+}
+
+void RMSImage::MinimumFilter::operator()(double* line, size_t n, ao::uvector<double>& scratch) const
+{
+	if(_halfWindow == 0)
+		return;
+	// Van Herk/Gil-Werman: the line is padded with _halfWindow values of infinity
+	// on both sides and divided in blocks of the window length. For each position,
+	// the minimum from the start of its block (prefix) and to the end of
+	// its block (suffix) is calculated. A window then consists of the suffix of
+	// one block and the prefix of the next.
+	const size_t
+		windowLength = _halfWindow * 2,
+		paddedSize = n + windowLength;
+	scratch.resize(paddedSize * 3);
+	double
+		*padded = scratch.data(),
+		*prefix = padded + paddedSize,
+		*suffix = prefix + paddedSize;
+	const double inf = std::numeric_limits<double>::infinity();
+	std::fill(padded, padded + _halfWindow, inf);
+	std::copy(line, line + n, padded + _halfWindow);
+	std::fill(padded + _halfWindow + n, padded + paddedSize, inf);
+	for(size_t i=0; i!=paddedSize; ++i)
+	{
+		if(i % windowLength == 0)
+			prefix[i] = padded[i];
+		else
+			prefix[i] = std::min(prefix[i-1], padded[i]);
+	}
+	for(size_t i=paddedSize; i!=0; --i)
+	{
+		const size_t index = i - 1;
+		if(index == paddedSize-1 || (index+1) % windowLength == 0)
+			suffix[index] = padded[index];
+		else
+			suffix[index] = std::min(suffix[index+1], padded[index]);
 	}
+	// The window of pixel x starts at padded index x and ends at x + windowLength - 1
+	for(size_t x=0; x!=n; ++x)
+		line[x] = std::min(suffix[x], prefix[x + windowLength - 1]);
 }
@@ -3,23 +3,84 @@
 
 #include "image.h"
 
+#include "uvector.h"
+
 class RMSImage
 {
 public:
-	static void Make(Image& rmsOutput, const Image& inputImage, double windowSize, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM);
+	/**
+	 * Make an image with the local RMS, calculated in a Gaussian window with a size of
+	 * windowSize times the beam. For circular beams, the Gaussian is approximated by
+	 * repeated box filters over the rows and columns, which takes constant time per pixel
+	 * independent of the window size. The approximation follows the Gaussian to within a
+	 * few percent up to about twice its sigma, but the window ends at about three sigma.
+	 * Like the convolution through FFTs that is used for elliptical beams, the image is
+	 * assumed to be periodic at the edges.
+	 */
+	static void Make(Image& rmsOutput, const Image& inputImage, double windowSize, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM, size_t threadCount = 1);
 	
-	static void SlidingMinimum(Image& output, const Image& input, size_t windowSize);
+	/**
+	 * Set each pixel to the minimum of the input pixels in a square window of windowSize
+	 * around the pixel. This uses the van Herk/Gil-Werman algorithm, which takes
+	 * constant time per pixel independent of the window size.
+	 */
+	static void SlidingMinimum(Image& output, const Image& input, size_t windowSize, size_t threadCount = 1);
 	
-	static void SlidingMaximum(Image& output, const Image& input, size_t windowSize)
+	static void SlidingMaximum(Image& output, const Image& input, size_t windowSize, size_t threadCount = 1)
 	{
 		Image flipped(input);
 		flipped.Negate();
-		SlidingMinimum(output, flipped, windowSize);
+		SlidingMinimum(output, flipped, windowSize, threadCount);
 		output.Negate();
 	}
 	
-	static void MakeWithNegativityLimit(Image& rmsOutput, const Image& inputImage, double windowSize, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM);
+	static void MakeWithNegativityLimit(Image& rmsOutput, const Image& inputImage, double windowSize, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM, size_t threadCount = 1);
+
+private:
+	/**
+	 * Approximation of a Gaussian convolution by successive (periodic) box filters,
+	 * using the box widths of Kovesi ("Fast almost-Gaussian filtering", 2010).
+	 */
+	class BoxGaussianFilter
+	{
+	public:
+		BoxGaussianFilter(double sigma);
+		
+		void operator()(double* line, size_t n, ao::uvector<double>& scratch) const;
+	
+	private:
+		static void boxPass(const double* input, double* output, size_t n, size_t radius);
+		
+		ao::uvector<size_t> _radii;
+	};
+	
+	/**
+	 * Minimum over the window [x - windowSize/2, x + windowSize/2), calculated with the
+	 * van Herk/Gil-Werman algorithm.
+	 */
+	class MinimumFilter
+	{
+	public:
+		MinimumFilter(size_t windowSize) : _halfWindow(windowSize/2) { }
+		
+		void operator()(double* line, size_t n, ao::uvector<double>& scratch) const;
+	
+	private:
+		size_t _halfWindow;
+	};
+	
+	/**
+	 * Apply a one-dimensional filter in-place on all rows (when horizontal) or all columns
+	 * of the image. Columns are processed in blocks that are transposed into a buffer, such
+	 * that memory is accessed contiguously.
+	 */
+	template<typename Filter>
+	static void filter(Image& image, const Filter& filter, bool horizontal, size_t threadCount);
+	
+	template<typename Filter>
+	static void filterThread(Image* image, const Filter* filter, bool horizontal, size_t threadIndex, size_t threadCount);
+	
+	static void makeWithFFT(Image& rmsOutput, const Image& inputImage, double windowSize, long double beamMaj, long double beamMin, long double beamPA, long double pixelScaleL, long double pixelScaleM);
 };
 
 #endif
-
@@ -0,0 +1,207 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../wsclean/brightpixelpredictor.h"
+#include "../wsclean/imagebufferallocator.h"
+#include "../wsclean/wlayerpassplanner.h"
+#include "../wsclean/wstackinggridder.h"
+
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(bright_pixel_predictor)
+
+struct BrightPixelFixture
+{
+	BrightPixelFixture() :
+		size(128),
+		layerCount(32),
+		pixelSize(0.005),
+		maxW(12.0),
+		frequencies({ 140e6, 147e6, 154e6, 161e6 }),
+		rng(42)
+	{
+		// Faint emission around the centre, with three bright pixels
+		std::uniform_real_distribution<double> fluxDist(-0.1, 0.1);
+		image.assign(size*size, 0.0);
+		for(size_t y=size/2-20; y!=size/2+20; ++y)
+		{
+			for(size_t x=size/2-20; x!=size/2+20; ++x)
+				image[x + y*size] = fluxDist(rng);
+		}
+		image[(size/2+10) + (size/2+5)*size] = 5.0;
+		image[(size/2-7) + (size/2+12)*size] = 3.0;
+		image[(size/2+3) + (size/2-9)*size] = -2.0;
+		
+		std::uniform_real_distribution<double> uvDist(-90.0, 90.0), wDist(0.0, 20.0);
+		const size_t rowCount = 200;
+		u.resize(rowCount); v.resize(rowCount); w.resize(rowCount);
+		for(size_t row=0; row!=rowCount; ++row)
+		{
+			u[row] = uvDist(rng); v[row] = uvDist(rng); w[row] = wDist(rng);
+		}
+	}
+	
+	/**
+	 * Predict all rows with the gridder, and with a DFT of the pixels above @p threshold
+	 * when it is positive. The predicted visibilities of the passes are combined as
+	 * WSMSGridder does: each pass writes the channels that it sampled.
+	 */
+	std::vector<std::complex<float>> predict(double threshold, double maxMem, size_t& passCount)
+	{
+		std::vector<double> model(image);
+		BrightPixelPredictor brightPixels;
+		if(threshold > 0.0)
+		{
+			BOOST_CHECK_EQUAL(brightPixels.ExtractComponents(model.data(), nullptr, size, size, pixelSize, pixelSize, threshold), 3u);
+			brightPixels.SetBands({ frequencies });
+		}
+		ImageBufferAllocator allocator;
+		WStackingGridder gridder(size, size, pixelSize, pixelSize, 2, &allocator, 7, 63);
+		gridder.PrepareWLayers(layerCount, maxMem, 0.0, maxW);
+		passCount = gridder.NPasses();
+		
+		const size_t channelCount = frequencies.size();
+		const std::complex<float> nan(std::numeric_limits<float>::quiet_NaN(), std::numeric_limits<float>::quiet_NaN());
+		std::vector<std::complex<float>> result(u.size() * channelCount, nan), row(channelCount);
+		BrightPixelPredictor::Buffer buffer;
+		for(size_t pass=0; pass!=gridder.NPasses(); ++pass)
+		{
+			gridder.InitializePrediction(model.data());
+			gridder.StartPredictionPass(pass);
+			for(size_t rowIndex=0; rowIndex!=u.size(); ++rowIndex)
+			{
+				for(size_t ch=0; ch!=channelCount; ++ch)
+				{
+					const double lambda = 299792458.0 / frequencies[ch];
+					gridder.SampleDataSample(row[ch], u[rowIndex]/lambda, v[rowIndex]/lambda, w[rowIndex]/lambda);
+				}
+				if(!brightPixels.Empty())
+					brightPixels.AddToSampledChannels(row.data(), channelCount, 0, u[rowIndex], v[rowIndex], w[rowIndex], buffer);
+				for(size_t ch=0; ch!=channelCount; ++ch)
+				{
+					if(std::isfinite(row[ch].real()))
+					{
+						std::complex<float>& dest = result[rowIndex*channelCount + ch];
+						// Every channel should be sampled in exactly one pass
+						BOOST_CHECK(!std::isfinite(dest.real()));
+						dest = row[ch];
+					}
+				}
+			}
+		}
+		return result;
+	}
+	
+	size_t size, layerCount;
+	double pixelSize, maxW;
+	ao::uvector<double> frequencies;
+	std::mt19937 rng;
+	std::vector<double> image, u, v, w;
+};
+
+BOOST_FIXTURE_TEST_CASE( extractComponents, BrightPixelFixture )
+{
+	std::vector<double> real(image), imaginary(size*size, 0.0);
+	imaginary[(size/2+10) + (size/2+5)*size] = 1.0;
+	// Only bright because of its imaginary part
+	imaginary[size/2 + (size/2)*size] = -4.0;
+	BrightPixelPredictor brightPixels;
+	BOOST_CHECK_EQUAL(brightPixels.ExtractComponents(real.data(), imaginary.data(), size, size, pixelSize, pixelSize, 1.0), 4u);
+	BOOST_CHECK_EQUAL(brightPixels.ComponentCount(), 4u);
+	for(size_t i=0; i!=size*size; ++i)
+	{
+		if(std::abs(image[i]) >= 1.0 || i == size/2 + (size/2)*size)
+		{
+			BOOST_CHECK_EQUAL(real[i], 0.0);
+			BOOST_CHECK_EQUAL(imaginary[i], 0.0);
+		}
+		else {
+			BOOST_CHECK_EQUAL(real[i], image[i]);
+		}
+	}
+	brightPixels.Clear();
+	BOOST_CHECK(brightPixels.Empty());
+}
+
+BOOST_FIXTURE_TEST_CASE( sampledChannelsOnly, BrightPixelFixture )
+{
+	BrightPixelPredictor brightPixels;
+	std::vector<double> model(image);
+	brightPixels.ExtractComponents(model.data(), nullptr, size, size, pixelSize, pixelSize, 1.0);
+	brightPixels.SetBands({ frequencies });
+	
+	const float nan = std::numeric_limits<float>::quiet_NaN();
+	std::vector<std::complex<float>>
+		sampled(frequencies.size(), 0.0),
+		partial = { 0.0, std::complex<float>(nan, nan), 0.0, std::complex<float>(nan, nan) };
+	BrightPixelPredictor::Buffer buffer;
+	brightPixels.AddToSampledChannels(sampled.data(), sampled.size(), 0, u[0], v[0], w[0], buffer);
+	brightPixels.AddToSampledChannels(partial.data(), partial.size(), 0, u[0], v[0], w[0], buffer);
+	for(size_t ch=0; ch!=frequencies.size(); ++ch)
+	{
+		BOOST_CHECK(std::isfinite(sampled[ch].real()));
+		if(ch%2 == 0)
+			BOOST_CHECK_EQUAL(partial[ch], sampled[ch]);
+		else
+			BOOST_CHECK(std::isnan(partial[ch].real()));
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE( bandsPerMeasurementSet, BrightPixelFixture )
+{
+	std::vector<double> model(image);
+	BrightPixelPredictor brightPixels;
+	brightPixels.ExtractComponents(model.data(), nullptr, size, size, pixelSize, pixelSize, 1.0);
+	// Two measurement sets with other frequencies and channel counts, predicted in turn
+	// as in several passes
+	const std::vector<ao::uvector<double>> msFrequencies = {
+		frequencies,
+		ao::uvector<double>({ 110e6, 115e6, 120e6, 125e6, 130e6, 135e6 })
+	};
+	const std::complex<float> guard(123.0, 456.0);
+	BrightPixelPredictor::Buffer buffer;
+	for(size_t i=0; i!=4; ++i)
+	{
+		const ao::uvector<double>& msBand = msFrequencies[i%2];
+		brightPixels.SetBands({ msBand });
+		BOOST_CHECK_EQUAL(brightPixels.BandCount(), 1u);
+		
+		BrightPixelPredictor expectedPixels;
+		std::vector<double> expectedModel(image);
+		expectedPixels.ExtractComponents(expectedModel.data(), nullptr, size, size, pixelSize, pixelSize, 1.0);
+		expectedPixels.SetBands({ msBand });
+		
+		// The row has one more value, which should not be written
+		std::vector<std::complex<float>> row(msBand.size() + 1, 0.0), expected(msBand.size(), 0.0);
+		row.back() = guard;
+		brightPixels.AddToSampledChannels(row.data(), msBand.size(), 0, u[i], v[i], w[i], buffer);
+		expectedPixels.AddToSampledChannels(expected.data(), msBand.size(), 0, u[i], v[i], w[i], buffer);
+		for(size_t ch=0; ch!=msBand.size(); ++ch)
+			BOOST_CHECK_EQUAL(row[ch], expected[ch]);
+		BOOST_CHECK_EQUAL(row.back(), guard);
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE( hybridPrediction, BrightPixelFixture )
+{
+	size_t singlePassCount, multiPassCount;
+	std::vector<std::complex<float>>
+		expected = predict(0.0, 1e9, singlePassCount),
+		hybrid = predict(1.0, WLayerPassPlanner(size, size, false).Memory(2, 4), multiPassCount);
+	BOOST_CHECK_EQUAL(singlePassCount, 1u);
+	BOOST_CHECK_GT(multiPassCount, 1u);
+	// The reference is limited by the accuracy of the gridder, which is a few times 1e-3 of
+	// the 10 Jy in bright pixels; a DFT with other conventions would differ by the full flux.
+	const float tolerance = 1e-2 * 10.0;
+	for(size_t i=0; i!=expected.size(); ++i)
+	{
+		BOOST_REQUIRE(std::isfinite(expected[i].real()));
+		BOOST_REQUIRE(std::isfinite(hybrid[i].real()));
+		BOOST_CHECK_SMALL(hybrid[i].real() - expected[i].real(), tolerance);
+		BOOST_CHECK_SMALL(hybrid[i].imag() - expected[i].imag(), tolerance);
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
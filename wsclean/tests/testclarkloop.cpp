@@ -0,0 +1,218 @@
+#include "../deconvolution/clarkloop.h"
+#include "../deconvolution/imageset.h"
+
+#include "../wsclean/imagebufferallocator.h"
+#include "../wsclean/imagingtable.h"
+
+#include "../uvector.h"
+
+#include <boost/test/unit_test.hpp>
+
+#include <cmath>
+#include <random>
+
+namespace {
+
+struct ClarkLoopFixture
+{
+	ClarkLoopFixture(size_t channelCount, bool squared) :
+		width(512), height(384),
+		threshold(0.5), gain(0.1), iterationCount(200)
+	{
+		for(size_t ch=0; ch!=channelCount; ++ch)
+		{
+			ImagingTableEntry& e = table.AddEntry();
+			e.index = ch;
+			e.joinedGroupIndex = 0;
+			e.outputChannelIndex = ch;
+			e.squaredDeconvolutionIndex = ch;
+			e.polarization = Polarization::StokesI;
+			e.lowestFrequency = 100 + ch;
+			e.highestFrequency = 100 + ch;
+			e.bandStartFrequency = 100 + ch;
+			e.bandEndFrequency = 100 + ch;
+			e.imageCount = 1;
+			e.imageWeight = 1.0 + ch;
+		}
+		table.Update();
+		
+		residual.reset(new ImageSet(&table, allocator, 0, squared, width, height));
+		std::mt19937 rng(42);
+		std::normal_distribution<double> dist(0.0, 1.0);
+		for(size_t img=0; img!=residual->size(); ++img)
+		{
+			for(size_t i=0; i!=width*height; ++i)
+				(*residual)[img][i] = dist(rng);
+			// Add a few sources that are cleaned
+			(*residual)[img][width/2 + height/2*width] += 50.0;
+			(*residual)[img][10 + 20*width] -= 30.0;
+			(*residual)[img][200 + 150*width] += 20.0 + img;
+		}
+		psfs.resize(residual->PSFCount());
+		psfPtrs.resize(residual->PSFCount());
+		for(size_t p=0; p!=psfs.size(); ++p)
+		{
+			psfs[p].resize(width*height);
+			const double sigma = 3.0 + p;
+			for(size_t y=0; y!=height; ++y)
+			{
+				for(size_t x=0; x!=width; ++x)
+				{
+					const double dx = double(x) - double(width/2), dy = double(y) - double(height/2);
+					psfs[p][x + y*width] = std::exp(-(dx*dx + dy*dy) / (2.0*sigma*sigma));
+				}
+			}
+			psfPtrs[p] = psfs[p].data();
+		}
+	}
+	
+	/**
+	 * Serial implementation of the Clark loop as it was before it was parallelized:
+	 * the integrated value is calculated for all selected pixels, and the psf is
+	 * subtracted from the selected pixels one by one.
+	 */
+	double runReference(std::vector<ao::uvector<double>>& models, size_t& iterations, bool allowNegatives)
+	{
+		ao::uvector<double> integrated(width*height);
+		residual->GetLinearIntegrated(integrated.data());
+		std::vector<size_t> positions;
+		for(size_t i=0; i!=width*height; ++i)
+		{
+			double value = allowNegatives ? std::fabs(integrated[i]) : integrated[i];
+			if(value >= threshold)
+				positions.push_back(i);
+		}
+		std::unique_ptr<ImageSet> selected(new ImageSet(&table, allocator, 0, residual->SquareJoinedChannels(), positions.size(), 1));
+		for(size_t img=0; img!=residual->size(); ++img)
+		{
+			for(size_t px=0; px!=positions.size(); ++px)
+				(*selected)[img][px] = (*residual)[img][positions[px]];
+		}
+		models.assign(residual->size(), ao::uvector<double>(width*height, 0.0));
+		
+		iterations = 0;
+		double maxValue;
+		size_t maxComponent = findMax(*selected, integrated, positions.size(), allowNegatives, maxValue);
+		while(std::fabs(maxValue) > threshold && iterations < iterationCount)
+		{
+			const int x = positions[maxComponent] % width, y = positions[maxComponent] / width;
+			for(size_t img=0; img!=selected->size(); ++img)
+			{
+				double* image = (*selected)[img];
+				const double* psf = psfPtrs[selected->PSFIndex(img)];
+				const double factor = image[maxComponent] * gain;
+				models[img][positions[maxComponent]] += factor;
+				for(size_t px=0; px!=positions.size(); ++px)
+				{
+					int psfX = int(positions[px] % width) - x + width/2;
+					int psfY = int(positions[px] / width) - y + height/2;
+					if(psfX >= 0 && psfX < int(width) && psfY >= 0 && psfY < int(height))
+						image[px] -= psf[psfX + psfY*width] * factor;
+				}
+			}
+			maxComponent = findMax(*selected, integrated, positions.size(), allowNegatives, maxValue);
+			++iterations;
+		}
+		return maxValue;
+	}
+	
+	static size_t findMax(const ImageSet& set, ao::uvector<double>& scratch, size_t n, bool allowNegatives, double& maxValue)
+	{
+		set.GetLinearIntegrated(scratch.data());
+		size_t maxComponent = 0;
+		maxValue = scratch[0];
+		for(size_t i=0; i!=n; ++i)
+		{
+			double value = allowNegatives ? std::fabs(scratch[i]) : scratch[i];
+			if(value > maxValue)
+			{
+				maxComponent = i;
+				maxValue = value;
+			}
+		}
+		maxValue = scratch[maxComponent];
+		return maxComponent;
+	}
+	
+	double runClarkLoop(std::vector<ao::uvector<double>>& models, size_t& iterations, bool allowNegatives, size_t threadCount)
+	{
+		ClarkLoop clarkLoop(width, height, width, height);
+		clarkLoop.SetIterationInfo(0, iterationCount);
+		clarkLoop.SetThreshold(threshold, threshold);
+		clarkLoop.SetGain(gain);
+		clarkLoop.SetAllowNegativeComponents(allowNegatives);
+		clarkLoop.SetThreadCount(threadCount);
+		double maxValue = clarkLoop.Run(*residual, psfPtrs);
+		iterations = clarkLoop.CurrentIteration();
+		models.assign(residual->size(), ao::uvector<double>(width*height));
+		for(size_t img=0; img!=residual->size(); ++img)
+			clarkLoop.GetFullIndividualModel(img, models[img].data());
+		return maxValue;
+	}
+	
+	void check(bool allowNegatives, size_t threadCount)
+	{
+		std::vector<ao::uvector<double>> referenceModels, models;
+		size_t referenceIterations, iterations;
+		double referenceMax = runReference(referenceModels, referenceIterations, allowNegatives);
+		double maxValue = runClarkLoop(models, iterations, allowNegatives, threadCount);
+		BOOST_CHECK_EQUAL(iterations, referenceIterations);
+		BOOST_CHECK_CLOSE_FRACTION(maxValue, referenceMax, 1e-8);
+		for(size_t img=0; img!=models.size(); ++img)
+		{
+			for(size_t i=0; i!=width*height; ++i)
+			{
+				if(std::fabs(models[img][i] - referenceModels[img][i]) > 1e-8)
+				{
+					BOOST_CHECK_CLOSE_FRACTION(models[img][i], referenceModels[img][i], 1e-8);
+					return;
+				}
+			}
+		}
+	}
+	
+	size_t width, height;
+	double threshold, gain;
+	size_t iterationCount;
+	ImagingTable table;
+	ImageBufferAllocator allocator;
+	std::unique_ptr<ImageSet> residual;
+	std::vector<ao::uvector<double>> psfs;
+	ao::uvector<const double*> psfPtrs;
+};
+
+}
+
+BOOST_AUTO_TEST_SUITE(clark_loop)
+
+BOOST_AUTO_TEST_CASE( single_image )
+{
+	ClarkLoopFixture f(1, false);
+	f.check(true, 1);
+}
+
+BOOST_AUTO_TEST_CASE( single_image_threaded )
+{
+	ClarkLoopFixture f(1, false);
+	f.check(true, 4);
+}
+
+BOOST_AUTO_TEST_CASE( positive_only_threaded )
+{
+	ClarkLoopFixture f(1, false);
+	f.check(false, 3);
+}
+
+BOOST_AUTO_TEST_CASE( weighted_channels_threaded )
+{
+	ClarkLoopFixture f(3, false);
+	f.check(true, 4);
+}
+
+BOOST_AUTO_TEST_CASE( squared_channels_threaded )
+{
+	ClarkLoopFixture f(2, true);
+	f.check(true, 5);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
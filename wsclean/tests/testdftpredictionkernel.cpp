@@ -0,0 +1,207 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../dftpredictionkernel.h"
+
+#include <cmath>
+#include <random>
+
+BOOST_AUTO_TEST_SUITE(dft_prediction_kernel)
+
+struct DFTPredictionKernelFixture
+{
+	DFTPredictionKernelFixture() :
+		frequencies({ 120e6, 140e6, 160e6 }),
+		rng(42)
+	{ }
+	
+	/**
+	 * Direct evaluation of one component, with the same conventions as DFTPredictionAlgorithm.
+	 */
+	std::complex<double> directPredict(double u, double v, double w, double frequency, double l, double m, const double* gausTransf, std::complex<double> flux) const
+	{
+		const double lambda = 299792458.0 / frequency;
+		u /= lambda; v /= lambda; w /= lambda;
+		const double angle = 2.0*M_PI*(u*l + v*m + w*(sqrt(1.0 - l*l - m*m) - 1.0));
+		std::complex<double> value = flux * std::polar(1.0, angle);
+		if(gausTransf)
+		{
+			const double
+				uTransf = u*gausTransf[0] + v*gausTransf[1],
+				vTransf = u*gausTransf[2] + v*gausTransf[3];
+			value *= exp(-uTransf*uTransf - vTransf*vTransf);
+		}
+		return value;
+	}
+	
+	void check(size_t polarizationCount, size_t pointCount, size_t gaussianCount)
+	{
+		const size_t valueCount = frequencies.size() * polarizationCount;
+		DFTPredictionKernel kernel(frequencies, polarizationCount);
+		std::uniform_real_distribution<double> lmDist(-0.05, 0.05), fluxDist(-1.0, 1.0), uvwDist(-3000.0, 3000.0);
+		std::vector<double> ls, ms, transformations;
+		std::vector<std::complex<double>> fluxes;
+		for(size_t i=0; i!=pointCount+gaussianCount; ++i)
+		{
+			ls.push_back(lmDist(rng));
+			ms.push_back(lmDist(rng));
+			for(size_t j=0; j!=valueCount; ++j)
+				fluxes.emplace_back(fluxDist(rng), fluxDist(rng));
+			// A Gaussian with a sigma of a few arcminutes
+			for(size_t j=0; j!=4; ++j)
+				transformations.push_back(fluxDist(rng) * 1e-3);
+			if(i < pointCount)
+				kernel.AddPointComponent(ls[i], ms[i], &fluxes[i * valueCount]);
+			else
+				kernel.AddGaussianComponent(ls[i], ms[i], &transformations[i * 4], &fluxes[i * valueCount]);
+		}
+		BOOST_CHECK_EQUAL(kernel.PointCount(), pointCount);
+		BOOST_CHECK_EQUAL(kernel.GaussianCount(), gaussianCount);
+		
+		DFTPredictionKernel::Buffer buffer;
+		std::vector<std::complex<float>> result(valueCount);
+		for(size_t row=0; row!=20; ++row)
+		{
+			const double u = uvwDist(rng), v = uvwDist(rng), w = uvwDist(rng) * 0.1;
+			kernel.Predict(result.data(), u, v, w, buffer);
+			for(size_t ch=0; ch!=frequencies.size(); ++ch)
+			{
+				for(size_t p=0; p!=polarizationCount; ++p)
+				{
+					std::complex<double> expected = 0.0;
+					for(size_t i=0; i!=pointCount+gaussianCount; ++i)
+					{
+						const double* gausTransf = (i < pointCount) ? nullptr : &transformations[i * 4];
+						expected += directPredict(u, v, w, frequencies[ch], ls[i], ms[i], gausTransf, fluxes[i * valueCount + ch*polarizationCount + p]);
+					}
+					const std::complex<float>& value = result[ch*polarizationCount + p];
+					BOOST_CHECK_SMALL(value.real() - expected.real(), 1e-4);
+					BOOST_CHECK_SMALL(value.imag() - expected.imag(), 1e-4);
+				}
+			}
+		}
+	}
+	
+	ao::uvector<double> frequencies;
+	std::mt19937 rng;
+};
+
+BOOST_AUTO_TEST_CASE( sinCos )
+{
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<double> dist(-1e4, 1e4);
+	ao::uvector<double> angles(1000);
+	for(double& angle : angles)
+		angle = dist(rng);
+	// Around the boundaries of the quadrants
+	for(size_t i=0; i!=16; ++i)
+	{
+		angles[i*2] = M_PI * 0.25 * i;
+		angles[i*2 + 1] = -M_PI * 0.25 * i + 1e-12;
+	}
+	ao::uvector<double> sines(angles.size()), cosines(angles.size());
+	DFTPredictionKernel::SinCos(angles.data(), sines.data(), cosines.data(), angles.size());
+	for(size_t i=0; i!=angles.size(); ++i)
+	{
+		BOOST_CHECK_SMALL(sines[i] - std::sin(angles[i]), 1e-14);
+		BOOST_CHECK_SMALL(cosines[i] - std::cos(angles[i]), 1e-14);
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE( points, DFTPredictionKernelFixture )
+{
+	check(1, 13, 0);
+}
+
+BOOST_FIXTURE_TEST_CASE( gaussians, DFTPredictionKernelFixture )
+{
+	check(1, 0, 7);
+}
+
+BOOST_FIXTURE_TEST_CASE( mixedFullPolarization, DFTPredictionKernelFixture )
+{
+	check(4, 9, 6);
+}
+
+BOOST_FIXTURE_TEST_CASE( phaseRecurrence, DFTPredictionKernelFixture )
+{
+	frequencies.resize(240);
+	for(size_t ch=0; ch!=frequencies.size(); ++ch)
+		frequencies[ch] = 120e6 + ch * 195312.5;
+	DFTPredictionKernel
+		exact(frequencies, 4),
+		resynchronized(frequencies, 4),
+		unsynchronized(frequencies, 4);
+	resynchronized.SetPhaseRecurrenceInterval(16);
+	unsynchronized.SetPhaseRecurrenceInterval(frequencies.size());
+	BOOST_CHECK(!exact.UsesPhaseRecurrence());
+	BOOST_CHECK(resynchronized.UsesPhaseRecurrence());
+	BOOST_CHECK(unsynchronized.UsesPhaseRecurrence());
+	
+	std::uniform_real_distribution<double> lmDist(-0.1, 0.1), fluxDist(-1.0, 1.0);
+	const size_t valueCount = frequencies.size() * 4, componentCount = 20;
+	std::vector<std::complex<double>> flux(valueCount);
+	for(size_t i=0; i!=componentCount; ++i)
+	{
+		const double l = lmDist(rng), m = lmDist(rng);
+		const double gausTransf[4] = { 1e-4, 2e-4, -1e-4, 3e-4 };
+		for(std::complex<double>& f : flux)
+			f = std::complex<double>(fluxDist(rng), fluxDist(rng));
+		for(DFTPredictionKernel* kernel : { &exact, &resynchronized, &unsynchronized })
+		{
+			if(i%2 == 0)
+				kernel->AddPointComponent(l, m, flux.data());
+			else
+				kernel->AddGaussianComponent(l, m, gausTransf, flux.data());
+		}
+	}
+	
+	// Baselines up to 100 km, with phases of up to 1e4 radians
+	std::uniform_real_distribution<double> uvwDist(-1e5, 1e5);
+	DFTPredictionKernel::Buffer buffer;
+	std::vector<std::complex<float>> expected(valueCount), resynchronizedResult(valueCount), unsynchronizedResult(valueCount);
+	double maxResynchronizedError = 0.0, maxUnsynchronizedError = 0.0;
+	for(size_t row=0; row!=10; ++row)
+	{
+		const double u = uvwDist(rng), v = uvwDist(rng), w = uvwDist(rng) * 0.1;
+		exact.Predict(expected.data(), u, v, w, buffer);
+		resynchronized.Predict(resynchronizedResult.data(), u, v, w, buffer);
+		unsynchronized.Predict(unsynchronizedResult.data(), u, v, w, buffer);
+		for(size_t i=0; i!=valueCount; ++i)
+		{
+			maxResynchronizedError = std::max<double>(maxResynchronizedError, std::abs(resynchronizedResult[i] - expected[i]));
+			maxUnsynchronizedError = std::max<double>(maxUnsynchronizedError, std::abs(unsynchronizedResult[i] - expected[i]));
+		}
+	}
+	// The values are up to about 20 Jy, so the errors are close to float precision
+	BOOST_CHECK_LT(maxResynchronizedError, 1e-5);
+	BOOST_CHECK_LT(maxUnsynchronizedError, 1e-4);
+}
+
+BOOST_FIXTURE_TEST_CASE( irregularChannels, DFTPredictionKernelFixture )
+{
+	frequencies = ao::uvector<double>({ 120e6, 130e6, 150e6, 160e6 });
+	DFTPredictionKernel exact(frequencies, 1), recurrence(frequencies, 1);
+	recurrence.SetPhaseRecurrenceInterval(4);
+	BOOST_CHECK(!recurrence.UsesPhaseRecurrence());
+	const std::complex<double> flux[4] = { 1.0, 2.0, 3.0, 4.0 };
+	exact.AddPointComponent(0.01, 0.02, flux);
+	recurrence.AddPointComponent(0.01, 0.02, flux);
+	DFTPredictionKernel::Buffer buffer;
+	std::vector<std::complex<float>> expected(frequencies.size()), result(frequencies.size());
+	exact.Predict(expected.data(), 1000.0, 2000.0, 100.0, buffer);
+	recurrence.Predict(result.data(), 1000.0, 2000.0, 100.0, buffer);
+	for(size_t ch=0; ch!=frequencies.size(); ++ch)
+		BOOST_CHECK_EQUAL(result[ch], expected[ch]);
+}
+
+BOOST_FIXTURE_TEST_CASE( empty, DFTPredictionKernelFixture )
+{
+	DFTPredictionKernel kernel(frequencies, 1);
+	DFTPredictionKernel::Buffer buffer;
+	std::vector<std::complex<float>> result(frequencies.size(), 1.0);
+	kernel.Predict(result.data(), 100.0, 200.0, 10.0, buffer);
+	for(const std::complex<float>& value : result)
+		BOOST_CHECK_EQUAL(value, std::complex<float>(0.0));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,225 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../banddata.h"
+#include "../imageweights.h"
+
+#include "../msproviders/msprovider.h"
+
+#include "../wsclean/imagebufferallocator.h"
+#include "../wsclean/msgridderbase.h"
+#include "../wsclean/wstackinggridder.h"
+
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(dual_grid_psf)
+
+/**
+ * Provides the visibilities and weights of one row at a time from memory.
+ */
+class RowProvider : public MSProvider
+{
+public:
+	explicit RowProvider(size_t channelCount) : _channelCount(channelCount), _data(nullptr), _weights(nullptr)
+	{ }
+	
+	void SetRow(const std::complex<float>* data, const float* weights)
+	{
+		_data = data;
+		_weights = weights;
+	}
+	
+	virtual casacore::MeasurementSet &MS() override { throw std::runtime_error("No measurement set"); }
+	virtual size_t RowId() const override { return 0; }
+	virtual bool CurrentRowAvailable() override { return true; }
+	virtual void NextRow() override { }
+	virtual void Reset() override { }
+	virtual void ReadMeta(double& u, double& v, double& w, size_t& dataDescId) override { throw std::runtime_error("Not implemented"); }
+	virtual void ReadMeta(double& u, double& v, double& w, size_t& dataDescId, size_t& antenna1, size_t& antenna2) override { throw std::runtime_error("Not implemented"); }
+	virtual void ReadData(std::complex<float>* buffer) override
+	{
+		std::copy_n(_data, _channelCount, buffer);
+	}
+	virtual void ReadModel(std::complex<float>* buffer) override { throw std::runtime_error("Not implemented"); }
+	virtual void WriteModel(size_t rowId, std::complex<float>* buffer) override { throw std::runtime_error("Not implemented"); }
+	virtual void ReadWeights(float* buffer) override
+	{
+		std::copy_n(_weights, _channelCount, buffer);
+	}
+	virtual void ReadWeights(std::complex<float>* buffer) override
+	{
+		for(size_t ch=0; ch!=_channelCount; ++ch)
+			buffer[ch] = _weights[ch];
+	}
+	virtual void ReopenRW() override { }
+	virtual double StartTime() override { return 0.0; }
+	virtual void MakeIdToMSRowMapping(std::vector<size_t>& idToMSRow) override { }
+	virtual PolarizationEnum Polarization() override { return Polarization::StokesI; }
+	virtual bool SupportsImagingWeights() const override { return false; }
+	virtual bool OpenImagingWeights(uint64_t key, ImagingWeightSums& sums) override { return false; }
+	virtual void ReadImagingWeights(float* buffer) override { throw std::runtime_error("Not implemented"); }
+	virtual void WriteImagingWeights(const float* buffer) override { throw std::runtime_error("Not implemented"); }
+	virtual void FinishImagingWeights(uint64_t key, const ImagingWeightSums& sums) override { throw std::runtime_error("Not implemented"); }
+
+private:
+	size_t _channelCount;
+	const std::complex<float>* _data;
+	const float* _weights;
+};
+
+/**
+ * Gives access to the reading and weighting of rows of the MSGridderBase.
+ */
+class RowGridder : public MSGridderBase
+{
+public:
+	using MSGridderBase::InversionRow;
+	using MSGridderBase::readAndWeightVisibilities;
+	using MSGridderBase::totalWeight;
+	
+	virtual void Invert() override { }
+	virtual void Predict(double* image) override { }
+	virtual void Predict(double* real, double* imaginary) override { }
+	virtual double *ImageRealResult() override { return nullptr; }
+	virtual double *ImageImaginaryResult() override { return nullptr; }
+	virtual bool HasGriddingCorrectionImage() const override { return false; }
+	virtual void GetGriddingCorrectionImage(double *image) const override { }
+
+private:
+	virtual size_t getSuggestedWGridSize() const override { return 1; }
+};
+
+struct DualGridPSFFixture
+{
+	DualGridPSFFixture() :
+		size(64), channelCount(4), rowCount(100),
+		pixelSize(0.01),
+		frequencies({ 140e6, 147e6, 154e6, 161e6 }),
+		band(channelCount, frequencies.data()),
+		rng(42)
+	{
+		// The last channel is not gridded in this pass
+		for(size_t ch=0; ch!=channelCount; ++ch)
+			isSelected[ch] = ch != channelCount-1;
+		std::uniform_real_distribution<double> uvDist(-60.0, 60.0), wDist(0.0, 20.0), valueDist(-1.0, 1.0), weightDist(0.0, 2.0);
+		for(size_t row=0; row!=rowCount; ++row)
+		{
+			us.push_back(uvDist(rng));
+			vs.push_back(uvDist(rng));
+			ws.push_back(wDist(rng));
+			for(size_t ch=0; ch!=channelCount; ++ch)
+			{
+				data.emplace_back(valueDist(rng), valueDist(rng));
+				// Some samples are flagged
+				weights.push_back(row%7 == ch ? 0.0 : weightDist(rng));
+			}
+		}
+	}
+	
+	/**
+	 * Read all rows, either as a dual-grid inversion that reads the PSF next to the
+	 * data, or as a separate PSF inversion. Returns the PSF visibilities, after weighting.
+	 */
+	std::vector<std::complex<float>> readPSF(bool dualGrid, WeightMode weightMode, enum MeasurementSetGridder::VisibilityWeightingMode visibilityWeighting, double& totalWeight)
+	{
+		ImageWeights imageWeights(weightMode, size, size, pixelSize, pixelSize);
+		imageWeights.Grid(us.data(), vs.data(), weights.data(), rowCount, band, 1);
+		imageWeights.FinishGridding();
+		
+		RowGridder gridder;
+		gridder.SetDoImagePSF(!dualGrid);
+		gridder.SetDoDualGridPSF(dualGrid);
+		gridder.SetWeighting(weightMode);
+		gridder.SetVisibilityWeightingMode(visibilityWeighting);
+		gridder.SetPrecalculatedWeightInfo(&imageWeights);
+		
+		RowProvider provider(channelCount);
+		std::vector<std::complex<float>> psf(rowCount * channelCount), dataBuffer(channelCount), modelBuffer(channelCount);
+		std::vector<float> weightBuffer(channelCount);
+		for(size_t row=0; row!=rowCount; ++row)
+		{
+			provider.SetRow(&data[row * channelCount], &weights[row * channelCount]);
+			RowGridder::InversionRow rowData;
+			rowData.uvw[0] = us[row];
+			rowData.uvw[1] = vs[row];
+			rowData.uvw[2] = ws[row];
+			rowData.dataDescId = 0;
+			if(dualGrid)
+			{
+				rowData.data = dataBuffer.data();
+				rowData.psfData = &psf[row * channelCount];
+			}
+			else {
+				rowData.data = &psf[row * channelCount];
+			}
+			gridder.readAndWeightVisibilities<1>(provider, rowData, band, weightBuffer.data(), modelBuffer.data(), isSelected);
+		}
+		totalWeight = gridder.totalWeight();
+		return psf;
+	}
+	
+	std::vector<double> makeImage(const std::vector<std::complex<float>>& psf, double totalWeight)
+	{
+		ImageBufferAllocator allocator;
+		WStackingGridder gridder(size, size, pixelSize, pixelSize, 1, &allocator, 7, 63);
+		gridder.PrepareWLayers(4, 1e9, 0.0, 12.0);
+		gridder.StartInversionPass(0);
+		for(size_t row=0; row!=rowCount; ++row)
+		{
+			for(size_t ch=0; ch!=channelCount; ++ch)
+			{
+				if(!isSelected[ch])
+					continue;
+				const double lambda = band.ChannelWavelength(ch);
+				gridder.AddDataSample(psf[row * channelCount + ch], us[row]/lambda, vs[row]/lambda, ws[row]/lambda);
+			}
+		}
+		gridder.FinishInversionPass();
+		gridder.FinalizeImage(1.0/totalWeight, false);
+		return std::vector<double>(gridder.RealImage(), gridder.RealImage() + size*size);
+	}
+	
+	size_t size, channelCount, rowCount;
+	double pixelSize;
+	std::vector<double> frequencies;
+	BandData band;
+	std::mt19937 rng;
+	bool isSelected[4];
+	std::vector<double> us, vs, ws;
+	std::vector<std::complex<float>> data;
+	std::vector<float> weights;
+};
+
+BOOST_FIXTURE_TEST_CASE( sameAsSeparatePSF, DualGridPSFFixture )
+{
+	const WeightMode weightModes[] = { WeightMode(WeightMode::NaturalWeighted), WeightMode(WeightMode::UniformWeighted) };
+	const enum MeasurementSetGridder::VisibilityWeightingMode visibilityWeightings[] = {
+		MeasurementSetGridder::NormalVisibilityWeighting,
+		MeasurementSetGridder::SquaredVisibilityWeighting,
+		MeasurementSetGridder::UnitVisibilityWeighting
+	};
+	for(const WeightMode& weightMode : weightModes)
+	{
+		for(enum MeasurementSetGridder::VisibilityWeightingMode visibilityWeighting : visibilityWeightings)
+		{
+			double separateWeight, dualWeight;
+			std::vector<std::complex<float>>
+				separatePSF = readPSF(false, weightMode, visibilityWeighting, separateWeight),
+				dualPSF = readPSF(true, weightMode, visibilityWeighting, dualWeight);
+			BOOST_CHECK_GT(separateWeight, 0.0);
+			BOOST_CHECK_EQUAL(dualWeight, separateWeight);
+			
+			std::vector<double>
+				separateImage = makeImage(separatePSF, separateWeight),
+				dualImage = makeImage(dualPSF, dualWeight);
+			const double peak = separateImage[size/2 + (size/2)*size];
+			BOOST_CHECK_GT(peak, 0.0);
+			for(size_t i=0; i!=size*size; ++i)
+				BOOST_CHECK_SMALL(dualImage[i] - separateImage[i], 1e-6 * peak);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
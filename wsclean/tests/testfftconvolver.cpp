@@ -0,0 +1,105 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../fftconvolver.h"
+#include "../uvector.h"
+
+#include <random>
+
+BOOST_AUTO_TEST_SUITE(fft_convolver)
+
+struct FFTConvolverFixture
+{
+	FFTConvolverFixture() :
+		width(24), height(16), kernelSize(5),
+		kernel(kernelSize * kernelSize),
+		preparedKernel(width * height, 0.0)
+	{
+		std::mt19937 rng(42);
+		std::normal_distribution<double> dist(0.0, 1.0);
+		for(double& k : kernel)
+			k = dist(rng);
+		FFTConvolver::PrepareSmallKernel(preparedKernel.data(), width, height, kernel.data(), kernelSize);
+		// The images are stored with an extra value in front, so that
+		// unaligned images can be tested too
+		images.resize(6);
+		for(ao::uvector<double>& image : images)
+		{
+			image.resize(width * height + 1);
+			for(double& v : image)
+				v = dist(rng);
+		}
+	}
+	
+	/**
+	 * Direct (circular) convolution with the small kernel
+	 */
+	ao::uvector<double> directConvolution(const double* image) const
+	{
+		ao::uvector<double> result(width * height, 0.0);
+		for(size_t y=0; y!=height; ++y)
+		{
+			for(size_t x=0; x!=width; ++x)
+			{
+				for(size_t ky=0; ky!=kernelSize; ++ky)
+				{
+					for(size_t kx=0; kx!=kernelSize; ++kx)
+					{
+						size_t
+							sx = (x + width + kernelSize/2 - kx) % width,
+							sy = (y + height + kernelSize/2 - ky) % height;
+						result[x + y*width] += kernel[kx + ky*kernelSize] * image[sx + sy*width];
+					}
+				}
+			}
+		}
+		return result;
+	}
+	
+	void checkEqual(const double* image, const ao::uvector<double>& expected)
+	{
+		for(size_t i=0; i!=width*height; ++i)
+			BOOST_CHECK_SMALL(image[i] - expected[i], 1e-10);
+	}
+	
+	size_t width, height, kernelSize;
+	ao::uvector<double> kernel, preparedKernel;
+	std::vector<ao::uvector<double>> images;
+};
+
+BOOST_FIXTURE_TEST_CASE( convolveSameSize, FFTConvolverFixture )
+{
+	ao::uvector<double> expected = directConvolution(images[0].data());
+	FFTConvolver::ConvolveSameSize(images[0].data(), preparedKernel.data(), width, height);
+	checkEqual(images[0].data(), expected);
+}
+
+BOOST_FIXTURE_TEST_CASE( reuseKernel, FFTConvolverFixture )
+{
+	FFTConvolver convolver(width, height);
+	convolver.SetKernel(preparedKernel.data());
+	for(size_t i=0; i!=images.size(); ++i)
+	{
+		double* image = images[i].data() + (i%2);
+		ao::uvector<double> expected = directConvolution(image);
+		convolver.ConvolveImage(image);
+		checkEqual(image, expected);
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE( batched, FFTConvolverFixture )
+{
+	FFTConvolver convolver(width, height);
+	convolver.SetKernel(preparedKernel.data());
+	std::vector<ao::uvector<double>> expected;
+	ao::uvector<double*> imagePtrs;
+	for(size_t i=0; i!=images.size(); ++i)
+	{
+		imagePtrs.push_back(images[i].data() + (i%2));
+		expected.push_back(directConvolution(imagePtrs.back()));
+	}
+	convolver.ConvolveImages(imagePtrs, 4);
+	for(size_t i=0; i!=images.size(); ++i)
+		checkEqual(imagePtrs[i], expected[i]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
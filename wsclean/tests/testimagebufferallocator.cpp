@@ -0,0 +1,113 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../wsclean/imagebufferallocator.h"
+
+#include <boost/thread/thread.hpp>
+
+BOOST_AUTO_TEST_SUITE(image_buffer_allocator)
+
+BOOST_AUTO_TEST_CASE( reuse_after_free )
+{
+	ImageBufferAllocator allocator;
+	double* a = allocator.Allocate(100);
+	a[99] = 1.0;
+	allocator.Free(a);
+	double* b = allocator.Allocate(100);
+	BOOST_CHECK_EQUAL(a, b);
+	allocator.Free(b);
+}
+
+BOOST_AUTO_TEST_CASE( alternating_sizes )
+{
+	ImageBufferAllocator allocator;
+	double* a = allocator.Allocate(100);
+	std::complex<double>* b = allocator.AllocateComplex(200);
+	double* c = allocator.Allocate(300);
+	allocator.Free(a);
+	allocator.Free(b);
+	allocator.Free(c);
+	// A change of size should no longer release the buffers of other sizes
+	BOOST_CHECK_EQUAL(allocator.Allocate(100), a);
+	BOOST_CHECK_EQUAL(allocator.AllocateComplex(200), b);
+	BOOST_CHECK_EQUAL(allocator.Allocate(300), c);
+	allocator.Free(a);
+	allocator.Free(b);
+	allocator.Free(c);
+}
+
+BOOST_AUTO_TEST_CASE( distinct_buffers )
+{
+	ImageBufferAllocator allocator;
+	ImageBufferAllocator::Ptr a, b;
+	allocator.Allocate(64, a);
+	allocator.Allocate(64, b);
+	BOOST_CHECK_NE(a.data(), b.data());
+	for(size_t i=0; i!=64; ++i)
+	{
+		a[i] = 1.0;
+		b[i] = 2.0;
+	}
+	for(size_t i=0; i!=64; ++i)
+		BOOST_CHECK_EQUAL(a[i], 1.0);
+}
+
+BOOST_AUTO_TEST_CASE( double_free )
+{
+	ImageBufferAllocator allocator;
+	double* a = allocator.Allocate(10);
+	allocator.Free(a);
+	BOOST_CHECK_THROW(allocator.Free(a), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE( free_unused )
+{
+	ImageBufferAllocator allocator;
+	double* a = allocator.Allocate(10);
+	double* b = allocator.Allocate(10);
+	allocator.Free(a);
+	allocator.FreeUnused();
+	b[9] = 1.0;
+	allocator.Free(b);
+}
+
+BOOST_AUTO_TEST_CASE( memory_placement )
+{
+	ImageBufferAllocator allocator;
+	allocator.SetMemoryPlacement(true, true);
+	const size_t size = 10*1024*1024;
+	double* a = allocator.Allocate(size);
+	for(size_t i=0; i!=size; ++i)
+		a[i] = 1.0;
+	allocator.Free(a);
+	// Large buffers bypass the thread cache; reusing it releases its pages
+	double* b = allocator.Allocate(size);
+	BOOST_CHECK_EQUAL(a, b);
+	for(size_t i=0; i!=size; ++i)
+		b[i] = 2.0;
+	BOOST_CHECK_EQUAL(b[size-1], 2.0);
+	allocator.Free(b);
+}
+
+static void allocateInThread(ImageBufferAllocator* allocator, size_t size)
+{
+	for(size_t i=0; i!=1000; ++i)
+	{
+		ImageBufferAllocator::Ptr a, b;
+		allocator->Allocate(size, a);
+		allocator->Allocate(size*2, b);
+		a[size-1] = 1.0;
+		b[size*2-1] = 2.0;
+	}
+}
+
+BOOST_AUTO_TEST_CASE( multiple_threads )
+{
+	ImageBufferAllocator allocator;
+	boost::thread_group threads;
+	for(size_t t=0; t!=4; ++t)
+		threads.add_thread(new boost::thread(&allocateInThread, &allocator, 100 + t));
+	threads.join_all();
+	allocator.FreeUnused();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -74,7 +74,7 @@ struct AdvImageSetFixture : public ImageSetFixture
 		image(4, 0.0)
 	{
 		writer.SetImageDimensions(2, 2);
-		cSet.Initialize(writer, 2, 2, "wsctest", allocator);
+		cSet.Initialize(writer, 2, 2, "wsctest");
 		image[0] = 2.0;
 		cSet.Store(image.data(), Polarization::XX, 0, false);
 		image[0] = -1.0;
@@ -92,6 +92,31 @@ BOOST_FIXTURE_TEST_CASE( load , AdvImageSetFixture)
 	BOOST_CHECK_EQUAL(image[0], 20.0);
 }
 	
+BOOST_AUTO_TEST_CASE( loadSpilled )
+{
+	FitsWriter writer;
+	writer.SetImageDimensions(2, 2);
+	CachedImageSet cSet;
+	cSet.Initialize(writer, 2, 3, "wsctest-spilled");
+	// Only two images fit in memory, so the others are written to disk
+	cSet.SetMemoryBudget(2.0 * 4.0 * sizeof(double));
+	ao::uvector<double> image(4);
+	for(size_t f=0; f!=3; ++f)
+	{
+		image[0] = f;
+		cSet.Store(image.data(), Polarization::XX, f, false);
+		image[0] = -double(f);
+		cSet.Store(image.data(), Polarization::YY, f, false);
+	}
+	for(size_t f=0; f!=3; ++f)
+	{
+		cSet.Load(image.data(), Polarization::XX, f, false);
+		BOOST_CHECK_EQUAL(image[0], double(f));
+		cSet.Load(image.data(), Polarization::YY, f, false);
+		BOOST_CHECK_EQUAL(image[0], -double(f));
+	}
+}
+
 BOOST_FIXTURE_TEST_CASE( loadAndAverage , AdvImageSetFixture)
 {
 	ImageSet dset(&table, allocator, 1, false, 2, 2);
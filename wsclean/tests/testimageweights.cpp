@@ -0,0 +1,144 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../banddata.h"
+#include "../imageweights.h"
+
+#include "../wsclean/imageweightcache.h"
+
+#include <boost/filesystem/operations.hpp>
+
+#include <fstream>
+#include <random>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(image_weights)
+
+/**
+ * Grid the same rows with the parallel row gridding and sample by sample.
+ */
+BOOST_AUTO_TEST_CASE( parallelGridding )
+{
+	const size_t size = 64, rowCount = 2000, channelCount = 5, polarizationCount = 2;
+	const double frequencies[channelCount] = { 140e6, 145e6, 150e6, 155e6, 160e6 };
+	const BandData band(channelCount, frequencies);
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<double> uvDist(-90.0, 90.0);
+	std::uniform_int_distribution<int> weightDist(0, 4);
+	std::vector<double> us(rowCount), vs(rowCount);
+	std::vector<float> weights(rowCount * channelCount * polarizationCount);
+	for(size_t row=0; row!=rowCount; ++row)
+	{
+		us[row] = uvDist(rng);
+		vs[row] = uvDist(rng);
+	}
+	// Integer weights make the sums independent of the order of gridding
+	for(float& weight : weights)
+		weight = weightDist(rng);
+	
+	ImageWeights expected(WeightMode(WeightMode::NaturalWeighted), size, size, 0.01, 0.01);
+	for(size_t row=0; row!=rowCount; ++row)
+	{
+		for(size_t ch=0; ch!=channelCount; ++ch)
+		{
+			const double wavelength = band.ChannelWavelength(ch);
+			for(size_t p=0; p!=polarizationCount; ++p)
+				expected.Grid(us[row] / wavelength, vs[row] / wavelength, weights[(row*channelCount + ch)*polarizationCount + p]);
+		}
+	}
+	std::vector<double> expectedGrid(size * size);
+	expected.GetGrid(expectedGrid.data());
+	
+	double gridSum = 0.0;
+	for(double value : expectedGrid)
+		gridSum += value;
+	BOOST_CHECK_GT(gridSum, 0.0);
+	
+	for(size_t threadCount : { 1, 4 })
+	{
+		ImageWeights weightsInParallel(WeightMode(WeightMode::NaturalWeighted), size, size, 0.01, 0.01, 1.0, threadCount);
+		weightsInParallel.Grid(us.data(), vs.data(), weights.data(), rowCount, band, polarizationCount);
+		std::vector<double> grid(size * size);
+		weightsInParallel.GetGrid(grid.data());
+		for(size_t i=0; i!=grid.size(); ++i)
+			BOOST_CHECK_EQUAL(grid[i], expectedGrid[i]);
+	}
+}
+
+static void gridRandomWeights(ImageWeights& weights)
+{
+	std::mt19937 rng(7);
+	std::uniform_real_distribution<double> uvDist(-30.0, 30.0), weightDist(0.0, 2.0);
+	for(size_t i=0; i!=1000; ++i)
+		weights.Grid(uvDist(rng), uvDist(rng), weightDist(rng));
+	weights.FinishGridding();
+}
+
+BOOST_AUTO_TEST_CASE( storeAndLoad )
+{
+	const std::string filename = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).string();
+	ImageWeights stored(WeightMode(WeightMode::UniformWeighted), 64, 64, 0.01, 0.01);
+	gridRandomWeights(stored);
+	stored.Store(filename, "test key");
+	
+	ImageWeights loaded(WeightMode(WeightMode::UniformWeighted), 64, 64, 0.01, 0.01);
+	BOOST_CHECK(loaded.Load(filename, "test key"));
+	std::vector<double> storedGrid(64*64), loadedGrid(64*64);
+	stored.GetGrid(storedGrid.data());
+	loaded.GetGrid(loadedGrid.data());
+	for(size_t i=0; i!=storedGrid.size(); ++i)
+		BOOST_CHECK_EQUAL(loadedGrid[i], storedGrid[i]);
+	BOOST_CHECK_EQUAL(loaded.Checksum(), stored.Checksum());
+	boost::filesystem::remove(filename);
+}
+
+BOOST_AUTO_TEST_CASE( loadWithOtherKey )
+{
+	const std::string filename = (boost::filesystem::temp_directory_path() / boost::filesystem::unique_path()).string();
+	ImageWeights stored(WeightMode(WeightMode::UniformWeighted), 64, 64, 0.01, 0.01);
+	gridRandomWeights(stored);
+	stored.Store(filename, "test key");
+	
+	// Other keys of the same and of a different length, and other dimensions, do not match
+	ImageWeights loaded(WeightMode(WeightMode::UniformWeighted), 64, 64, 0.01, 0.01);
+	BOOST_CHECK(!loaded.Load(filename, "test kez"));
+	BOOST_CHECK(!loaded.Load(filename, "other test key"));
+	BOOST_CHECK(!loaded.Load(filename + "-missing", "test key"));
+	ImageWeights otherSize(WeightMode(WeightMode::UniformWeighted), 128, 128, 0.01, 0.01);
+	BOOST_CHECK(!otherSize.Load(filename, "test key"));
+	
+	// The grid is not changed when loading fails
+	std::vector<double> grid(64*64);
+	loaded.GetGrid(grid.data());
+	for(double value : grid)
+		BOOST_CHECK_EQUAL(value, 0.0);
+	boost::filesystem::remove(filename);
+}
+
+BOOST_AUTO_TEST_CASE( storageManagerModificationTime )
+{
+	const boost::filesystem::path directory = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+	const std::vector<int> weightManagers = { 1 };
+	BOOST_CHECK_EQUAL(ImageWeightCache::StorageManagerModificationTime(directory.string(), weightManagers), 0);
+	boost::filesystem::create_directory(directory);
+	const char* filenames[] = { "table.dat", "table.f0", "table.f1", "table.f1_TSM0", "table.f10" };
+	for(const char* filename : filenames)
+	{
+		const boost::filesystem::path file = directory / filename;
+		std::ofstream(file.string()) << "column";
+		boost::filesystem::last_write_time(file, 1000000);
+	}
+	BOOST_CHECK_EQUAL(ImageWeightCache::StorageManagerModificationTime(directory.string(), weightManagers), int64_t(1000000) * 1000000000);
+	
+	// Writing other storage managers, e.g. that of the model data, does not change the time
+	boost::filesystem::last_write_time(directory / "table.dat", 1000020);
+	boost::filesystem::last_write_time(directory / "table.f0", 1000020);
+	boost::filesystem::last_write_time(directory / "table.f10", 1000020);
+	BOOST_CHECK_EQUAL(ImageWeightCache::StorageManagerModificationTime(directory.string(), weightManagers), int64_t(1000000) * 1000000000);
+	
+	// Rewriting a file of the storage manager changes the time
+	boost::filesystem::last_write_time(directory / "table.f1_TSM0", 1000010);
+	BOOST_CHECK_EQUAL(ImageWeightCache::StorageManagerModificationTime(directory.string(), weightManagers), int64_t(1000010) * 1000000000);
+	boost::filesystem::remove_all(directory);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,118 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../deconvolution/peaktracker.h"
+#include "../deconvolution/simpleclean.h"
+
+#include "../uvector.h"
+
+#include <random>
+
+BOOST_AUTO_TEST_SUITE(peak_tracker)
+
+struct PeakTrackerFixture
+{
+	PeakTrackerFixture() :
+		width(300), height(200),
+		image(width * height),
+		mask(width * height),
+		rng(42)
+	{
+		std::normal_distribution<double> dist(0.0, 1.0);
+		for(size_t i=0; i!=width*height; ++i)
+		{
+			image[i] = dist(rng);
+			mask[i] = (i % 7) != 0;
+		}
+	}
+
+	void change(size_t x1, size_t y1, size_t x2, size_t y2, double factor)
+	{
+		std::normal_distribution<double> dist(0.0, 1.0);
+		for(size_t y=y1; y!=y2; ++y)
+		{
+			for(size_t x=x1; x!=x2; ++x)
+				image[x + y*width] = dist(rng) * factor;
+		}
+	}
+
+	void check(const PeakTracker& tracker, const bool* maskPtr, bool allowNegatives)
+	{
+		size_t x, y, expectedX, expectedY;
+		double value = tracker.Peak(x, y), expectedValue;
+		if(maskPtr)
+			expectedValue = SimpleClean::FindPeakWithMask(image.data(), width, height, expectedX, expectedY, allowNegatives, 0, height, maskPtr, 3, 5);
+		else
+			expectedValue = SimpleClean::FindPeakSimple(image.data(), width, height, expectedX, expectedY, allowNegatives, 0, height, 3, 5);
+		BOOST_CHECK_EQUAL(x, expectedX);
+		BOOST_CHECK_EQUAL(y, expectedY);
+		BOOST_CHECK_EQUAL(value, expectedValue);
+	}
+
+	void run(bool useMask, bool allowNegatives)
+	{
+		const bool* maskPtr = useMask ? mask.data() : nullptr;
+		PeakTracker tracker(width, height, allowNegatives, maskPtr, 3, 5, 16);
+		tracker.Reset(image.data());
+		check(tracker, maskPtr, allowNegatives);
+		std::uniform_int_distribution<size_t> xDist(0, width-1), yDist(0, height-1);
+		for(size_t i=0; i!=50; ++i)
+		{
+			size_t
+				xa = xDist(rng), xb = xDist(rng),
+				ya = yDist(rng), yb = yDist(rng);
+			// Decrease the values, like a subtraction would do, with an occasional increase
+			const double factor = (i%10 == 9) ? 5.0 : 0.5;
+			change(std::min(xa, xb), std::min(ya, yb), std::max(xa, xb)+1, std::max(ya, yb)+1, factor);
+			tracker.Update(image.data(), std::min(xa, xb), std::min(ya, yb), std::max(xa, xb)+1, std::max(ya, yb)+1);
+			check(tracker, maskPtr, allowNegatives);
+		}
+	}
+
+	size_t width, height;
+	ao::uvector<double> image;
+	ao::uvector<bool> mask;
+	std::mt19937 rng;
+};
+
+BOOST_FIXTURE_TEST_CASE( withoutMask, PeakTrackerFixture )
+{
+	run(false, true);
+}
+
+BOOST_FIXTURE_TEST_CASE( positiveOnly, PeakTrackerFixture )
+{
+	run(false, false);
+}
+
+BOOST_FIXTURE_TEST_CASE( withMask, PeakTrackerFixture )
+{
+	run(true, true);
+}
+
+BOOST_FIXTURE_TEST_CASE( equalValues, PeakTrackerFixture )
+{
+	// Of equal values, the first one in the image should be selected
+	image.assign(width*height, 0.0);
+	image[100 + 50*width] = 2.0;
+	image[20 + 60*width] = 2.0;
+	image[200 + 10*width] = -2.0;
+	PeakTracker tracker(width, height, true, nullptr, 0, 0, 16);
+	tracker.Reset(image.data());
+	size_t x, y;
+	BOOST_CHECK_EQUAL(tracker.Peak(x, y), -2.0);
+	BOOST_CHECK_EQUAL(x, 200);
+	BOOST_CHECK_EQUAL(y, 10);
+}
+
+BOOST_FIXTURE_TEST_CASE( noPeak, PeakTrackerFixture )
+{
+	mask.assign(width*height, false);
+	PeakTracker tracker(width, height, true, mask.data(), 0, 0);
+	tracker.Reset(image.data());
+	size_t x, y;
+	BOOST_CHECK(std::isnan(tracker.Peak(x, y)));
+	BOOST_CHECK_EQUAL(x, width);
+	BOOST_CHECK_EQUAL(y, height);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,148 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../msproviders/polarizationconverter.h"
+
+#include <cmath>
+#include <limits>
+#include <random>
+
+BOOST_AUTO_TEST_SUITE(polarization_converter)
+
+struct PolarizationConverterFixture
+{
+	PolarizationConverterFixture() :
+		channelCount(37),
+		linear({ Polarization::XX, Polarization::XY, Polarization::YX, Polarization::YY }),
+		circular({ Polarization::RR, Polarization::RL, Polarization::LR, Polarization::LL })
+	{ }
+	
+	void fill(size_t polCount)
+	{
+		std::mt19937 rng(42);
+		std::uniform_real_distribution<float> dist(-1.0, 1.0);
+		std::uniform_int_distribution<int> flagDist(0, 9);
+		const size_t n = channelCount * polCount;
+		data.resize(n);
+		weights.resize(n);
+		flags.resize(n);
+		for(size_t i=0; i!=n; ++i)
+		{
+			data[i] = std::complex<float>(dist(rng), dist(rng));
+			weights[i] = dist(rng) + 1.0;
+			flags[i] = flagDist(rng) == 0;
+		}
+		// Some values that are not finite
+		data[3] = std::complex<float>(std::numeric_limits<float>::quiet_NaN(), 0.0);
+		data[n/2] = std::complex<float>(0.0, std::numeric_limits<float>::infinity());
+	}
+	
+	bool isValid(size_t index) const
+	{
+		return !flags[index] && std::isfinite(data[index].real()) && std::isfinite(data[index].imag());
+	}
+	
+	/**
+	 * Check a conversion of two input polarizations a and b, with out = factor x (a - sign x b).
+	 */
+	void checkCombination(const std::vector<PolarizationEnum>& polsIn, PolarizationEnum polOut, size_t indexA, size_t indexB, float sign, std::complex<float> factor)
+	{
+		const size_t polCount = polsIn.size();
+		fill(polCount);
+		PolarizationConverter converter(polsIn, polOut);
+		BOOST_CHECK_EQUAL(converter.OutputPolarizationCount(), 1);
+		std::vector<std::complex<float>> result(channelCount);
+		std::vector<float> resultWeights(channelCount);
+		converter.ConvertWeightedData(result.data(), data.data(), weights.data(), reinterpret_cast<const bool*>(flags.data()), channelCount);
+		converter.ConvertWeights(resultWeights.data(), data.data(), weights.data(), reinterpret_cast<const bool*>(flags.data()), channelCount);
+		for(size_t ch=0; ch!=channelCount; ++ch)
+		{
+			const size_t a = ch*polCount + indexA, b = ch*polCount + indexB;
+			std::complex<float> expected = 0.0;
+			if(isValid(a) && isValid(b))
+				expected = factor * (data[a]*weights[a] - sign * data[b]*weights[b]);
+			BOOST_CHECK_SMALL(std::abs(result[ch] - expected), 1e-6f);
+			
+			float expectedWeight = 0.0;
+			if(isValid(b))
+				expectedWeight = (isValid(a) ? weights[a] : 0.0) + weights[b];
+			BOOST_CHECK_EQUAL(resultWeights[ch], expectedWeight);
+		}
+	}
+	
+	size_t channelCount;
+	std::vector<PolarizationEnum> linear, circular;
+	std::vector<std::complex<float>> data;
+	std::vector<float> weights;
+	// std::vector<bool> is packed
+	std::vector<char> flags;
+};
+
+BOOST_FIXTURE_TEST_CASE( instrumental, PolarizationConverterFixture )
+{
+	fill(4);
+	PolarizationConverter converter(linear, Polarization::Instrumental);
+	BOOST_CHECK_EQUAL(converter.OutputPolarizationCount(), 4);
+	std::vector<std::complex<float>> result(channelCount * 4);
+	std::vector<std::complex<float>> resultWeights(channelCount * 4);
+	converter.ConvertWeightedData(result.data(), data.data(), weights.data(), reinterpret_cast<const bool*>(flags.data()), channelCount);
+	converter.ConvertWeights(resultWeights.data(), data.data(), weights.data(), reinterpret_cast<const bool*>(flags.data()), channelCount);
+	for(size_t i=0; i!=channelCount * 4; ++i)
+	{
+		BOOST_CHECK_EQUAL(result[i], isValid(i) ? data[i]*weights[i] : std::complex<float>(0.0));
+		BOOST_CHECK_EQUAL(resultWeights[i], std::complex<float>(isValid(i) ? weights[i] : 0.0));
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE( select, PolarizationConverterFixture )
+{
+	for(size_t polIndex=0; polIndex!=4; ++polIndex)
+	{
+		fill(4);
+		PolarizationConverter converter(circular, circular[polIndex]);
+		std::vector<std::complex<float>> result(channelCount);
+		std::vector<float> resultWeights(channelCount);
+		converter.ConvertWeightedData(result.data(), data.data(), weights.data(), reinterpret_cast<const bool*>(flags.data()), channelCount);
+		converter.ConvertWeights(resultWeights.data(), data.data(), weights.data(), reinterpret_cast<const bool*>(flags.data()), channelCount);
+		for(size_t ch=0; ch!=channelCount; ++ch)
+		{
+			const size_t i = ch*4 + polIndex;
+			BOOST_CHECK_EQUAL(result[ch], isValid(i) ? data[i]*weights[i] : std::complex<float>(0.0));
+			BOOST_CHECK_EQUAL(resultWeights[ch], isValid(i) ? weights[i] : 0.0);
+		}
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE( linearToStokes, PolarizationConverterFixture )
+{
+	const std::complex<float> minusI(0.0, -1.0);
+	checkCombination(linear, Polarization::StokesI, 0, 3, -1.0, 1.0);
+	checkCombination(linear, Polarization::StokesQ, 0, 3, 1.0, 1.0);
+	checkCombination(linear, Polarization::StokesU, 1, 2, -1.0, 1.0);
+	checkCombination(linear, Polarization::StokesV, 1, 2, 1.0, minusI);
+}
+
+BOOST_FIXTURE_TEST_CASE( circularToStokes, PolarizationConverterFixture )
+{
+	const std::complex<float> minusI(0.0, -1.0);
+	checkCombination(circular, Polarization::StokesI, 0, 3, -1.0, 1.0);
+	checkCombination(circular, Polarization::StokesQ, 1, 2, -1.0, 1.0);
+	checkCombination(circular, Polarization::StokesU, 1, 2, 1.0, minusI);
+	checkCombination(circular, Polarization::StokesV, 0, 3, 1.0, 1.0);
+}
+
+BOOST_FIXTURE_TEST_CASE( otherLayouts, PolarizationConverterFixture )
+{
+	// Two polarizations, and a layout that is not specialized
+	checkCombination({ Polarization::XX, Polarization::YY }, Polarization::StokesI, 0, 1, -1.0, 1.0);
+	checkCombination({ Polarization::YY, Polarization::XX, Polarization::XY }, Polarization::StokesQ, 1, 0, 1.0, 1.0);
+}
+
+BOOST_FIXTURE_TEST_CASE( unsupported, PolarizationConverterFixture )
+{
+	fill(2);
+	PolarizationConverter converter({ Polarization::XX, Polarization::YY }, Polarization::StokesU);
+	std::vector<std::complex<float>> result(channelCount);
+	BOOST_CHECK_THROW(converter.ConvertWeightedData(result.data(), data.data(), weights.data(), reinterpret_cast<const bool*>(flags.data()), channelCount), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,175 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../rmsimage.h"
+
+#include "../wsclean/imagebufferallocator.h"
+
+#include <cmath>
+#include <random>
+
+BOOST_AUTO_TEST_SUITE(rms_image)
+
+struct RMSImageFixture
+{
+	RMSImageFixture() :
+		width(96), height(80),
+		image(width, height, allocator)
+	{
+		std::mt19937 rng(42);
+		std::normal_distribution<double> dist(0.0, 1.0);
+		for(size_t y=0; y!=height; ++y)
+		{
+			for(size_t x=0; x!=width; ++x)
+			{
+				// Noise with a slowly varying level
+				double level = 1.0 + 0.5 * std::sin(x * 2.0 * M_PI / width) * std::cos(y * 2.0 * M_PI / height);
+				image[x + y*width] = dist(rng) * level;
+			}
+		}
+	}
+	
+	/**
+	 * The sliding minimum as it was implemented before the van Herk/Gil-Werman algorithm was used.
+	 */
+	void referenceSlidingMinimum(Image& output, const Image& input, size_t windowSize)
+	{
+		output = Image(width, height, allocator);
+		Image temp(output);
+		for(size_t y=0; y!=height; ++y)
+		{
+			for(size_t x=0; x!=width; ++x)
+			{
+				size_t left = std::max(x, windowSize/2) - windowSize/2;
+				size_t right = std::min(x, width-windowSize/2) + windowSize/2;
+				temp[x + y*width] = *std::min_element(&input[y*width] + left, &input[y*width] + right);
+			}
+		}
+		for(size_t x=0; x!=width; ++x)
+		{
+			for(size_t y=0; y!=height; ++y)
+			{
+				size_t top = std::max(y, windowSize/2) - windowSize/2;
+				size_t bottom = std::min(y, height-windowSize/2) + windowSize/2;
+				double minimum = temp[top*width + x];
+				for(size_t winY=top; winY!=bottom; ++winY)
+					minimum = std::min(minimum, temp[winY*width + x]);
+				output[y*width + x] = minimum;
+			}
+		}
+	}
+	
+	/**
+	 * Direct calculation of the RMS in a periodic Gaussian window.
+	 */
+	void referenceRMS(Image& output, const Image& image, double sigma)
+	{
+		output = Image(width, height, 0.0, allocator);
+		const int radius = std::ceil(sigma * 6.0);
+		ao::uvector<double> kernel(radius*2 + 1);
+		double kernelSum = 0.0;
+		for(int i=-radius; i<=radius; ++i)
+		{
+			kernel[i+radius] = std::exp(-0.5 * i * i / (sigma * sigma));
+			kernelSum += kernel[i+radius];
+		}
+		for(size_t y=0; y!=height; ++y)
+		{
+			for(size_t x=0; x!=width; ++x)
+			{
+				double sum = 0.0;
+				for(int dy=-radius; dy<=radius; ++dy)
+				{
+					for(int dx=-radius; dx<=radius; ++dx)
+					{
+						size_t
+							sx = (x + width * radius + dx) % width,
+							sy = (y + height * radius + dy) % height;
+						sum += kernel[dx+radius] * kernel[dy+radius] * image[sx + sy*width] * image[sx + sy*width];
+					}
+				}
+				output[x + y*width] = std::sqrt(sum / (kernelSum * kernelSum));
+			}
+		}
+	}
+	
+	ImageBufferAllocator allocator;
+	size_t width, height;
+	Image image;
+};
+
+BOOST_FIXTURE_TEST_CASE( slidingMinimum, RMSImageFixture )
+{
+	for(size_t windowSize : {2, 5, 8, 21, 64})
+	{
+		Image expected, result;
+		referenceSlidingMinimum(expected, image, windowSize);
+		for(size_t threadCount : {1, 3})
+		{
+			RMSImage::SlidingMinimum(result, image, windowSize, threadCount);
+			for(size_t i=0; i!=width*height; ++i)
+				BOOST_CHECK_EQUAL(result[i], expected[i]);
+		}
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE( slidingMaximum, RMSImageFixture )
+{
+	Image expected, result, negated(image);
+	negated.Negate();
+	referenceSlidingMinimum(expected, negated, 9);
+	RMSImage::SlidingMaximum(result, image, 9, 2);
+	for(size_t i=0; i!=width*height; ++i)
+		BOOST_CHECK_EQUAL(result[i], -expected[i]);
+}
+
+BOOST_FIXTURE_TEST_CASE( rms, RMSImageFixture )
+{
+	// A beam of 2 pixels and a window of 3 beams
+	const double pixelScale = 0.001, beamSize = 2.0 * pixelScale, windowSize = 3.0;
+	const double sigma = beamSize * windowSize / (2.0 * std::sqrt(2.0 * std::log(2.0)) * pixelScale);
+	Image expected, result, threadedResult;
+	referenceRMS(expected, image, sigma);
+	RMSImage::Make(result, image, windowSize, beamSize, beamSize, 0.0, pixelScale, pixelScale);
+	RMSImage::Make(threadedResult, image, windowSize, beamSize, beamSize, 0.0, pixelScale, pixelScale, 4);
+	for(size_t i=0; i!=width*height; ++i)
+	{
+		BOOST_CHECK_CLOSE_FRACTION(result[i], expected[i], 0.03);
+		BOOST_CHECK_EQUAL(threadedResult[i], result[i]);
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE( brightSource, RMSImageFixture )
+{
+	// The approximated Gaussian is only accurate up to about twice its sigma
+	const double pixelScale = 0.001, beamSize = 2.0 * pixelScale, windowSize = 3.0;
+	const double sigma = beamSize * windowSize / (2.0 * std::sqrt(2.0 * std::log(2.0)) * pixelScale);
+	image = 0.0;
+	image[48 + 40*width] = 100.0;
+	Image expected, result;
+	referenceRMS(expected, image, sigma);
+	RMSImage::Make(result, image, windowSize, beamSize, beamSize, 0.0, pixelScale, pixelScale, 2);
+	for(size_t y=0; y!=height; ++y)
+	{
+		for(size_t x=0; x!=width; ++x)
+		{
+			const double dx = double(x) - 48.0, dy = double(y) - 40.0;
+			if(dx*dx + dy*dy <= 4.0 * sigma * sigma)
+				BOOST_CHECK_CLOSE_FRACTION(result[x + y*width], expected[x + y*width], 0.05);
+		}
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE( constantRMS, RMSImageFixture )
+{
+	// The RMS of a constant image is the constant, also with windows larger than the image
+	image = 3.0;
+	Image result;
+	for(double windowSize : {1.0, 10.0, 100.0})
+	{
+		RMSImage::Make(result, image, windowSize, 0.002, 0.002, 0.0, 0.001, 0.001, 2);
+		for(size_t i=0; i!=width*height; ++i)
+			BOOST_CHECK_CLOSE_FRACTION(result[i], 3.0, 1e-10);
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,82 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../wsclean/wlayerhistogram.h"
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(w_layer_histogram)
+
+static double maxDistanceToLayer(const std::vector<double>& samples, const std::vector<double>& layers, bool isComplex)
+{
+	double maxDistance = 0.0;
+	for(double sample : samples)
+	{
+		const double w = isComplex ? sample : std::fabs(sample);
+		double distance = std::fabs(w - layers.front());
+		for(double layer : layers)
+			distance = std::min(distance, std::fabs(w - layer));
+		maxDistance = std::max(maxDistance, distance);
+	}
+	return maxDistance;
+}
+
+BOOST_AUTO_TEST_CASE( evenlySpreadSamples )
+{
+	WLayerHistogram histogram(11, 0.0, 100.0, false);
+	BOOST_CHECK_CLOSE(histogram.LayerSpacing(), 10.0, 1e-8);
+	std::vector<double> samples;
+	for(size_t i=0; i!=1001; ++i)
+		samples.push_back(i * 0.1);
+	for(double w : samples)
+		histogram.Add(w);
+	const std::vector<double> layers = histogram.LayerWValues();
+	BOOST_CHECK_LE(layers.size(), 11);
+	BOOST_CHECK_LE(maxDistanceToLayer(samples, layers, false), 5.0 + 1e-8);
+}
+
+BOOST_AUTO_TEST_CASE( samplesWithGap )
+{
+	// Most samples at small w, a few at the largest w, as for long baselines
+	std::mt19937 rng(42);
+	std::exponential_distribution<double> dist(0.2);
+	WLayerHistogram histogram(101, 0.0, 1000.0, false);
+	std::vector<double> samples;
+	for(size_t i=0; i!=10000; ++i)
+	{
+		const double w = std::min(dist(rng), 1000.0);
+		samples.push_back(w);
+	}
+	samples.push_back(-990.0);
+	samples.push_back(1000.0);
+	for(double w : samples)
+		histogram.Add(w);
+	const std::vector<double> layers = histogram.LayerWValues();
+	BOOST_CHECK_LT(layers.size(), 20);
+	BOOST_CHECK_LE(maxDistanceToLayer(samples, layers, false), histogram.LayerSpacing() * 0.5 + 1e-8);
+	for(size_t i=1; i!=layers.size(); ++i)
+		BOOST_CHECK_GE(layers[i] - layers[i-1], histogram.LayerSpacing() - 1e-8);
+}
+
+BOOST_AUTO_TEST_CASE( complexSamples )
+{
+	WLayerHistogram histogram(21, 0.0, 100.0, true);
+	const std::vector<double> samples = { -100.0, -97.5, -3.0, 0.0, 2.0, 55.0, 100.0 };
+	for(double w : samples)
+		histogram.Add(w);
+	// Samples outside the range are not counted
+	histogram.Add(-150.0);
+	const std::vector<double> layers = histogram.LayerWValues();
+	BOOST_CHECK_EQUAL(layers.size(), 4);
+	BOOST_CHECK_LE(maxDistanceToLayer(samples, layers, true), histogram.LayerSpacing() * 0.5 + 1e-8);
+	BOOST_CHECK_GT(layers.front(), -100.0);
+}
+
+BOOST_AUTO_TEST_CASE( noSamples )
+{
+	WLayerHistogram histogram(8, 10.0, 80.0, false);
+	BOOST_CHECK_EQUAL(histogram.LayerWValues().size(), 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,84 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../wsclean/wlayerpassplanner.h"
+
+BOOST_AUTO_TEST_SUITE(w_layer_pass_planner)
+
+BOOST_AUTO_TEST_CASE( enoughMemory )
+{
+	WLayerPassPlanner planner(1024, 1024, false);
+	const WLayerPassPlanner::Plan plan = planner.Make(32, 8, 1e12);
+	BOOST_CHECK_EQUAL(plan.passCount, 1);
+	BOOST_CHECK_EQUAL(plan.threadCount, 8);
+	BOOST_CHECK_EQUAL(plan.layersPerPass, 32);
+	BOOST_CHECK_EQUAL(plan.memory, planner.Memory(8, 32));
+}
+
+BOOST_AUTO_TEST_CASE( fewLayers )
+{
+	WLayerPassPlanner planner(1024, 1024, false);
+	const WLayerPassPlanner::Plan plan = planner.Make(3, 8, 1e12);
+	BOOST_CHECK_EQUAL(plan.passCount, 1);
+	BOOST_CHECK_EQUAL(plan.threadCount, 3);
+}
+
+BOOST_AUTO_TEST_CASE( limitedMemory )
+{
+	WLayerPassPlanner planner(4096, 4096, false);
+	planner.SetVisibilityCount(100000000);
+	for(double maxMemory : { 2e9, 4e9, 8e9, 16e9 })
+	{
+		const WLayerPassPlanner::Plan plan = planner.Make(64, 16, maxMemory);
+		BOOST_CHECK_LE(plan.memory, maxMemory);
+		BOOST_CHECK_EQUAL(plan.memory, planner.Memory(plan.threadCount, plan.layersPerPass));
+		BOOST_CHECK_GE(plan.passCount * plan.layersPerPass, 64);
+		BOOST_CHECK_LT((plan.passCount-1) * plan.layersPerPass, 64);
+		// No plan that fits should be estimated to be faster
+		for(size_t threadCount=1; threadCount<=16; ++threadCount)
+		{
+			for(size_t passCount=1; passCount<=64; ++passCount)
+			{
+				const size_t layersPerPass = (64 + passCount - 1) / passCount;
+				if(planner.Memory(threadCount, layersPerPass) <= maxMemory)
+					BOOST_CHECK_LE(plan.time, planner.Time(passCount, threadCount, 64));
+			}
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE( moreMemoryFewerPasses )
+{
+	WLayerPassPlanner planner(4096, 4096, true);
+	planner.SetVisibilityCount(100000000);
+	size_t previousPassCount = 64;
+	for(double maxMemory : { 2e9, 4e9, 8e9, 16e9, 32e9 })
+	{
+		const WLayerPassPlanner::Plan plan = planner.Make(64, 16, maxMemory);
+		BOOST_CHECK_LE(plan.passCount, previousPassCount);
+		previousPassCount = plan.passCount;
+	}
+	BOOST_CHECK_EQUAL(previousPassCount, 1);
+}
+
+BOOST_AUTO_TEST_CASE( costlyReadingUsesFewerThreads )
+{
+	// With very expensive passes, memory is better spent on layers than on threads
+	WLayerPassPlanner planner(4096, 4096, false);
+	const double maxMemory = planner.Memory(4, 32);
+	planner.SetVisibilityCount(size_t(1e12));
+	const WLayerPassPlanner::Plan plan = planner.Make(64, 16, maxMemory);
+	BOOST_CHECK_LT(plan.threadCount, 16);
+	BOOST_CHECK_LE(plan.passCount, 2);
+}
+
+BOOST_AUTO_TEST_CASE( insufficientMemory )
+{
+	WLayerPassPlanner planner(8192, 8192, false);
+	const WLayerPassPlanner::Plan plan = planner.Make(16, 4, 1e6);
+	BOOST_CHECK_EQUAL(plan.passCount, 16);
+	BOOST_CHECK_EQUAL(plan.threadCount, 1);
+	BOOST_CHECK_EQUAL(plan.layersPerPass, 1);
+	BOOST_CHECK_GT(plan.memory, 1e6);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,407 @@
+#include <boost/test/unit_test.hpp>
+
+#include "../wsclean/imagebufferallocator.h"
+#include "../wsclean/wlayerpassplanner.h"
+#include "../wsclean/wstackinggridder.h"
+
+#include <boost/filesystem/operations.hpp>
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(wstacking_gridder)
+
+struct KernelBlockFixture
+{
+	KernelBlockFixture() :
+		uvWidth(64),
+		rng(42)
+	{
+		std::uniform_real_distribution<double> dist(-1.0, 1.0);
+		uvData.resize(uvWidth * uvWidth);
+		for(std::complex<double>& value : uvData)
+			value = std::complex<double>(dist(rng), dist(rng));
+	}
+	
+	void check(size_t kernelSize, size_t offset)
+	{
+		std::uniform_real_distribution<double> dist(0.0, 1.0);
+		std::vector<double> kernel(kernelSize * kernelSize);
+		for(double& value : kernel)
+			value = dist(rng);
+		const std::complex<double>* block = &uvData[offset];
+		std::complex<double>
+			expected = WStackingGridder::SumKernelBlockScalar(block, uvWidth, kernel.data(), kernelSize),
+			result = WStackingGridder::SumKernelBlock(block, uvWidth, kernel.data(), kernelSize);
+		// The sum is reordered, so only the rounding errors differ
+		const double tolerance = 1e-14 * kernelSize * kernelSize;
+		BOOST_CHECK_SMALL(result.real() - expected.real(), tolerance);
+		BOOST_CHECK_SMALL(result.imag() - expected.imag(), tolerance);
+	}
+	
+	size_t uvWidth;
+	std::vector<std::complex<double>> uvData;
+	std::mt19937 rng;
+};
+
+BOOST_FIXTURE_TEST_CASE( kernelBlockSizes, KernelBlockFixture )
+{
+	// Sizes with and without remaining cells after blocks of four
+	for(size_t kernelSize : { 1, 2, 3, 4, 5, 7, 8, 9, 15, 16 })
+		check(kernelSize, uvWidth*3 + 5);
+}
+
+BOOST_FIXTURE_TEST_CASE( kernelBlockOffsets, KernelBlockFixture )
+{
+	// Unaligned starts of the block
+	for(size_t offset=0; offset!=8; ++offset)
+	{
+		check(7, uvWidth*offset + offset);
+		check(9, uvWidth*offset + offset);
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE( addKernelBlock, KernelBlockFixture )
+{
+	std::uniform_real_distribution<double> dist(0.0, 1.0);
+	const std::complex<double> sample(0.75, -1.5);
+	const size_t offset = uvWidth*5 + 3;
+	for(size_t kernelSize : { 1, 5, 7, 9, 16 })
+	{
+		std::vector<double> kernel(kernelSize * kernelSize);
+		for(double& value : kernel)
+			value = dist(rng);
+		std::vector<std::complex<double>> result(uvData);
+		WStackingGridder::AddKernelBlock(&result[offset], uvWidth, kernel.data(), kernelSize, sample);
+		for(size_t y=0; y!=uvWidth; ++y)
+		{
+			for(size_t x=0; x!=uvWidth; ++x)
+			{
+				const size_t index = x + y*uvWidth;
+				std::complex<double> expected = uvData[index];
+				const size_t i = index%uvWidth - offset%uvWidth, j = index/uvWidth - offset/uvWidth;
+				if(index >= offset && i < kernelSize && j < kernelSize)
+					expected += std::complex<double>(sample.real() * kernel[i + j*kernelSize], sample.imag() * kernel[i + j*kernelSize]);
+				BOOST_CHECK_EQUAL(result[index], expected);
+			}
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE( kernelBlockSingleCell )
+{
+	const size_t uvWidth = 16, kernelSize = 7;
+	std::vector<std::complex<double>> uvData(uvWidth * uvWidth, 0.0);
+	std::vector<double> kernel(kernelSize * kernelSize, 0.5);
+	kernel[kernelSize*3 + 6] = 2.0;
+	uvData[uvWidth*3 + 6] = std::complex<double>(3.0, -1.0);
+	BOOST_CHECK_EQUAL(WStackingGridder::SumKernelBlock(uvData.data(), uvWidth, kernel.data(), kernelSize), std::complex<double>(6.0, -2.0));
+}
+
+/**
+ * Grid the same samples with different ways of storing the w-layers.
+ */
+static std::vector<double> makeImage(const std::string& scratchDirectory, double maxMem, size_t threadCount = 2, const std::vector<size_t>& layerThreads = std::vector<size_t>())
+{
+	const size_t size = 64;
+	ImageBufferAllocator allocator;
+	WStackingGridder gridder(size, size, 0.01, 0.01, threadCount, &allocator, 7, 63);
+	gridder.SetLayerScratchDirectory(scratchDirectory);
+	gridder.PrepareWLayers(8, maxMem, 0.0, 100.0);
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<double> uvDist(-1000.0, 1000.0), wDist(0.0, 100.0), valueDist(-1.0, 1.0);
+	std::vector<double> u(1000), v(1000), w(1000);
+	std::vector<std::complex<float>> values(1000);
+	for(size_t i=0; i!=values.size(); ++i)
+	{
+		u[i] = uvDist(rng); v[i] = uvDist(rng); w[i] = wDist(rng);
+		values[i] = std::complex<float>(valueDist(rng), valueDist(rng));
+	}
+	for(size_t pass=0; pass!=gridder.NPasses(); ++pass)
+	{
+		gridder.StartInversionPass(pass, layerThreads.empty() ? nullptr : layerThreads.data());
+		for(size_t i=0; i!=values.size(); ++i)
+			gridder.AddDataSample(values[i], u[i], v[i], w[i]);
+		gridder.FinishInversionPass();
+	}
+	gridder.FinalizeImage(1.0, false);
+	return std::vector<double>(gridder.RealImage(), gridder.RealImage() + size*size);
+}
+
+BOOST_AUTO_TEST_CASE( mappedLayers )
+{
+	// All layers in memory, one pass
+	std::vector<double> expected = makeImage(std::string(), 1e9);
+	// Two layers in memory, four passes
+	std::vector<double> multiPass = makeImage(std::string(), WLayerPassPlanner(64, 64, false).Memory(2, 2));
+	// All layers mapped, one pass
+	std::vector<double> mapped = makeImage(boost::filesystem::temp_directory_path().string(), 1e9);
+	double maxValue = 0.0;
+	for(size_t i=0; i!=expected.size(); ++i)
+	{
+		maxValue = std::max(maxValue, std::fabs(expected[i]));
+		BOOST_CHECK_SMALL(multiPass[i] - expected[i], 1e-8);
+		BOOST_CHECK_SMALL(mapped[i] - expected[i], 1e-8);
+	}
+	BOOST_CHECK_GT(maxValue, 1e-3);
+}
+
+BOOST_AUTO_TEST_CASE( layerThreads )
+{
+	std::vector<double> expected = makeImage(std::string(), 1e9);
+	// The layers are reused over four passes, and are zeroed by more threads than
+	// there are FFT threads
+	const std::vector<size_t> layerThreads = { 5, 0, 3, 1, 4, 2, 5, 0 };
+	std::vector<double> multiPass = makeImage(std::string(), WLayerPassPlanner(64, 64, false).Memory(2, 2), 2, layerThreads);
+	for(size_t i=0; i!=expected.size(); ++i)
+		BOOST_CHECK_SMALL(multiPass[i] - expected[i], 1e-8);
+}
+
+BOOST_AUTO_TEST_CASE( layerBlockSize )
+{
+	ImageBufferAllocator allocator;
+	// Layers in memory over multiple passes don't need blocks
+	WStackingGridder gridder(64, 64, 0.01, 0.01, 2, &allocator, 7, 63);
+	gridder.PrepareWLayers(8, WLayerPassPlanner(64, 64, false).Memory(2, 2), 0.0, 100.0);
+	BOOST_CHECK_GT(gridder.NPasses(), 1u);
+	BOOST_CHECK_EQUAL(gridder.LayerBlockSize(), 0u);
+	
+	WStackingGridder mappedGridder(64, 64, 0.01, 0.01, 2, &allocator, 7, 63);
+	mappedGridder.SetLayerScratchDirectory(boost::filesystem::temp_directory_path().string());
+	mappedGridder.PrepareWLayers(8, WLayerPassPlanner(64, 64, false).Memory(2, 2), 0.0, 100.0);
+	BOOST_CHECK_EQUAL(mappedGridder.NPasses(), 1u);
+	BOOST_CHECK_GT(mappedGridder.LayerBlockSize(), 0u);
+	BOOST_CHECK_LT(mappedGridder.LayerBlockSize(), 8u);
+}
+
+BOOST_AUTO_TEST_CASE( imageRowBands )
+{
+	// The threads accumulate in bands of rows of one image; with three threads the
+	// bands are unequal and not every thread has a layer in the last round
+	std::vector<double> expected = makeImage(std::string(), 1e9, 1);
+	std::vector<double> threaded = makeImage(std::string(), 1e9, 3);
+	for(size_t i=0; i!=expected.size(); ++i)
+		BOOST_CHECK_SMALL(threaded[i] - expected[i], 1e-8);
+}
+
+/**
+ * Relative rms error of the inner quarter of a dirty image, compared with a direct
+ * Fourier transform of the same samples.
+ */
+static double imageError(GridModeEnum gridMode, size_t kernelSize)
+{
+	const size_t size = 128, sampleCount = 200;
+	const double pixelSize = 0.005;
+	ImageBufferAllocator allocator;
+	WStackingGridder gridder(size, size, pixelSize, pixelSize, 1, &allocator, kernelSize, 63);
+	gridder.SetGridMode(gridMode);
+	gridder.PrepareWLayers(1, 1e9, 0.0, 0.0);
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<double> uvDist(-55.0, 55.0), valueDist(-1.0, 1.0);
+	std::vector<double> u(sampleCount), v(sampleCount);
+	std::vector<std::complex<float>> values(sampleCount);
+	gridder.StartInversionPass(0);
+	for(size_t i=0; i!=sampleCount; ++i)
+	{
+		u[i] = uvDist(rng); v[i] = uvDist(rng);
+		values[i] = std::complex<float>(valueDist(rng), valueDist(rng));
+		gridder.AddDataSample(values[i], u[i], v[i], 0.0);
+	}
+	gridder.FinishInversionPass();
+	gridder.FinalizeImage(1.0, false);
+	
+	double errorSum = 0.0, valueSum = 0.0;
+	for(size_t y=size/4; y!=size*3/4; ++y)
+	{
+		for(size_t x=size/4; x!=size*3/4; ++x)
+		{
+			const double l = (double(size/2) - double(x)) * pixelSize, m = (double(y) - double(size/2)) * pixelSize;
+			double expected = 0.0;
+			for(size_t i=0; i!=sampleCount; ++i)
+			{
+				const double phase = -2.0 * M_PI * (u[i]*l + v[i]*m);
+				expected += values[i].real() * cos(phase) - values[i].imag() * sin(phase);
+			}
+			const double error = gridder.RealImage()[x + y*size] - expected;
+			errorSum += error * error;
+			valueSum += expected * expected;
+		}
+	}
+	return sqrt(errorSum / valueSum);
+}
+
+BOOST_AUTO_TEST_CASE( exponentialOfSemicircleKernel )
+{
+	const double
+		kaiserBessel = imageError(KaiserBesselKernel, 7),
+		exponentialOfSemicircle = imageError(ExponentialOfSemicircleKernel, 7),
+		smallExponentialOfSemicircle = imageError(ExponentialOfSemicircleKernel, 5);
+	BOOST_CHECK_LT(exponentialOfSemicircle, 0.02);
+	BOOST_CHECK_LT(exponentialOfSemicircle, kaiserBessel);
+	// A smaller kernel is still as accurate as the Kaiser-Bessel kernel
+	BOOST_CHECK_LT(smallExponentialOfSemicircle, kaiserBessel);
+}
+
+/**
+ * Invert and predict random samples with a trimmed image, to compare the pruned FFTs with
+ * full FFTs. A zero trim size means no trimming.
+ */
+struct TrimFixture
+{
+	TrimFixture() : size(64), trimWidth(40), trimHeight(34), rng(42)
+	{
+		// The uv-plane extends to 50 wavelengths
+		std::uniform_real_distribution<double> uvDist(-45.0, 45.0), wDist(0.0, 100.0), valueDist(-1.0, 1.0);
+		u.resize(500); v.resize(500); w.resize(500); values.resize(500);
+		for(size_t i=0; i!=values.size(); ++i)
+		{
+			u[i] = uvDist(rng); v[i] = uvDist(rng); w[i] = wDist(rng);
+			values[i] = std::complex<float>(valueDist(rng), valueDist(rng));
+		}
+	}
+	
+	void prepare(WStackingGridder& gridder, bool trim)
+	{
+		if(trim)
+			gridder.SetTrimSize(trimWidth, trimHeight);
+		gridder.PrepareWLayers(8, 1e9, 0.0, 100.0);
+	}
+	
+	std::vector<double> invert(bool trim)
+	{
+		ImageBufferAllocator allocator;
+		WStackingGridder gridder(size, size, 0.01, 0.01, 3, &allocator, 7, 63);
+		prepare(gridder, trim);
+		gridder.StartInversionPass(0);
+		for(size_t i=0; i!=values.size(); ++i)
+			gridder.AddDataSample(values[i], u[i], v[i], w[i]);
+		gridder.FinishInversionPass();
+		gridder.FinalizeImage(1.0, false);
+		return std::vector<double>(gridder.RealImage(), gridder.RealImage() + size*size);
+	}
+	
+	std::vector<std::complex<double>> predict(const std::vector<double>& image, bool trim)
+	{
+		ImageBufferAllocator allocator;
+		WStackingGridder gridder(size, size, 0.01, 0.01, 3, &allocator, 7, 63);
+		prepare(gridder, trim);
+		gridder.InitializePrediction(image.data());
+		gridder.StartPredictionPass(0);
+		std::vector<std::complex<double>> result(values.size());
+		for(size_t i=0; i!=values.size(); ++i)
+			gridder.SampleDataSample(result[i], u[i], v[i], w[i]);
+		return result;
+	}
+	
+	bool isInTrim(size_t x, size_t y) const
+	{
+		return x >= (size-trimWidth)/2 && x < (size+trimWidth)/2 && y >= (size-trimHeight)/2 && y < (size+trimHeight)/2;
+	}
+	
+	size_t size, trimWidth, trimHeight;
+	std::mt19937 rng;
+	std::vector<double> u, v, w;
+	std::vector<std::complex<float>> values;
+};
+
+BOOST_FIXTURE_TEST_CASE( trimmedInversion, TrimFixture )
+{
+	std::vector<double>
+		expected = invert(false),
+		trimmed = invert(true);
+	for(size_t y=0; y!=size; ++y)
+	{
+		for(size_t x=0; x!=size; ++x)
+		{
+			const size_t i = x + y*size;
+			if(isInTrim(x, y))
+				BOOST_CHECK_SMALL(trimmed[i] - expected[i], 1e-8);
+			else
+				BOOST_CHECK_EQUAL(trimmed[i], 0.0);
+		}
+	}
+}
+
+BOOST_FIXTURE_TEST_CASE( trimmedPrediction, TrimFixture )
+{
+	// The trimmed prediction ignores everything outside the trimmed part of the image
+	std::uniform_real_distribution<double> dist(-1.0, 1.0);
+	std::vector<double> image(size*size), padded(size*size, 0.0);
+	for(size_t y=0; y!=size; ++y)
+	{
+		for(size_t x=0; x!=size; ++x)
+		{
+			const size_t i = x + y*size;
+			image[i] = dist(rng);
+			if(isInTrim(x, y))
+				padded[i] = image[i];
+		}
+	}
+	std::vector<std::complex<double>>
+		expected = predict(padded, false),
+		trimmed = predict(image, true);
+	double maxValue = 0.0;
+	for(size_t i=0; i!=values.size(); ++i)
+	{
+		maxValue = std::max(maxValue, std::abs(expected[i]));
+		BOOST_CHECK_SMALL(std::abs(trimmed[i] - expected[i]), 1e-8);
+	}
+	BOOST_CHECK_GT(maxValue, 1e-3);
+}
+
+/**
+ * Invert samples with w-values in two groups with a gap between them, on evenly spaced
+ * layers or on the given layers.
+ */
+static std::vector<double> invertWithLayers(const std::vector<double>& layerWValues)
+{
+	const size_t size = 64;
+	ImageBufferAllocator allocator;
+	WStackingGridder gridder(size, size, 0.01, 0.01, 2, &allocator, 7, 63);
+	if(layerWValues.empty())
+		gridder.PrepareWLayers(11, 1e9, 0.0, 100.0);
+	else
+		gridder.PrepareWLayers(layerWValues, 1e9, 0.0, 100.0);
+	std::mt19937 rng(42);
+	std::uniform_real_distribution<double> uvDist(-45.0, 45.0), wDist(0.0, 20.0), valueDist(-1.0, 1.0);
+	gridder.StartInversionPass(0);
+	for(size_t i=0; i!=500; ++i)
+	{
+		double w = wDist(rng);
+		if(i%2 == 0)
+			w = 100.0 - w;
+		gridder.AddDataSample(std::complex<float>(valueDist(rng), valueDist(rng)), uvDist(rng), uvDist(rng), w);
+	}
+	gridder.FinishInversionPass();
+	gridder.FinalizeImage(1.0, false);
+	return std::vector<double>(gridder.RealImage(), gridder.RealImage() + size*size);
+}
+
+BOOST_AUTO_TEST_CASE( nonUniformLayers )
+{
+	// Layers at the positions of the evenly spaced layers that have samples give the same image
+	const std::vector<double>
+		expected = invertWithLayers(std::vector<double>()),
+		nonUniform = invertWithLayers({ 0.0, 10.0, 20.0, 80.0, 90.0, 100.0 });
+	double maxValue = 0.0;
+	for(size_t i=0; i!=expected.size(); ++i)
+	{
+		maxValue = std::max(maxValue, std::fabs(expected[i]));
+		BOOST_CHECK_SMALL(nonUniform[i] - expected[i], 1e-8);
+	}
+	BOOST_CHECK_GT(maxValue, 1e-3);
+	
+	ImageBufferAllocator allocator;
+	WStackingGridder gridder(64, 64, 0.01, 0.01, 1, &allocator, 7, 63);
+	gridder.PrepareWLayers({ 0.0, 10.0, 20.0, 80.0 }, 1e9, 0.0, 100.0);
+	BOOST_CHECK_EQUAL(gridder.NWLayers(), 4);
+	BOOST_CHECK_EQUAL(gridder.WToLayer(-4.0), 0);
+	BOOST_CHECK_EQUAL(gridder.WToLayer(16.0), 2);
+	BOOST_CHECK_EQUAL(gridder.WToLayer(60.0), 3);
+	BOOST_CHECK_EQUAL(gridder.WToLayer(100.0), 3);
+	BOOST_CHECK_EQUAL(gridder.WToLayer(101.0), 4);
+	BOOST_CHECK_EQUAL(gridder.LayerToW(3), 80.0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,48 @@
+#ifndef THREAD_AFFINITY_H
+#define THREAD_AFFINITY_H
+
+#include <cstddef>
+
+#include <pthread.h>
+#include <sched.h>
+
+class ThreadAffinity
+{
+public:
+	/**
+	 * Restrict the calling thread to a single CPU. The CPU is the index'th CPU
+	 * (modulo the number of CPUs) that the process may run on, such that threads
+	 * with consecutive indices are spread over the available CPUs. Memory that a
+	 * pinned thread writes to first is placed on the NUMA node of its CPU.
+	 * This does nothing on platforms that do not support thread affinity.
+	 */
+	static void PinToCPU(size_t index)
+	{
+#ifndef __APPLE__
+		cpu_set_t cs;
+		CPU_ZERO(&cs);
+		sched_getaffinity(0, sizeof cs, &cs);
+		const size_t count = CPU_COUNT(&cs);
+		if(count == 0)
+			return;
+		size_t cpuIndex = index % count;
+		for(int i = 0; i < CPU_SETSIZE; i++)
+		{
+			if(CPU_ISSET(i, &cs))
+			{
+				if(cpuIndex == 0)
+				{
+					cpu_set_t pinned;
+					CPU_ZERO(&pinned);
+					CPU_SET(i, &pinned);
+					pthread_setaffinity_np(pthread_self(), sizeof pinned, &pinned);
+					return;
+				}
+				--cpuIndex;
+			}
+		}
+#endif
+	}
+};
+
+#endif
@@ -0,0 +1,58 @@
+#include "brightpixelpredictor.h"
+
+#include "../units/imagecoordinates.h"
+
+#include <algorithm>
+#include <cmath>
+
+size_t BrightPixelPredictor::ExtractComponents(double* real, double* imaginary, size_t width, size_t height, double pixelSizeX, double pixelSizeY, double threshold)
+{
+	const size_t oldCount = _components.size();
+	for(size_t y=0; y!=height; ++y)
+	{
+		for(size_t x=0; x!=width; ++x)
+		{
+			const size_t index = x + y*width;
+			const std::complex<double> flux(real[index], imaginary == nullptr ? 0.0 : imaginary[index]);
+			if(std::abs(flux) >= threshold)
+			{
+				Component component;
+				ImageCoordinates::XYToLM(x, y, pixelSizeX, pixelSizeY, width, height, component.l, component.m);
+				component.flux = flux;
+				_components.push_back(component);
+				real[index] = 0.0;
+				if(imaginary != nullptr)
+					imaginary[index] = 0.0;
+			}
+		}
+	}
+	return _components.size() - oldCount;
+}
+
+void BrightPixelPredictor::SetBands(const std::vector<ao::uvector<double>>& bandFrequencies)
+{
+	_kernels.clear();
+	for(const ao::uvector<double>& frequencies : bandFrequencies)
+	{
+		_kernels.emplace_back(new DFTPredictionKernel(frequencies, 1));
+		ao::uvector<std::complex<double>> flux(frequencies.size());
+		for(const Component& component : _components)
+		{
+			flux.assign(frequencies.size(), component.flux);
+			_kernels.back()->AddPointComponent(component.l, component.m, flux.data());
+		}
+	}
+}
+
+void BrightPixelPredictor::AddToSampledChannels(std::complex<float>* data, size_t channelCount, size_t bandIndex, double u, double v, double w, Buffer& buffer) const
+{
+	const DFTPredictionKernel& kernel = *_kernels[bandIndex];
+	buffer.values.resize(kernel.ChannelCount());
+	kernel.Predict(buffer.values.data(), u, v, w, buffer.kernelBuffer);
+	const size_t n = std::min(channelCount, kernel.ChannelCount());
+	for(size_t ch=0; ch!=n; ++ch)
+	{
+		if(std::isfinite(data[ch].real()))
+			data[ch] += buffer.values[ch];
+	}
+}
@@ -0,0 +1,85 @@
+#ifndef BRIGHT_PIXEL_PREDICTOR_H
+#define BRIGHT_PIXEL_PREDICTOR_H
+
+#include "../dftpredictionkernel.h"
+#include "../uvector.h"
+
+#include <complex>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+/**
+ * Predicts the brightest pixels of a model image with a direct Fourier transform,
+ * while the remainder of the image is predicted by the @ref WStackingGridder. The
+ * gridder is inaccurate for bright sources far from the phase centre, whereas the
+ * DFT is exact but scales with the number of components.
+ */
+class BrightPixelPredictor
+{
+public:
+	/**
+	 * Scratch space for @ref AddToSampledChannels(). Each thread should have its own buffer.
+	 */
+	struct Buffer
+	{
+		DFTPredictionKernel::Buffer kernelBuffer;
+		ao::uvector<std::complex<float>> values;
+	};
+	
+	/**
+	 * Move the pixels with an absolute flux of at least @p threshold from the image
+	 * into the list of components, and set them to zero in the image. The pixel
+	 * positions are converted to l,m as done by the gridder.
+	 * @param imaginary Imaginary part of the image, or nullptr.
+	 * @returns The number of pixels that were moved.
+	 */
+	size_t ExtractComponents(double* real, double* imaginary, size_t width, size_t height, double pixelSizeX, double pixelSizeY, double threshold);
+	
+	/**
+	 * Prepare the DFT of the components for the bands of a measurement set, replacing
+	 * the bands of an earlier measurement set. Bands are indexed like
+	 * @p bandFrequencies, which should be by the data description ids of the rows.
+	 * The model image has the same flux in all channels.
+	 */
+	void SetBands(const std::vector<ao::uvector<double>>& bandFrequencies);
+	
+	/**
+	 * Add the DFT of the components to a row that was sampled by the gridder. A row is
+	 * sampled in every pass that covers part of its channels, and the channels that are
+	 * not in the pass are NaN. The DFT values are added to the finite channels only, so
+	 * that each channel receives them exactly once over all passes.
+	 * @param data Predicted visibilities of the row, one per channel.
+	 * @param channelCount Number of channels of the row, which is that of the band.
+	 * @param u,v,w Coordinates of the row in meters.
+	 */
+	void AddToSampledChannels(std::complex<float>* data, size_t channelCount, size_t bandIndex, double u, double v, double w, Buffer& buffer) const;
+	
+	/**
+	 * Remove the components and bands.
+	 */
+	void Clear()
+	{
+		_components.clear();
+		_kernels.clear();
+	}
+	
+	size_t ComponentCount() const { return _components.size(); }
+	
+	size_t BandCount() const { return _kernels.size(); }
+	
+	bool Empty() const { return _components.empty(); }
+
+private:
+	struct Component
+	{
+		double l, m;
+		std::complex<double> flux;
+	};
+	
+	std::vector<Component> _components;
+	// One kernel per band
+	std::vector<std::unique_ptr<DFTPredictionKernel>> _kernels;
+};
+
+#endif
@@ -2,41 +2,57 @@
 #define CACHED_IMAGE_SET_H
 
 #include "../fitswriter.h"
-#include "../fitsreader.h"
+#include "../lane.h"
+#include "../polarization.h"
+#include "../uvector.h"
 
 #include "imagebufferallocator.h"
+#include "logger.h"
 
-#include <string.h>
+#include <boost/thread/thread.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <string.h>
+#include <vector>
 
+/**
+ * Stores the temporary PSF, model and residual images of a run. Images are
+ * kept in memory as long as they fit in the memory budget. When the budget is
+ * exceeded, the least recently used images are written to raw binary files by
+ * a background thread, and are read back when they are loaded again.
+ */
 class CachedImageSet
 {
 public:
-	CachedImageSet() : _polCount(0), _freqCount(0), _allocator(0), _image(0)
+	CachedImageSet() : _polCount(0), _freqCount(0), _memoryBudget(std::numeric_limits<double>::max()),
+		_memoryUsage(0.0), _useCounter(0)
 	{
+		startSpillThread();
 	}
 	
 	~CachedImageSet()
 	{
-		if(_allocator != 0)
-			_allocator->Free(_image);
-		
-		for(std::set<std::string>::const_iterator filenamePtr=_storedNames.begin(); filenamePtr!=_storedNames.end(); ++filenamePtr)
-		{
-			std::remove(filenamePtr->c_str());
-		}
+		stopSpillThread();
+		removeSpilledFiles();
 	}
 	
-	void Initialize(const FitsWriter& writer, size_t polCount, size_t freqCount, const std::string& prefix, ImageBufferAllocator& allocator)
+	void Initialize(const FitsWriter& writer, size_t polCount, size_t freqCount, const std::string& prefix)
 	{
+		stopSpillThread();
+		removeSpilledFiles();
+		_entries.clear();
+		_memoryUsage = 0.0;
 		_writer = writer;
 		_polCount = polCount;
 		_freqCount = freqCount;
 		_prefix = prefix;
-		if(_allocator != 0)
-			_allocator->Free(_image);
-		_image = 0;
-		_allocator = &allocator;
+		startSpillThread();
 	}
 	
 	void SetFitsWriter(const FitsWriter& writer)
@@ -44,49 +60,196 @@ public:
 		_writer = writer;
 	}
 	
+	/**
+	 * Set the number of bytes that images in memory may use. Images that are
+	 * being written to disk count as well.
+	 */
+	void SetMemoryBudget(double bytes)
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_memoryBudget = bytes;
+	}
+	
 	void Load(double* image, PolarizationEnum polarization, size_t freqIndex, bool isImaginary) const
 	{
 		if(_writer.Width() == 0 || _writer.Height() == 0)
 			throw std::runtime_error("Writer is not set.");
-		Logger::Debug << "Loading " << name(polarization, freqIndex, isImaginary) << '\n';
-		if(_polCount == 1 && _freqCount == 1)
-			if(_image == 0)
+		const std::string n = name(polarization, freqIndex, isImaginary);
+		Logger::Debug << "Loading " << n << '\n';
+		std::vector<SpillJob> jobs;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			std::map<std::string, Entry>::iterator entryIter = _entries.find(n);
+			if(entryIter == _entries.end())
 				throw std::runtime_error("Loading image before store");
-			else
-				memcpy(image, _image, _writer.Width() * _writer.Height() * sizeof(double));
-		else {
-			FitsReader reader(name(polarization, freqIndex, isImaginary));
-			reader.Read(image);
+			Entry& entry = entryIter->second;
+			entry.lastUse = ++_useCounter;
+			if(entry.data)
+				memcpy(image, entry.data->data(), imageBytes());
+			else if(entry.pendingData)
+				memcpy(image, entry.pendingData->data(), imageBytes());
+			else {
+				std::ifstream file(n, std::ios::in | std::ios::binary);
+				file.read(reinterpret_cast<char*>(image), imageBytes());
+				if(!file.good())
+					throw std::runtime_error("Error reading temporary image " + n);
+				// Keep the image in memory; the file stays valid until it is overwritten
+				entry.data.reset(new ao::uvector<double>(image, image + imageSize()));
+				_memoryUsage += imageBytes();
+				evict(n, jobs);
+			}
 		}
+		spill(jobs);
 	}
 	
 	void Store(const double* image, PolarizationEnum polarization, size_t freqIndex, bool isImaginary)
 	{
 		if(_writer.Width() == 0 || _writer.Height() == 0)
 			throw std::runtime_error("Writer is not set.");
-		Logger::Debug << "Storing " << name(polarization, freqIndex, isImaginary) << '\n';
-		if(_polCount == 1 && _freqCount == 1)
+		const std::string n = name(polarization, freqIndex, isImaginary);
+		Logger::Debug << "Storing " << n << '\n';
+		std::vector<SpillJob> jobs;
 		{
-			if(_image == 0)
-				_image = _allocator->Allocate(_writer.Width() * _writer.Height());
-			memcpy(_image, image, _writer.Width() * _writer.Height() * sizeof(double));
-		}
-		else {
-			std::string n = name(polarization, freqIndex, isImaginary);
-			_writer.Write(n, image);
-			_storedNames.insert(n);
+			std::unique_lock<std::mutex> lock(_mutex);
+			Entry& entry = _entries[n];
+			entry.lastUse = ++_useCounter;
+			entry.isOnDisk = false;
+			if(entry.pendingData)
+			{
+				// The image that is being written is outdated: forget about it
+				entry.pendingData.reset();
+				_memoryUsage -= imageBytes();
+			}
+			if(!entry.data)
+			{
+				entry.data.reset(new ao::uvector<double>(imageSize()));
+				_memoryUsage += imageBytes();
+			}
+			memcpy(entry.data->data(), image, imageBytes());
+			evict(n, jobs);
 		}
+		spill(jobs);
 	}
 	
 private:
+	struct Entry
+	{
+		Entry() : lastUse(0), isOnDisk(false) { }
+		std::shared_ptr<ao::uvector<double>> data, pendingData;
+		size_t lastUse;
+		bool isOnDisk;
+	};
+	
+	struct SpillJob
+	{
+		std::string filename;
+		std::shared_ptr<ao::uvector<double>> data;
+	};
+	
+	size_t imageSize() const { return _writer.Width() * _writer.Height(); }
+	double imageBytes() const { return double(imageSize()) * sizeof(double); }
+	
+	/**
+	 * Remove least recently used images from memory until the budget is met. The
+	 * image with name @p keep, which was just accessed, always stays. Images that
+	 * have no valid copy on disk are handed to the spill thread. Should be called
+	 * with the lock held; the jobs should be passed to @ref spill() after releasing it.
+	 */
+	void evict(const std::string& keep, std::vector<SpillJob>& jobs) const
+	{
+		while(_memoryUsage > _memoryBudget)
+		{
+			std::map<std::string, Entry>::iterator lru = _entries.end();
+			for(std::map<std::string, Entry>::iterator i=_entries.begin(); i!=_entries.end(); ++i)
+			{
+				if(i->second.data && i->first != keep && (lru == _entries.end() || i->second.lastUse < lru->second.lastUse))
+					lru = i;
+			}
+			if(lru == _entries.end())
+				break;
+			Entry& entry = lru->second;
+			if(entry.isOnDisk)
+			{
+				entry.data.reset();
+				_memoryUsage -= imageBytes();
+			}
+			else {
+				// The memory is accounted for until the spill thread has written the image
+				entry.pendingData = std::move(entry.data);
+				jobs.push_back(SpillJob{lru->first, entry.pendingData});
+			}
+		}
+	}
+	
+	void spill(const std::vector<SpillJob>& jobs) const
+	{
+		for(const SpillJob& job : jobs)
+		{
+			Logger::Debug << "Spilling " << job.filename << " to disk\n";
+			_spillLane->write(job);
+		}
+	}
+	
+	void spillThreadFunction()
+	{
+		SpillJob job;
+		while(_spillLane->read(job))
+		{
+			std::ofstream file(job.filename, std::ios::out | std::ios::binary | std::ios::trunc);
+			file.write(reinterpret_cast<const char*>(job.data->data()), job.data->size() * sizeof(double));
+			file.close();
+			const bool isWritten = file.good();
+			
+			std::unique_lock<std::mutex> lock(_mutex);
+			_spilledNames.insert(job.filename);
+			std::map<std::string, Entry>::iterator entryIter = _entries.find(job.filename);
+			// If the image was stored again in the meantime, the written image is outdated
+			if(entryIter != _entries.end() && entryIter->second.pendingData == job.data)
+			{
+				Entry& entry = entryIter->second;
+				if(isWritten)
+				{
+					entry.pendingData.reset();
+					entry.isOnDisk = true;
+					_memoryUsage -= double(job.data->size()) * sizeof(double);
+				}
+				else {
+					Logger::Warn << "Could not write temporary image " << job.filename << ", keeping it in memory.\n";
+					entry.data = std::move(entry.pendingData);
+				}
+			}
+		}
+	}
+	
+	void startSpillThread()
+	{
+		_spillLane.reset(new ao::lane<SpillJob>(4));
+		_spillThread.reset(new boost::thread(&CachedImageSet::spillThreadFunction, this));
+	}
+	
+	void stopSpillThread()
+	{
+		_spillLane->write_end();
+		_spillThread->join();
+		_spillThread.reset();
+		_spillLane.reset();
+	}
+	
+	void removeSpilledFiles()
+	{
+		for(const std::string& filename : _spilledNames)
+			std::remove(filename.c_str());
+		_spilledNames.clear();
+	}
+	
 	std::string name(PolarizationEnum polarization, size_t freqIndex, bool isImaginary) const
 	{
 		if(_freqCount == 1)
 		{
 			if(isImaginary)
-				return _prefix + '-' + Polarization::TypeToShortString(polarization) + "i-tmp.fits";
+				return _prefix + '-' + Polarization::TypeToShortString(polarization) + "i-tmp.raw";
 			else
-				return _prefix + '-' + Polarization::TypeToShortString(polarization) + "-tmp.fits";
+				return _prefix + '-' + Polarization::TypeToShortString(polarization) + "-tmp.raw";
 		}
 		else {
 			std::ostringstream str;
@@ -97,17 +260,27 @@ private:
 			if(freqIndex < 10) str << '0';
 			if(freqIndex < 100) str << '0';
 			if(freqIndex < 1000) str << '0';
-			str << freqIndex << "-tmp.fits";
+			str << freqIndex << "-tmp.raw";
 			return str.str();
 		}
 	}
+	
+	CachedImageSet(const CachedImageSet&) = delete;
+	void operator=(const CachedImageSet&) = delete;
+	
 	FitsWriter _writer;
 	size_t _polCount, _freqCount;
 	std::string _prefix;
 	
-	ImageBufferAllocator* _allocator;
-	double *_image;
-	std::set<std::string> _storedNames;
+	// The cache is changed by loading images, hence these are mutable
+	double _memoryBudget;
+	mutable double _memoryUsage;
+	mutable size_t _useCounter;
+	mutable std::map<std::string, Entry> _entries;
+	std::set<std::string> _spilledNames;
+	mutable std::mutex _mutex;
+	std::unique_ptr<ao::lane<SpillJob>> _spillLane;
+	std::unique_ptr<boost::thread> _spillThread;
 };
 
 #endif
@@ -32,6 +32,27 @@ void CommandLine::printHelp()
 		"   Default: 100.\n"
 		"-absmem <memory limit>\n"
 		"   Like -mem, but this specifies a fixed amount of memory in gigabytes.\n"
+		"-image-cache-mem <memory limit>\n"
+		"   Amount of memory in gigabytes that is used to keep temporary psf, model and residual images in\n"
+		"   memory. Images that do not fit are written to disk in the background.\n"
+		"   This memory is subtracted from the memory that the gridder uses. Default: a quarter of the memory limit.\n"
+		"-huge-pages\n"
+		"   Align large image buffers and w-layers on huge pages and ask the kernel to back them with\n"
+		"   transparent huge pages. This reduces TLB misses on large images.\n"
+		"-numa-local\n"
+		"   Place the memory of reused image buffers on the NUMA node of the thread that uses them. Most\n"
+		"   effective together with -pin-threads.\n"
+		"-pin-threads\n"
+		"   Pin gridding and FFT threads to CPUs, such that their w-layers and image buffers stay local.\n"
+		"-mapped-w-layers\n"
+		"   Keep the w-layers of an inversion in a memory-mapped file in the temporary directory, such that\n"
+		"   all layers are gridded in a single pass over the data, also when they do not fit in memory.\n"
+		"-nonuniform-w-layers\n"
+		"   Only place w-layers at w-values that have samples, keeping the accuracy of evenly spaced layers.\n"
+		"   This saves FFTs and memory when large w-ranges have no samples, e.g. for long baselines.\n"
+		"-dual-grid-psf\n"
+		"   Grid the PSF in the same pass over the data as the first dirty image, instead of in a pass\n"
+		"   of its own. This reads the data once less, but the two w-stacks have to share the memory.\n"
 		"-verbose (or -v)\n"
 		"   Increase verbosity of output.\n"
 		"-log-time\n"
@@ -45,6 +66,14 @@ void CommandLine::printHelp()
 		"   Default: only reorder when in channel imaging mode.\n"
 		"-tempdir <directory>\n"
 		"   Set the temporary directory used when reordering files. Default: same directory as input measurement set.\n"
+		"-pre-apply-imaging-weights\n"
+		"   Store the final imaging weights next to the reordered data, such that they are calculated only once and\n"
+		"   subsequent inversions can directly grid pre-weighted visibilities. Only has effect when reordering.\n"
+		"-cache-weights\n"
+		"   Keep the imaging weight grids on disk, next to the reordered files, and reuse them in later runs\n"
+		"   with the same weighting, image size, scale, uv limits and selection. Grids are recalculated when\n"
+		"   the number of rows changes, or when the storage manager files of the UVW, FLAG, WEIGHT or\n"
+		"   WEIGHT_SPECTRUM columns are written. Cached grids are not removed afterwards.\n"
 		"-update-model-required (default), and\n"
 		"-no-update-model-required\n"
 		"   These two options specify wether the model data column is required to\n"
@@ -138,9 +167,10 @@ void CommandLine::printHelp()
 		"   Perform inversion at the Nyquist resolution and upscale the image to the requested image size afterwards.\n"
 		"   This speeds up inversion considerably, but makes aliasing slightly worse. This effect is\n"
 		"   in most cases <1%. Default: on.\n"
-		"-gridmode <\"nn\", \"kb\" or \"rect\">\n"
+		"-gridmode <\"nn\", \"kb\", \"rect\" or \"es\">\n"
 		"   Kernel and mode used for gridding: kb = Kaiser-Bessel (default with 7 pixels), nn = nearest\n"
-		"   neighbour (no kernel), rect = rectangular window. Default: kb.\n"
+		"   neighbour (no kernel), rect = rectangular window, es = exponential of semicircle. The es kernel\n"
+		"   reaches the accuracy of kb with a smaller -gkernelsize, e.g. 5, which is faster. Default: kb.\n"
 		"-gkernelsize <size>\n"
 		"   Gridding antialiasing kernel size. Default: 7.\n"
 		"-oversampling <factor>\n"
@@ -156,6 +186,13 @@ void CommandLine::printHelp()
 		"   only effect when -mgain is set or -predict is given.\n"
 		"-dft-with-beam\n"
 		"   Apply the beam during DFT. Currently only works for LOFAR.\n"
+		"-dft-phase-recurrence <interval>\n"
+		"   Speed up the DFT for regularly spaced channels by calculating the phase of a channel from that of the\n"
+		"   previous channel. The phases are calculated directly every <interval> channels. Default: off.\n"
+		"-hybrid-dft-threshold <flux>\n"
+		"   Predict model pixels with an absolute flux above the given value (in Jy) with a direct Fourier transform,\n"
+		"   and the rest of the model image with the gridder. This makes the prediction of bright sources more accurate.\n"
+		"   Not used with -use-idg or a shifted phase centre. Default: off.\n"
 		"-visibility-weighting-mode [normal/squared/unit]\n"
 		"   Specify visibility weighting modi. Affects how the weights (normally) stored in\n"
 		"   WEIGHT_SPECTRUM column are applied. Useful for estimating e.g. EoR power spectra errors.\n"
@@ -632,6 +669,16 @@ int CommandLine::Run(int argc, char* argv[])
 		{
 			settings.dftWithBeam = true;
 		}
+		else if(param == "dft-phase-recurrence")
+		{
+			++argi;
+			settings.dftPhaseRecurrenceInterval = parse_size_t(argv[argi], "dft-phase-recurrence");
+		}
+		else if(param == "hybrid-dft-threshold")
+		{
+			++argi;
+			settings.hybridDFTThreshold = atof(argv[argi]);
+		}
 		else if(param == "name")
 		{
 			++argi;
@@ -646,10 +693,12 @@ int CommandLine::Run(int argc, char* argv[])
 				settings.gridMode = KaiserBesselKernel;
 			else if(gridModeStr == "rect")
 				settings.gridMode = RectangularKernel;
+			else if(gridModeStr == "es" || gridModeStr == "exponentialsemicircle")
+				settings.gridMode = ExponentialOfSemicircleKernel;
 			else if(gridModeStr == "nn" || gridModeStr == "nearestneighbour")
 				settings.gridMode = NearestNeighbourGridding;
 			else
-				throw std::runtime_error("Invalid gridding mode: should be either kb (Kaiser-Bessel) or nn (NearestNeighbour)");
+				throw std::runtime_error("Invalid gridding mode: should be kb (Kaiser-Bessel), nn (NearestNeighbour), rect (rectangular) or es (exponential of semicircle)");
 		}
 		else if(param == "smallinversion")
 		{
@@ -916,6 +965,43 @@ int CommandLine::Run(int argc, char* argv[])
 			settings.forceNoReorder = true;
 			settings.forceReorder = false;
 		}
+		else if(param == "pre-apply-imaging-weights")
+		{
+			settings.preApplyImagingWeights = true;
+		}
+		else if(param == "image-cache-mem")
+		{
+			++argi;
+			settings.imageCacheMemory = atof(argv[argi]);
+		}
+		else if(param == "huge-pages")
+		{
+			settings.useHugePages = true;
+		}
+		else if(param == "numa-local")
+		{
+			settings.numaLocalAllocation = true;
+		}
+		else if(param == "pin-threads")
+		{
+			settings.pinThreads = true;
+		}
+		else if(param == "mapped-w-layers")
+		{
+			settings.mappedWLayers = true;
+		}
+		else if(param == "nonuniform-w-layers")
+		{
+			settings.nonUniformWLayers = true;
+		}
+		else if(param == "dual-grid-psf")
+		{
+			settings.dualGridPSF = true;
+		}
+		else if(param == "cache-weights")
+		{
+			settings.cacheImagingWeights = true;
+		}
 		else if(param == "update-model-required")
 		{
 			settings.modelUpdateRequired = true;
@@ -22,7 +22,14 @@ enum GridModeEnum {
 		* as much attenuated compared to the KB window, which has much deeper
 		* sidelobes further out.
 		*/
-	RectangularKernel
+	RectangularKernel,
+	
+	/** Interpolate with an exponential of semicircle kernel,
+		* exp(beta (sqrt(1 - x^2) - 1)). It attenuates aliasing about as well as
+		* the Kaiser-Bessel kernel with a smaller kernel size, which makes gridding
+		* faster. Its correction function is calculated by integrating the kernel.
+		*/
+	ExponentialOfSemicircleKernel
 };
 
 #endif
@@ -1,11 +1,23 @@
 #ifndef IMAGE_BUFFER_ALLOCATOR_H
 #define IMAGE_BUFFER_ALLOCATOR_H
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <complex>
+#include <cstdint>
 #include <iostream>
-#include <vector>
-#include <stdexcept>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "logger.h"
 
 //#define USE_DIRECT_ALLOCATOR
@@ -52,25 +64,31 @@ public:
 		ImageBufferAllocator* _allocator;
 	};
 	
-	ImageBufferAllocator() : _buffers(), _nReal(0), _nComplex(0), _nRealMax(0), _nComplexMax(0), _previousSize(0)
-	{ }
+	ImageBufferAllocator() : _nReal(0), _nComplex(0), _nRealMax(0), _nComplexMax(0), _generation(0),
+		_allocatedBytes(0), _peakAllocatedBytes(0), _id(nextId()),
+		_useHugePages(false), _numaLocal(false)
+	{
+		std::lock_guard<std::mutex> guard(registryMutex());
+		registry()[_id] = this;
+	}
 	
 	~ImageBufferAllocator()
 	{
+		{
+			// After unregistering, buffers in thread caches are no longer returned to this allocator
+			std::lock_guard<std::mutex> guard(registryMutex());
+			registry().erase(_id);
+		}
 		std::lock_guard<std::mutex> guard(_mutex);
 		size_t usedCount = 0;
 		std::ostringstream str;
-		for(std::vector<Buffer>::iterator i=_buffers.begin(); i!=_buffers.end(); ++i)
+		for(Header* header : _buffers)
 		{
-			if(i->isFirstHalfUsed) {
-				++usedCount;
-				str << "Still used: buffer of " << i->size << '\n';
-			}
-			if(i->isSecondHalfUsed) {
+			if(header->isUsed) {
 				++usedCount;
-				str << "Still used: buffer of " << i->size << '\n';
+				str << "Still used: buffer of " << header->sizeClass->size << '\n';
 			}
-			free(i->ptr);
+			free(header);
 		}
 		if(usedCount != 0)
 		{
@@ -81,15 +99,37 @@ public:
 	void ReportStatistics() const
 	{
 		std::lock_guard<std::mutex> guard(_mutex);
-		double totalSize = 0.0;
-		for(std::vector<Buffer>::const_iterator i=_buffers.begin(); i!=_buffers.end(); ++i)
-		{
-			totalSize += double(i->size) * double(sizeof(double)*2);
-		}
+		std::vector<const SizeClass*> sizeClasses;
+		for(const auto& sizeClass : _sizeClasses)
+			sizeClasses.push_back(sizeClass.second.get());
+		std::sort(sizeClasses.begin(), sizeClasses.end(), [](const SizeClass* a, const SizeClass* b) { return a->size < b->size; });
 		Logger::Info << "Image buf alloc stats:\n"
 			"         max alloc'd images = " << _nRealMax << " real + " << _nComplexMax << " complex\n"
 			"       max allocated chunks = " << _buffers.size() << "\n"
-			"      current allocated mem = " << round(totalSize/1e8)/10.0 << " GB \n";
+			"      current allocated mem = " << round(_allocatedBytes/1e8)/10.0 << " GB \n"
+			"         peak allocated mem = " << round(_peakAllocatedBytes/1e8)/10.0 << " GB \n";
+		for(const SizeClass* sizeClass : sizeClasses)
+		{
+			const size_t requests = sizeClass->requests, hits = sizeClass->hits;
+			Logger::Info << "  buffers of " << round(sizeClass->Bytes()/1e5)/10.0 << " MB: "
+				<< requests << " requests, hit rate " << round(1000.0 * hits / std::max<size_t>(1, requests))/10.0 << "%, peak "
+				<< sizeClass->peakUsed << " buffers (" << round(sizeClass->peakUsed*sizeClass->Bytes()/1e8)/10.0 << " GB)\n";
+		}
+	}
+	
+	/**
+	 * Set how the memory of buffers is placed. This should be called before
+	 * buffers are allocated.
+	 * @param useHugePages Align large buffers on huge pages and advise the kernel to
+	 * back them with transparent huge pages, which reduces TLB misses on large layers.
+	 * @param numaLocal When a buffer is reused by another thread, release its
+	 * pages, such that they are placed again on the NUMA node of the thread that
+	 * first writes to the buffer. Buffers reused from a thread cache keep their pages.
+	 */
+	void SetMemoryPlacement(bool useHugePages, bool numaLocal)
+	{
+		_useHugePages = useHugePages;
+		_numaLocal = numaLocal;
 	}
 	
 	void Allocate(size_t size, Ptr& ptr)
@@ -100,162 +140,255 @@ public:
 	double* Allocate(size_t size)
 	{
 		if(size%2==1) ++size;
-		std::lock_guard<std::mutex> guard(_mutex);
-		
-		if(size != _previousSize)
+		increaseCount(_nReal, _nRealMax);
+		return allocate(size)->Data();
+	}
+	
+	std::complex<double>* AllocateComplex(size_t size)
+	{
+		if(size%2==1) ++size;
+		increaseCount(_nComplex, _nComplexMax);
+		return reinterpret_cast<std::complex<double>*>(allocate(size*2)->Data());
+	}
+	
+	void Free(double* buffer)
+	{
+		if(buffer != 0)
 		{
-			FreeUnused();
-			_previousSize = size;
+			release(buffer, "Invalid or double call to ImageBufferAllocator::Free(double*).");
+			--_nReal;
 		}
-		
-		++_nReal;
-		if(_nReal > _nRealMax) _nRealMax = _nReal;
-		for(std::vector<Buffer>::iterator i=_buffers.begin(); i!=_buffers.end(); ++i)
+	}
+	
+	void Free(std::complex<double>* buffer)
+	{
+		if(buffer != 0)
 		{
-			if(i->size == size)
+			release(reinterpret_cast<double*>(buffer), "Invalid or double call to ImageBufferAllocator::Free(std::complex<double>*).");
+			--_nComplex;
+		}
+	}
+	
+	/**
+	 * Releases the memory of all buffers that are not in use. Buffers that are
+	 * in the cache of another thread are returned to the free lists when that thread
+	 * next uses the allocator, and are released by a later call.
+	 */
+	void FreeUnused()
+	{
+		threadCache().Flush(_id);
+		++_generation;
+		std::lock_guard<std::mutex> guard(_mutex);
+		size_t unusedCount = 0;
+		for(auto& sizeClass : _sizeClasses)
+		{
+			for(Header* header : sizeClass.second->freeList)
 			{
-				if(!i->isFirstHalfUsed)
-				{
-					i->isFirstHalfUsed = true;
-					return i->ptr;
-				}
-				if(!i->isSecondHalfUsed)
-				{
-					i->isSecondHalfUsed = true;
-					return i->ptr + size;
-				}
+				_buffers.erase(header);
+				_allocatedBytes -= sizeClass.second->Bytes();
+				free(header);
+				++unusedCount;
 			}
+			sizeClass.second->freeList.clear();
+		}
+		if(unusedCount != 0)
+		{
+			Logger::Debug << "Freed " << unusedCount << " image buffer(s).\n";
 		}
-		Buffer* newBuffer = allocateNewBuffer(size);
-		newBuffer->isFirstHalfUsed = true;
-		return newBuffer->ptr;
 	}
 	
-	std::complex<double>* AllocateComplex(size_t size)
+private:
+	struct Header;
+	
+	/**
+	 * All buffers of the same size form a size class. Unused buffers of a class
+	 * are kept in its free list, so that they can be reused without searching.
+	 */
+	struct SizeClass
 	{
-		if(size%2==1) ++size;
-		std::lock_guard<std::mutex> guard(_mutex);
+		SizeClass(size_t _size, uint64_t _allocatorId) :
+			size(_size), allocatorId(_allocatorId), requests(0), hits(0), used(0), peakUsed(0)
+		{ }
+		double Bytes() const { return double(size) * sizeof(double); }
 		
-		if(size != _previousSize)
+		const size_t size; // in doubles
+		const uint64_t allocatorId;
+		std::vector<Header*> freeList;
+		std::atomic<size_t> requests, hits, used, peakUsed;
+	};
+	
+	/**
+	 * Every buffer is preceded by a header, such that the size class of a buffer is
+	 * found directly when it is freed. The header keeps the buffer aligned on 16 bytes.
+	 */
+	struct Header
+	{
+		SizeClass* sizeClass;
+		uint32_t magic;
+		uint32_t isUsed;
+		double* Data() { return reinterpret_cast<double*>(this + 1); }
+		static Header* FromData(double* data) { return reinterpret_cast<Header*>(data) - 1; }
+		static constexpr uint32_t MagicValue = 0x1BA110CA;
+	};
+	static_assert(sizeof(Header) % (sizeof(double)*2) == 0, "Header size should keep buffers aligned");
+	
+	/**
+	 * Each thread keeps a few recently freed buffers, which it can reuse without
+	 * taking the allocator lock. Only smaller buffers are cached, to limit the
+	 * memory that is held by the caches of idle threads.
+	 */
+	class ThreadCache
+	{
+	public:
+		~ThreadCache()
 		{
-			FreeUnused();
-			_previousSize = size;
+			for(const Entry& entry : _entries)
+				returnToOwner(entry);
 		}
 		
-		++_nComplex;
-		if(_nComplex > _nComplexMax) _nComplexMax = _nComplex;
-		for(std::vector<Buffer>::iterator i=_buffers.begin(); i!=_buffers.end(); ++i)
+		Header* Take(uint64_t allocatorId, size_t generation, size_t size)
 		{
-			if(i->size == size)
+			for(std::vector<Entry>::iterator i=_entries.begin(); i!=_entries.end(); ++i)
 			{
-				if(!i->isFirstHalfUsed && !i->isSecondHalfUsed)
+				if(i->allocatorId == allocatorId && i->header->sizeClass->size == size)
 				{
-					i->isFirstHalfUsed = true;
-					i->isSecondHalfUsed = true;
-					return reinterpret_cast<std::complex<double>*>(i->ptr);
+					Entry entry = *i;
+					_entries.erase(i);
+					if(entry.generation == generation)
+						return entry.header;
+					// The allocator has freed its unused buffers since this buffer was cached
+					returnToOwner(entry);
+					return nullptr;
 				}
 			}
+			return nullptr;
 		}
-		Buffer* newBuffer = allocateNewBuffer(size);
-		newBuffer->isFirstHalfUsed = true;
-		newBuffer->isSecondHalfUsed = true;
-		return reinterpret_cast<std::complex<double>*>(newBuffer->ptr);
-	}
-	
-	void Free(double* buffer)
-	{
-		if(buffer != 0)
+		
+		/**
+		 * @returns false if the buffer is too large to be cached.
+		 */
+		bool Put(uint64_t allocatorId, size_t generation, Header* header)
 		{
-			std::lock_guard<std::mutex> guard(_mutex);
-			bool found = false;
-			for(std::vector<Buffer>::iterator i=_buffers.begin(); i!=_buffers.end(); ++i)
+			if(header->sizeClass->Bytes() > MaxCachedBytes)
+				return false;
+			if(_entries.size() == MaxEntries)
 			{
-				if(i->ptr == buffer)
-				{
-					found = true;
-					i->isFirstHalfUsed = false;
-					break;
-				}
-				else if(i->ptr + i->size == buffer)
-				{
-					found = true;
-					i->isSecondHalfUsed = false;
-					break;
-				}
+				returnToOwner(_entries.front());
+				_entries.erase(_entries.begin());
 			}
-			if(!found)
+			_entries.push_back(Entry{allocatorId, generation, header});
+			return true;
+		}
+		
+		void Flush(uint64_t allocatorId)
+		{
+			std::vector<Entry>::iterator i=_entries.begin();
+			while(i!=_entries.end())
 			{
-				std::cerr << "Invalid or double call to ImageBufferAllocator::Free(double*).\n";
-				throw std::runtime_error("Invalid or double call to ImageBufferAllocator::Free(double*).");
+				if(i->allocatorId == allocatorId)
+				{
+					returnToOwner(*i);
+					i = _entries.erase(i);
+				}
+				else ++i;
 			}
-			--_nReal;
 		}
-	}
+		
+	private:
+		struct Entry
+		{
+			uint64_t allocatorId;
+			size_t generation;
+			Header* header;
+		};
+		static constexpr size_t MaxEntries = 4;
+		static constexpr double MaxCachedBytes = 64.0 * 1024.0 * 1024.0;
+		
+		static void returnToOwner(const Entry& entry)
+		{
+			std::lock_guard<std::mutex> guard(registryMutex());
+			std::map<uint64_t, ImageBufferAllocator*>::const_iterator owner = registry().find(entry.allocatorId);
+			if(owner != registry().end())
+				owner->second->addToFreeList(entry.header);
+		}
+		
+		std::vector<Entry> _entries;
+	};
 	
-	void Free(std::complex<double>* buffer)
+	Header* allocate(size_t size)
 	{
-		if(buffer != 0)
+		Header* header = threadCache().Take(_id, _generation, size);
+		SizeClass* sizeClass;
+		bool isReused = false;
+		if(header != nullptr)
 		{
+			sizeClass = header->sizeClass;
+			++sizeClass->hits;
+		}
+		else {
 			std::lock_guard<std::mutex> guard(_mutex);
-			bool found = false;
-			for(std::vector<Buffer>::iterator i=_buffers.begin(); i!=_buffers.end(); ++i)
+			std::unique_ptr<SizeClass>& sizeClassPtr = _sizeClasses[size];
+			if(!sizeClassPtr)
+				sizeClassPtr.reset(new SizeClass(size, _id));
+			sizeClass = sizeClassPtr.get();
+			if(sizeClass->freeList.empty())
 			{
-				if(i->ptr == reinterpret_cast<double*>(buffer))
-				{
-					found = true;
-					i->isFirstHalfUsed = false;
-					i->isSecondHalfUsed = false;
-					break;
-				}
+				header = allocateNewBuffer(sizeClass);
 			}
-			if(!found)
-			{
-				std::cerr << "Invalid or double call to ImageBufferAllocator::Free(std::complex<double>*).\n";
-				throw std::runtime_error("Invalid or double call to ImageBufferAllocator::Free(std::complex<double>*).");
+			else {
+				header = sizeClass->freeList.back();
+				sizeClass->freeList.pop_back();
+				++sizeClass->hits;
+				isReused = true;
 			}
-			--_nComplex;
 		}
+		if(isReused && _numaLocal)
+			releasePages(header);
+		++sizeClass->requests;
+		increaseCount(sizeClass->used, sizeClass->peakUsed);
+		header->isUsed = 1;
+		return header;
 	}
 	
-	void FreeUnused()
+	void release(double* buffer, const char* errorMessage)
 	{
-		size_t unusedCount = 0;
-		std::vector<Buffer>::iterator i=_buffers.begin();
-		while(i!=_buffers.end())
+		Header* header = Header::FromData(buffer);
+		if(header->magic != Header::MagicValue || !header->isUsed || header->sizeClass->allocatorId != _id)
 		{
-			if(!i->isFirstHalfUsed && !i->isSecondHalfUsed)
-			{
-				free(i->ptr);
-				_buffers.erase(i);
-				i = _buffers.begin();
-				++unusedCount;
-			} else {
-				++i;
-			}
-		}
-		if(unusedCount != 0)
-		{
-			Logger::Debug << "Freed " << unusedCount << " image buffer(s).\n";
+			std::cerr << errorMessage << '\n';
+			throw std::runtime_error(errorMessage);
 		}
+		header->isUsed = 0;
+		--header->sizeClass->used;
+		if(!threadCache().Put(_id, _generation, header))
+			addToFreeList(header);
 	}
 	
-private:
-	struct Buffer
+	void addToFreeList(Header* header)
 	{
-		double* ptr;
-		size_t size;
-		bool isFirstHalfUsed, isSecondHalfUsed;
-	};
+		std::lock_guard<std::mutex> guard(_mutex);
+		header->sizeClass->freeList.push_back(header);
+	}
+	
+	static void increaseCount(std::atomic<size_t>& count, std::atomic<size_t>& maxCount)
+	{
+		size_t newCount = ++count;
+		size_t oldMax = maxCount;
+		while(newCount > oldMax && !maxCount.compare_exchange_weak(oldMax, newCount))
+		{ }
+	}
 	
-	Buffer* allocateNewBuffer(size_t size)
+	Header* allocateNewBuffer(SizeClass* sizeClass)
 	{
-		_buffers.push_back(Buffer());
-		Buffer* buffer = &_buffers.back();
-		int errVal = posix_memalign(reinterpret_cast<void**>(&buffer->ptr), sizeof(double)*2, size*sizeof(double) * 2);
+		Header* header;
+		const size_t bytes = sizeof(Header) + sizeClass->size*sizeof(double);
+		const bool useHugePages = _useHugePages && bytes >= HugePageSize;
+		const size_t alignment = useHugePages ? HugePageSize : sizeof(double)*2;
+		int errVal = posix_memalign(reinterpret_cast<void**>(&header), alignment, bytes);
 		if(errVal != 0)
 		{
 			std::ostringstream msg;
-			msg << "posix_memalign() failed when allocating " << size*sizeof(double) * 2 << " bytes: ";
+			msg << "posix_memalign() failed when allocating " << bytes << " bytes: ";
 			switch(errVal)
 			{
 				case EINVAL:
@@ -267,15 +400,76 @@ private:
 			}
 			throw std::runtime_error(msg.str());
 		}
-		buffer->size = size;
-		buffer->isFirstHalfUsed = false;
-		buffer->isSecondHalfUsed = false;
-		return buffer;
+#ifdef MADV_HUGEPAGE
+		if(useHugePages)
+		{
+			// The buffer starts at a page boundary, so only the end needs rounding
+			const size_t pageSize = sysconf(_SC_PAGESIZE);
+			madvise(header, bytes - bytes % pageSize, MADV_HUGEPAGE);
+		}
+#endif
+		header->sizeClass = sizeClass;
+		header->magic = Header::MagicValue;
+		header->isUsed = 0;
+		_buffers.insert(header);
+		_allocatedBytes += sizeClass->Bytes();
+		_peakAllocatedBytes = std::max(_peakAllocatedBytes, _allocatedBytes);
+		return header;
 	}
 	
-	std::vector<Buffer> _buffers;
-	size_t _nReal, _nComplex, _nRealMax, _nComplexMax, _previousSize;
+	/**
+	 * Give the pages that lie completely inside the buffer back to the kernel. They read
+	 * as zero afterwards, and are newly placed when they are written to.
+	 */
+	static void releasePages(Header* header)
+	{
+		const size_t pageSize = sysconf(_SC_PAGESIZE);
+		const size_t
+			start = reinterpret_cast<size_t>(header->Data()),
+			end = start + header->sizeClass->size*sizeof(double),
+			firstPage = (start + pageSize - 1) / pageSize * pageSize,
+			lastPage = end / pageSize * pageSize;
+		if(lastPage > firstPage)
+			madvise(reinterpret_cast<void*>(firstPage), lastPage - firstPage, MADV_DONTNEED);
+	}
+	
+	static ThreadCache& threadCache()
+	{
+		static thread_local ThreadCache cache;
+		return cache;
+	}
+	
+	/**
+	 * The registry maps allocator ids to living allocators, so that thread caches
+	 * never return buffers to an allocator that was destroyed.
+	 */
+	static std::map<uint64_t, ImageBufferAllocator*>& registry()
+	{
+		static std::map<uint64_t, ImageBufferAllocator*> allocators;
+		return allocators;
+	}
+	
+	static std::mutex& registryMutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+	
+	static uint64_t nextId()
+	{
+		static std::atomic<uint64_t> id(0);
+		return ++id;
+	}
+	
+	std::unordered_map<size_t, std::unique_ptr<SizeClass>> _sizeClasses;
+	std::unordered_set<Header*> _buffers;
+	std::atomic<size_t> _nReal, _nComplex, _nRealMax, _nComplexMax, _generation;
+	double _allocatedBytes, _peakAllocatedBytes;
+	const uint64_t _id;
+	bool _useHugePages, _numaLocal;
 	mutable std::mutex _mutex;
+	
+	static constexpr size_t HugePageSize = 2*1024*1024;
 };
 
 #else // USE_DIRECT_ALLOCATOR
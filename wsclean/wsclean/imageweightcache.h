@@ -4,15 +4,34 @@
 #include "inversionalgorithm.h"
 #include "logger.h"
 
+#include "../fnvhash.h"
 #include "../imageweights.h"
+#include "../msproviders/msprovider.h"
+#include "../msselection.h"
+#include "../polarization.h"
 #include "../weightmode.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iterator>
 #include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <boost/filesystem/operations.hpp>
+
+#include <casacore/casa/Arrays/Vector.h>
+#include <casacore/casa/Containers/Record.h>
+#include <casacore/tables/Tables/Table.h>
 
 class ImageWeightCache
 {
 public:
-	ImageWeightCache(const WeightMode& weightMode, size_t imageWidth, size_t imageHeight, double pixelScaleX, double pixelScaleY, double minUVInLambda, double maxUVInLambda, double rankFilterLevel, size_t rankFilterSize) :
+	ImageWeightCache(const WeightMode& weightMode, size_t imageWidth, size_t imageHeight, double pixelScaleX, double pixelScaleY, double minUVInLambda, double maxUVInLambda, double rankFilterLevel, size_t rankFilterSize, size_t threadCount) :
 		_weightMode(weightMode),
 		_imageWidth(imageWidth),
 		_imageHeight(imageHeight),
@@ -22,6 +41,7 @@ public:
 		_maxUVInLambda(maxUVInLambda),
 		_rankFilterLevel(rankFilterLevel),
 		_rankFilterSize(rankFilterSize),
+		_threadCount(threadCount),
 		_gaussianTaperBeamSize(0),
 		_tukeyTaperInLambda(0), _tukeyInnerTaperInLambda(0),
 		_edgeTaperInLambda(0),
@@ -40,6 +60,129 @@ public:
 		_edgeTukeyTaperInLambda = edgeTukeyTaperInLambda;
 	}
 	
+	/**
+	 * Enable the on-disk cache of weight grids. Grids are stored in files whose
+	 * names start with @p prefix, and are reused by later runs that use the
+	 * same weighting settings and select the same data. An empty prefix disables
+	 * the cache.
+	 */
+	void SetCachePrefix(const std::string& prefix) { _cachePrefix = prefix; }
+	
+	/**
+	 * Whether a cache prefix was set. Without it, no cache key needs to be made.
+	 */
+	bool IsCacheEnabled() const { return !_cachePrefix.empty(); }
+	
+	/**
+	 * Append a description of the data that is gridded from one measurement set
+	 * to a key for @ref LoadFromCache() and @ref StoreInCache(). The description
+	 * includes the number of rows and the modification time of the columns that
+	 * the weights are calculated from, such that weights are recalculated after
+	 * e.g. flagging or changing the weights.
+	 */
+	static void AddToCacheKey(std::string& dataKey, const std::string& msName, const MSSelection& selection, PolarizationEnum polarization)
+	{
+		const casacore::Table table(msName);
+		std::ostringstream str;
+		str << msName << " rows=" << table.nrow() << " modified=" << ColumnModificationTime(table)
+			<< " pol=" << Polarization::TypeToShortString(polarization)
+			<< " field=" << selection.FieldId() << " band=" << selection.BandId()
+			<< " channels=" << selection.ChannelRangeStart() << '-' << selection.ChannelRangeEnd()
+			<< " timesteps=" << selection.IntervalStart() << '-' << selection.IntervalEnd()
+			<< std::setprecision(17) << " uvw=" << selection.MinUVWInM() << '-' << selection.MaxUVWInM() << '\n';
+		dataKey += str.str();
+	}
+	
+	/**
+	 * The last time that the UVW, FLAG, WEIGHT or WEIGHT_SPECTRUM column of a table
+	 * was written, as given by the files of the storage managers of these columns.
+	 * Writing other columns, such as MODEL_DATA, does not change the time, unless
+	 * they are stored by the same storage manager.
+	 * @returns Modification time in nanoseconds since the epoch.
+	 */
+	static int64_t ColumnModificationTime(const casacore::Table& table)
+	{
+		const std::string weightColumns[] = { "UVW", "FLAG", "WEIGHT", "WEIGHT_SPECTRUM" };
+		const casacore::Record dataManagers = table.dataManagerInfo();
+		std::vector<int> sequenceNumbers;
+		for(unsigned i=0; i!=dataManagers.nfields(); ++i)
+		{
+			const casacore::Record& dataManager = dataManagers.subRecord(i);
+			const casacore::Vector<casacore::String> columns = dataManager.asArrayString("COLUMNS");
+			for(const casacore::String& column : columns)
+			{
+				if(std::find(std::begin(weightColumns), std::end(weightColumns), column) != std::end(weightColumns))
+				{
+					sequenceNumbers.push_back(dataManager.asInt("SEQNR"));
+					break;
+				}
+			}
+		}
+		return StorageManagerModificationTime(table.tableName(), sequenceNumbers);
+	}
+	
+	/**
+	 * The last time that a file of one of the given storage managers was written.
+	 * A storage manager with sequence number n stores its columns in the files
+	 * "table.f<n>" and "table.f<n>_<suffix>" in the table directory.
+	 * @returns Modification time in nanoseconds since the epoch, or zero when none
+	 * of the files can be read.
+	 */
+	static int64_t StorageManagerModificationTime(const std::string& tableName, const std::vector<int>& sequenceNumbers)
+	{
+		int64_t latest = 0;
+		boost::system::error_code error;
+		for(boost::filesystem::directory_iterator i(tableName, error), end; !error && i!=end; i.increment(error))
+		{
+			const std::string filename = i->path().filename().string();
+			bool isStorageManagerFile = false;
+			for(int sequenceNumber : sequenceNumbers)
+			{
+				const std::string prefix = "table.f" + std::to_string(sequenceNumber);
+				if(filename.compare(0, prefix.size(), prefix) == 0 &&
+					(filename.size() == prefix.size() || filename[prefix.size()] == '_'))
+					isStorageManagerFile = true;
+			}
+			struct stat fileStatus;
+			if(isStorageManagerFile && stat(i->path().c_str(), &fileStatus) == 0 && S_ISREG(fileStatus.st_mode))
+				latest = std::max(latest, int64_t(fileStatus.st_mtim.tv_sec) * 1000000000 + int64_t(fileStatus.st_mtim.tv_nsec));
+		}
+		return latest;
+	}
+	
+	/**
+	 * Reset the weights, and read them from the cache if weights for the same
+	 * settings and @p dataKey were stored earlier.
+	 * @returns true when the weights were read from the cache. Otherwise,
+	 * the weights still need to be gridded.
+	 */
+	bool LoadFromCache(const std::string& dataKey)
+	{
+		ResetWeights();
+		if(!IsCacheEnabled())
+			return false;
+		const std::string key = cacheKey(dataKey), filename = cacheFilename(key);
+		if(_imageWeights->Load(filename, key))
+		{
+			Logger::Debug << "Read cached weights from " << filename << ".\n";
+			return true;
+		}
+		return false;
+	}
+	
+	/**
+	 * Write the finished weights to the cache, if the cache is enabled.
+	 */
+	void StoreInCache(const std::string& dataKey) const
+	{
+		if(IsCacheEnabled())
+		{
+			const std::string key = cacheKey(dataKey), filename = cacheFilename(key);
+			Logger::Debug << "Storing weights in " << filename << ".\n";
+			_imageWeights->Store(filename, key);
+		}
+	}
+	
 	void Update(MeasurementSetGridder& gridder, size_t outChannelIndex, size_t outIntervalIndex)
 	{
 		if(outChannelIndex != _currentWeightChannel || outIntervalIndex != _currentWeightInterval)
@@ -53,7 +196,7 @@ public:
 	
 	void ResetWeights()
 	{
-		_imageWeights.reset(new ImageWeights(_weightMode, _imageWidth, _imageHeight, _pixelScaleX, _pixelScaleY, _weightMode.SuperWeight()));
+		_imageWeights.reset(new ImageWeights(_weightMode, _imageWidth, _imageHeight, _pixelScaleX, _pixelScaleY, _weightMode.SuperWeight(), _threadCount));
 	};
 	
 	ImageWeights& Weights()
@@ -95,7 +238,20 @@ private:
 	{
 		Logger::Info << "Precalculating weights for " << _weightMode.ToString() << " weighting... ";
 		Logger::Info.Flush();
-		ResetWeights();
+		std::string dataKey;
+		if(IsCacheEnabled())
+		{
+			for(size_t i=0; i!=gridder.MeasurementSetCount(); ++i)
+			{
+				MSProvider& msProvider = gridder.MeasurementSet(i);
+				AddToCacheKey(dataKey, msProvider.MS().tableName(), gridder.Selection(i), msProvider.Polarization());
+			}
+		}
+		if(LoadFromCache(dataKey))
+		{
+			Logger::Info << "DONE (cached)\n";
+			return;
+		}
 		for(size_t i=0; i!=gridder.MeasurementSetCount(); ++i)
 		{
 			_imageWeights->Grid(gridder.MeasurementSet(i), gridder.Selection(i));
@@ -104,22 +260,54 @@ private:
 		}
 		_imageWeights->FinishGridding();
 		InitializeWeightTapers();
+		StoreInCache(dataKey);
 		Logger::Info << "DONE\n";
 	}
 	
+	/**
+	 * The full key consists of all settings that influence the weights, followed
+	 * by the description of the data. Tapers and the rank filter are part of the
+	 * key, because the grid is stored after these have been applied.
+	 */
+	std::string cacheKey(const std::string& dataKey) const
+	{
+		std::ostringstream key;
+		key << std::setprecision(17)
+			<< "mode=" << _weightMode.ToString() << " robust=" << _weightMode.BriggsRobustness() << " superweight=" << _weightMode.SuperWeight()
+			<< " size=" << _imageWidth << 'x' << _imageHeight
+			<< " scale=" << _pixelScaleX << ',' << _pixelScaleY
+			<< " uvrange=" << _minUVInLambda << '-' << _maxUVInLambda
+			<< " rankfilter=" << _rankFilterLevel << ',' << _rankFilterSize
+			<< " tapers=" << _gaussianTaperBeamSize << ',' << _tukeyTaperInLambda << ',' << _tukeyInnerTaperInLambda
+			<< ',' << _edgeTaperInLambda << ',' << _edgeTukeyTaperInLambda << '\n'
+			<< dataKey;
+		return key.str();
+	}
+	
+	std::string cacheFilename(const std::string& key) const
+	{
+		// The file is named by the hash of the key; the full key is verified on reading
+		FNVHash hash;
+		hash.Add(key);
+		std::ostringstream filename;
+		filename << _cachePrefix << "-weights-" << std::hex << std::setw(16) << std::setfill('0') << hash.Value() << ".tmp";
+		return filename.str();
+	}
+	
 	std::unique_ptr<ImageWeights> _imageWeights;
 	const WeightMode _weightMode;
 	size_t _imageWidth, _imageHeight;
 	double _pixelScaleX, _pixelScaleY;
 	double _minUVInLambda, _maxUVInLambda;
 	double _rankFilterLevel;
-	size_t _rankFilterSize;
+	size_t _rankFilterSize, _threadCount;
 	double _gaussianTaperBeamSize;
 	double _tukeyTaperInLambda, _tukeyInnerTaperInLambda;
 	double _edgeTaperInLambda;
 	double _edgeTukeyTaperInLambda;
 	
 	size_t _currentWeightChannel, _currentWeightInterval;
+	std::string _cachePrefix;
 };
 
 #endif
@@ -37,6 +37,7 @@ class MeasurementSetGridder
 			_measurementSets(),
 			_dataColumnName("DATA"),
 			_doImagePSF(false),
+			_doDualGridPSF(false),
 			_doSubtractModel(false),
 			_addToModel(false),
 			_smallInversion(false),
@@ -50,7 +51,12 @@ class MeasurementSetGridder
 			_overSamplingFactor(63),
 			_normalizeForWeighting(true),
 			_visibilityWeightingMode(NormalVisibilityWeighting),
-			_gridMode(KaiserBesselKernel)
+			_gridMode(KaiserBesselKernel),
+			_preApplyImagingWeights(false),
+			_pinThreads(false),
+			_dftPredictionThreshold(0.0),
+			_wLayerScratchDirectory(),
+			_nonUniformWLayers(false)
 		{
 		}
 		virtual ~MeasurementSetGridder()
@@ -76,6 +82,7 @@ class MeasurementSetGridder
 		
 		const std::string &DataColumnName() const { return _dataColumnName; }
 		bool DoImagePSF() const { return _doImagePSF; }
+		bool DoDualGridPSF() const { return _doDualGridPSF; }
 		bool DoSubtractModel() const { return _doSubtractModel; }
 		bool AddToModel() const { return _addToModel; }
 		bool SmallInversion() const { return _smallInversion; }
@@ -90,6 +97,18 @@ class MeasurementSetGridder
 		double WLimit() const { return _wLimit; }
 		bool NormalizeForWeighting() const { return _normalizeForWeighting; }
 		enum VisibilityWeightingMode VisibilityWeightingMode() const { return _visibilityWeightingMode; }
+		/**
+		 * Whether the final imaging weights should be stored by MS providers that
+		 * support this, such that later inversions can grid pre-weighted samples.
+		 */
+		bool PreApplyImagingWeights() const { return _preApplyImagingWeights; }
+		/**
+		 * Whether gridding and FFT threads should be pinned to CPUs.
+		 */
+		bool PinThreads() const { return _pinThreads; }
+		double DFTPredictionThreshold() const { return _dftPredictionThreshold; }
+		const std::string& WLayerScratchDirectory() const { return _wLayerScratchDirectory; }
+		bool NonUniformWLayers() const { return _nonUniformWLayers; }
 		
 		void SetImageWidth(size_t imageWidth)
 		{
@@ -123,6 +142,16 @@ class MeasurementSetGridder
 		{
 			_doImagePSF = doImagePSF;
 		}
+		/**
+		 * When set, an inversion of the image also makes the PSF, from the same pass
+		 * over the data. The PSF is then available from @ref PSFRealResult(). Only
+		 * used when @ref SupportsDualGridPSF() returns true, and ignored for an
+		 * inversion of the PSF itself.
+		 */
+		void SetDoDualGridPSF(bool doDualGridPSF)
+		{
+			_doDualGridPSF = doDualGridPSF;
+		}
 		void SetPolarization(PolarizationEnum polarization)
 		{
 			_polarization = polarization;
@@ -175,6 +204,43 @@ class MeasurementSetGridder
 		{
 			_visibilityWeightingMode = mode;
 		}
+		void SetPreApplyImagingWeights(bool preApplyImagingWeights)
+		{
+			_preApplyImagingWeights = preApplyImagingWeights;
+		}
+		void SetPinThreads(bool pinThreads)
+		{
+			_pinThreads = pinThreads;
+		}
+		/**
+		 * Model pixels with an absolute value of at least the threshold are predicted
+		 * with a direct Fourier transform, and the remaining image is predicted with
+		 * the gridder. Zero (the default) disables the DFT. Only supported by the
+		 * w-stacking gridder.
+		 */
+		void SetDFTPredictionThreshold(double threshold)
+		{
+			_dftPredictionThreshold = threshold;
+		}
+		/**
+		 * When set, the w-layers of an inversion are kept in a memory-mapped file in this
+		 * directory, such that all layers are gridded in a single pass. An empty
+		 * directory (the default) keeps the layers in memory. Only supported by the
+		 * w-stacking gridder.
+		 */
+		void SetWLayerScratchDirectory(const std::string& directory)
+		{
+			_wLayerScratchDirectory = directory;
+		}
+		/**
+		 * Place the w-layers only at w-values where there are samples, with the same
+		 * maximum distance between a sample and its layer as evenly spaced layers.
+		 * Only supported by the w-stacking gridder.
+		 */
+		void SetNonUniformWLayers(bool nonUniformWLayers)
+		{
+			_nonUniformWLayers = nonUniformWLayers;
+		}
 		
 		virtual void Invert() = 0;
 		
@@ -183,6 +249,11 @@ class MeasurementSetGridder
 		
 		virtual double *ImageRealResult() = 0;
 		virtual double *ImageImaginaryResult() = 0;
+		virtual bool SupportsDualGridPSF() const { return false; }
+		/**
+		 * The PSF of the last inversion, when it was made with @ref SetDoDualGridPSF().
+		 */
+		virtual double *PSFRealResult() { return nullptr; }
 		virtual double PhaseCentreRA() const = 0;
 		virtual double PhaseCentreDec() const = 0;
 		virtual bool HasDenormalPhaseCentre() const { return false; }
@@ -239,7 +310,7 @@ class MeasurementSetGridder
 		size_t _wGridSize;
 		std::vector<MSProvider*> _measurementSets;
 		std::string _dataColumnName;
-		bool _doImagePSF, _doSubtractModel, _addToModel, _smallInversion;
+		bool _doImagePSF, _doDualGridPSF, _doSubtractModel, _addToModel, _smallInversion;
 		double _wLimit;
 		class ImageWeights *_precalculatedWeightInfo;
 		PolarizationEnum _polarization;
@@ -251,6 +322,10 @@ class MeasurementSetGridder
 		bool _normalizeForWeighting;
 		enum VisibilityWeightingMode _visibilityWeightingMode;
 		GridModeEnum _gridMode;
+		bool _preApplyImagingWeights, _pinThreads;
+		double _dftPredictionThreshold;
+		std::string _wLayerScratchDirectory;
+		bool _nonUniformWLayers;
 };
 
 #endif
@@ -4,6 +4,7 @@
 
 #include "../msproviders/msprovider.h"
 
+#include "../fnvhash.h"
 #include "../imageweights.h"
 
 #include "../units/angle.h"
@@ -17,7 +18,9 @@
 #include <casacore/measures/TableMeasures/ScalarMeasColumn.h>
 #include <casacore/tables/Tables/ArrColDesc.h>
 
-MSGridderBase::MSData::MSData() : msIndex(0), matchingRows(0), totalRowsProcessed(0)
+#include <cstring>
+
+MSGridderBase::MSData::MSData() : msIndex(0), matchingRows(0), totalRowsProcessed(0), visibilityCount(0), hasImagingWeights(false)
 { }
 
 MSGridderBase::MSData::~MSData()
@@ -109,6 +112,7 @@ void MSGridderBase::calculateWLimits(MSGridderBase::MSData& msData)
 	msData.maxW = 0.0;
 	msData.minW = 1e100;
 	msData.maxBaselineUVW = 0.0;
+	msData.visibilityCount = 0;
 	MultiBandData selectedBand = msData.SelectedBand();
 	std::vector<float> weightArray(selectedBand.MaxChannels() * NPolInMSProvider);
 	msData.msProvider->Reset();
@@ -118,6 +122,7 @@ void MSGridderBase::calculateWLimits(MSGridderBase::MSData& msData)
 		double uInM, vInM, wInM;
 		msData.msProvider->ReadMeta(uInM, vInM, wInM, dataDescId);
 		const BandData& curBand = selectedBand[dataDescId];
+		msData.visibilityCount += curBand.ChannelCount();
 		double wHi = fabs(wInM / curBand.SmallestWavelength());
 		double wLo = fabs(wInM / curBand.LongestWavelength());
 		double baselineInM = sqrt(uInM*uInM + vInM*vInM + wInM*wInM);
@@ -286,20 +291,17 @@ void MSGridderBase::calculateOverallMetaData(const MSData* msDataVector)
 }
 
 template<size_t PolarizationCount>
-void MSGridderBase::readAndWeightVisibilities(MSProvider& msProvider, InversionRow& rowData, const BandData& curBand, float* weightBuffer, std::complex<float>* modelBuffer, const bool* isSelected)
+void MSGridderBase::readVisibilities(MSProvider& msProvider, InversionRow& rowData, const BandData& curBand, std::complex<float>* modelBuffer)
 {
 	if(DoImagePSF())
 	{
-		msProvider.ReadWeights(rowData.data);
-		if(HasDenormalPhaseCentre())
-		{
-			double lmsqrt = sqrt(1.0-PhaseCentreDL()*PhaseCentreDL()- PhaseCentreDM()*PhaseCentreDM());
-			double shiftFactor = 2.0*M_PI* (rowData.uvw[2] * (lmsqrt-1.0));
-			rotateVisibilities<PolarizationCount>(curBand, shiftFactor, rowData.data);
-		}
+		readWeightsAsVisibilities<PolarizationCount>(msProvider, rowData, curBand, rowData.data);
 	}
 	else {
 		msProvider.ReadData(rowData.data);
+		// The PSF of a dual-grid inversion is read as above
+		if(rowData.psfData != nullptr)
+			readWeightsAsVisibilities<PolarizationCount>(msProvider, rowData, curBand, rowData.psfData);
 	}
 	
 	if(DoSubtractModel())
@@ -312,6 +314,24 @@ void MSGridderBase::readAndWeightVisibilities(MSProvider& msProvider, InversionR
 			modelIter++;
 		}
 	}
+}
+
+template<size_t PolarizationCount>
+void MSGridderBase::readWeightsAsVisibilities(MSProvider& msProvider, const InversionRow& rowData, const BandData& curBand, std::complex<float>* buffer)
+{
+	msProvider.ReadWeights(buffer);
+	if(HasDenormalPhaseCentre())
+	{
+		double lmsqrt = sqrt(1.0-PhaseCentreDL()*PhaseCentreDL()- PhaseCentreDM()*PhaseCentreDM());
+		double shiftFactor = 2.0*M_PI* (rowData.uvw[2] * (lmsqrt-1.0));
+		rotateVisibilities<PolarizationCount>(curBand, shiftFactor, buffer);
+	}
+}
+
+template<size_t PolarizationCount>
+void MSGridderBase::readAndWeightVisibilities(MSProvider& msProvider, InversionRow& rowData, const BandData& curBand, float* weightBuffer, std::complex<float>* modelBuffer, const bool* isSelected)
+{
+	readVisibilities<PolarizationCount>(msProvider, rowData, curBand, modelBuffer);
 	
 	msProvider.ReadWeights(weightBuffer);
 	
@@ -334,6 +354,11 @@ void MSGridderBase::readAndWeightVisibilities(MSProvider& msProvider, InversionR
 		case SquaredVisibilityWeighting:
 			for(size_t chp=0; chp!=curBand.ChannelCount() * PolarizationCount; ++chp)
 				rowData.data[chp] *= weightBuffer[chp];
+			if(rowData.psfData != nullptr)
+			{
+				for(size_t chp=0; chp!=curBand.ChannelCount() * PolarizationCount; ++chp)
+					rowData.psfData[chp] *= weightBuffer[chp];
+			}
 			break;
 		case UnitVisibilityWeighting:
 			for(size_t chp=0; chp!=curBand.ChannelCount() * PolarizationCount; ++chp)
@@ -343,6 +368,16 @@ void MSGridderBase::readAndWeightVisibilities(MSProvider& msProvider, InversionR
 				else
 					rowData.data[chp] /= weightBuffer[chp];
 			}
+			if(rowData.psfData != nullptr)
+			{
+				for(size_t chp=0; chp!=curBand.ChannelCount() * PolarizationCount; ++chp)
+				{
+					if(weightBuffer[chp] == 0.0)
+						rowData.psfData[chp] = 0.0;
+					else
+						rowData.psfData[chp] /= weightBuffer[chp];
+				}
+			}
 			break;
 	}
 	switch(Weighting().Mode())
@@ -351,7 +386,9 @@ void MSGridderBase::readAndWeightVisibilities(MSProvider& msProvider, InversionR
 		case WeightMode::BriggsWeighted:
 		case WeightMode::NaturalWeighted:
 		{
-			std::complex<float>* dataIter = rowData.data;
+			std::complex<float>
+				*dataIter = rowData.data,
+				*psfIter = rowData.psfData;
 			float* weightIter = weightBuffer;
 			for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
 			{
@@ -373,6 +410,14 @@ void MSGridderBase::readAndWeightVisibilities(MSProvider& msProvider, InversionR
 					++dataIter;
 					++weightIter;
 				}
+				if(psfIter != nullptr)
+				{
+					for(size_t p=0; p!=PolarizationCount; ++p)
+					{
+						*psfIter *= weight;
+						++psfIter;
+					}
+				}
 			}
 		} break;
 	}
@@ -382,6 +427,88 @@ template void MSGridderBase::readAndWeightVisibilities<1>(MSProvider& msProvider
 
 template void MSGridderBase::readAndWeightVisibilities<4>(MSProvider& msProvider, InversionRow& newItem, const BandData& curBand, float* weightBuffer, std::complex<float>* modelBuffer, const bool* isSelected);
 
+template<size_t PolarizationCount>
+void MSGridderBase::readPreweightedVisibilities(MSProvider& msProvider, InversionRow& rowData, const BandData& curBand, float* imagingWeightBuffer, std::complex<float>* modelBuffer)
+{
+	readVisibilities<PolarizationCount>(msProvider, rowData, curBand, modelBuffer);
+	
+	msProvider.ReadImagingWeights(imagingWeightBuffer);
+	for(size_t chp=0; chp!=curBand.ChannelCount() * PolarizationCount; ++chp)
+		rowData.data[chp] *= imagingWeightBuffer[chp];
+	if(rowData.psfData != nullptr)
+	{
+		for(size_t chp=0; chp!=curBand.ChannelCount() * PolarizationCount; ++chp)
+			rowData.psfData[chp] *= imagingWeightBuffer[chp];
+	}
+}
+
+template void MSGridderBase::readPreweightedVisibilities<1>(MSProvider& msProvider, InversionRow& newItem, const BandData& curBand, float* imagingWeightBuffer, std::complex<float>* modelBuffer);
+
+template void MSGridderBase::readPreweightedVisibilities<4>(MSProvider& msProvider, InversionRow& newItem, const BandData& curBand, float* imagingWeightBuffer, std::complex<float>* modelBuffer);
+
+template<size_t PolarizationCount>
+void MSGridderBase::calculateImagingWeights(const double* uvw, const BandData& curBand, const float* weightBuffer, const bool* isSelected, float* imagingWeightBuffer, MSProvider::ImagingWeightSums& sums) const
+{
+	const float* weightIter = weightBuffer;
+	float* imagingWeightIter = imagingWeightBuffer;
+	for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
+	{
+		double
+			u = uvw[0] / curBand.ChannelWavelength(ch),
+			v = uvw[1] / curBand.ChannelWavelength(ch),
+			weight = PrecalculatedWeightInfo()->GetWeight(u, v);
+		if(isSelected[ch])
+		{
+			// This follows the accounting in readAndWeightVisibilities()
+			double cumWeight = weight * *weightIter;
+			if(cumWeight != 0.0)
+			{
+				sums.visibilityWeightSum += *weightIter * 0.5;
+				++sums.griddedVisibilityCount;
+				sums.maxGriddedWeight = std::max(cumWeight, sums.maxGriddedWeight);
+				sums.totalWeight += cumWeight;
+			}
+		}
+		for(size_t p=0; p!=PolarizationCount; ++p)
+		{
+			switch(VisibilityWeightingMode())
+			{
+				case NormalVisibilityWeighting:
+					*imagingWeightIter = weight;
+					break;
+				case SquaredVisibilityWeighting:
+					*imagingWeightIter = weight * *weightIter;
+					break;
+				case UnitVisibilityWeighting:
+					if(*weightIter == 0.0)
+						*imagingWeightIter = 0.0;
+					else
+						*imagingWeightIter = weight / *weightIter;
+					break;
+			}
+			++weightIter;
+			++imagingWeightIter;
+		}
+	}
+}
+
+template void MSGridderBase::calculateImagingWeights<1>(const double* uvw, const BandData& curBand, const float* weightBuffer, const bool* isSelected, float* imagingWeightBuffer, MSProvider::ImagingWeightSums& sums) const;
+
+template void MSGridderBase::calculateImagingWeights<4>(const double* uvw, const BandData& curBand, const float* weightBuffer, const bool* isSelected, float* imagingWeightBuffer, MSProvider::ImagingWeightSums& sums) const;
+
+uint64_t MSGridderBase::imagingWeightKey(size_t nWLayers) const
+{
+	const double values[] = {
+		_minW, _maxW, double(nWLayers), double(IsComplex()),
+		double(VisibilityWeightingMode()), double(NonUniformWLayers())
+	};
+	FNVHash hash(PrecalculatedWeightInfo()->Checksum());
+	hash.Add(values, sizeof(values) / sizeof(double));
+	const uint64_t key = hash.Value();
+	// Zero is reserved for imaging weights that were not completely written
+	return key == 0 ? 1 : key;
+}
+
 template<size_t PolarizationCount>
 void MSGridderBase::rotateVisibilities(const BandData& bandData, double shiftFactor, std::complex<float>* dataIter)
 {
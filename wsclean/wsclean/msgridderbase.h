@@ -4,6 +4,8 @@
 #include "inversionalgorithm.h"
 #include "../multibanddata.h"
 
+#include "../msproviders/msprovider.h"
+
 class MSGridderBase : public MeasurementSetGridder
 {
 public:
@@ -61,8 +63,11 @@ protected:
 			MultiBandData bandData;
 			size_t startChannel, endChannel;
 			size_t matchingRows, totalRowsProcessed;
+			// Number of visibilities (rows x selected channels), counted by calculateWLimits()
+			size_t visibilityCount;
 			double minW, maxW, maxBaselineUVW;
 			size_t rowStart, rowEnd;
+			bool hasImagingWeights;
 		
 			MultiBandData SelectedBand() const { return MultiBandData(bandData, startChannel, endChannel); }
 		private:
@@ -73,9 +78,16 @@ protected:
 		
 	struct InversionRow
 	{
+		InversionRow() : data(nullptr), psfData(nullptr) { }
+		
 		double uvw[3];
 		size_t dataDescId;
 		std::complex<float>* data;
+		/**
+		 * When not null, the visibilities of the PSF are read into this buffer
+		 * as well, and are weighted the same as @ref data.
+		 */
+		std::complex<float>* psfData;
 	};
 		
 	void resetMetaData()
@@ -111,6 +123,36 @@ protected:
 	
 	template<size_t PolarizationCount>
 	void readAndWeightVisibilities(MSProvider& msProvider, InversionRow& rowData, const BandData& curBand, float* weightBuffer, std::complex<float>* modelBuffer, const bool* isSelected);
+	
+	/**
+	 * Like @ref readAndWeightVisibilities(), but multiplies the visibilities with the
+	 * imaging weights that were stored in the provider earlier. The weight sums are
+	 * not updated; these are stored together with the imaging weights.
+	 */
+	template<size_t PolarizationCount>
+	void readPreweightedVisibilities(MSProvider& msProvider, InversionRow& rowData, const BandData& curBand, float* imagingWeightBuffer, std::complex<float>* modelBuffer);
+	
+	/**
+	 * Calculate the imaging weights of a row, i.e. the factors with which
+	 * @ref readAndWeightVisibilities() multiplies the visibilities. Samples of
+	 * selected channels (@p isSelected has one value per channel) are added to @p sums.
+	 */
+	template<size_t PolarizationCount>
+	void calculateImagingWeights(const double* uvw, const BandData& curBand, const float* weightBuffer, const bool* isSelected, float* imagingWeightBuffer, MSProvider::ImagingWeightSums& sums) const;
+	
+	/**
+	 * A key that identifies the imaging weights and the selection of samples over
+	 * which the weight sums are accumulated.
+	 */
+	uint64_t imagingWeightKey(size_t nWLayers) const;
+	
+	void addImagingWeightSums(const MSProvider::ImagingWeightSums& sums)
+	{
+		_visibilityWeightSum += sums.visibilityWeightSum;
+		_griddedVisibilityCount += sums.griddedVisibilityCount;
+		_maxGriddedWeight = std::max(_maxGriddedWeight, sums.maxGriddedWeight);
+		_totalWeight += sums.totalWeight;
+	}
 
 	double _maxW, _minW;
 	double _theoreticalBeamSize;
@@ -130,6 +172,16 @@ protected:
 	void initializeMSDataVector(std::vector<MSData>& msDataVector, size_t nPolInMSProvider);
 	
 private:
+	template<size_t PolarizationCount>
+	void readVisibilities(MSProvider& msProvider, InversionRow& rowData, const BandData& curBand, std::complex<float>* modelBuffer);
+	
+	/**
+	 * Read the weights of the current row into @p buffer as the visibilities of the PSF,
+	 * which are phase rotated like the data when the phase centre is shifted.
+	 */
+	template<size_t PolarizationCount>
+	void readWeightsAsVisibilities(MSProvider& msProvider, const InversionRow& rowData, const BandData& curBand, std::complex<float>* buffer);
+	
 	template<size_t PolarizationCount>
 	static void rotateVisibilities(const BandData &bandData, double shiftFactor, std::complex<float>* dataIter);
 	
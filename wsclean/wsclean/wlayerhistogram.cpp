@@ -0,0 +1,38 @@
+#include "wlayerhistogram.h"
+
+#include <algorithm>
+
+WLayerHistogram::WLayerHistogram(size_t uniformLayerCount, double minW, double maxW, bool isComplex) :
+	_lowW(isComplex ? -maxW : minW),
+	_highW(maxW),
+	_isComplex(isComplex)
+{
+	double range = maxW - _lowW;
+	if(range <= 0.0)
+		range = 1.0;
+	_layerSpacing = uniformLayerCount > 1 ? range / (uniformLayerCount - 1) : range;
+	_binWidth = _layerSpacing / _binsPerLayer;
+	// One more bin for samples at maxW
+	_counts.assign(size_t(range / _binWidth) + 1, 0);
+}
+
+std::vector<double> WLayerHistogram::LayerWValues() const
+{
+	std::vector<double> layers;
+	size_t bin = 0;
+	while(bin != _counts.size())
+	{
+		if(_counts[bin] == 0)
+			++bin;
+		else {
+			// A layer in the middle of one layer spacing from the start of this bin
+			// covers this and the next bins that end within the spacing
+			layers.push_back(_lowW + bin * _binWidth + 0.5 * _layerSpacing);
+			bin = std::min(bin + _binsPerLayer, _counts.size());
+		}
+	}
+	// At least one layer is required
+	if(layers.empty())
+		layers.push_back(_lowW);
+	return layers;
+}
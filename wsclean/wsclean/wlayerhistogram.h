@@ -0,0 +1,67 @@
+#ifndef W_LAYER_HISTOGRAM_H
+#define W_LAYER_HISTOGRAM_H
+
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+/**
+ * Places w-layers of the w-stacking gridder only where there are samples.
+ * 
+ * The accuracy of w-stacking is set by the largest distance in w between a sample
+ * and the layer it is gridded on, which is half the layer spacing for evenly
+ * spaced layers. This class counts the samples in bins that are a fraction of this
+ * spacing, and places layers such that every occupied bin lies within half the
+ * spacing of a layer. The accuracy is therefore the same as for evenly spaced
+ * layers, but w-ranges without samples, which are common at large w, get no layers
+ * at all.
+ */
+class WLayerHistogram
+{
+public:
+	/**
+	 * @param uniformLayerCount Number of evenly spaced layers that would be used
+	 * for the range, which sets the spacing of the layers.
+	 * @param minW Smallest (absolute) w-value of the samples.
+	 * @param maxW Largest (absolute) w-value of the samples.
+	 * @param isComplex Whether a complex image is made, in which case the range
+	 * of signed w-values -maxW to maxW is used, as in the @ref WStackingGridder.
+	 */
+	WLayerHistogram(size_t uniformLayerCount, double minW, double maxW, bool isComplex);
+	
+	/**
+	 * Count a sample. Samples outside the range are not gridded, and are not counted.
+	 */
+	void Add(double wInLambda)
+	{
+		double w = _isComplex ? wInLambda : std::abs(wInLambda);
+		if(w >= _lowW && w <= _highW)
+		{
+			size_t bin = size_t((w - _lowW) / _binWidth);
+			if(bin >= _counts.size())
+				bin = _counts.size() - 1;
+			++_counts[bin];
+		}
+	}
+	
+	/**
+	 * The w-values of the layers, in increasing order. There are at most as many
+	 * layers as evenly spaced layers.
+	 */
+	std::vector<double> LayerWValues() const;
+	
+	/**
+	 * Spacing of evenly spaced layers, and the largest spacing of the placed layers.
+	 */
+	double LayerSpacing() const { return _layerSpacing; }
+	
+private:
+	/** Number of bins per layer spacing */
+	static const size_t _binsPerLayer = 8;
+	
+	double _lowW, _highW, _layerSpacing, _binWidth;
+	bool _isComplex;
+	std::vector<size_t> _counts;
+};
+
+#endif
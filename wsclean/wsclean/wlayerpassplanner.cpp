@@ -0,0 +1,136 @@
+#include "wlayerpassplanner.h"
+
+#include <algorithm>
+#include <cmath>
+
+WLayerPassPlanner::WLayerPassPlanner(size_t width, size_t height, bool isComplex) :
+	_width(width),
+	_height(height),
+	_isComplex(isComplex),
+	_visibilityCount(0)
+{
+}
+
+double WLayerPassPlanner::bufferBytes(size_t doubleCount) const
+{
+	// Large buffers may be aligned on a huge page, which can waste up to one
+	// page per buffer
+	const double hugePageSize = 2.0*1024.0*1024.0;
+	return double(doubleCount) * sizeof(double) + hugePageSize;
+}
+
+double WLayerPassPlanner::threadBytes() const
+{
+	// The FFT input and output
+	return 2.0 * bufferBytes(_width * _height * 2);
+}
+
+double WLayerPassPlanner::imageBytes() const
+{
+	// The image that all threads project the layers on
+	return bufferBytes(_width * _height) * (_isComplex ? 2.0 : 1.0);
+}
+
+double WLayerPassPlanner::Memory(size_t threadCount, size_t layersPerPass) const
+{
+	return double(layersPerPass) * bufferBytes(_width * _height * 2) + double(threadCount) * threadBytes() + imageBytes();
+}
+
+double WLayerPassPlanner::Time(size_t passCount, size_t threadCount, size_t layerCount) const
+{
+	// Rough costs: a complex FFT takes about 5 N log2 N operations at 1 GFlop/s
+	// per thread, zeroing and projecting a layer about 30 ns per pixel, and
+	// reading a visibility with its metadata about 5 ns.
+	const double
+		pixelCount = double(_width) * double(_height),
+		layerTime = 5e-9 * pixelCount * std::log2(std::max(2.0, pixelCount)) + 3e-8 * pixelCount,
+		readTime = 5e-9 * double(_visibilityCount);
+	const size_t
+		layersPerPass = (layerCount + passCount - 1) / passCount,
+		layersPerThread = (layersPerPass + threadCount - 1) / threadCount;
+	return double(passCount) * (readTime + double(layersPerThread) * layerTime);
+}
+
+WLayerPassPlanner::Plan WLayerPassPlanner::Make(size_t layerCount, size_t maxThreadCount, double maxMemory) const
+{
+	if(layerCount == 0) layerCount = 1;
+	if(maxThreadCount == 0) maxThreadCount = 1;
+	// Threads beyond the number of layers have nothing to transform
+	if(maxThreadCount > layerCount) maxThreadCount = layerCount;
+	
+	Plan best;
+	bool found = false;
+	for(size_t threadCount=maxThreadCount; threadCount!=0; --threadCount)
+	{
+		// More passes can be faster when they divide the layers more evenly over
+		// the threads, so all pass counts that fit are considered
+		for(size_t passCount=1; passCount<=layerCount; ++passCount)
+		{
+			const size_t layersPerPass = (layerCount + passCount - 1) / passCount;
+			const double memory = Memory(threadCount, layersPerPass);
+			if(memory <= maxMemory)
+			{
+				const double time = Time(passCount, threadCount, layerCount);
+				// Ties are resolved in favour of more threads and fewer passes
+				if(!found || time < best.time)
+				{
+					best.passCount = passCount;
+					best.threadCount = threadCount;
+					best.layersPerPass = layersPerPass;
+					best.residentLayerCount = layersPerPass;
+					best.memory = memory;
+					best.time = time;
+					found = true;
+				}
+			}
+		}
+	}
+	if(!found)
+	{
+		best.passCount = layerCount;
+		best.threadCount = 1;
+		best.layersPerPass = 1;
+		best.residentLayerCount = 1;
+		best.memory = Memory(1, 1);
+		best.time = Time(layerCount, 1, layerCount);
+	}
+	return best;
+}
+
+WLayerPassPlanner::Plan WLayerPassPlanner::MakeMapped(size_t layerCount, size_t maxThreadCount, double maxMemory) const
+{
+	if(layerCount == 0) layerCount = 1;
+	if(maxThreadCount == 0) maxThreadCount = 1;
+	if(maxThreadCount > layerCount) maxThreadCount = layerCount;
+	
+	// Layers that are not resident are written to the file during gridding and
+	// read back for the FFT, at a rate of about 1 GB/s.
+	const double
+		layerBytes = double(_width) * double(_height) * sizeof(double) * 2.0,
+		pagingTimePerLayer = 2.0 * layerBytes * 1e-9;
+	Plan best;
+	best.passCount = 1;
+	best.threadCount = 1;
+	best.layersPerPass = layerCount;
+	best.residentLayerCount = 1;
+	best.memory = Memory(1, 1);
+	best.time = Time(1, 1, layerCount) + double(layerCount - 1) * pagingTimePerLayer;
+	for(size_t threadCount=maxThreadCount; threadCount!=0; --threadCount)
+	{
+		const double remaining = maxMemory - double(threadCount) * threadBytes() - imageBytes();
+		const double fittingLayers = std::floor(remaining / bufferBytes(_width * _height * 2));
+		if(fittingLayers >= 1.0)
+		{
+			const size_t residentLayerCount = std::min<size_t>(layerCount, size_t(fittingLayers));
+			const double time = Time(1, threadCount, layerCount) + double(layerCount - residentLayerCount) * pagingTimePerLayer;
+			if(time < best.time || best.memory > maxMemory)
+			{
+				best.threadCount = threadCount;
+				best.residentLayerCount = residentLayerCount;
+				best.memory = Memory(threadCount, residentLayerCount);
+				best.time = time;
+			}
+		}
+	}
+	return best;
+}
@@ -0,0 +1,85 @@
+#ifndef W_LAYER_PASS_PLANNER_H
+#define W_LAYER_PASS_PLANNER_H
+
+#include <cstddef>
+
+/**
+ * Decides how the w-layers of the w-stacking gridder are processed: in how many
+ * passes, and with how many threads that each have their own FFT buffers.
+ * 
+ * The planner models the memory that a plan requires, which consists of the layers
+ * of one pass, the image that the threads share (two for complex images) and per
+ * thread the input and output buffers of the FFT. Buffers are allocated by the @ref ImageBufferAllocator, which
+ * keeps freed buffers for reuse, so the peak of all buffers that are simultaneously in use
+ * is required. The wall time of a plan is estimated from the number of FFTs that each
+ * thread performs, and the cost of reading all visibilities once more for every pass.
+ * Of all plans that fit in the available memory, the fastest is chosen.
+ */
+class WLayerPassPlanner
+{
+public:
+	struct Plan
+	{
+		size_t passCount, threadCount, layersPerPass;
+		/** Number of layers that fit in memory, which is less than @ref layersPerPass
+		 * only for plans that keep the layers in a memory-mapped file. */
+		size_t residentLayerCount;
+		/** Predicted peak memory in bytes */
+		double memory;
+		/** Estimated wall time in seconds for gridding and Fourier transforming */
+		double time;
+	};
+	
+	/**
+	 * @param width Width of the layers in pixels.
+	 * @param height Height of the layers in pixels.
+	 * @param isComplex Whether a complex image is made, which requires a second
+	 * image.
+	 */
+	WLayerPassPlanner(size_t width, size_t height, bool isComplex);
+	
+	/**
+	 * Set the number of visibilities that are read during each pass. When this is zero,
+	 * the cost of reading is unknown and the plan with the fewest passes is preferred
+	 * among plans that are equally fast otherwise.
+	 */
+	void SetVisibilityCount(size_t visibilityCount) { _visibilityCount = visibilityCount; }
+	
+	/**
+	 * Make the fastest plan that fits in @p maxMemory. If no plan fits, the plan that
+	 * requires the least memory is returned, which uses one thread and one layer per pass.
+	 * @param layerCount Total number of w-layers.
+	 * @param maxThreadCount Maximum number of threads that can be used.
+	 * @param maxMemory Memory in bytes that the plan may use.
+	 */
+	Plan Make(size_t layerCount, size_t maxThreadCount, double maxMemory) const;
+	
+	/**
+	 * Make the fastest plan that grids all layers in a single pass, while the layers
+	 * are kept in a memory-mapped file. Only the layers that fit in @p maxMemory next
+	 * to the buffers of the threads stay resident; the others are written to and read
+	 * back from the file once. Fewer threads leave more memory for resident layers.
+	 */
+	Plan MakeMapped(size_t layerCount, size_t maxThreadCount, double maxMemory) const;
+	
+	/**
+	 * Predicted peak memory in bytes of a plan.
+	 */
+	double Memory(size_t threadCount, size_t layersPerPass) const;
+	
+	/**
+	 * Estimated wall time in seconds of a plan.
+	 */
+	double Time(size_t passCount, size_t threadCount, size_t layerCount) const;
+	
+private:
+	double bufferBytes(size_t doubleCount) const;
+	double threadBytes() const;
+	double imageBytes() const;
+	
+	size_t _width, _height;
+	bool _isComplex;
+	size_t _visibilityCount;
+};
+
+#endif
@@ -39,6 +39,8 @@
 #include <iostream>
 #include <memory>
 
+#include <boost/filesystem/path.hpp>
+
 std::string commandLine;
 
 WSClean::WSClean() :
@@ -69,32 +71,54 @@ void WSClean::imagePSF(ImagingTableEntry& entry)
 	Logger::Info << " == Constructing PSF ==\n";
 	_inversionWatch.Start();
 	_gridder->SetDoImagePSF(true);
+	_gridder->SetDoDualGridPSF(false);
 	_gridder->SetDoSubtractModel(false);
 	_gridder->SetVerbose(_isFirstInversion);
 	_gridder->Invert();
 	
+	processPSF(entry, _gridder->ImageRealResult());
+}
+
+void WSClean::imagePSFAndMainFirst(ImagingTableEntry& entry)
+{
+	Logger::Info.Flush();
+	Logger::Info << " == Constructing PSF and image ==\n";
+	_inversionWatch.Start();
+	_gridder->SetDoImagePSF(false);
+	_gridder->SetDoDualGridPSF(true);
+	_gridder->SetDoSubtractModel(_settings.subtractModel || _settings.continuedRun);
+	_gridder->SetVerbose(_isFirstInversion);
+	_gridder->Invert();
+	_gridder->SetDoDualGridPSF(false);
+	
+	processPSF(entry, _gridder->PSFRealResult());
+}
+
+void WSClean::processPSF(ImagingTableEntry& entry, double* psf)
+{
+	size_t channelIndex = entry.outputChannelIndex;
 	size_t centralIndex = _settings.trimmedImageWidth/2 + (_settings.trimmedImageHeight/2) * _settings.trimmedImageWidth;
 	if(_settings.normalizeForWeighting)
 	{
 		double normFactor;
-		if(_gridder->ImageRealResult()[centralIndex] != 0.0)
-			normFactor = 1.0/_gridder->ImageRealResult()[centralIndex];
+		if(psf[centralIndex] != 0.0)
+			normFactor = 1.0/psf[centralIndex];
 		else
 			normFactor = 0.0;
 		_infoPerChannel[channelIndex].psfNormalizationFactor = normFactor;
-		multiplyImage(normFactor, _gridder->ImageRealResult());
+		multiplyImage(normFactor, psf);
 		Logger::Debug << "Normalized PSF by factor of " << normFactor << ".\n";
 	}
 		
-	DeconvolutionAlgorithm::RemoveNaNsInPSF(_gridder->ImageRealResult(), _settings.trimmedImageWidth, _settings.trimmedImageHeight);
+	DeconvolutionAlgorithm::RemoveNaNsInPSF(psf, _settings.trimmedImageWidth, _settings.trimmedImageHeight);
 	_psfImages.SetFitsWriter(createWSCFitsWriter(entry, false).Writer());
-	_psfImages.Store(_gridder->ImageRealResult(), *_settings.polarizations.begin(), channelIndex, false);
+	_psfImages.Store(psf, *_settings.polarizations.begin(), channelIndex, false);
 	_inversionWatch.Pause();
 	
 	_isFirstInversion = false;
 	
 	double bMaj, bMin, bPA;
-	determineBeamSize(bMaj, bMin, bPA, _gridder->ImageRealResult(), _gridder->BeamSize());
+	determineBeamSize(bMaj, bMin, bPA, psf, _gridder->BeamSize());
 	entry.imageWeight = _gridder->ImageWeight();
 	_infoPerChannel[channelIndex].theoreticBeamSize = _gridder->BeamSize();
 	_infoPerChannel[channelIndex].beamMaj = bMaj;
@@ -109,14 +133,14 @@ void WSClean::imagePSF(ImagingTableEntry& entry)
 		
 	if(_settings.isUVImageSaved)
 	{
-		saveUVImage(_gridder->ImageRealResult(), *_settings.polarizations.begin(), entry, false, "uvpsf");
+		saveUVImage(psf, *_settings.polarizations.begin(), entry, false, "uvpsf");
 	}
 	
 	Logger::Info << "Writing psf image... ";
 	Logger::Info.Flush();
 	const std::string name(ImageFilename::GetPSFPrefix(_settings, channelIndex, entry.outputIntervalIndex) + "-psf.fits");
 	WSCFitsWriter fitsFile = createWSCFitsWriter(entry, false);
-	fitsFile.WritePSF(name, _gridder->ImageRealResult());
+	fitsFile.WritePSF(name, psf);
 	Logger::Info << "DONE\n";
 }
 
@@ -145,13 +169,7 @@ void WSClean::imageMainFirst(PolarizationEnum polarization, size_t joinedChannel
 	_inversionWatch.Pause();
 	_gridder->SetVerbose(false);
 	
-	multiplyImage(_infoPerChannel[joinedChannelIndex].psfNormalizationFactor, _gridder->ImageRealResult());
-	storeAndCombineXYandYX(_residualImages, polarization, joinedChannelIndex, false, _gridder->ImageRealResult());
-	if(Polarization::IsComplex(polarization))
-	{
-		multiplyImage(_infoPerChannel[joinedChannelIndex].psfNormalizationFactor, _gridder->ImageImaginaryResult());
-		storeAndCombineXYandYX(_residualImages, polarization, joinedChannelIndex, true, _gridder->ImageImaginaryResult());
-	}
+	storeMainImage(polarization, joinedChannelIndex);
 }
 
 void WSClean::imageMainNonFirst(PolarizationEnum polarization, size_t joinedChannelIndex)
@@ -163,6 +181,11 @@ void WSClean::imageMainNonFirst(PolarizationEnum polarization, size_t joinedChan
 	_gridder->Invert();
 	_inversionWatch.Pause();
 	
+	storeMainImage(polarization, joinedChannelIndex);
+}
+
+void WSClean::storeMainImage(PolarizationEnum polarization, size_t joinedChannelIndex)
+{
 	multiplyImage(_infoPerChannel[joinedChannelIndex].psfNormalizationFactor, _gridder->ImageRealResult());
 	storeAndCombineXYandYX(_residualImages, polarization, joinedChannelIndex, false, _gridder->ImageRealResult());
 	if(Polarization::IsComplex(polarization))
@@ -269,23 +292,53 @@ void WSClean::dftPredict(const ImagingTable& squaredGroup)
 		DeconvolutionAlgorithm::GetModelFromImage(model, modelImages[0].data(), _settings.trimmedImageWidth, _settings.trimmedImageHeight, _gridder->PhaseCentreRA(), _gridder->PhaseCentreDec(), _settings.pixelScaleX, _settings.pixelScaleY, _gridder->PhaseCentreDL(), _gridder->PhaseCentreDM(), 0.0, squaredGroup.Front().CentralFrequency());
 	else throw std::runtime_error("Can't perform DFT for this set of polarizations: either image only I or IQUV.");
 	
-	NDPPP::SaveSkyModel("wsclean-prediction-skymodel.txt", model, false);
-	NDPPP::ConvertSkyModelToSourceDB("wsclean-prediction.sourcedb", "wsclean-prediction-skymodel.txt");
-	
 	Logger::Info << "Number of components to be predicted: " << model.SourceCount() << '\n';
 	
 	_predictingWatch.Start();
 	
-	for(size_t filenameIndex=0; filenameIndex!=_settings.filenames.size(); ++filenameIndex)
+	if(_settings.dftWithBeam)
 	{
-		for(size_t d=0; d!=_msBands[filenameIndex].DataDescCount(); ++d)
+		// The beam depends on time and station, which the MSProvider interface does not
+		// provide, hence applying the beam is left to NDPPP.
+		NDPPP::SaveSkyModel("wsclean-prediction-skymodel.txt", model, false);
+		NDPPP::ConvertSkyModelToSourceDB("wsclean-prediction.sourcedb", "wsclean-prediction-skymodel.txt");
+		
+		for(size_t filenameIndex=0; filenameIndex!=_settings.filenames.size(); ++filenameIndex)
 		{
-			const std::string& msName = _settings.filenames[filenameIndex];
-			
-			MSSelection selection(_globalSelection);
-			if(!selectChannels(selection, filenameIndex, d, squaredGroup.Front()))
-				continue;
-			NDPPP::Predict(msName, _settings.dftWithBeam);
+			for(size_t d=0; d!=_msBands[filenameIndex].DataDescCount(); ++d)
+			{
+				const std::string& msName = _settings.filenames[filenameIndex];
+				
+				MSSelection selection(_globalSelection);
+				if(!selectChannels(selection, filenameIndex, d, squaredGroup.Front()))
+					continue;
+				NDPPP::Predict(msName, _settings.dftWithBeam);
+			}
+		}
+	}
+	else {
+		for(size_t filenameIndex=0; filenameIndex!=_settings.filenames.size(); ++filenameIndex)
+		{
+			for(size_t d=0; d!=_msBands[filenameIndex].DataDescCount(); ++d)
+			{
+				MSSelection selection(_globalSelection);
+				if(!selectChannels(selection, filenameIndex, d, squaredGroup.Front()))
+					continue;
+				const MultiBandData selectedBands(_msBands[filenameIndex], selection.ChannelRangeStart(), selection.ChannelRangeEnd());
+				const BandData& band = selectedBands[d];
+				DFTPredictionInput input;
+				input.InitializeFromModel(model, _gridder->PhaseCentreRA(), _gridder->PhaseCentreDec(), band);
+				DFTPredictionAlgorithm algorithm(input, band);
+				algorithm.SetPhaseRecurrenceInterval(_settings.dftPhaseRecurrenceInterval);
+				// Each polarization is written through its own provider. The Stokes
+				// parameters are written in order, as writing e.g. Q into linear
+				// correlations uses the I that is already in the model data.
+				for(size_t i=0; i!=squaredGroup.EntryCount(); ++i)
+				{
+					std::unique_ptr<MSProvider> msProvider(initializeMSProvider(squaredGroup[i], selection, filenameIndex, d));
+					algorithm.PredictMeasurementSet(*msProvider, _settings.threadCount);
+				}
+			}
 		}
 	}
 	
@@ -306,46 +359,89 @@ void WSClean::initializeImageWeights(const ImagingTableEntry& entry)
 void WSClean::initializeMFSImageWeights()
 {
 	Logger::Info << "Precalculating MFS weights for " << _settings.weightMode.ToString() << " weighting...\n";
-	_imageWeightCache->ResetWeights();
-	if(_doReorder)
+	std::string dataKey;
+	if(_imageWeightCache->IsCacheEnabled())
 	{
-		for(size_t sg=0; sg!=_imagingTable.SquaredGroupCount(); ++sg)
+		if(_doReorder)
 		{
-			const ImagingTable subTable = _imagingTable.GetSquaredGroup(sg);
-			const ImagingTableEntry& entry = subTable.Front();
-			for(size_t msIndex=0; msIndex!=_settings.filenames.size(); ++msIndex)
+			for(size_t sg=0; sg!=_imagingTable.SquaredGroupCount(); ++sg)
 			{
-				const ImagingTableEntry::MSInfo& ms = entry.msData[msIndex];
-				for(size_t dataDescId=0; dataDescId!=_msBands[msIndex].DataDescCount(); ++dataDescId)
+				const ImagingTable subTable = _imagingTable.GetSquaredGroup(sg);
+				const ImagingTableEntry& entry = subTable.Front();
+				for(size_t msIndex=0; msIndex!=_settings.filenames.size(); ++msIndex)
 				{
-					MSSelection partSelection(_globalSelection);
-					partSelection.SetBandId(dataDescId);
-					bool hasSelection = selectChannels(partSelection, msIndex, dataDescId, subTable.Front());
-					if(hasSelection)
+					for(size_t dataDescId=0; dataDescId!=_msBands[msIndex].DataDescCount(); ++dataDescId)
 					{
-						PolarizationEnum pol = _settings.useIDG ? Polarization::Instrumental : entry.polarization;
-						PartitionedMS msProvider(_partitionedMSHandles[msIndex], ms.bands[dataDescId].partIndex, pol, dataDescId);
-						_imageWeightCache->Weights().Grid(msProvider, partSelection);
+						MSSelection partSelection(_globalSelection);
+						partSelection.SetBandId(dataDescId);
+						if(selectChannels(partSelection, msIndex, dataDescId, entry))
+						{
+							PolarizationEnum pol = _settings.useIDG ? Polarization::Instrumental : entry.polarization;
+							ImageWeightCache::AddToCacheKey(dataKey, _settings.filenames[msIndex], partSelection, pol);
+						}
 					}
 				}
 			}
 		}
+		else {
+			for(size_t i=0; i!=_settings.filenames.size(); ++i)
+			{
+				for(size_t d=0; d!=_msBands[i].DataDescCount(); ++d)
+				{
+					MSSelection selection(_globalSelection);
+					selection.SetBandId(d);
+					PolarizationEnum pol = _settings.useIDG ? Polarization::Instrumental : *_settings.polarizations.begin();
+					ImageWeightCache::AddToCacheKey(dataKey, _settings.filenames[i], selection, pol);
+				}
+			}
+		}
 	}
-	else {
-		for(size_t i=0; i!=_settings.filenames.size(); ++i)
+	
+	if(!_imageWeightCache->LoadFromCache(dataKey))
+	{
+		if(_doReorder)
 		{
-			for(size_t d=0; d!=_msBands[i].DataDescCount(); ++d)
+			for(size_t sg=0; sg!=_imagingTable.SquaredGroupCount(); ++sg)
+			{
+				const ImagingTable subTable = _imagingTable.GetSquaredGroup(sg);
+				const ImagingTableEntry& entry = subTable.Front();
+				for(size_t msIndex=0; msIndex!=_settings.filenames.size(); ++msIndex)
+				{
+					const ImagingTableEntry::MSInfo& ms = entry.msData[msIndex];
+					for(size_t dataDescId=0; dataDescId!=_msBands[msIndex].DataDescCount(); ++dataDescId)
+					{
+						MSSelection partSelection(_globalSelection);
+						partSelection.SetBandId(dataDescId);
+						bool hasSelection = selectChannels(partSelection, msIndex, dataDescId, subTable.Front());
+						if(hasSelection)
+						{
+							PolarizationEnum pol = _settings.useIDG ? Polarization::Instrumental : entry.polarization;
+							PartitionedMS msProvider(_partitionedMSHandles[msIndex], ms.bands[dataDescId].partIndex, pol, dataDescId);
+							_imageWeightCache->Weights().Grid(msProvider, partSelection);
+						}
+					}
+				}
+			}
+		}
+		else {
+			for(size_t i=0; i!=_settings.filenames.size(); ++i)
 			{
-				PolarizationEnum pol = _settings.useIDG ? Polarization::Instrumental : *_settings.polarizations.begin();
-				ContiguousMS msProvider(_settings.filenames[i], _settings.dataColumnName, _globalSelection, pol, d, _settings.deconvolutionMGain != 1.0);
-				_imageWeightCache->Weights().Grid(msProvider,  _globalSelection);
-				Logger::Info << '.';
-				Logger::Info.Flush();
+				for(size_t d=0; d!=_msBands[i].DataDescCount(); ++d)
+				{
+					PolarizationEnum pol = _settings.useIDG ? Polarization::Instrumental : *_settings.polarizations.begin();
+					ContiguousMS msProvider(_settings.filenames[i], _settings.dataColumnName, _globalSelection, pol, d, _settings.deconvolutionMGain != 1.0);
+					_imageWeightCache->Weights().Grid(msProvider,  _globalSelection);
+					Logger::Info << '.';
+					Logger::Info.Flush();
+				}
 			}
 		}
+		_imageWeightCache->Weights().FinishGridding();
+		_imageWeightCache->InitializeWeightTapers();
+		_imageWeightCache->StoreInCache(dataKey);
 	}
-	_imageWeightCache->Weights().FinishGridding();
-	_imageWeightCache->InitializeWeightTapers();
+	else
+		Logger::Info << "Read MFS weights from cache.\n";
 	if(_settings.isWeightImageSaved)
 		_imageWeightCache->Weights().Save(_settings.prefixName+"-weights.fits");
 }
@@ -373,6 +469,12 @@ void WSClean::prepareInversionAlgorithm(PolarizationEnum polarization)
 	_gridder->SetSmallInversion(_settings.smallInversion);
 	_gridder->SetNormalizeForWeighting(_settings.normalizeForWeighting);
 	_gridder->SetVisibilityWeightingMode(_settings.visibilityWeightingMode);
+	_gridder->SetPreApplyImagingWeights(_settings.preApplyImagingWeights);
+	_gridder->SetPinThreads(_settings.pinThreads);
+	_gridder->SetDFTPredictionThreshold(_settings.hybridDFTThreshold);
+	if(_settings.mappedWLayers)
+		_gridder->SetWLayerScratchDirectory(_settings.temporaryDirectory.empty() ? std::string(".") : _settings.temporaryDirectory);
+	_gridder->SetNonUniformWLayers(_settings.nonUniformWLayers);
 }
 
 void WSClean::performReordering(bool isPredictMode)
@@ -417,6 +519,8 @@ void WSClean::performReordering(bool isPredictMode)
 
 void WSClean::RunClean()
 {
+	_imageAllocator.SetMemoryPlacement(_settings.useHugePages, _settings.numaLocalAllocation);
+	
 	// If no column specified, determine column to use
 	if(_settings.dataColumnName.empty())
 	{
@@ -456,7 +560,7 @@ void WSClean::RunClean()
 		if(_settings.useIDG)
 			_gridder.reset(new IdgMsGridder());
 		else
-			_gridder.reset(new WSMSGridder(&_imageAllocator, _settings.threadCount, _settings.memFraction, _settings.absMemLimit));
+			_gridder.reset(new WSMSGridder(&_imageAllocator, _settings.threadCount, _settings.memFraction, _settings.absMemLimit, imageCacheBudget()));
 		
 		for(size_t groupIndex=0; groupIndex!=_imagingTable.IndependentGroupCount(); ++groupIndex)
 		{
@@ -530,6 +634,17 @@ void WSClean::RunClean()
 	}
 }
 
+double WSClean::imageCacheBudget() const
+{
+	if(_settings.imageCacheMemory != 0.0)
+		return _settings.imageCacheMemory * 1024.0 * 1024.0 * 1024.0;
+	// By default, use a quarter of the memory limit for temporary images
+	double limit = double(System::TotalMemory()) * _settings.memFraction;
+	if(_settings.absMemLimit != 0.0)
+		limit = std::min(limit, _settings.absMemLimit * 1024.0 * 1024.0 * 1024.0);
+	return limit / 4.0;
+}
+
 ImageWeightCache* WSClean::createWeightCache()
 {
 	ImageWeightCache* cache = new ImageWeightCache(
@@ -537,11 +652,25 @@ ImageWeightCache* WSClean::createWeightCache()
 		_settings.untrimmedImageWidth, _settings.untrimmedImageHeight,
 		_settings.pixelScaleX, _settings.pixelScaleY,
 		_settings.minUVInLambda, _settings.maxUVInLambda,
-		_settings.rankFilterLevel, _settings.rankFilterSize);
+		_settings.rankFilterLevel, _settings.rankFilterSize,
+		_settings.threadCount);
 	cache->SetTaperInfo(
 		_settings.gaussianTaperBeamSize,
 		_settings.tukeyTaperInLambda, _settings.tukeyInnerTaperInLambda,
 		_settings.edgeTaperInLambda, _settings.edgeTukeyTaperInLambda);
+	if(_settings.cacheImagingWeights)
+	{
+		// The cached grids are stored next to the reordered files of the first measurement set
+		boost::filesystem::path msPath(_settings.filenames.front());
+		while(msPath.has_filename() && msPath.filename() == ".")
+			msPath = msPath.parent_path();
+		boost::filesystem::path prefix;
+		if(_settings.temporaryDirectory.empty())
+			prefix = msPath;
+		else
+			prefix = boost::filesystem::path(_settings.temporaryDirectory) / msPath.filename();
+		cache->SetCachePrefix(prefix.string());
+	}
 	return cache;
 }
 
@@ -554,6 +683,8 @@ void WSClean::RunPredict()
 	
 	_settings.dataColumnName = "DATA";
 	
+	_imageAllocator.SetMemoryPlacement(_settings.useHugePages, _settings.numaLocalAllocation);
+	
 	_settings.Propogate();
 	
 	_settings.GetMSSelection(_globalSelection);
@@ -579,7 +710,7 @@ void WSClean::RunPredict()
 		if(_settings.useIDG)
 			_gridder.reset(new IdgMsGridder());
 		else
-			_gridder.reset(new WSMSGridder(&_imageAllocator, _settings.threadCount, _settings.memFraction, _settings.absMemLimit));
+			_gridder.reset(new WSMSGridder(&_imageAllocator, _settings.threadCount, _settings.memFraction, _settings.absMemLimit, imageCacheBudget()));
 	
 		for(size_t groupIndex=0; groupIndex!=_imagingTable.SquaredGroupCount(); ++groupIndex)
 		{
@@ -638,10 +769,14 @@ bool WSClean::selectChannels(MSSelection& selection, size_t msIndex, size_t data
 void WSClean::runIndependentGroup(ImagingTable& groupTable)
 {
 	WSCFitsWriter writer(createWSCFitsWriter(groupTable.Front(), false));
-	_modelImages.Initialize(writer.Writer(), _settings.polarizations.size(), _settings.channelsOut, _settings.prefixName + "-model", _imageAllocator);
-	_residualImages.Initialize(writer.Writer(), _settings.polarizations.size(), _settings.channelsOut, _settings.prefixName + "-residual", _imageAllocator);
+	_modelImages.Initialize(writer.Writer(), _settings.polarizations.size(), _settings.channelsOut, _settings.prefixName + "-model");
+	_residualImages.Initialize(writer.Writer(), _settings.polarizations.size(), _settings.channelsOut, _settings.prefixName + "-residual");
 	if(groupTable.Front().polarization == *_settings.polarizations.begin())
-		_psfImages.Initialize(writer.Writer(), 1, groupTable.SquaredGroupCount(), _settings.prefixName + "-psf", _imageAllocator);
+		_psfImages.Initialize(writer.Writer(), 1, groupTable.SquaredGroupCount(), _settings.prefixName + "-psf");
+	// The budget is divided over the model, residual and psf images
+	_modelImages.SetMemoryBudget(imageCacheBudget() / 3.0);
+	_residualImages.SetMemoryBudget(imageCacheBudget() / 3.0);
+	_psfImages.SetMemoryBudget(imageCacheBudget() / 3.0);
 	
 	const std::string rootPrefix = _settings.prefixName;
 		
@@ -908,8 +1043,9 @@ void WSClean::predictGroup(const ImagingTable& imagingGroup)
 {
 	_modelImages.Initialize(
 		createWSCFitsWriter(imagingGroup.Front(), false).Writer(),
-		_settings.polarizations.size(), 1, _settings.prefixName + "-model", _imageAllocator
+		_settings.polarizations.size(), 1, _settings.prefixName + "-model"
 	);
+	_modelImages.SetMemoryBudget(imageCacheBudget());
 	
 	const std::string rootPrefix = _settings.prefixName;
 		
@@ -997,7 +1133,11 @@ void WSClean::runFirstInversion(ImagingTableEntry& entry)
 	bool isFirstPol = entry.polarization == *_settings.polarizations.begin();
 	bool isLastPol = entry.polarization == *_settings.polarizations.rbegin();
 	bool doMakePSF = _settings.deconvolutionIterationCount > 0 || _settings.makePSF || _settings.makePSFOnly;
-	if(doMakePSF && isFirstPol)
+	// The PSF can be gridded in the same pass as the first dirty image
+	bool dualGridPSF = _settings.dualGridPSF && doMakePSF && isFirstPol && !_settings.makePSFOnly && _gridder->SupportsDualGridPSF();
+	if(dualGridPSF)
+		imagePSFAndMainFirst(entry);
+	else if(doMakePSF && isFirstPol)
 		imagePSF(entry);
 	
 	if(isLastPol && (_settings.applyPrimaryBeam || _settings.dftWithBeam))
@@ -1020,7 +1160,14 @@ void WSClean::runFirstInversion(ImagingTableEntry& entry)
 		_modelImages.SetFitsWriter(writer);
 		_residualImages.SetFitsWriter(writer);
 		
-		imageMainFirst(entry.polarization, entry.outputChannelIndex);
+		if(dualGridPSF)
+		{
+			// The image was made together with the PSF
+			_gridder->SetVerbose(false);
+			storeMainImage(entry.polarization, entry.outputChannelIndex);
+		}
+		else
+			imageMainFirst(entry.polarization, entry.outputChannelIndex);
 		
 		// If this was the first polarization of this channel, we need to set
 		// the info for this channel
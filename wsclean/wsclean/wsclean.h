@@ -59,12 +59,16 @@ private:
 	void makeImagingTableEntry(const std::vector<OrderedChannel>& channels, size_t outIntervalIndex, size_t outChannelIndex, ImagingTableEntry& entry);
 	void addPolarizationsToImagingTable(size_t& joinedGroupIndex, size_t& squaredGroupIndex, size_t outChannelIndex, const ImagingTableEntry& templateEntry);
 	class ImageWeightCache* createWeightCache();
+	double imageCacheBudget() const;
 	
 	void multiplyImage(double factor, double* image) const;
 	void imagePSF(ImagingTableEntry& entry);
+	void imagePSFAndMainFirst(ImagingTableEntry& entry);
+	void processPSF(ImagingTableEntry& entry, double* psf);
 	void imageGridding();
 	void imageMainFirst(PolarizationEnum polarization, size_t channelIndex);
 	void imageMainNonFirst(PolarizationEnum polarization, size_t channelIndex);
+	void storeMainImage(PolarizationEnum polarization, size_t channelIndex);
 	void predict(PolarizationEnum polarization, size_t channelIndex);
 	void dftPredict(const ImagingTable& squaredGroup);
 	
@@ -35,7 +35,7 @@ public:
 	double manualBeamMajorSize, manualBeamMinorSize, manualBeamPA;
 	bool fittedBeam, theoreticBeam, circularBeam;
 	bool continuedRun;
-	double memFraction, absMemLimit, minUVWInMeters, maxUVWInMeters, minUVInLambda, maxUVInLambda, wLimit, rankFilterLevel;
+	double memFraction, absMemLimit, imageCacheMemory, minUVWInMeters, maxUVWInMeters, minUVInLambda, maxUVInLambda, wLimit, rankFilterLevel;
 	size_t rankFilterSize;
 	double gaussianTaperBeamSize, tukeyTaperInLambda, tukeyInnerTaperInLambda, edgeTaperInLambda, edgeTukeyTaperInLambda;
 	size_t nWLayers, antialiasingKernelSize, overSamplingFactor, threadCount;
@@ -51,8 +51,12 @@ public:
 	std::string prefixName;
 	bool smallInversion, makePSF, makePSFOnly, isWeightImageSaved, isUVImageSaved, isDirtySaved, isGriddingImageSaved;
 	bool dftPrediction, dftWithBeam;
+	size_t dftPhaseRecurrenceInterval;
+	double hybridDFTThreshold;
 	std::string temporaryDirectory;
 	bool forceReorder, forceNoReorder, subtractModel, modelUpdateRequired, mfsWeighting;
+	bool preApplyImagingWeights, cacheImagingWeights;
+	bool useHugePages, numaLocalAllocation, pinThreads, mappedWLayers, nonUniformWLayers, dualGridPSF;
 	bool normalizeForWeighting;
 	bool applyPrimaryBeam, reusePrimaryBeam, useDifferentialLofarBeam, savePsfPb, useIDG;
 	enum GridModeEnum gridMode;
@@ -130,7 +134,7 @@ inline WSCleanSettings::WSCleanSettings() :
 	manualBeamMajorSize(0.0), manualBeamMinorSize(0.0),
 	manualBeamPA(0.0), fittedBeam(true), theoreticBeam(false), circularBeam(false),
 	continuedRun(false),
-	memFraction(1.0), absMemLimit(0.0),
+	memFraction(1.0), absMemLimit(0.0), imageCacheMemory(0.0),
 	minUVWInMeters(0.0), maxUVWInMeters(0.0),
 	minUVInLambda(0.0), maxUVInLambda(0.0), wLimit(0.0),
 	rankFilterLevel(3.0), rankFilterSize(16),
@@ -151,11 +155,17 @@ inline WSCleanSettings::WSCleanSettings() :
 	smallInversion(true), makePSF(false), makePSFOnly(false), isWeightImageSaved(false),
 	isUVImageSaved(false), isDirtySaved(true), isGriddingImageSaved(false),
 	dftPrediction(false), dftWithBeam(false),
+	dftPhaseRecurrenceInterval(0),
+	hybridDFTThreshold(0.0),
 	temporaryDirectory(),
 	forceReorder(false), forceNoReorder(false),
 	subtractModel(false),
 	modelUpdateRequired(true),
 	mfsWeighting(false),
+	preApplyImagingWeights(false),
+	cacheImagingWeights(false),
+	useHugePages(false), numaLocalAllocation(false), pinThreads(false),
+	mappedWLayers(false), nonUniformWLayers(false), dualGridPSF(false),
 	normalizeForWeighting(true),
 	applyPrimaryBeam(false), reusePrimaryBeam(false),
 	useDifferentialLofarBeam(false),
@@ -3,19 +3,27 @@
 #include "imagebufferallocator.h"
 #include "logger.h"
 
+#include "../fnvhash.h"
 #include "../imageweights.h"
 #include "../buffered_lane.h"
 #include "../fftresampler.h"
 #include "../image.h"
+#include "../threadaffinity.h"
 
 #include "../msproviders/msprovider.h"
 
 #include <casacore/ms/MeasurementSets/MeasurementSet.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
 
-WSMSGridder::WSMSGridder(ImageBufferAllocator* imageAllocator, size_t threadCount, double memFraction, double absMemLimit) :
+WSMSGridder::WSMSGridder(ImageBufferAllocator* imageAllocator, size_t threadCount, double memFraction, double absMemLimit, double reservedMemory) :
 	MSGridderBase(),
 	_cpuCount(threadCount),
 	_laneBufferSize(std::max<size_t>(_cpuCount*2,1024)),
@@ -41,11 +49,18 @@ WSMSGridder::WSMSGridder(ImageBufferAllocator* imageAllocator, size_t threadCoun
 		if(absMemLimit!=0.0 && double(_memSize) > double(1024.0*1024.0*1024.0) * absMemLimit)
 			_memSize = int64_t(double(absMemLimit) * double(1024.0*1024.0*1024.0));
 	}
+	if(reservedMemory > 0.0)
+	{
+		// At least half of the limit is kept for gridding
+		_memSize = std::max(_memSize - int64_t(reservedMemory), _memSize / 2);
+		const double reservedInGB = reservedMemory / (1024.0*1024.0*1024.0), gridderInGB = double(_memSize) / (1024.0*1024.0*1024.0);
+		Logger::Info << "Reserved " << round(reservedInGB*10.0)/10.0 << " GB for cached images, gridding uses up to " << round(gridderInGB*10.0)/10.0 << " GB.\n";
+	}
 }
 		
 void WSMSGridder::countSamplesPerLayer(MSData& msData)
 {
-	ao::uvector<size_t> sampleCount(WGridSize(), 0);
+	ao::uvector<size_t> sampleCount(_gridder->NWLayers(), 0);
 	size_t total = 0;
 	msData.matchingRows = 0;
 	msData.msProvider->Reset();
@@ -59,7 +74,7 @@ void WSMSGridder::countSamplesPerLayer(MSData& msData)
 		{
 			double w = wInM / bandData.ChannelWavelength(ch);
 			size_t wLayerIndex = _gridder->WToLayer(w);
-			if(wLayerIndex < WGridSize())
+			if(wLayerIndex < _gridder->NWLayers())
 			{
 				++sampleCount[wLayerIndex];
 				++total;
@@ -74,6 +89,187 @@ void WSMSGridder::countSamplesPerLayer(MSData& msData)
 		Logger::Debug << *i << ' ';
 	}
 	Logger::Debug << "\nTotal nr. of visibilities to be gridded: " << total << '\n';
+	for(size_t layer=0; layer!=sampleCount.size(); ++layer)
+		_layerSampleCounts[layer] += sampleCount[layer];
+}
+
+void WSMSGridder::updateLayerSampleCounts(std::vector<MSData>& msDataVector)
+{
+	const std::string key = sampleCountKey(msDataVector);
+	std::map<std::string, SampleCounts>::const_iterator cached = _sampleCountCache.find(key);
+	if(cached == _sampleCountCache.end())
+	{
+		_layerSampleCounts.assign(_gridder->NWLayers(), 0);
+		SampleCounts counts;
+		for(MSData& msData : msDataVector)
+		{
+			countSamplesPerLayer(msData);
+			counts.matchingRows.push_back(msData.matchingRows);
+		}
+		counts.layerSampleCounts = _layerSampleCounts;
+		_sampleCountCache.insert(std::make_pair(key, std::move(counts)));
+	}
+	else {
+		_layerSampleCounts = cached->second.layerSampleCounts;
+		for(size_t i=0; i!=msDataVector.size(); ++i)
+			msDataVector[i].matchingRows = cached->second.matchingRows[i];
+	}
+}
+
+std::string WSMSGridder::sampleCountKey(const std::vector<MSData>& msDataVector) const
+{
+	// The w-values of the layers are identified by their hash
+	FNVHash layerHash;
+	for(size_t layer=0; layer!=_gridder->NWLayers(); ++layer)
+		layerHash.Add(_gridder->LayerToW(layer));
+	std::ostringstream key;
+	key << std::setprecision(17) << "layers=" << _gridder->NWLayers() << ',' << std::hex << layerHash.Value() << std::dec;
+	for(size_t i=0; i!=msDataVector.size(); ++i)
+	{
+		const MSSelection& selection = Selection(i);
+		key << '\n' << msDataVector[i].msProvider->MS().tableName()
+			<< " field=" << selection.FieldId() << " band=" << selection.BandId()
+			<< " channels=" << msDataVector[i].startChannel << '-' << msDataVector[i].endChannel
+			<< " timesteps=" << selection.IntervalStart() << '-' << selection.IntervalEnd()
+			<< " uvw=" << selection.MinUVWInM() << '-' << selection.MaxUVWInM();
+	}
+	return key.str();
+}
+
+void WSMSGridder::countSamplesPerW(MSData& msData, WLayerHistogram& histogram)
+{
+	msData.msProvider->Reset();
+	while(msData.msProvider->CurrentRowAvailable())
+	{
+		double uInM, vInM, wInM;
+		size_t dataDescId;
+		msData.msProvider->ReadMeta(uInM, vInM, wInM, dataDescId);
+		const BandData& bandData(msData.bandData[dataDescId]);
+		for(size_t ch=msData.startChannel; ch!=msData.endChannel; ++ch)
+			histogram.Add(wInM / bandData.ChannelWavelength(ch));
+		msData.msProvider->NextRow();
+	}
+}
+
+void WSMSGridder::prepareWLayers(std::vector<MSData>& msDataVector, bool isInversion)
+{
+	double maxMem = double(_memSize)*(7.0/10.0);
+	// Mapped layers are gridded from the block buffers of gridMeasurementSet(), which
+	// are reserved here for the largest possible number of blocks, one per layer
+	if(isInversion && !WLayerScratchDirectory().empty())
+	{
+		const size_t maxBlockCount = std::max<size_t>(WGridSize(), 1);
+		maxMem -= double(maxBlockCount * blockBufferSize(maxBlockCount)) * sizeof(InversionWorkSample);
+	}
+	// During a dual-grid inversion, the PSF gridder gets the same memory, so that
+	// both make the same plan
+	if(_psfGridder)
+		maxMem *= 0.5;
+	if(NonUniformWLayers() && WGridSize() > 1)
+	{
+		WLayerHistogram histogram(WGridSize(), _minW, _maxW, IsComplex());
+		for(MSData& msData : msDataVector)
+			countSamplesPerW(msData, histogram);
+		const std::vector<double> layerWValues = histogram.LayerWValues();
+		Logger::Info << "Placing " << layerWValues.size() << " of " << WGridSize() << " w-layers at w-values with samples.\n";
+		_gridder->PrepareWLayers(layerWValues, maxMem, _minW, _maxW);
+		if(_psfGridder)
+			_psfGridder->PrepareWLayers(layerWValues, maxMem, _minW, _maxW);
+	}
+	else {
+		_gridder->PrepareWLayers(WGridSize(), maxMem, _minW, _maxW);
+		if(_psfGridder)
+			_psfGridder->PrepareWLayers(WGridSize(), maxMem, _minW, _maxW);
+	}
+}
+
+void WSMSGridder::assignLayersToThreads(size_t passIndex)
+{
+	// Without counts, layers are distributed round robin
+	_layerThreads.resize(_gridder->NWLayers());
+	for(size_t layer=0; layer!=_layerThreads.size(); ++layer)
+		_layerThreads[layer] = layer % _cpuCount;
+	size_t totalCount = 0;
+	for(size_t count : _layerSampleCounts)
+		totalCount += count;
+	if(totalCount == 0 || _cpuCount == 1)
+		return;
+	
+	// Give the layers of this pass, largest first, to the thread that has been
+	// assigned the fewest samples so far
+	const size_t
+		passStart = _gridder->LayerRangeStart(passIndex),
+		passEnd = _gridder->LayerRangeStart(passIndex+1);
+	std::vector<size_t> layers;
+	for(size_t layer=passStart; layer!=passEnd; ++layer)
+		layers.push_back(layer);
+	std::stable_sort(layers.begin(), layers.end(), [&](size_t a, size_t b) {
+		return _layerSampleCounts[a] > _layerSampleCounts[b];
+	});
+	ao::uvector<size_t> threadLoads(_cpuCount, 0);
+	for(size_t layer : layers)
+	{
+		const size_t thread = std::min_element(threadLoads.begin(), threadLoads.end()) - threadLoads.begin();
+		_layerThreads[layer] = thread;
+		threadLoads[thread] += _layerSampleCounts[layer];
+	}
+	Logger::Debug << "Samples per gridding thread:";
+	for(size_t load : threadLoads)
+		Logger::Debug << ' ' << load;
+	Logger::Debug << '\n';
+}
+
+void WSMSGridder::reportThreadBusyTimes() const
+{
+	const double
+		maxTime = *std::max_element(_threadBusyTimes.begin(), _threadBusyTimes.end()),
+		minTime = *std::min_element(_threadBusyTimes.begin(), _threadBusyTimes.end());
+	double sum = 0.0;
+	for(double busyTime : _threadBusyTimes)
+		sum += busyTime;
+	const double average = sum / _threadBusyTimes.size();
+	Logger::Debug << "Busy time per gridding thread (s):";
+	for(double busyTime : _threadBusyTimes)
+		Logger::Debug << ' ' << round(busyTime*100.0)/100.0;
+	Logger::Debug << '\n';
+	if(Verbose())
+	{
+		Logger::Info << "Gridding thread busy time: min " << round(minTime*100.0)/100.0 << " s, max " << round(maxTime*100.0)/100.0 << " s";
+		if(average > 0.0)
+			Logger::Info << " (max/average = " << round(maxTime / average * 100.0)/100.0 << ")";
+		Logger::Info << '\n';
+	}
+}
+
+void WSMSGridder::storeImagingWeights(MSData& msData, uint64_t key, MSProvider::ImagingWeightSums& sums)
+{
+	Logger::Info << "Storing imaging weights... ";
+	Logger::Info.Flush();
+	const MultiBandData selectedBand(msData.SelectedBand());
+	ao::uvector<float> weightBuffer(selectedBand.MaxChannels());
+	ao::uvector<float> imagingWeightBuffer(selectedBand.MaxChannels());
+	ao::uvector<bool> isSelected(selectedBand.MaxChannels());
+	memset(&sums, 0, sizeof(MSProvider::ImagingWeightSums));
+	msData.msProvider->Reset();
+	while(msData.msProvider->CurrentRowAvailable())
+	{
+		double uvw[3];
+		size_t dataDescId;
+		msData.msProvider->ReadMeta(uvw[0], uvw[1], uvw[2], dataDescId);
+		const BandData& curBand(selectedBand[dataDescId]);
+		// The sums cover the samples that are gridded in any of the passes
+		for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
+		{
+			double w = uvw[2] / curBand.ChannelWavelength(ch);
+			isSelected[ch] = _gridder->WToLayer(w) < _gridder->NWLayers();
+		}
+		msData.msProvider->ReadWeights(weightBuffer.data());
+		calculateImagingWeights<1>(uvw, curBand, weightBuffer.data(), isSelected.data(), imagingWeightBuffer.data(), sums);
+		msData.msProvider->WriteImagingWeights(imagingWeightBuffer.data());
+		msData.msProvider->NextRow();
+	}
+	msData.msProvider->FinishImagingWeights(key, sums);
+	Logger::Info << "DONE\n";
 }
 
 size_t WSMSGridder::getSuggestedWGridSize() const
@@ -125,6 +321,8 @@ void WSMSGridder::gridMeasurementSet(MSData &msData)
 {
 	const MultiBandData selectedBand(msData.SelectedBand());
 	_gridder->PrepareBand(selectedBand);
+	if(_psfGridder)
+		_psfGridder->PrepareBand(selectedBand);
 	ao::uvector<std::complex<float>> modelBuffer(selectedBand.MaxChannels());
 	ao::uvector<float> weightBuffer(selectedBand.MaxChannels());
 	ao::uvector<bool> isSelected(selectedBand.MaxChannels());
@@ -143,9 +341,29 @@ void WSMSGridder::gridMeasurementSet(MSData &msData)
 		bufferedLanes[i].reset(&_inversionCPULanes[i], bufferSize);
 	}
 	
+	// When the w-layers are memory mapped and not all of them fit in memory,
+	// the samples are collected per block of layers, such that the gridding
+	// threads touch only a few layers at a time. Their memory is reserved by
+	// prepareWLayers().
+	const size_t layerBlockSize = _gridder->LayerBlockSize();
+	std::vector<std::vector<InversionWorkSample>> blockBuffers;
+	size_t samplesPerBlock = 0;
+	if(layerBlockSize != 0 && layerBlockSize < _gridder->NWLayers())
+	{
+		blockBuffers.resize((_gridder->NWLayers() + layerBlockSize - 1) / layerBlockSize);
+		samplesPerBlock = blockBufferSize(blockBuffers.size());
+		for(std::vector<InversionWorkSample>& buffer : blockBuffers)
+			buffer.reserve(samplesPerBlock);
+	}
+	
 	InversionRow newItem;
-	ao::uvector<std::complex<float>> newItemData(selectedBand.MaxChannels());
+	ao::uvector<std::complex<float>> newItemData(selectedBand.MaxChannels()), newItemPSFData;
 	newItem.data = newItemData.data();
+	if(_psfGridder)
+	{
+		newItemPSFData.resize(selectedBand.MaxChannels());
+		newItem.psfData = newItemPSFData.data();
+	}
 			
 	size_t rowsRead = 0;
 	msData.msProvider->Reset();
@@ -165,27 +383,42 @@ void WSMSGridder::gridMeasurementSet(MSData &msData)
 			newItem.uvw[2] = wInMeters;
 			newItem.dataDescId = dataDescId;
 			
-			// Any visibilities that are not gridded in this pass
-			// should not contribute to the weight sum, so set these
-			// to have zero weight.
-			for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
+			if(msData.hasImagingWeights)
 			{
-				double w = newItem.uvw[2] / curBand.ChannelWavelength(ch);
-				isSelected[ch] = _gridder->IsInLayerRange(w);
+				readPreweightedVisibilities<1>(*msData.msProvider, newItem, curBand, weightBuffer.data(), modelBuffer.data());
+			}
+			else {
+				// Any visibilities that are not gridded in this pass
+				// should not contribute to the weight sum, so set these
+				// to have zero weight.
+				for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
+				{
+					double w = newItem.uvw[2] / curBand.ChannelWavelength(ch);
+					isSelected[ch] = _gridder->IsInLayerRange(w);
+				}
+		
+				readAndWeightVisibilities<1>(*msData.msProvider, newItem, curBand, weightBuffer.data(), modelBuffer.data(), isSelected.data());
 			}
-	
-			readAndWeightVisibilities<1>(*msData.msProvider, newItem, curBand, weightBuffer.data(), modelBuffer.data(), isSelected.data());
 			
 			InversionWorkSample sampleData;
 			for(size_t ch=0; ch!=curBand.ChannelCount(); ++ch)
 			{
 				double wavelength = curBand.ChannelWavelength(ch);
 				sampleData.sample = newItem.data[ch];
+				if(_psfGridder)
+					sampleData.psfSample = newItem.psfData[ch];
 				sampleData.uInLambda = newItem.uvw[0] / wavelength;
 				sampleData.vInLambda = newItem.uvw[1] / wavelength;
 				sampleData.wInLambda = newItem.uvw[2] / wavelength;
-				size_t cpu = _gridder->WToLayer(sampleData.wInLambda) % _cpuCount;
-				bufferedLanes[cpu].write(sampleData);
+				const size_t layer = _gridder->WToLayer(sampleData.wInLambda);
+				if(blockBuffers.empty())
+					bufferedLanes[layerThread(layer)].write(sampleData);
+				else {
+					std::vector<InversionWorkSample>& buffer = blockBuffers[layer / layerBlockSize];
+					buffer.push_back(sampleData);
+					if(buffer.size() == samplesPerBlock)
+						flushBlockBuffer(buffer, bufferedLanes.get());
+				}
 			}
 			
 			++rowsRead;
@@ -194,6 +427,8 @@ void WSMSGridder::gridMeasurementSet(MSData &msData)
 		msData.msProvider->NextRow();
 	}
 	
+	for(std::vector<InversionWorkSample>& buffer : blockBuffers)
+		flushBlockBuffer(buffer, bufferedLanes.get());
 	for(size_t i=0; i!=_cpuCount; ++i)
 		bufferedLanes[i].write_end();
 	
@@ -202,6 +437,13 @@ void WSMSGridder::gridMeasurementSet(MSData &msData)
 	msData.totalRowsProcessed += rowsRead;
 }
 
+void WSMSGridder::flushBlockBuffer(std::vector<InversionWorkSample>& buffer, lane_write_buffer<InversionWorkSample>* bufferedLanes)
+{
+	for(const InversionWorkSample& sampleData : buffer)
+		bufferedLanes[layerThread(_gridder->WToLayer(sampleData.wInLambda))].write(sampleData);
+	buffer.clear();
+}
+
 void WSMSGridder::startInversionWorkThreads(size_t maxChannelCount)
 {
 	_inversionCPULanes.reset(new ao::lane<InversionWorkSample>[_cpuCount]);
@@ -211,7 +453,7 @@ void WSMSGridder::startInversionWorkThreads(size_t maxChannelCount)
 	{
 		_inversionCPULanes[i].resize(maxChannelCount * _laneBufferSize);
 		set_lane_debug_name(_inversionCPULanes[i], "Work lane (buffered) containing individual visibility samples");
-		_threadGroup->add_thread(new boost::thread(&WSMSGridder::workThreadPerSample, this, &_inversionCPULanes[i]));
+		_threadGroup->add_thread(new boost::thread(&WSMSGridder::workThreadPerSample, this, &_inversionCPULanes[i], i));
 	}
 }
 
@@ -222,8 +464,14 @@ void WSMSGridder::finishInversionWorkThreads()
 	_inversionCPULanes.reset();
 }
 
-void WSMSGridder::workThreadPerSample(ao::lane<InversionWorkSample>* workLane)
+void WSMSGridder::workThreadPerSample(ao::lane<InversionWorkSample>* workLane, size_t threadIndex)
 {
+	if(PinThreads())
+		ThreadAffinity::PinToCPU(threadIndex);
+	// A thread that waits for its lane does not use cpu time, so the cpu time of
+	// this thread is the time that it was busy gridding.
+	timespec startTime, endTime;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &startTime);
 	size_t bufferSize = std::max<size_t>(8u, workLane->capacity()/8);
 	bufferSize = std::min<size_t>(128,std::min(bufferSize, workLane->capacity()));
 	lane_read_buffer<InversionWorkSample> buffer(workLane, bufferSize);
@@ -231,7 +479,11 @@ void WSMSGridder::workThreadPerSample(ao::lane<InversionWorkSample>* workLane)
 	while(buffer.read(sampleData))
 	{
 		_gridder->AddDataSample(sampleData.sample, sampleData.uInLambda, sampleData.vInLambda, sampleData.wInLambda);
+		if(_psfGridder)
+			_psfGridder->AddDataSample(sampleData.psfSample, sampleData.uInLambda, sampleData.vInLambda, sampleData.wInLambda);
 	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &endTime);
+	_threadBusyTimes[threadIndex] += double(endTime.tv_sec - startTime.tv_sec) + 1e-9 * double(endTime.tv_nsec - startTime.tv_nsec);
 }
 
 void WSMSGridder::predictMeasurementSet(MSData &msData)
@@ -239,6 +491,7 @@ void WSMSGridder::predictMeasurementSet(MSData &msData)
 	msData.msProvider->ReopenRW();
 	const MultiBandData selectedBandData(msData.SelectedBand());
 	_gridder->PrepareBand(selectedBandData);
+	initializeDFTKernels(selectedBandData);
 	
 	size_t rowsProcessed = 0;
 	
@@ -251,7 +504,7 @@ void WSMSGridder::predictMeasurementSet(MSData &msData)
 	boost::thread writeThread(&WSMSGridder::predictWriteThread, this, &writeLane, &msData);
 	boost::thread_group calcThreads;
 	for(size_t i=0; i!=_cpuCount; ++i)
-		calcThreads.add_thread(new boost::thread(&WSMSGridder::predictCalcThread, this, &calcLane, &writeLane));
+		calcThreads.add_thread(new boost::thread(&WSMSGridder::predictCalcThread, this, &calcLane, &writeLane, &selectedBandData));
 
 		
 	/* Start by reading the u,v,ws in, so we don't need IO access
@@ -303,19 +556,73 @@ void WSMSGridder::predictMeasurementSet(MSData &msData)
 	writeThread.join();
 }
 
-void WSMSGridder::predictCalcThread(ao::lane<PredictionWorkItem>* inputLane, ao::lane<PredictionWorkItem>* outputLane)
+void WSMSGridder::predictCalcThread(ao::lane<PredictionWorkItem>* inputLane, ao::lane<PredictionWorkItem>* outputLane, const MultiBandData* selectedBandData)
 {
 	lane_write_buffer<PredictionWorkItem> writeBuffer(outputLane, _laneBufferSize);
+	BrightPixelPredictor::Buffer dftBuffer;
 	
 	PredictionWorkItem item;
 	while(inputLane->read(item))
 	{
 		_gridder->SampleData(item.data, item.dataDescId, item.u, item.v, item.w);
 		
+		if(!_brightPixelPredictor.Empty())
+			_brightPixelPredictor.AddToSampledChannels(item.data, (*selectedBandData)[item.dataDescId].ChannelCount(), item.dataDescId, item.u, item.v, item.w, dftBuffer);
+		
 		writeBuffer.write(item);
 	}
 }
 
+void WSMSGridder::extractDFTComponents(double*& real, double*& imaginary, ImageBufferAllocator::Ptr& remainingReal, ImageBufferAllocator::Ptr& remainingImag)
+{
+	_brightPixelPredictor.Clear();
+	if(DFTPredictionThreshold() <= 0.0)
+		return;
+	if(HasDenormalPhaseCentre())
+	{
+		// The gridder uses the shifted image coordinates for the u,v terms but the
+		// unshifted ones for the w term, which a DFT component can not reproduce.
+		Logger::Warn << "Warning: DFT prediction of bright components is not supported with a shifted phase centre; predicting the full model with the gridder.\n";
+		return;
+	}
+	
+	// The input is of size TrimWidth() x TrimHeight()
+	const size_t width = TrimWidth(), height = TrimHeight();
+	_imageBufferAllocator->Allocate(width * height, remainingReal);
+	std::copy_n(real, width * height, remainingReal.data());
+	if(imaginary != 0)
+	{
+		_imageBufferAllocator->Allocate(width * height, remainingImag);
+		std::copy_n(imaginary, width * height, remainingImag.data());
+	}
+	_brightPixelPredictor.ExtractComponents(remainingReal.data(), imaginary == 0 ? nullptr : remainingImag.data(), width, height, PixelSizeX(), PixelSizeY(), DFTPredictionThreshold());
+	Logger::Info << "Predicting " << _brightPixelPredictor.ComponentCount() << " model pixels above " << DFTPredictionThreshold() << " Jy with a direct Fourier transform.\n";
+	if(_brightPixelPredictor.Empty())
+	{
+		remainingReal.reset();
+		remainingImag.reset();
+	}
+	else {
+		real = remainingReal.data();
+		if(imaginary != 0)
+			imaginary = remainingImag.data();
+	}
+}
+
+void WSMSGridder::initializeDFTKernels(const MultiBandData& selectedBandData)
+{
+	if(_brightPixelPredictor.Empty())
+		return;
+	// The kernels of an earlier measurement set have other frequencies
+	std::vector<ao::uvector<double>> bandFrequencies(selectedBandData.DataDescCount());
+	for(size_t dataDescId=0; dataDescId!=selectedBandData.DataDescCount(); ++dataDescId)
+	{
+		const BandData& band = selectedBandData[dataDescId];
+		bandFrequencies[dataDescId].assign(band.begin(), band.end());
+	}
+	_brightPixelPredictor.SetBands(bandFrequencies);
+}
+
 void WSMSGridder::predictWriteThread(ao::lane<PredictionWorkItem>* predictionWorkLane, const MSData* msData)
 {
 	lane_read_buffer<PredictionWorkItem> buffer(predictionWorkLane, std::min(_laneBufferSize, predictionWorkLane->capacity()));
@@ -327,26 +634,74 @@ void WSMSGridder::predictWriteThread(ao::lane<PredictionWorkItem>* predictionWor
 	}
 }
 
+std::unique_ptr<WStackingGridder> WSMSGridder::makeInversionGridder(size_t visibilityCount) const
+{
+	std::unique_ptr<WStackingGridder> gridder(new WStackingGridder(_actualInversionWidth, _actualInversionHeight, _actualPixelSizeX, _actualPixelSizeY, _cpuCount, _imageBufferAllocator, AntialiasingKernelSize(), OverSamplingFactor()));
+	gridder->SetGridMode(GridMode());
+	gridder->SetPinThreads(PinThreads());
+	if(HasDenormalPhaseCentre())
+		gridder->SetDenormalPhaseCentre(PhaseCentreDL(), PhaseCentreDM());
+	gridder->SetIsComplex(IsComplex());
+	// The FFTs can skip the padding, unless the image is resampled, which needs the full image
+	if(ImageWidth()==_actualInversionWidth && ImageHeight()==_actualInversionHeight)
+		gridder->SetTrimSize(TrimWidth(), TrimHeight());
+	//_imager->SetImageConjugatePart(Polarization() == Polarization::YX && IsComplex());
+	// Only inversion maps the layers: degridding reads them in random order
+	gridder->SetLayerScratchDirectory(WLayerScratchDirectory());
+	gridder->SetVisibilityCount(visibilityCount);
+	return gridder;
+}
+
 void WSMSGridder::Invert()
 {
 	std::vector<MSData> msDataVector;
 	initializeMSDataVector(msDataVector, 1);
 	
-	_gridder = std::unique_ptr<WStackingGridder>(new WStackingGridder(_actualInversionWidth, _actualInversionHeight, _actualPixelSizeX, _actualPixelSizeY, _cpuCount, _imageBufferAllocator, AntialiasingKernelSize(), OverSamplingFactor()));
-	_gridder->SetGridMode(GridMode());
-	if(HasDenormalPhaseCentre())
-		_gridder->SetDenormalPhaseCentre(PhaseCentreDL(), PhaseCentreDM());
-	_gridder->SetIsComplex(IsComplex());
-	//_imager->SetImageConjugatePart(Polarization() == Polarization::YX && IsComplex());
-	_gridder->PrepareWLayers(WGridSize(), double(_memSize)*(7.0/10.0), _minW, _maxW);
-	
-	if(Verbose() && Logger::IsVerbose())
+	size_t visibilityCount = 0;
+	for(const MSData& msData : msDataVector)
+		visibilityCount += msData.visibilityCount;
+	_gridder = makeInversionGridder(visibilityCount);
+	// With a dual-grid PSF, every sample that is read and weighted is also gridded
+	// with its weight on a second w-stack
+	if(DoDualGridPSF() && !DoImagePSF())
 	{
-		for(size_t i=0; i!=MeasurementSetCount(); ++i)
-			countSamplesPerLayer(msDataVector[i]);
+		Logger::Info << "Gridding the PSF in the same pass.\n";
+		_psfGridder = makeInversionGridder(visibilityCount);
 	}
+	else
+		_psfGridder.reset();
+	prepareWLayers(msDataVector, true);
+	
+	// The sample counts are used to balance the layers over the gridding threads
+	if(_cpuCount > 1 || (Verbose() && Logger::IsVerbose()))
+		updateLayerSampleCounts(msDataVector);
+	else
+		_layerSampleCounts.assign(_gridder->NWLayers(), 0);
 	
 	resetVisibilityCounters();
+	if(PreApplyImagingWeights())
+	{
+		// Providers that can store the final imaging weights get them calculated once,
+		// after which all passes can grid pre-weighted samples and the weight sums
+		// are known in advance.
+		const uint64_t key = imagingWeightKey(_gridder->NWLayers());
+		for(size_t i=0; i!=MeasurementSetCount(); ++i)
+		{
+			MSData& msData = msDataVector[i];
+			if(msData.msProvider->SupportsImagingWeights())
+			{
+				MSProvider::ImagingWeightSums sums;
+				if(!msData.msProvider->OpenImagingWeights(key, sums))
+				{
+					storeImagingWeights(msData, key, sums);
+					if(!msData.msProvider->OpenImagingWeights(key, sums))
+						throw std::runtime_error("Could not open the stored imaging weights");
+				}
+				addImagingWeightSums(sums);
+				msData.hasImagingWeights = true;
+			}
+		}
+	}
 	for(size_t pass=0; pass!=_gridder->NPasses(); ++pass)
 	{
 		Logger::Info << "Gridding pass " << pass << "... ";
@@ -356,7 +711,12 @@ void WSMSGridder::Invert()
 		//_inversionWorkLane.reset(new ao::lane<InversionWorkItem>(2048));
 		//set_lane_debug_name(*_inversionWorkLane, "Inversion work lane containing full row data");
 		
-		_gridder->StartInversionPass(pass);
+		// The layers are zeroed by the threads that grid them
+		assignLayersToThreads(pass);
+		_gridder->StartInversionPass(pass, _layerThreads.data());
+		if(_psfGridder)
+			_psfGridder->StartInversionPass(pass, _layerThreads.data());
+		_threadBusyTimes.assign(_cpuCount, 0.0);
 		
 		for(size_t i=0; i!=MeasurementSetCount(); ++i)
 		{
@@ -374,9 +734,12 @@ void WSMSGridder::Invert()
 			finishInversionWorkThreads();
 		}
 		//_inversionWorkLane.reset();
+		reportThreadBusyTimes();
 		
 		Logger::Info << "Fourier transforms...\n";
 		_gridder->FinishInversionPass();
+		if(_psfGridder)
+			_psfGridder->FinishInversionPass();
 	}
 	
 	if(Verbose())
@@ -395,16 +758,29 @@ void WSMSGridder::Invert()
 	}
 	
 	if(NormalizeForWeighting())
+	{
 		_gridder->FinalizeImage(1.0/totalWeight(), false);
+		if(_psfGridder)
+			_psfGridder->FinalizeImage(1.0/totalWeight(), false);
+	}
 	else {
 		Logger::Info << "Not dividing by normalization factor of " << totalWeight()/2.0 << ".\n";
 		_gridder->FinalizeImage(2.0, true);
+		if(_psfGridder)
+			_psfGridder->FinalizeImage(2.0, true);
 	}
 	Logger::Info << "Gridded visibility count: " << double(GriddedVisibilityCount());
 	if(Weighting().IsNatural())
 		Logger::Info << ", effective count after weighting: " << EffectiveGriddedVisibilityCount();
 	Logger::Info << '\n';
 	
+	resampleAndTrim(*_gridder);
+	if(_psfGridder)
+		resampleAndTrim(*_psfGridder);
+}
+
+void WSMSGridder::resampleAndTrim(WStackingGridder& gridder)
+{
 	if(ImageWidth()!=_actualInversionWidth || ImageHeight()!=_actualInversionHeight)
 	{
 		// Interpolate the image
@@ -416,16 +792,16 @@ void WSMSGridder::Invert()
 			double *resizedReal = _imageBufferAllocator->Allocate(ImageWidth() * ImageHeight());
 			double *resizedImag = _imageBufferAllocator->Allocate(ImageWidth() * ImageHeight());
 			resampler.Start();
-			resampler.AddTask(_gridder->RealImage(), resizedReal);
-			resampler.AddTask(_gridder->ImaginaryImage(), resizedImag);
+			resampler.AddTask(gridder.RealImage(), resizedReal);
+			resampler.AddTask(gridder.ImaginaryImage(), resizedImag);
 			resampler.Finish();
-			_gridder->ReplaceRealImageBuffer(resizedReal);
-			_gridder->ReplaceImaginaryImageBuffer(resizedImag);
+			gridder.ReplaceRealImageBuffer(resizedReal);
+			gridder.ReplaceImaginaryImageBuffer(resizedImag);
 		}
 		else {
 			double *resized = _imageBufferAllocator->Allocate(ImageWidth() * ImageHeight());
-			resampler.RunSingle(_gridder->RealImage(), resized);
-			_gridder->ReplaceRealImageBuffer(resized);
+			resampler.RunSingle(gridder.RealImage(), resized);
+			gridder.ReplaceRealImageBuffer(resized);
 		}
 	}
 	
@@ -435,14 +811,14 @@ void WSMSGridder::Invert()
 		// Perform trimming
 		
 		double *trimmed = _imageBufferAllocator->Allocate(TrimWidth() * TrimHeight());
-		Image::Trim(trimmed, TrimWidth(), TrimHeight(), _gridder->RealImage(), ImageWidth(), ImageHeight());
-		_gridder->ReplaceRealImageBuffer(trimmed);
+		Image::Trim(trimmed, TrimWidth(), TrimHeight(), gridder.RealImage(), ImageWidth(), ImageHeight());
+		gridder.ReplaceRealImageBuffer(trimmed);
 		
 		if(IsComplex())
 		{
 			double *trimmedImag = _imageBufferAllocator->Allocate(TrimWidth() * TrimHeight());
-			Image::Trim(trimmedImag, TrimWidth(), TrimHeight(), _gridder->ImaginaryImage(), ImageWidth(), ImageHeight());
-			_gridder->ReplaceImaginaryImageBuffer(trimmedImag);
+			Image::Trim(trimmedImag, TrimWidth(), TrimHeight(), gridder.ImaginaryImage(), ImageWidth(), ImageHeight());
+			gridder.ReplaceImaginaryImageBuffer(trimmedImag);
 		}
 	}
 }
@@ -457,20 +833,35 @@ void WSMSGridder::Predict(double* real, double* imaginary)
 	std::vector<MSData> msDataVector;
 	initializeMSDataVector(msDataVector, 1);
 	
+	// The PSF of a dual-grid inversion has been fetched by now; keeping its gridder
+	// would hold on to its image, and would halve the memory of the prediction.
+	_psfGridder.reset();
 	_gridder = std::unique_ptr<WStackingGridder>(new WStackingGridder(_actualInversionWidth, _actualInversionHeight, _actualPixelSizeX, _actualPixelSizeY, _cpuCount, _imageBufferAllocator, AntialiasingKernelSize(), OverSamplingFactor()));
 	_gridder->SetGridMode(GridMode());
+	_gridder->SetPinThreads(PinThreads());
 	if(HasDenormalPhaseCentre())
 		_gridder->SetDenormalPhaseCentre(PhaseCentreDL(), PhaseCentreDM());
 	_gridder->SetIsComplex(IsComplex());
+	// The FFTs can skip the padding, unless the image is resampled, which needs the full image
+	if(ImageWidth()==_actualInversionWidth && ImageHeight()==_actualInversionHeight)
+		_gridder->SetTrimSize(TrimWidth(), TrimHeight());
 	//_imager->SetImageConjugatePart(Polarization() == Polarization::YX && IsComplex());
-	_gridder->PrepareWLayers(WGridSize(), double(_memSize)*(7.0/10.0), _minW, _maxW);
+	size_t visibilityCount = 0;
+	for(const MSData& msData : msDataVector)
+		visibilityCount += msData.visibilityCount;
+	_gridder->SetVisibilityCount(visibilityCount);
+	prepareWLayers(msDataVector, false);
 	
 	if(Verbose())
 	{
+		_layerSampleCounts.assign(_gridder->NWLayers(), 0);
 		for(size_t i=0; i!=MeasurementSetCount(); ++i)
 			countSamplesPerLayer(msDataVector[i]);
 	}
 	
+	ImageBufferAllocator::Ptr remainingReal, remainingImag;
+	extractDFTComponents(real, imaginary, remainingReal, remainingImag);
+	
 	ImageBufferAllocator::Ptr untrimmedReal, untrimmedImag;
 	if(TrimWidth() != ImageWidth() || TrimHeight() != ImageHeight())
 	{
@@ -534,6 +925,9 @@ void WSMSGridder::Predict(double* real, double* imaginary)
 	resampledImag.reset();
 	untrimmedReal.reset();
 	untrimmedImag.reset();
+	remainingReal.reset();
+	remainingImag.reset();
+	_brightPixelPredictor.Clear();
 	
 	size_t totalRowsWritten = 0, totalMatchingRows = 0;
 	for(size_t i=0; i!=MeasurementSetCount(); ++i)
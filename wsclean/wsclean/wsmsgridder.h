@@ -1,14 +1,22 @@
 #ifndef WS_MS_GRIDDER_H
 #define WS_MS_GRIDDER_H
 
+#include "brightpixelpredictor.h"
+#include "imagebufferallocator.h"
 #include "msgridderbase.h"
+#include "wlayerhistogram.h"
 #include "wstackinggridder.h"
 
+#include "../buffered_lane.h"
 #include "../lane.h"
 #include "../multibanddata.h"
+#include "../uvector.h"
 
+#include <algorithm>
 #include <complex>
+#include <map>
 #include <memory>
+#include <string>
 
 #include <casacore/casa/Arrays/Array.h>
 #include <casacore/tables/Tables/ArrayColumn.h>
@@ -18,12 +26,14 @@
 namespace casacore {
 	class MeasurementSet;
 }
-class ImageBufferAllocator;
-
 class WSMSGridder : public MSGridderBase
 {
 	public:
-		WSMSGridder(class ImageBufferAllocator* imageAllocator, size_t threadCount, double memFraction, double absMemLimit);
+		/**
+		 * @param reservedMemory Memory in bytes that is used elsewhere, e.g. to cache
+		 * images, and that is subtracted from the memory limit of the gridder.
+		 */
+		WSMSGridder(class ImageBufferAllocator* imageAllocator, size_t threadCount, double memFraction, double absMemLimit, double reservedMemory);
 	
 		virtual void Invert();
 		
@@ -36,6 +46,8 @@ class WSMSGridder : public MSGridderBase
 				throw std::runtime_error("No imaginary result available for non-complex inversion");
 			return _gridder->ImaginaryImage();
 		}
+		virtual bool SupportsDualGridPSF() const { return true; }
+		virtual double *PSFRealResult() { return _psfGridder ? _psfGridder->RealImage() : nullptr; }
 		virtual bool HasGriddingCorrectionImage() const { return GridMode() != NearestNeighbourGridding; }
 		virtual void GetGriddingCorrectionImage(double *image) const { _gridder->GetGriddingCorrectionImage(image); }
 		
@@ -45,6 +57,7 @@ class WSMSGridder : public MSGridderBase
 		virtual void FreeImagingData()
 		{
 			_gridder.reset();
+			_psfGridder.reset();
 		}
 		
 	private:
@@ -52,6 +65,8 @@ class WSMSGridder : public MSGridderBase
 		{
 			double uInLambda, vInLambda, wInLambda;
 			std::complex<float> sample;
+			// Only used when the PSF is gridded as well
+			std::complex<float> psfSample;
 		};
 		struct PredictionWorkItem
 		{
@@ -59,13 +74,67 @@ class WSMSGridder : public MSGridderBase
 			std::complex<float> *data;
 			size_t rowId, dataDescId;
 		};
+		struct SampleCounts
+		{
+			ao::uvector<size_t> layerSampleCounts;
+			// Matching rows of each measurement set
+			std::vector<size_t> matchingRows;
+		};
 		
+		/**
+		 * Make a gridder for an inversion with the settings of this class.
+		 */
+		std::unique_ptr<WStackingGridder> makeInversionGridder(size_t visibilityCount) const;
+		/**
+		 * Resample and trim the images of a finalized inversion to the requested size.
+		 */
+		void resampleAndTrim(WStackingGridder& gridder);
 		void gridMeasurementSet(MSData &msData);
 		void countSamplesPerLayer(MSData &msData);
+		/**
+		 * Set the sample counts per layer. The counts only depend on the selected data and
+		 * the w-layers, so they are counted once for each selection, e.g. for each output
+		 * channel, and reused in the inversions of later major iterations.
+		 */
+		void updateLayerSampleCounts(std::vector<MSData>& msDataVector);
+		std::string sampleCountKey(const std::vector<MSData>& msDataVector) const;
+		void countSamplesPerW(MSData &msData, WLayerHistogram& histogram);
+		/**
+		 * Prepare the w-layers of the gridder (and of the PSF gridder), which are evenly
+		 * spaced or, with @ref NonUniformWLayers(), placed with a @ref WLayerHistogram of
+		 * the samples. An inversion also reserves memory for the block buffers.
+		 */
+		void prepareWLayers(std::vector<MSData>& msDataVector, bool isInversion);
+		/**
+		 * Number of samples in each of the @p blockCount buffers that collect the samples
+		 * per block of mapped layers. The buffers hold about 4M samples in total.
+		 */
+		size_t blockBufferSize(size_t blockCount) const
+		{
+			return std::max<size_t>(_laneBufferSize, 4194304 / blockCount);
+		}
+		/**
+		 * Decide which thread grids each w-layer of the pass, such that the threads get
+		 * about the same number of samples according to @ref countSamplesPerLayer().
+		 */
+		void assignLayersToThreads(size_t passIndex);
+		void reportThreadBusyTimes() const;
+		size_t layerThread(size_t layer) const
+		{
+			return (layer < _layerThreads.size()) ? _layerThreads[layer] : layer % _cpuCount;
+		}
+		/**
+		 * Write the samples that were collected for a block of w-layers to the lanes
+		 * of the threads that grid them, and empty the buffer.
+		 */
+		void flushBlockBuffer(std::vector<InversionWorkSample>& buffer, lane_write_buffer<InversionWorkSample>* bufferedLanes);
+		void storeImagingWeights(MSData &msData, uint64_t key, MSProvider::ImagingWeightSums& sums);
 		virtual size_t getSuggestedWGridSize() const  ;
 
 		void predictMeasurementSet(MSData &msData);
-
+		void extractDFTComponents(double*& real, double*& imaginary, ImageBufferAllocator::Ptr& remainingReal, ImageBufferAllocator::Ptr& remainingImag);
+		void initializeDFTKernels(const MultiBandData& selectedBandData);
+		
 		void workThread(ao::lane<InversionRow>* workLane)
 		{
 			InversionRow workItem;
@@ -78,15 +147,28 @@ class WSMSGridder : public MSGridderBase
 		
 		void startInversionWorkThreads(size_t maxChannelCount);
 		void finishInversionWorkThreads();
-		void workThreadPerSample(ao::lane<InversionWorkSample>* workLane);
+		void workThreadPerSample(ao::lane<InversionWorkSample>* workLane, size_t threadIndex);
 		
-		void predictCalcThread(ao::lane<PredictionWorkItem>* inputLane, ao::lane<PredictionWorkItem>* outputLane);
+		void predictCalcThread(ao::lane<PredictionWorkItem>* inputLane, ao::lane<PredictionWorkItem>* outputLane, const MultiBandData* selectedBandData);
 		void predictWriteThread(ao::lane<PredictionWorkItem>* samplingWorkLane, const MSData* msData);
 
 		std::unique_ptr<WStackingGridder> _gridder;
+		// Gridder of the PSF when it is gridded in the same pass as the image, with the
+		// same w-layers and passes as _gridder
+		std::unique_ptr<WStackingGridder> _psfGridder;
 		std::unique_ptr<ao::lane<InversionRow>> _inversionWorkLane;
 		std::unique_ptr<ao::lane<InversionWorkSample>[]> _inversionCPULanes;
 		std::unique_ptr<boost::thread_group> _threadGroup;
+		// Bright model pixels that are predicted with a DFT, with one band per data description id
+		BrightPixelPredictor _brightPixelPredictor;
+		// Number of samples per w-layer, summed over the measurement sets
+		ao::uvector<size_t> _layerSampleCounts;
+		// Sample counts of earlier inversions, by the key of sampleCountKey()
+		std::map<std::string, SampleCounts> _sampleCountCache;
+		// Index of the gridding thread for each w-layer
+		ao::uvector<size_t> _layerThreads;
+		// Cpu time spent by each gridding thread during the current pass
+		ao::uvector<double> _threadBusyTimes;
 		size_t _cpuCount, _laneBufferSize;
 		int64_t _memSize;
 		ImageBufferAllocator* _imageBufferAllocator;
@@ -1,20 +1,43 @@
 #include "wstackinggridder.h"
 #include "imagebufferallocator.h"
 #include "logger.h"
+#include "wlayerpassplanner.h"
+
+#include "../threadaffinity.h"
 
 #include <fftw3.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include <boost/thread/barrier.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/thread/mutex.hpp>
 
+#ifdef __SSE__
+#define USE_INTRINSICS
+#endif
+
+#ifdef USE_INTRINSICS
+#include <immintrin.h>
+#endif
+
 WStackingGridder::WStackingGridder(size_t width, size_t height, double pixelSizeX, double pixelSizeY, size_t fftThreadCount, ImageBufferAllocator* allocator, size_t kernelSize, size_t overSamplingFactor) :
 	_width(width),
 	_height(height),
 	_pixelSizeX(pixelSizeX),
 	_pixelSizeY(pixelSizeY),
+	_trimWidth(width),
+	_trimHeight(height),
 	_nWLayers(0),
 	_nPasses(0),
 	_curLayerRangeIndex(0),
@@ -27,9 +50,15 @@ WStackingGridder::WStackingGridder(size_t width, size_t height, double pixelSize
 	_gridMode(KaiserBesselKernel),
 	_overSamplingFactor(overSamplingFactor),
 	_kernelSize(kernelSize),
-	_imageData(fftThreadCount, 0),
-	_imageDataImaginary(fftThreadCount, 0),
+	_kernelBlockFunctions(kernelBlockFunctions(kernelSize)),
+	_imageData(nullptr),
+	_imageDataImaginary(nullptr),
 	_nFFTThreads(fftThreadCount),
+	_visibilityCount(0),
+	_layerBlockSize(0),
+	_mappedLayers(nullptr),
+	_mappedLayersSize(0),
+	_pinThreads(false),
 	_imageBufferAllocator(allocator)
 {
 	makeKernels();
@@ -38,11 +67,8 @@ WStackingGridder::WStackingGridder(size_t width, size_t height, double pixelSize
 WStackingGridder::~WStackingGridder()
 {
 	try {
-		for(size_t i=0; i!=_nFFTThreads; ++i)
-		{
-			_imageBufferAllocator->Free(_imageData[i]);
-			_imageBufferAllocator->Free(_imageDataImaginary[i]);
-		}
+		_imageBufferAllocator->Free(_imageData);
+		_imageBufferAllocator->Free(_imageDataImaginary);
 		freeLayeredUVData();
 		fftw_cleanup();
 	} catch(std::exception& e) { }
@@ -61,50 +87,89 @@ void WStackingGridder::PrepareWLayers(size_t nWLayers, double maxMem, double min
 		// exact w value of all visibilies.
 		_maxW += 1.0;
 	}
-	
-	size_t nrCopies = _nFFTThreads;
-	if(nrCopies > _nWLayers) nrCopies = _nWLayers;
-	double memPerImage = _width * _height * sizeof(double);
-	double memPerCore = memPerImage * 5.0; // two complex ones for FFT, one for projecting on
-	double remainingMem = maxMem - nrCopies * memPerCore;
-	if(remainingMem <= memPerImage * _nFFTThreads)
-	{
-		_nFFTThreads = size_t(maxMem*3.0/(5.0*memPerCore)); // times 3/5 to use 3/5 of mem for FFTing at most
-		if(_nFFTThreads==0) _nFFTThreads = 1;
-		remainingMem = maxMem - _nFFTThreads * memPerCore;
-		
+	_layerWValues.clear();
+	prepareWLayers(maxMem);
+}
+
+void WStackingGridder::PrepareWLayers(const std::vector<double>& layerWValues, double maxMem, double minW, double maxW)
+{
+	_layerWValues = layerWValues;
+	_nWLayers = layerWValues.size();
+	_minW = minW;
+	_maxW = maxW;
+	prepareWLayers(maxMem);
+}
+
+size_t WStackingGridder::nearestLayer(double w) const
+{
+	if(w > _maxW || w < (_isComplex ? -_maxW : _minW))
+		return _nWLayers;
+	std::vector<double>::const_iterator next = std::lower_bound(_layerWValues.begin(), _layerWValues.end(), w);
+	if(next == _layerWValues.begin())
+		return 0;
+	else if(next == _layerWValues.end())
+		return _layerWValues.size() - 1;
+	else if(*next - w < w - *(next-1))
+		return next - _layerWValues.begin();
+	else
+		return next - _layerWValues.begin() - 1;
+}
+
+void WStackingGridder::prepareWLayers(double maxMem)
+{
+	WLayerPassPlanner planner(_width, _height, _isComplex);
+	planner.SetVisibilityCount(_visibilityCount);
+	const WLayerPassPlanner::Plan plan = _layerScratchDirectory.empty() ?
+		planner.Make(_nWLayers, _nFFTThreads, maxMem) :
+		planner.MakeMapped(_nWLayers, _nFFTThreads, maxMem);
+	// Layers in memory are all resident, so samples only need to be ordered in blocks when they are mapped
+	_layerBlockSize = _layerScratchDirectory.empty() ? 0 : plan.residentLayerCount;
+	if(plan.memory > maxMem)
+	{
 		Logger::Warn <<
 			"WARNING: the amount of available memory is too low for the image size,\n"
-			"       : not all cores might be used.\n"
-			"       : nr buffers avail for FFT: " << _nFFTThreads << " remaining mem: " << round(remainingMem/1.0e8)/10.0 << " GB \n";
+			"       : one w-layer per pass with a single FFT thread requires " << round(plan.memory/1.0e8)/10.0 << " GB,\n"
+			"       : but " << round(maxMem/1.0e8)/10.0 << " GB is available.\n";
+	}
+	else if(plan.threadCount < _nFFTThreads && plan.threadCount < _nWLayers)
+	{
+		Logger::Info << "Using " << plan.threadCount << " of " << _nFFTThreads << " threads for FFTs, to reduce the number of passes.\n";
 	}
+	_nFFTThreads = plan.threadCount;
 	
-	// Allocate FFT buffers
+	// Allocate the image. Its row bands are zeroed by the threads that accumulate
+	// them, such that their memory is placed close to these threads.
 	size_t imgSize = _height * _width;
+	_imageData = _imageBufferAllocator->Allocate(imgSize);
+	if(_isComplex)
+		_imageDataImaginary = _imageBufferAllocator->Allocate(imgSize);
+	boost::thread_group threadGroup;
 	for(size_t i=0; i!=_nFFTThreads; ++i)
-	{
-		_imageData[i] = _imageBufferAllocator->Allocate(imgSize);
-		memset(_imageData[i], 0, imgSize * sizeof(double));
-		if(_isComplex)
-		{
-			_imageDataImaginary[i] = _imageBufferAllocator->Allocate(imgSize);
-			memset(_imageDataImaginary[i], 0, imgSize * sizeof(double));
-		}
-	}
+		threadGroup.add_thread(new boost::thread(&WStackingGridder::zeroImageDataThreadFunction, this, i));
+	threadGroup.join_all();
 	
-	// Calculate nr wlayers per pass from remaining memory
-	int maxNWLayersPerPass = int((double) remainingMem / (2.0*memPerImage));
-	if(maxNWLayersPerPass < 1)
-		maxNWLayersPerPass=1;
-	_nPasses = (nWLayers+maxNWLayersPerPass-1)/maxNWLayersPerPass;
-	if(_nPasses == 0) _nPasses = 1;
+	_nPasses = plan.passCount;
 	Logger::Info << "Will process " << (_nWLayers / _nPasses) << "/" << _nWLayers << " w-layers per pass.\n";
+	Logger::Info << "W-layer plan: " << plan.passCount << " pass(es) with " << plan.layersPerPass << " layers (" << plan.residentLayerCount << " in memory) and " << plan.threadCount <<
+		" FFT threads, predicted memory " << round(plan.memory/1.0e8)/10.0 << "/" << round(maxMem/1.0e8)/10.0 <<
+		" GB, estimated time " << round(plan.time*10.0)/10.0 << " s.\n";
 	
 	_curLayerRangeIndex = 0;
 }
 
 void WStackingGridder::initializeLayeredUVData(size_t n)
 {
+	if(_mappedLayers != nullptr)
+	{
+		munmap(_mappedLayers, _mappedLayersSize);
+		_mappedLayers = nullptr;
+		_layeredUVData.clear();
+	}
+	if(!_layerScratchDirectory.empty() && n != 0)
+	{
+		mapLayeredUVData(n);
+		return;
+	}
 	while(_layeredUVData.size() > n)
 	{
 		_imageBufferAllocator->Free(_layeredUVData.back());
@@ -114,15 +179,113 @@ void WStackingGridder::initializeLayeredUVData(size_t n)
 		_layeredUVData.push_back(_imageBufferAllocator->AllocateComplex(_width * _height));
 }
 
-void WStackingGridder::StartInversionPass(size_t passIndex)
+/**
+ * The layers are placed in a file in the scratch directory that is mapped in memory,
+ * such that the kernel can page out the layers that do not fit in memory. The file
+ * is removed directly, so that its space is released when it is unmapped, also when
+ * wsclean stops unexpectedly.
+ */
+void WStackingGridder::mapLayeredUVData(size_t n)
+{
+	const size_t layerBytes = _width * _height * sizeof(std::complex<double>);
+	std::string filename = _layerScratchDirectory + "/wsclean-wlayers-XXXXXX";
+	std::vector<char> filenameBuffer(filename.begin(), filename.end());
+	filenameBuffer.push_back(0);
+	int fd = mkstemp(filenameBuffer.data());
+	if(fd == -1)
+		throw std::runtime_error("Could not create scratch file for w-layers in directory '" + _layerScratchDirectory + "': " + strerror(errno));
+	unlink(filenameBuffer.data());
+	// The space is allocated up front, because writing to a sparse file on a full disk
+	// through the mapping would crash with SIGBUS. Allocated blocks read as zeros, so
+	// the layers need not be zeroed.
+	int errNo = posix_fallocate(fd, 0, n * layerBytes);
+	if(errNo != 0)
+	{
+		close(fd);
+		std::ostringstream str;
+		str << "Could not allocate " << n * layerBytes << " bytes for w-layers in directory '" << _layerScratchDirectory << "': " << strerror(errNo);
+		throw std::runtime_error(str.str());
+	}
+	void* mapping = mmap(nullptr, n * layerBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	errNo = errno;
+	close(fd);
+	if(mapping == MAP_FAILED)
+		throw std::runtime_error("Could not map scratch file for w-layers: " + std::string(strerror(errNo)));
+	_mappedLayers = mapping;
+	_mappedLayersSize = n * layerBytes;
+	_layeredUVData.resize(n);
+	for(size_t i=0; i!=n; ++i)
+		_layeredUVData[i] = reinterpret_cast<std::complex<double>*>(static_cast<char*>(mapping) + i * layerBytes);
+	Logger::Info << "Mapped " << n << " w-layers (" << round(_mappedLayersSize/1.0e8)/10.0 << " GB) in " << _layerScratchDirectory << ", of which " << _layerBlockSize << " fit in memory.\n";
+}
+
+/**
+ * Once a mapped layer has been transformed, its pages are removed from the file, such
+ * that the kernel does not write them back to disk.
+ */
+void WStackingGridder::releaseMappedLayer(size_t layerIndex)
+{
+	const size_t
+		pageSize = sysconf(_SC_PAGE_SIZE),
+		layerBytes = _width * _height * sizeof(std::complex<double>),
+		start = layerIndex * layerBytes,
+		end = start + layerBytes,
+		pageStart = (start + pageSize - 1) / pageSize * pageSize,
+		pageEnd = end / pageSize * pageSize;
+	// Pages that are shared with neighbouring layers are kept
+	if(pageEnd > pageStart)
+		madvise(static_cast<char*>(_mappedLayers) + pageStart, pageEnd - pageStart, MADV_REMOVE);
+}
+
+void WStackingGridder::StartInversionPass(size_t passIndex, const size_t* layerThreads)
 {
 	initializeSqrtLMLookupTable();
 	
 	_curLayerRangeIndex = passIndex;
-	size_t nLayersInPass = layerRangeStart(passIndex+1) - layerRangeStart(passIndex);
+	const size_t
+		layerOffset = layerRangeStart(passIndex),
+		nLayersInPass = layerRangeStart(passIndex+1) - layerOffset;
 	initializeLayeredUVData(nLayersInPass);
+	if(_mappedLayers == nullptr)
+	{
+		size_t nThreads = _nFFTThreads;
+		if(layerThreads != nullptr)
+		{
+			nThreads = 0;
+			for(size_t i=0; i!=nLayersInPass; ++i)
+				nThreads = std::max(nThreads, layerThreads[i + layerOffset] + 1);
+		}
+		boost::thread_group threadGroup;
+		for(size_t i=0; i!=nThreads; ++i)
+			threadGroup.add_thread(new boost::thread(&WStackingGridder::zeroLayersThreadFunction, this, i, nLayersInPass, layerThreads));
+		threadGroup.join_all();
+	}
+}
+
+void WStackingGridder::zeroImageDataThreadFunction(size_t threadIndex)
+{
+	if(_pinThreads)
+		ThreadAffinity::PinToCPU(threadIndex);
+	// The first and last thread also zero the rows outside the trimmed part
+	const size_t
+		yStart = (threadIndex == 0) ? 0 : rowBandStart(threadIndex),
+		yEnd = (threadIndex+1 == _nFFTThreads) ? _height : rowBandStart(threadIndex+1);
+	memset(&_imageData[yStart*_width], 0, (yEnd - yStart) * _width * sizeof(double));
+	if(_isComplex)
+		memset(&_imageDataImaginary[yStart*_width], 0, (yEnd - yStart) * _width * sizeof(double));
+}
+
+void WStackingGridder::zeroLayersThreadFunction(size_t threadIndex, size_t nLayersInPass, const size_t* layerThreads)
+{
+	if(_pinThreads)
+		ThreadAffinity::PinToCPU(threadIndex);
+	const size_t layerOffset = layerRangeStart(_curLayerRangeIndex);
 	for(size_t i=0; i!=nLayersInPass; ++i)
-		memset(_layeredUVData[i], 0, _width*_height * sizeof(double)*2);
+	{
+		const size_t layerThread = (layerThreads == nullptr) ? (i + layerOffset) % _nFFTThreads : layerThreads[i + layerOffset];
+		if(layerThread == threadIndex)
+			memset(_layeredUVData[i], 0, _width*_height * sizeof(double)*2);
+	}
 }
 
 void WStackingGridder::StartPredictionPass(size_t passIndex)
@@ -145,44 +308,124 @@ void WStackingGridder::StartPredictionPass(size_t passIndex)
 	threadGroup.join_all();
 }
 
-void WStackingGridder::fftToImageThreadFunction(boost::mutex *mutex, std::stack<size_t> *tasks, size_t threadIndex)
+/**
+ * Plans a 2D FFT of a layer from @p in to @p out. The FFT consists of the plans in the
+ * returned list, which are executed in order. When only some rows are used, the FFT is
+ * split in 1D FFTs over the columns and over the used rows only. With @p pruneOutput,
+ * the columns are transformed first and only the used output rows are calculated;
+ * otherwise the used input rows are transformed first, and the other input rows
+ * should be zero.
+ */
+static std::vector<fftw_plan> planLayerFFT(size_t width, size_t height, const std::vector<std::pair<size_t, size_t>>& rowRanges, std::complex<double> *in, std::complex<double> *out, int sign, bool pruneOutput)
+{
+	fftw_complex
+		*fftwIn = reinterpret_cast<fftw_complex*>(in),
+		*fftwOut = reinterpret_cast<fftw_complex*>(out);
+	std::vector<fftw_plan> plans;
+	if(rowRanges.size() == 1 && rowRanges.front().first == 0 && rowRanges.front().second == height)
+	{
+		plans.push_back(fftw_plan_dft_2d(height, width, fftwIn, fftwOut, sign, FFTW_ESTIMATE));
+	}
+	else {
+		const int columnSize = height, rowSize = width;
+		fftw_plan columnPlan = fftw_plan_many_dft(1, &columnSize, width,
+			fftwIn, nullptr, width, 1,
+			fftwOut, nullptr, width, 1, sign, FFTW_ESTIMATE);
+		if(pruneOutput)
+			plans.push_back(columnPlan);
+		// The rows are transformed in place
+		fftw_complex *rowData = pruneOutput ? fftwOut : fftwIn;
+		for(const std::pair<size_t, size_t>& range : rowRanges)
+		{
+			fftw_complex *start = rowData + range.first * width;
+			plans.push_back(fftw_plan_many_dft(1, &rowSize, range.second - range.first,
+				start, nullptr, 1, width,
+				start, nullptr, 1, width, sign, FFTW_ESTIMATE));
+		}
+		if(!pruneOutput)
+			plans.push_back(columnPlan);
+	}
+	return plans;
+}
+
+bool WStackingGridder::isInTrimmedRow(size_t fftRow, bool isInversion) const
 {
+	// See projectOnImageAndCorrect() and copyImageToLayerAndInverseCorrect() for the row order
+	size_t imageRow = isInversion ? (_height - fftRow) + _height / 2 : fftRow + _height / 2;
+	if(imageRow >= _height) imageRow -= _height;
+	return imageRow >= (_height - _trimHeight) / 2 && imageRow < (_height + _trimHeight) / 2;
+}
+
+std::vector<std::pair<size_t, size_t>> WStackingGridder::trimmedRowRanges(bool isInversion) const
+{
+	std::vector<std::pair<size_t, size_t>> ranges;
+	for(size_t y=0; y!=_height; ++y)
+	{
+		if(isInTrimmedRow(y, isInversion))
+		{
+			if(!ranges.empty() && ranges.back().second == y)
+				++ranges.back().second;
+			else
+				ranges.emplace_back(y, y+1);
+		}
+	}
+	return ranges;
+}
+
+/**
+ * The layers are transformed in rounds of one layer per thread. After the FFTs of a
+ * round, every thread adds its band of rows of all transformed layers of the round to
+ * the image. Hence the threads share a single image, which needs no reduction at the end.
+ */
+void WStackingGridder::fftToImageThreadFunction(boost::mutex *mutex, boost::barrier *barrier, std::vector<std::complex<double>*> *fftOutputs, size_t nPlanes, size_t threadIndex)
+{
+	if(_pinThreads)
+		ThreadAffinity::PinToCPU(threadIndex);
 	const size_t imgSize = _width * _height;
 	std::complex<double> *fftwIn = _imageBufferAllocator->AllocateComplex(imgSize);
 	// reinterpret_cast<std::complex<double>*>(fftw_malloc(imgSize * sizeof(double) * 2));
 	std::complex<double> *fftwOut = _imageBufferAllocator->AllocateComplex(imgSize);
 	// reinterpret_cast<std::complex<double>*>(fftw_malloc(imgSize * sizeof(double) * 2));
+	(*fftOutputs)[threadIndex] = fftwOut;
 	
 	boost::mutex::scoped_lock lock(*mutex);
-	fftw_plan plan =
-		fftw_plan_dft_2d(_height, _width,
-			reinterpret_cast<fftw_complex*>(fftwIn), reinterpret_cast<fftw_complex*>(fftwOut),
-			FFTW_BACKWARD, FFTW_ESTIMATE);
+	std::vector<fftw_plan> plans = planLayerFFT(_width, _height, trimmedRowRanges(true), fftwIn, fftwOut, FFTW_BACKWARD, true);
+	lock.unlock();
 		
 	const size_t layerOffset = layerRangeStart(_curLayerRangeIndex);
 
-	while(!tasks->empty())
+	for(size_t roundStart=0; roundStart<nPlanes; roundStart+=_nFFTThreads)
 	{
-		size_t layer = tasks->top();
-		tasks->pop();
-		lock.unlock();
-		
-		// Fourier transform the layer
-		std::complex<double> *uvData = _layeredUVData[layer];
-		memcpy(fftwIn, uvData, imgSize * sizeof(double) * 2);
-		fftw_execute(plan);
-		
-		// Add layer to full image
-		if(_isComplex)
-			projectOnImageAndCorrect<true>(fftwOut, LayerToW(layer + layerOffset), threadIndex);
-		else
-			projectOnImageAndCorrect<false>(fftwOut, LayerToW(layer + layerOffset), threadIndex);
+		// Fourier transform the layer of this thread
+		const size_t layer = roundStart + threadIndex;
+		if(layer < nPlanes)
+		{
+			std::complex<double> *uvData = _layeredUVData[layer];
+			memcpy(fftwIn, uvData, imgSize * sizeof(double) * 2);
+			if(_mappedLayers != nullptr)
+				releaseMappedLayer(layer);
+			for(fftw_plan plan : plans)
+				fftw_execute(plan);
+		}
+		barrier->wait();
 		
-		// lock for accessing tasks in guard
-		lock.lock();
+		// Add the band of this thread of all layers in the round to the image
+		const size_t roundEnd = std::min(roundStart + _nFFTThreads, nPlanes);
+		for(size_t roundLayer=roundStart; roundLayer!=roundEnd; ++roundLayer)
+		{
+			const std::complex<double> *source = (*fftOutputs)[roundLayer - roundStart];
+			if(_isComplex)
+				projectOnImageAndCorrect<true>(source, LayerToW(roundLayer + layerOffset), threadIndex);
+			else
+				projectOnImageAndCorrect<false>(source, LayerToW(roundLayer + layerOffset), threadIndex);
+		}
+		// The FFT outputs can not be overwritten before all threads have used them
+		barrier->wait();
 	}
-	// Lock is still required for destroying plan
-	fftw_destroy_plan(plan);
+	// Lock is required for destroying plans
+	lock.lock();
+	for(fftw_plan plan : plans)
+		fftw_destroy_plan(plan);
 	lock.unlock();
 	_imageBufferAllocator->Free(fftwIn);
 	_imageBufferAllocator->Free(fftwOut);
@@ -197,10 +440,7 @@ void WStackingGridder::fftToUVThreadFunction(boost::mutex *mutex, std::stack<siz
 		// reinterpret_cast<std::complex<double>*>(fftw_malloc(imgSize * sizeof(double) * 2));
 	
 	boost::mutex::scoped_lock lock(*mutex);
-	fftw_plan plan =
-		fftw_plan_dft_2d(_height, _width,
-			reinterpret_cast<fftw_complex*>(fftwIn), reinterpret_cast<fftw_complex*>(fftwOut),
-			FFTW_FORWARD, FFTW_ESTIMATE);
+	std::vector<fftw_plan> plans = planLayerFFT(_width, _height, trimmedRowRanges(false), fftwIn, fftwOut, FFTW_FORWARD, false);
 		
 	const size_t layerOffset = layerRangeStart(_curLayerRangeIndex);
 
@@ -217,15 +457,17 @@ void WStackingGridder::fftToUVThreadFunction(boost::mutex *mutex, std::stack<siz
 			copyImageToLayerAndInverseCorrect<false>(fftwIn, LayerToW(layer + layerOffset));
 		
 		// Fourier transform the layer
-		fftw_execute(plan);
+		for(fftw_plan plan : plans)
+			fftw_execute(plan);
 		std::complex<double> *uvData = _layeredUVData[layer];
 		memcpy(uvData, fftwOut, imgSize * sizeof(double) * 2);
 		
 		// lock for accessing tasks in guard
 		lock.lock();
 	}
-	// Lock is still required for destroying plan
-	fftw_destroy_plan(plan);
+	// Lock is still required for destroying plans
+	for(fftw_plan plan : plans)
+		fftw_destroy_plan(plan);
 	lock.unlock();
 	
 	_imageBufferAllocator->Free(fftwIn);
@@ -236,14 +478,15 @@ void WStackingGridder::FinishInversionPass()
 {
 	size_t layerOffset = layerRangeStart(_curLayerRangeIndex);
 	size_t nPlanes = layerRangeStart(_curLayerRangeIndex+1) - layerOffset;
-	std::stack<size_t> planes;
-	for(size_t plane=0; plane!=nPlanes; ++plane)
-		planes.push(plane);
 	
+	// Layers are processed in the order in which they are stored, which helps
+	// reading mapped layers
 	boost::mutex mutex;
+	boost::barrier barrier(_nFFTThreads);
+	std::vector<std::complex<double>*> fftOutputs(_nFFTThreads);
 	boost::thread_group threadGroup;
 	for(size_t i=0; i!=_nFFTThreads; ++i)
-		threadGroup.add_thread(new boost::thread(&WStackingGridder::fftToImageThreadFunction, this, &mutex, &planes, i));
+		threadGroup.add_thread(new boost::thread(&WStackingGridder::fftToImageThreadFunction, this, &mutex, &barrier, &fftOutputs, nPlanes, i));
 	threadGroup.join_all();
 }
 
@@ -262,6 +505,9 @@ void WStackingGridder::makeKernels()
 		case RectangularKernel:
 			makeRectangularKernel(_1dKernel, _overSamplingFactor);
 			break;
+		case ExponentialOfSemicircleKernel:
+			makeExponentialOfSemicircleKernel(_1dKernel, _overSamplingFactor);
+			break;
 	}
 	
 	std::vector<std::vector<double>>::iterator gridKernelIter = _griddingKernels.begin();
@@ -335,6 +581,34 @@ void WStackingGridder::makeRectangularKernel(std::vector<double> &kernel, size_t
 		kernel[i] = kernel[n-1-i];
 }
 
+/**
+ * The kernel is exp(beta (sqrt(1 - z^2) - 1)), with z running from -1 to 1 over the
+ * kernel. It is normalized to one in the centre, which is not important because
+ * the image is divided by the transform of the same kernel. A beta of 2.3 times the
+ * kernel size is close to optimal for the aliasing of the image.
+ */
+double WStackingGridder::exponentialOfSemicircle(double x) const
+{
+	const double
+		beta = 2.3 * _kernelSize,
+		z = x / (0.5 * _kernelSize);
+	if(z*z >= 1.0)
+		return 0.0;
+	else
+		return exp(beta * (sqrt(1.0 - z*z) - 1.0));
+}
+
+void WStackingGridder::makeExponentialOfSemicircleKernel(std::vector<double> &kernel, size_t overSamplingFactor) const
+{
+	size_t
+		n = kernel.size(),
+		mid = n/2;
+	for(size_t i=0; mid+i!=n; i++)
+		kernel[mid+i] = exponentialOfSemicircle(double(i) / overSamplingFactor);
+	for(size_t i=0; i!=mid; i++)
+		kernel[i] = kernel[n-1-i];
+}
+
 double WStackingGridder::bessel0(double x, double precision)
 {
 	// Calculate I_0 = SUM of m 0 -> inf [ (x/2)^(2m) ]
@@ -424,18 +698,7 @@ void WStackingGridder::AddDataSample(std::complex<float> sample, double uInLambd
 				else {
 					x -= mid;
 					y -= mid;
-					std::vector<double>::iterator kernelIter = kernel.begin();
-					for(size_t j=0; j!=_kernelSize; ++j)
-					{
-						std::complex<double> *uvRowPtr = &uvData[x + y*_width];
-						for(size_t i=0; i!=_kernelSize; ++i)
-						{
-							*uvRowPtr += std::complex<double>(sample.real() * (*kernelIter), sample.imag() * (*kernelIter));
-							++uvRowPtr;
-							++kernelIter;
-						}
-						++y;
-					}
+					_kernelBlockFunctions.add(&uvData[x + y*_width], _width, kernel.data(), _kernelSize, sample);
 				}
 			}
 		}
@@ -514,18 +777,7 @@ void WStackingGridder::SampleDataSample(std::complex<double>& value, double uInL
 				else {
 					x -= mid;
 					y -= mid;
-					std::vector<double>::iterator kernelIter = kernel.begin();
-					for(size_t j=0; j!=_kernelSize; ++j)
-					{
-						std::complex<double> *uvRowPtr = &uvData[x + y*_width];
-						for(size_t i=0; i!=_kernelSize; ++i)
-						{
-							sample += std::complex<double>(uvRowPtr->real() * (*kernelIter), uvRowPtr->imag() * (*kernelIter));
-							++uvRowPtr;
-							++kernelIter;
-						}
-						++y;
-					}
+					sample = _kernelBlockFunctions.sum(&uvData[x + y*_width], _width, kernel.data(), _kernelSize);
 				}
 			}
 			else {
@@ -542,6 +794,156 @@ void WStackingGridder::SampleDataSample(std::complex<double>& value, double uInL
 	}
 }
 
+std::complex<double> WStackingGridder::SumKernelBlockScalar(const std::complex<double>* uvData, size_t uvWidth, const double* kernel, size_t kernelSize)
+{
+	std::complex<double> sample = 0.0;
+	for(size_t j=0; j!=kernelSize; ++j)
+	{
+		const std::complex<double>* uvRowPtr = &uvData[j*uvWidth];
+		for(size_t i=0; i!=kernelSize; ++i)
+		{
+			sample += std::complex<double>(uvRowPtr->real() * (*kernel), uvRowPtr->imag() * (*kernel));
+			++uvRowPtr;
+			++kernel;
+		}
+	}
+	return sample;
+}
+
+std::complex<double> WStackingGridder::SumKernelBlock(const std::complex<double>* uvData, size_t uvWidth, const double* kernel, size_t kernelSize)
+{
+	return kernelBlockFunctions(kernelSize).sum(uvData, uvWidth, kernel, kernelSize);
+}
+
+void WStackingGridder::AddKernelBlock(std::complex<double>* uvData, size_t uvWidth, const double* kernel, size_t kernelSize, std::complex<double> sample)
+{
+	kernelBlockFunctions(kernelSize).add(uvData, uvWidth, kernel, kernelSize, sample);
+}
+
+/**
+ * The common kernel sizes are specialized, such that the compiler can unroll the
+ * loops over a kernel row. Other sizes use the instantiation with KernelSize = 0.
+ */
+WStackingGridder::KernelBlockFunctions WStackingGridder::kernelBlockFunctions(size_t kernelSize)
+{
+	KernelBlockFunctions functions;
+	switch(kernelSize)
+	{
+	case 5:
+		functions.sum = &sumKernelBlock<5>;
+		functions.add = &addKernelBlock<5>;
+		break;
+	case 7:
+		functions.sum = &sumKernelBlock<7>;
+		functions.add = &addKernelBlock<7>;
+		break;
+	case 9:
+		functions.sum = &sumKernelBlock<9>;
+		functions.add = &addKernelBlock<9>;
+		break;
+	default:
+		functions.sum = &sumKernelBlock<0>;
+		functions.add = &addKernelBlock<0>;
+		break;
+	}
+	return functions;
+}
+
+/**
+ * KernelSize is the size of the kernel, or 0 when it is only known at run time, in
+ * which case the kernelSize parameter is used.
+ */
+template<size_t KernelSize>
+std::complex<double> WStackingGridder::sumKernelBlock(const std::complex<double>* uvData, size_t uvWidth, const double* kernel, size_t kernelSize)
+{
+	const size_t n = (KernelSize == 0) ? kernelSize : KernelSize;
+#if defined __AVX__ && defined USE_INTRINSICS && !defined FORCE_NON_AVX
+	// Three independent accumulators of (real, imaginary) pairs: the even and odd
+	// cells of the blocks of four, and the remaining cells of each row
+	__m256d sumEven = _mm256_setzero_pd(), sumOdd = _mm256_setzero_pd();
+	__m128d sumRemainder = _mm_setzero_pd();
+	for(size_t j=0; j!=n; ++j)
+	{
+		const double* uvRow = reinterpret_cast<const double*>(&uvData[j*uvWidth]);
+		const double* kernelRow = &kernel[j*n];
+		size_t i = 0;
+		for(; i+4<=n; i+=4)
+		{
+			// Cells 0, 1 and 2, 3 of the block, each as (re, im, re, im)
+			__m256d uv01 = _mm256_loadu_pd(&uvRow[i*2]);
+			__m256d uv23 = _mm256_loadu_pd(&uvRow[i*2+4]);
+			// Kernel values (k0, k1, k2, k3)
+			__m256d k = _mm256_loadu_pd(&kernelRow[i]);
+			// Regroup as cells 0, 2 and 1, 3, such that the kernel values
+			// can be duplicated within the lanes: (k0, k0, k2, k2) and (k1, k1, k3, k3)
+			__m256d uv02 = _mm256_permute2f128_pd(uv01, uv23, 0x20);
+			__m256d uv13 = _mm256_permute2f128_pd(uv01, uv23, 0x31);
+#ifdef __FMA__
+			sumEven = _mm256_fmadd_pd(uv02, _mm256_unpacklo_pd(k, k), sumEven);
+			sumOdd = _mm256_fmadd_pd(uv13, _mm256_unpackhi_pd(k, k), sumOdd);
+#else
+			sumEven = _mm256_add_pd(sumEven, _mm256_mul_pd(uv02, _mm256_unpacklo_pd(k, k)));
+			sumOdd = _mm256_add_pd(sumOdd, _mm256_mul_pd(uv13, _mm256_unpackhi_pd(k, k)));
+#endif
+		}
+		for(; i!=n; ++i)
+			sumRemainder = _mm_add_pd(sumRemainder, _mm_mul_pd(_mm_loadu_pd(&uvRow[i*2]), _mm_set1_pd(kernelRow[i])));
+	}
+	__m256d sum = _mm256_add_pd(sumEven, sumOdd);
+	__m128d total = _mm_add_pd(_mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1)), sumRemainder);
+	double result[2];
+	_mm_storeu_pd(result, total);
+	return std::complex<double>(result[0], result[1]);
+#else
+#warning "Not using AVX optimized version of sumKernelBlock()!"
+	return SumKernelBlockScalar(uvData, uvWidth, kernel, n);
+#endif
+}
+
+template<size_t KernelSize>
+void WStackingGridder::addKernelBlock(std::complex<double>* uvData, size_t uvWidth, const double* kernel, size_t kernelSize, std::complex<double> sample)
+{
+	const size_t n = (KernelSize == 0) ? kernelSize : KernelSize;
+#if defined __AVX__ && defined USE_INTRINSICS && !defined FORCE_NON_AVX
+	const __m256d sample2 = _mm256_set_pd(sample.imag(), sample.real(), sample.imag(), sample.real());
+	const __m128d sample1 = _mm_set_pd(sample.imag(), sample.real());
+	for(size_t j=0; j!=n; ++j)
+	{
+		double* uvRow = reinterpret_cast<double*>(&uvData[j*uvWidth]);
+		const double* kernelRow = &kernel[j*n];
+		size_t i = 0;
+		for(; i+4<=n; i+=4)
+		{
+			// Kernel values (k0, k1, k2, k3), spread to (k0, k0, k1, k1) and (k2, k2, k3, k3)
+			__m256d k = _mm256_loadu_pd(&kernelRow[i]);
+			__m256d k01 = _mm256_permute_pd(_mm256_permute2f128_pd(k, k, 0x00), 0xC);
+			__m256d k23 = _mm256_permute_pd(_mm256_permute2f128_pd(k, k, 0x11), 0xC);
+			__m256d uv01 = _mm256_loadu_pd(&uvRow[i*2]);
+			__m256d uv23 = _mm256_loadu_pd(&uvRow[i*2+4]);
+			// No fused multiply-add, such that the grid is the same as with the scalar version
+			uv01 = _mm256_add_pd(uv01, _mm256_mul_pd(sample2, k01));
+			uv23 = _mm256_add_pd(uv23, _mm256_mul_pd(sample2, k23));
+			_mm256_storeu_pd(&uvRow[i*2], uv01);
+			_mm256_storeu_pd(&uvRow[i*2+4], uv23);
+		}
+		for(; i!=n; ++i)
+			_mm_storeu_pd(&uvRow[i*2], _mm_add_pd(_mm_loadu_pd(&uvRow[i*2]), _mm_mul_pd(sample1, _mm_set1_pd(kernelRow[i]))));
+	}
+#else
+	const double sampleReal = sample.real(), sampleImag = sample.imag();
+	for(size_t j=0; j!=n; ++j)
+	{
+		double* uvRow = reinterpret_cast<double*>(&uvData[j*uvWidth]);
+		const double* kernelRow = &kernel[j*n];
+		for(size_t i=0; i!=n; ++i)
+		{
+			uvRow[i*2] += sampleReal * kernelRow[i];
+			uvRow[i*2+1] += sampleImag * kernelRow[i];
+		}
+	}
+#endif
+}
+
 void WStackingGridder::FinalizeImage(double multiplicationFactor, bool correctFFTFactor)
 {
 	freeLayeredUVData();
@@ -554,19 +956,9 @@ void WStackingGridder::FinalizeImage(double multiplicationFactor, bool correctFF
 		finalizeImage(multiplicationFactor, _imageDataImaginary);
 }
 
-void WStackingGridder::finalizeImage(double multiplicationFactor, std::vector<double*>& dataArray)
+void WStackingGridder::finalizeImage(double multiplicationFactor, double *data)
 {
-	for(size_t i=1;i!=_nFFTThreads;++i)
-	{
-		double *primaryData = dataArray[0];
-		double *endPtr = dataArray[i] + (_width * _height);
-		for(double *dataPtr = dataArray[i]; dataPtr!=endPtr; ++dataPtr)
-		{
-			*primaryData += *dataPtr;
-			++primaryData;
-		}
-	}
-	double *dataPtr = dataArray[0];
+	double *dataPtr = data;
 	for(size_t y=0;y!=_height;++y)
 	{
 		//double m = ((double) y-(_height/2)) * _pixelSizeY + _phaseCentreDM;
@@ -579,7 +971,7 @@ void WStackingGridder::finalizeImage(double multiplicationFactor, std::vector<do
 	}
 	
 	if(_gridMode != NearestNeighbourGridding)
-		correctImageForKernel<false>(dataArray[0]);
+		correctImageForKernel<false>(data);
 }
 
 template<bool Inverse>
@@ -588,29 +980,17 @@ void WStackingGridder::correctImageForKernel(double *image) const
 	const size_t nX = _width * _overSamplingFactor, nY = _height * _overSamplingFactor;
 	
 	double
-		*fftwInX = reinterpret_cast<double*>(fftw_malloc(nX/2 * sizeof(double))),
 		*fftwOutX = reinterpret_cast<double*>(fftw_malloc(nX/2 * sizeof(double)));
 	double
 		*fftwOutY;
-	fftw_plan planX = fftw_plan_r2r_1d(nX/2, fftwInX, fftwOutX, FFTW_REDFT01, FFTW_ESTIMATE);
-	memset(fftwInX, 0, nX/2 * sizeof(double));
-	memcpy(fftwInX, &_1dKernel[_kernelSize*_overSamplingFactor/2], (_kernelSize*_overSamplingFactor/2+1) * sizeof(double));
-	fftw_execute(planX);
-	fftw_free(fftwInX);
-	fftw_destroy_plan(planX);
+	makeKernelCorrection(fftwOutX, _width);
 	if(_width == _height)
 	{
 		fftwOutY = fftwOutX;
 	}
 	else {
-		double *fftwInY = reinterpret_cast<double*>(fftw_malloc(nY/2 * sizeof(double)));
 		fftwOutY = reinterpret_cast<double*>(fftw_malloc(nY/2 * sizeof(double)));
-		fftw_plan planY = fftw_plan_r2r_1d(nY/2, fftwInY, fftwOutY, FFTW_REDFT01, FFTW_ESTIMATE);
-		memset(fftwInY, 0, nY/2 * sizeof(double));
-		memcpy(fftwInY, &_1dKernel[_kernelSize*_overSamplingFactor/2], (_kernelSize*_overSamplingFactor/2+1) * sizeof(double));
-		fftw_execute(planY);
-		fftw_free(fftwInY);
-		fftw_destroy_plan(planY);
+		makeKernelCorrection(fftwOutY, _height);
 	}
 	
 	double normFactor = 1.0 / (_overSamplingFactor * _overSamplingFactor);
@@ -635,6 +1015,47 @@ void WStackingGridder::correctImageForKernel(double *image) const
 	}
 }
 
+/**
+ * Calculates the Fourier transform of the 1D kernel for the pixels at distance
+ * 0 to imageSize/2 from the centre, scaled by the oversampling factor. The transform
+ * of the exponential of semicircle kernel has no closed form, so it is integrated
+ * with the trapezoidal rule. Since the kernel and its derivatives are almost zero at
+ * its edges, this converges quickly. The other kernels are transformed in their
+ * tabulated form with a discrete cosine transform.
+ */
+void WStackingGridder::makeKernelCorrection(double *correction, size_t imageSize) const
+{
+	const size_t n = imageSize * _overSamplingFactor;
+	if(_gridMode == ExponentialOfSemicircleKernel)
+	{
+		const size_t stepCount = _kernelSize * 128;
+		const double step = 0.5 * _kernelSize / stepCount;
+		std::vector<double> kernel(stepCount+1);
+		for(size_t i=0; i!=stepCount+1; ++i)
+			kernel[i] = exponentialOfSemicircle(i * step);
+		const size_t correctionSize = std::min(imageSize/2+1, n/2);
+		for(size_t k=0; k!=correctionSize; ++k)
+		{
+			const double frequency = 2.0 * M_PI * double(k) / imageSize;
+			double sum = 0.5 * kernel[0];
+			for(size_t i=1; i!=stepCount; ++i)
+				sum += kernel[i] * cos(frequency * i * step);
+			sum += 0.5 * kernel[stepCount] * cos(frequency * 0.5 * _kernelSize);
+			// The integral over the symmetric kernel is twice the integral over one half
+			correction[k] = 2.0 * sum * step * _overSamplingFactor;
+		}
+	}
+	else {
+		double *fftwIn = reinterpret_cast<double*>(fftw_malloc(n/2 * sizeof(double)));
+		fftw_plan plan = fftw_plan_r2r_1d(n/2, fftwIn, correction, FFTW_REDFT01, FFTW_ESTIMATE);
+		memset(fftwIn, 0, n/2 * sizeof(double));
+		memcpy(fftwIn, &_1dKernel[_kernelSize*_overSamplingFactor/2], (_kernelSize*_overSamplingFactor/2+1) * sizeof(double));
+		fftw_execute(plan);
+		fftw_free(fftwIn);
+		fftw_destroy_plan(plan);
+	}
+}
+
 void WStackingGridder::GetGriddingCorrectionImage(double *image) const
 {
 	for(size_t i=0; i!=_width*_height; ++i)
@@ -642,9 +1063,9 @@ void WStackingGridder::GetGriddingCorrectionImage(double *image) const
 	correctImageForKernel<true>(image);
 }
 
-void WStackingGridder::initializePrediction(const double* image, std::vector<double*>& dataArray)
+void WStackingGridder::initializePrediction(const double* image, double *data)
 {
-	double *dataPtr = dataArray[0];
+	double *dataPtr = data;
 	const double *inPtr = image;
 	for(size_t y=0;y!=_height;++y)
 	{
@@ -662,7 +1083,7 @@ void WStackingGridder::initializePrediction(const double* image, std::vector<dou
 	}
 	if(_gridMode != NearestNeighbourGridding)
 	{
-		correctImageForKernel<false>(dataArray[0]);
+		correctImageForKernel<false>(data);
 	}
 }
 
@@ -694,40 +1115,44 @@ void WStackingGridder::initializeSqrtLMLookupTable()
 template<bool IsComplexImpl>
 void WStackingGridder::projectOnImageAndCorrect(const std::complex<double> *source, double w, size_t threadIndex)
 {
-	double *dataReal = _imageData[threadIndex], *dataImaginary;
+	double *dataReal = _imageData, *dataImaginary;
 	if(IsComplexImpl)
-		dataImaginary = _imageDataImaginary[threadIndex];
+		dataImaginary = _imageDataImaginary;
 	
 	const double twoPiW = -2.0 * M_PI * w;
-	std::vector<double>::const_iterator sqrtLMIter = _sqrtLMLookupTable.begin();
-	for(size_t y=0;y!=_height;++y)
+	const size_t
+		xStart = (_width - _trimWidth) / 2,
+		xEnd = (_width + _trimWidth) / 2;
+	for(size_t ySrc=rowBandStart(threadIndex); ySrc!=rowBandStart(threadIndex+1); ++ySrc)
 	{
-		size_t ySrc = (_height - y) + _height / 2;
-		if(ySrc >= _height) ySrc -= _height;
+		// The FFT output row y that ends up at image row ySrc = (_height - y) + _height / 2
+		size_t y = (_height - ySrc) + _height / 2;
+		if(y >= _height) y -= _height;
+		const std::complex<double> *sourceRow = &source[y * _width];
+		const double *sqrtLMRow = &_sqrtLMLookupTable[y * _width];
 		
-		for(size_t x=0;x!=_width;++x)
+		for(size_t xSrc=xStart; xSrc!=xEnd; ++xSrc)
 		{
-			size_t xSrc = x + _width / 2;
-			if(xSrc >= _width) xSrc -= _width;
+			// The FFT output column x that ends up at image column xSrc = x + _width / 2
+			size_t x = xSrc + (_width - _width / 2);
+			if(x >= _width) x -= _width;
 			
-			double rad = twoPiW * *sqrtLMIter;
+			double rad = twoPiW * sqrtLMRow[x];
 			double s, c;
 			sincos(rad, &s, &c);
 			/*std::complex<double> val = std::complex<double>(
 				source->real() * c - source->imag() * s,
 				source->real() * s + source->imag() * c
 			);*/
-			dataReal[xSrc + ySrc*_width] += source->real()*c - source->imag()*s;
+			const std::complex<double> value = sourceRow[x];
+			dataReal[xSrc + ySrc*_width] += value.real()*c - value.imag()*s;
 			if(IsComplexImpl)
 			{
 				if(_imageConjugatePart)
-					dataImaginary[xSrc + ySrc*_width] += -source->real()*s + source->imag()*c;
+					dataImaginary[xSrc + ySrc*_width] += -value.real()*s + value.imag()*c;
 				else
-					dataImaginary[xSrc + ySrc*_width] += source->real()*s + source->imag()*c;
+					dataImaginary[xSrc + ySrc*_width] += value.real()*s + value.imag()*c;
 			}
-			
-			++source;
-			++sqrtLMIter;
 		}
 	}
 }
@@ -762,11 +1187,14 @@ void WStackingGridder::initializeSqrtLMLookupTableForSampling()
 template<bool IsComplexImpl>
 void WStackingGridder::copyImageToLayerAndInverseCorrect(std::complex<double> *dest, double w)
 {
-	double *dataReal = _imageData[0], *dataImaginary;
+	double *dataReal = _imageData, *dataImaginary;
 	if(IsComplexImpl)
-		dataImaginary = _imageDataImaginary[0];
+		dataImaginary = _imageDataImaginary;
 	
 	const double twoPiW = 2.0 * M_PI * w;
+	const size_t
+		xStart = (_width - _trimWidth) / 2,
+		xEnd = (_width + _trimWidth) / 2;
 	std::vector<double>::const_iterator sqrtLMIter = _sqrtLMLookupTable.begin();
 	for(size_t y=0;y!=_height;++y)
 	{
@@ -777,12 +1205,28 @@ void WStackingGridder::copyImageToLayerAndInverseCorrect(std::complex<double> *d
 		size_t yDest = y + _height / 2;
 		if(yDest >= _height) yDest -= _height;
 		
+		// Rows outside the trimmed part are zero, which the FFT over the columns requires
+		if(!isInTrimmedRow(y, false))
+		{
+			std::fill(dest, dest + _width, std::complex<double>(0.0));
+			dest += _width;
+			sqrtLMIter += _width;
+			continue;
+		}
+		
 		for(size_t x=0;x!=_width;++x)
 		{
 			size_t xDest = (_width - x) + _width / 2;
 			if(xDest >= _width) xDest -= _width;
 			//size_t xSrc = x + _width / 2;
 			//if(xSrc >= _width) xSrc -= _width;
+			if(xDest < xStart || xDest >= xEnd)
+			{
+				*dest = 0.0;
+				++dest;
+				++sqrtLMIter;
+				continue;
+			}
 			
 			double rad = twoPiW * *sqrtLMIter;
 			double s, c;
@@ -804,14 +1248,14 @@ void WStackingGridder::copyImageToLayerAndInverseCorrect(std::complex<double> *d
 
 void WStackingGridder::ReplaceRealImageBuffer(double* newBuffer)
 {
-	_imageBufferAllocator->Free(_imageData[0]);
-	_imageData[0] = newBuffer;
+	_imageBufferAllocator->Free(_imageData);
+	_imageData = newBuffer;
 }
 
 void WStackingGridder::ReplaceImaginaryImageBuffer(double* newBuffer)
 {
-	_imageBufferAllocator->Free(_imageDataImaginary[0]);
-	_imageDataImaginary[0] = newBuffer;
+	_imageBufferAllocator->Free(_imageDataImaginary);
+	_imageDataImaginary = newBuffer;
 }
 
 #ifndef AVOID_CASACORE
@@ -15,6 +15,7 @@
 // Forward declare boost::mutex to avoid header inclusion
 namespace boost
 {
+	class barrier;
 	class mutex;
 }
 
@@ -23,6 +24,8 @@ namespace boost
 #include <complex>
 #include <vector>
 #include <stack>
+#include <string>
+#include <utility>
 
 class ImageBufferAllocator;
 
@@ -138,13 +141,31 @@ class WStackingGridder
 		 * @p minW < abs(@c w) < @p maxW. When @p nWLayers == 1, this is not required.
 		 * 
 		 * @param nWLayers Number of uv grids at different w-values, should be >= 1.
-		 * @param maxMem Allowed memory in bytes. The gridder will try to set the number
-		 * of passes such that this value is not exceeded. Note that this is approximate.
+		 * @param maxMem Allowed memory in bytes. The gridder will choose the number
+		 * of passes and FFT threads such that this value is not exceeded, using the
+		 * memory model of @ref WLayerPassPlanner. Note that this is approximate.
 		 * @param minW The smallest w-value to be inverted/predicted.
 		 * @param maxW The largest w-value to be inverted/predicted.
 		 */
 		void PrepareWLayers(size_t nWLayers, double maxMem, double minW, double maxW);
 		
+		/**
+		 * Initialize the inversion/prediction stage with w-layers at the given w-values,
+		 * instead of evenly spaced layers. Samples are gridded on the nearest layer, and the
+		 * layers should therefore be placed such that every sample is close enough to one
+		 * of them, for example with a @ref WLayerHistogram. For non-complex images, the
+		 * w-values are absolute w-values.
+		 * 
+		 * Samples outside the range from @p minW to @p maxW are not gridded, and as in
+		 * @ref PrepareWLayers(size_t, double, double, double), -@p maxW replaces @p minW
+		 * for complex images.
+		 * @param layerWValues Increasing w-values of the layers, at least one.
+		 * @param maxMem Allowed memory in bytes, as in @ref PrepareWLayers(size_t, double, double, double).
+		 * @param minW The smallest w-value to be inverted/predicted.
+		 * @param maxW The largest w-value to be inverted/predicted.
+		 */
+		void PrepareWLayers(const std::vector<double>& layerWValues, double maxMem, double minW, double maxW);
+		
 #ifndef AVOID_CASACORE
 		/**
 		 * Initialize the inversion/prediction stage with a given band. This is
@@ -165,12 +186,15 @@ class WStackingGridder
 		 * Calculate on which layer this w-value belongs. Only valid once
 		 * @ref PrepareWLayers() has been called.
 		 * @param wInLambda The w-value, in units of number of wavelengths.
-		 * @returns W-layer index.
+		 * @returns W-layer index, which is @ref NWLayers() or more when the w-value
+		 * is not gridded.
 		 * @see @ref LayerToW()
 		 */
 		size_t WToLayer(double wInLambda) const
 		{
-			if(_nWLayers == 1)
+			if(!_layerWValues.empty())
+				return nearestLayer(_isComplex ? wInLambda : fabs(wInLambda));
+			else if(_nWLayers == 1)
 				return 0;
 			else {
 				if(_isComplex)
@@ -188,7 +212,9 @@ class WStackingGridder
 		 */
 		double LayerToW(size_t layer) const
 		{
-			if(_nWLayers == 1)
+			if(!_layerWValues.empty())
+				return _layerWValues[layer];
+			else if(_nWLayers == 1)
 				return 0.0;
 			else {
 				if(_isComplex)
@@ -205,6 +231,14 @@ class WStackingGridder
 		 */
 		size_t NWLayers() const { return _nWLayers; }
 		
+		/**
+		 * Get the first w-layer that is processed during a pass. The layers of
+		 * pass p are LayerRangeStart(p) up to LayerRangeStart(p+1).
+		 * @param passIndex Zero-indexed pass, 0 <= @p passIndex <= @ref NPasses().
+		 * @returns Index of the first w-layer of the pass.
+		 */
+		size_t LayerRangeStart(size_t passIndex) const { return layerRangeStart(passIndex); }
+		
 		/**
 		 * Determine whether specified w-value should be gridded in this pass.
 		 * This method can only be called after calling @ref StartInversionPass()
@@ -292,8 +326,10 @@ class WStackingGridder
 		 * Each call to @ref StartInversionPass() should be followed by a call to
 		 * @ref FinishInversionPass().
 		 * @param passIndex The zero-indexed index of this pass, 0 <= @p passIndex < @ref NPasses().
+		 * @param layerThreads Optional array with for each w-layer (of all passes) the index of the
+		 * thread that grids it. The layers are zeroed by these threads, see @ref PinThreads().
 		 */
-		void StartInversionPass(size_t passIndex);
+		void StartInversionPass(size_t passIndex, const size_t* layerThreads = nullptr);
 		
 		/**
 		 * Finish an inversion gridding pass. This will perform the Fourier transforms of the currently gridded
@@ -412,13 +448,13 @@ class WStackingGridder
 		 * If a complex image is produced, this image returns the real part. The imaginary part can
 		 * be acquired with @ref ImaginaryImage().
 		 */
-		double *RealImage() { return _imageData[0]; }
+		double *RealImage() { return _imageData; }
 		
 		/**
 		 * Get the imaginary part of a complex image after inversion. Otherwise similar to
 		 * @ref RealImage().
 		 */
-		double *ImaginaryImage() { return _imageDataImaginary[0]; }
+		double *ImaginaryImage() { return _imageDataImaginary; }
 		
 		/**
 		 * Get the number of threads used when performing the FFTs. The w-layers are divided over
@@ -428,6 +464,9 @@ class WStackingGridder
 		 * nothing. Therefore, when not performing any w-term correction with @ref NWLayers() == 1,
 		 * this value has no effect.
 		 * 
+		 * The threads add the transformed layers to a single image, in which each thread
+		 * owns a band of rows, so the memory of the image does not grow with the number of threads.
+		 * 
 		 * When @ref NWLayers() == 1 , it is still possible to perform multi-threading by setting
 		 * up fftw to do so. The @ref FFTWMultiThreadEnabler class can be used to setup fftw
 		 * properly to do so.
@@ -436,6 +475,44 @@ class WStackingGridder
 		 */
 		size_t NFFTThreads() const { return _nFFTThreads; }
 		
+		/**
+		 * Whether threads are pinned to CPUs. When enabled, FFT thread i and the thread
+		 * that zeroes the layers of i run on the same CPU. Together with
+		 * @ref ImageBufferAllocator::SetMemoryPlacement(), this keeps the buffers of a thread on the
+		 * NUMA node of that thread. A w-layer is zeroed by the thread that was given for it to
+		 * @ref StartInversionPass(), or otherwise by thread layer % @ref NFFTThreads(). Callers that
+		 * grid each layer with that thread, pinned to the cpu with the same index, grid into local memory.
+		 */
+		bool PinThreads() const { return _pinThreads; }
+		
+		void SetPinThreads(bool pinThreads) { _pinThreads = pinThreads; }
+		
+		/**
+		 * Set the number of visibilities that are read in each pass, which
+		 * @ref PrepareWLayers() uses to estimate the cost of an extra pass.
+		 * When it is not set, the number of passes is minimized.
+		 * @param visibilityCount Number of visibilities.
+		 */
+		void SetVisibilityCount(size_t visibilityCount) { _visibilityCount = visibilityCount; }
+		
+		/**
+		 * Keep the w-layers in a memory-mapped scratch file in the given directory, such
+		 * that all layers can be gridded in a single pass, even when they do not fit in memory.
+		 * The kernel pages out the layers that do not fit. This is meant for inversion with
+		 * fast local disks; the samples should be ordered by @ref LayerBlockSize() to keep
+		 * the pages that are used in memory. Should be called before @ref PrepareWLayers().
+		 * @param directory Directory for the scratch file, or an empty string to keep the layers in memory.
+		 */
+		void SetLayerScratchDirectory(const std::string& directory) { _layerScratchDirectory = directory; }
+		
+		/**
+		 * Number of consecutive w-layers that fit in memory when the layers are mapped to a
+		 * scratch file, see @ref SetLayerScratchDirectory(). Gridding the samples of one such
+		 * block of layers at a time avoids paging.
+		 * @returns Number of layers per block, or zero when the layers are kept in memory.
+		 */
+		size_t LayerBlockSize() const { return _layerBlockSize; }
+		
 		/**
 		 * Set the number of threads used to perform the FFTs.
 		 * @see @ref NFFTThreads() for an explanation.
@@ -494,6 +571,18 @@ class WStackingGridder
 		 */
 		void SetDenormalPhaseCentre(double dl, double dm) { _phaseCentreDL = dl; _phaseCentreDM = dm; }
 		
+		/**
+		 * Set the size of the central part of the image that is used. When it is smaller
+		 * than the image, the w-layers are Fourier transformed row by row and column by
+		 * column, and the rows outside this part are skipped: inversion does not calculate
+		 * them, and prediction skips them because they are zero. The pixels outside this part of
+		 * an inverted image are zero, and prediction ignores the pixels outside this part.
+		 * This should be called before @ref PrepareWLayers(). By default, the full image is used.
+		 * @param trimWidth Width of the part in pixels.
+		 * @param trimHeight Height of the part in pixels.
+		 */
+		void SetTrimSize(size_t trimWidth, size_t trimHeight) { _trimWidth = trimWidth; _trimHeight = trimHeight; }
+		
 		/**
 		 * Make an image that contains the effect of the gridding kernel in image space.
 		 * The gridder already corrects for the kernel internally, so it is not necessary
@@ -551,6 +640,34 @@ class WStackingGridder
 		 */
 		void GetKaiserBesselKernel(double* kernel, size_t n, bool multiplyWithSinc);
 		
+		/**
+		 * Sum a block of uv cells, weighted by a gridding kernel. This is the inner loop of
+		 * @ref SampleDataSample() for samples that are not near the edge of the uv plane.
+		 * When compiled with AVX, each kernel row is processed four cells at a time.
+		 * @param uvData First cell of the block.
+		 * @param uvWidth Number of cells between the starts of two rows of the block.
+		 * @param kernel Kernel values, @p kernelSize x @p kernelSize in row-major order.
+		 * @param kernelSize Width and height of the block.
+		 * @returns The weighted sum.
+		 */
+		static std::complex<double> SumKernelBlock(const std::complex<double>* uvData, size_t uvWidth, const double* kernel, size_t kernelSize);
+		
+		/**
+		 * Add a sample to a block of uv cells, weighted by a gridding kernel. This is the inner
+		 * loop of @ref AddDataSample() for samples that are not near the edge of the uv plane.
+		 * @param uvData First cell of the block.
+		 * @param uvWidth Number of cells between the starts of two rows of the block.
+		 * @param kernel Kernel values, @p kernelSize x @p kernelSize in row-major order.
+		 * @param kernelSize Width and height of the block.
+		 * @param sample The value to add.
+		 */
+		static void AddKernelBlock(std::complex<double>* uvData, size_t uvWidth, const double* kernel, size_t kernelSize, std::complex<double> sample);
+		
+		/**
+		 * Scalar version of @ref SumKernelBlock(), which sums the cells in order.
+		 */
+		static std::complex<double> SumKernelBlockScalar(const std::complex<double>* uvData, size_t uvWidth, const double* kernel, size_t kernelSize);
+		
 		/**
 		 * Get width of image as specified during construction. This is the full width, before
 		 * any trimming has been applied.
@@ -591,16 +708,47 @@ class WStackingGridder
 		}
 		template<bool IsComplexImpl>
 		void projectOnImageAndCorrect(const std::complex<double> *source, double w, size_t threadIndex);
+		/** Index of the layer closest to @p w, or the layer count when @p w is outside the gridded range. */
+		size_t nearestLayer(double w) const;
+		void prepareWLayers(double maxMem);
+		/**
+		 * The rows of the trimmed part of the image that are accumulated by a thread.
+		 * The bands of the threads are disjoint, so they can add to the same image
+		 * without locking.
+		 */
+		size_t rowBandStart(size_t threadIndex) const
+		{
+			return (_height - _trimHeight) / 2 + (_trimHeight * threadIndex) / _nFFTThreads;
+		}
 		template<bool IsComplexImpl>
 		void copyImageToLayerAndInverseCorrect(std::complex<double> *dest, double w);
 		void initializeSqrtLMLookupTable();
 		void initializeSqrtLMLookupTableForSampling();
 		void initializeLayeredUVData(size_t n);
+		void mapLayeredUVData(size_t n);
+		void releaseMappedLayer(size_t layerIndex);
 		void freeLayeredUVData() { initializeLayeredUVData(0); }
-		void fftToImageThreadFunction(boost::mutex *mutex, std::stack<size_t> *tasks, size_t threadIndex);
+		void fftToImageThreadFunction(boost::mutex *mutex, boost::barrier *barrier, std::vector<std::complex<double>*> *fftOutputs, size_t nPlanes, size_t threadIndex);
 		void fftToUVThreadFunction(boost::mutex *mutex, std::stack<size_t> *tasks);
-		void finalizeImage(double multiplicationFactor, std::vector<double*>& dataArray);
-		void initializePrediction(const double *image, std::vector<double*>& dataArray);
+		void zeroImageDataThreadFunction(size_t threadIndex);
+		void zeroLayersThreadFunction(size_t threadIndex, size_t nLayersInPass, const size_t* layerThreads);
+		void finalizeImage(double multiplicationFactor, double *data);
+		void initializePrediction(const double *image, double *data);
+		
+		/**
+		 * The inner loops of gridding and degridding, instantiated for the kernel size.
+		 * They are selected once, when the gridder is constructed.
+		 */
+		struct KernelBlockFunctions
+		{
+			std::complex<double> (*sum)(const std::complex<double>* uvData, size_t uvWidth, const double* kernel, size_t kernelSize);
+			void (*add)(std::complex<double>* uvData, size_t uvWidth, const double* kernel, size_t kernelSize, std::complex<double> sample);
+		};
+		static KernelBlockFunctions kernelBlockFunctions(size_t kernelSize);
+		template<size_t KernelSize>
+		static std::complex<double> sumKernelBlock(const std::complex<double>* uvData, size_t uvWidth, const double* kernel, size_t kernelSize);
+		template<size_t KernelSize>
+		static void addKernelBlock(std::complex<double>* uvData, size_t uvWidth, const double* kernel, size_t kernelSize, std::complex<double> sample);
 		
 		void makeKernels();
 		/**
@@ -616,14 +764,34 @@ class WStackingGridder
 		
 		void makeRectangularKernel(std::vector<double> &kernel, size_t overSamplingFactor);
 		
+		/**
+		 * The value of the exponential of semicircle kernel at a distance of @p x
+		 * cells from its centre.
+		 */
+		double exponentialOfSemicircle(double x) const;
+		void makeExponentialOfSemicircleKernel(std::vector<double> &kernel, size_t overSamplingFactor) const;
+		
 		double bessel0(double x, double precision);
 		template<bool Inverse>
 		void correctImageForKernel(double *image) const;
+		void makeKernelCorrection(double *correction, size_t imageSize) const;
+		/**
+		 * Whether a row of the FFT output (for inversion) or input (for prediction)
+		 * lies in the trimmed part of the image.
+		 */
+		bool isInTrimmedRow(size_t fftRow, bool isInversion) const;
+		/**
+		 * The ranges of consecutive FFT rows that lie in the trimmed part of the image.
+		 */
+		std::vector<std::pair<size_t, size_t>> trimmedRowRanges(bool isInversion) const;
 		
 		const size_t _width, _height;
 		const double _pixelSizeX, _pixelSizeY;
+		size_t _trimWidth, _trimHeight;
 		size_t _nWLayers, _nPasses, _curLayerRangeIndex;
 		double _minW, _maxW, _phaseCentreDL, _phaseCentreDM;
+		/** W-values of non-uniformly placed layers, or empty for evenly spaced layers */
+		std::vector<double> _layerWValues;
 		bool _isComplex, _imageConjugatePart;
 #ifndef AVOID_CASACORE
 		MultiBandData _bandData;
@@ -633,11 +801,18 @@ class WStackingGridder
 		size_t _overSamplingFactor, _kernelSize;
 		std::vector<double> _1dKernel;
 		std::vector<std::vector<double>> _griddingKernels;
+		KernelBlockFunctions _kernelBlockFunctions;
 		
 		std::vector<std::complex<double>*> _layeredUVData;
-		std::vector<double*> _imageData, _imageDataImaginary;
+		// The image that all FFT threads accumulate in, each in its own band of rows
+		double *_imageData, *_imageDataImaginary;
 		std::vector<double> _sqrtLMLookupTable;
-		size_t _nFFTThreads;
+		size_t _nFFTThreads, _visibilityCount, _layerBlockSize;
+		std::string _layerScratchDirectory;
+		// Memory-mapped file that holds the layers, or nullptr when they are allocated normally
+		void* _mappedLayers;
+		size_t _mappedLayersSize;
+		bool _pinThreads;
 		ImageBufferAllocator* _imageBufferAllocator;
 };
 